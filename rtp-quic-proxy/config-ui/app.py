@@ -1,6 +1,6 @@
 from flask import Flask, request, jsonify
 from auth import generate_token, login_required, api_key_required
-from models import create_tenant, get_tenant_by_api_key, update_usage, get_billing_info, get_all_tenants, store_proxy_config, get_proxy_config
+from models import create_tenant, get_tenant_by_api_key, update_usage, get_billing_info, get_all_tenants, store_proxy_config, get_proxy_config, set_tenant_limits
 
 app = Flask(__name__)
 
@@ -18,7 +18,7 @@ def login():
 @login_required
 def create_new_tenant(current_user):
     data = request.json
-    tenant_id, api_key = create_tenant(data['name'])
+    tenant_id, api_key = create_tenant(data['name'], int(data.get('rate_kbps', 0)), int(data.get('burst_kb', 0)))
     return jsonify({'tenant_id': tenant_id, 'api_key': api_key}), 201
 
 @app.route('/tenants', methods=['GET'])
@@ -27,6 +27,13 @@ def list_tenants(current_user):
     tenants = get_all_tenants()
     return jsonify(tenants), 200
 
+@app.route('/tenants/<tenant_id>/limits', methods=['PUT'])
+@login_required
+def update_limits(current_user, tenant_id):
+    data = request.json
+    set_tenant_limits(tenant_id, int(data.get('rate_kbps', 0)), int(data.get('burst_kb', 0)))
+    return jsonify({'status': 'success'}), 200
+
 @app.route('/tenants/<tenant_id>/billing', methods=['GET'])
 @login_required
 def get_billing(current_user, tenant_id):
@@ -3,12 +3,17 @@ import uuid
 
 redis_client = redis.Redis(host='redis', port=6379)
 
-def create_tenant(tenant_name):
+def create_tenant(tenant_name, rate_kbps=0, burst_kb=0):
     tenant_id = str(uuid.uuid4())
     api_key = str(uuid.uuid4())
-    redis_client.hmset(f"tenant:{tenant_id}", {"name": tenant_name, "api_key": api_key, "usage": 0})
+    redis_client.hmset(f"tenant:{tenant_id}", {"name": tenant_name, "api_key": api_key, "usage": 0,
+                                               "rate_kbps": rate_kbps, "burst_kb": burst_kb})
     return tenant_id, api_key
 
+# Uplink rate and burst QuicRtp holds the tenant to; 0 kbit/s is unlimited
+def set_tenant_limits(tenant_id, rate_kbps, burst_kb):
+    redis_client.hmset(f"tenant:{tenant_id}", {"rate_kbps": rate_kbps, "burst_kb": burst_kb})
+
 def get_tenant_by_api_key(api_key):
     keys = redis_client.keys("tenant:*")
     for key in keys:
@@ -35,7 +40,9 @@ def get_all_tenants():
             "id": key.decode('utf-8'),
             "name": tenant[b'name'].decode('utf-8'),
             "api_key": tenant[b'api_key'].decode('utf-8'),
-            "usage": int(tenant[b'usage'].decode('utf-8'))
+            "usage": int(tenant[b'usage'].decode('utf-8')),
+            "rate_kbps": int(tenant.get(b'rate_kbps', b'0').decode('utf-8')),
+            "burst_kb": int(tenant.get(b'burst_kb', b'0').decode('utf-8'))
         })
     return tenants
 
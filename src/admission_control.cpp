@@ -0,0 +1,59 @@
+/*
+ * Copyright 2024 nrjchnd@gmail.com
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     https://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an **"AS IS" BASIS,**
+ * **WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.**
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "admission_control.h"
+#include "logger.h"
+#include <algorithm>
+
+// Fraction of the thresholds the load has to fall below before new
+// sessions are admitted again
+const double RECOVERY_FACTOR = 0.8;
+
+AdmissionControl::AdmissionControl()
+    : maxUtilization_(0.0), maxQueueDepth_(0), busyNs_(0), overloaded_(false), refused_(0),
+      lastUpdate_(std::chrono::steady_clock::now())
+{
+}
+
+void AdmissionControl::setThresholds(double maxUtilization, size_t maxQueueDepth) {
+    maxUtilization_ = maxUtilization;
+    maxQueueDepth_ = maxQueueDepth;
+}
+
+void AdmissionControl::update(std::chrono::steady_clock::time_point now, size_t threads, size_t queueDepth) {
+    auto elapsed = std::chrono::duration_cast<std::chrono::nanoseconds>(now - lastUpdate_);
+    if (elapsed.count() <= 0 || threads == 0) {
+        return;
+    }
+    lastUpdate_ = now;
+    uint64_t busy = busyNs_.exchange(0, std::memory_order_relaxed);
+    double utilization = std::min(static_cast<double>(busy) / (static_cast<double>(elapsed.count()) * threads), 1.0);
+
+    bool busyOver = maxUtilization_ > 0.0 && utilization >= maxUtilization_;
+    bool queueOver = maxQueueDepth_ != 0 && queueDepth >= maxQueueDepth_;
+    bool busyClear = maxUtilization_ <= 0.0 || utilization < maxUtilization_ * RECOVERY_FACTOR;
+    bool queueClear = maxQueueDepth_ == 0 || queueDepth < maxQueueDepth_ * RECOVERY_FACTOR;
+
+    if (!overloaded_ && (busyOver || queueOver)) {
+        overloaded_ = true;
+        Logger::getLogger()->warn("Overloaded ({:.0f}% busy, {} packets queued), refusing new sessions",
+                                  utilization * 100.0, queueDepth);
+    } else if (overloaded_ && busyClear && queueClear) {
+        overloaded_ = false;
+        Logger::getLogger()->info("Load back to {:.0f}% busy, {} packets queued; admitting new sessions ({} refused so far)",
+                                  utilization * 100.0, queueDepth, refusedSessions());
+    }
+}
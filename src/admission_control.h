@@ -0,0 +1,58 @@
+/*
+ * Copyright 2024 nrjchnd@gmail.com
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     https://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an **"AS IS" BASIS,**
+ * **WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.**
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#ifndef ADMISSION_CONTROL_H
+#define ADMISSION_CONTROL_H
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+
+// Refuses new sessions while the node is overloaded, so the calls already
+// up keep their quality instead of every call degrading. Load is judged
+// from how busy the packet-processing threads were and how many packets
+// wait for the QUIC connection; admission resumes once both have fallen
+// well below their thresholds, so it does not flap.
+class AdmissionControl {
+public:
+    AdmissionControl();
+
+    // maxUtilization is the busy fraction (0-1) of the processing threads;
+    // 0 disables either check
+    void setThresholds(double maxUtilization, size_t maxQueueDepth);
+
+    // Time spent handling one packet; any thread
+    void recordBusy(std::chrono::nanoseconds busy) {
+        busyNs_.fetch_add(static_cast<uint64_t>(busy.count()), std::memory_order_relaxed);
+    }
+
+    // Re-evaluates the load; called periodically from one thread
+    void update(std::chrono::steady_clock::time_point now, size_t threads, size_t queueDepth);
+
+    bool overloaded() const { return overloaded_.load(std::memory_order_relaxed); }
+    void refuse() { refused_.fetch_add(1, std::memory_order_relaxed); }
+    uint64_t refusedSessions() const { return refused_.load(std::memory_order_relaxed); }
+
+private:
+    double maxUtilization_;
+    size_t maxQueueDepth_;
+    std::atomic<uint64_t> busyNs_;
+    std::atomic<bool> overloaded_;
+    std::atomic<uint64_t> refused_;
+    std::chrono::steady_clock::time_point lastUpdate_;
+};
+
+#endif // ADMISSION_CONTROL_H
@@ -0,0 +1,222 @@
+/*
+ * Copyright 2024 nrjchnd@gmail.com
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     https://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an **"AS IS" BASIS,**
+ * **WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.**
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "asio_udp_io.h"
+#include "logger.h"
+#include <algorithm>
+#include <array>
+#include <cerrno>
+#include <cstring>
+
+// Upper bound on recvmmsg calls per wakeup so one busy socket cannot starve the others
+const int MAX_BATCHES_PER_WAKEUP = 4;
+
+AsioUdpIo::AsioUdpIo(boost::asio::io_context& io_context, size_t receiveBatch)
+    : socket_(io_context), batchSize_(std::min(std::max<size_t>(receiveBatch, 1), UDP_RECEIVE_BATCH_MAX))
+{
+}
+
+AsioUdpIo::~AsioUdpIo() {
+    close();
+}
+
+void AsioUdpIo::open(uint16_t port, bool reusePort) {
+    boost::asio::ip::udp::endpoint endpoint(boost::asio::ip::udp::v4(), port);
+    socket_.open(endpoint.protocol());
+    if (reusePort) {
+        socket_.set_option(boost::asio::detail::socket_option::boolean<SOL_SOCKET, SO_REUSEPORT>(true));
+    }
+    socket_.bind(endpoint);
+}
+
+void AsioUdpIo::adopt(int fd, uint16_t) {
+    socket_.assign(boost::asio::ip::udp::v4(), fd);
+}
+
+void AsioUdpIo::startReceive(ReceiveHandler handler) {
+    receiveHandler_ = handler;
+    beginReceive();
+}
+
+void AsioUdpIo::startReceiveBatch(BatchReceiveHandler handler) {
+    batchHandler_ = handler;
+    beginReceive();
+}
+
+void AsioUdpIo::beginReceive() {
+    boost::asio::post(socket_.get_executor(), [self = shared_from_this()]() {
+        if (!self->socket_.is_open()) {
+            return;
+        }
+        self->allocateBuffers();
+        if (self->batchSize_ > 1) {
+            self->waitForBatch();
+        } else {
+            self->receive();
+        }
+    });
+}
+
+void AsioUdpIo::sendTo(const uint8_t* data, size_t len, const boost::asio::ip::udp::endpoint& destination) {
+    boost::system::error_code error;
+    socket_.send_to(boost::asio::buffer(data, len), destination, 0, error);
+    if (error) {
+        Logger::getLogger()->warn("UDP send to {}:{} failed: {}", destination.address().to_string(), destination.port(), error.message());
+    }
+}
+
+void AsioUdpIo::sendTo(const boost::asio::const_buffer& header, const boost::asio::const_buffer& payload,
+                       const boost::asio::ip::udp::endpoint& destination) {
+    std::array<boost::asio::const_buffer, 2> buffers = {header, payload};
+    boost::system::error_code error;
+    socket_.send_to(buffers, destination, 0, error);
+    if (error) {
+        Logger::getLogger()->warn("UDP send to {}:{} failed: {}", destination.address().to_string(), destination.port(), error.message());
+    }
+}
+
+void AsioUdpIo::close() {
+    if (socket_.is_open()) {
+        boost::system::error_code error;
+        socket_.close(error);
+    }
+}
+
+bool AsioUdpIo::isOpen() const {
+    return socket_.is_open();
+}
+
+int AsioUdpIo::nativeHandle() const {
+    // native_handle() is non-const in boost::asio
+    auto& socket = const_cast<boost::asio::ip::udp::socket&>(socket_);
+    return socket.is_open() ? static_cast<int>(socket.native_handle()) : -1;
+}
+
+void AsioUdpIo::allocateBuffers() {
+    PacketArena& arena = PacketArena::instance();
+    if (batchSize_ == 1) {
+        recvBuffer_ = arena.allocate();
+        return;
+    }
+
+    batchBuffers_.resize(batchSize_);
+    batchHeaders_.resize(batchSize_);
+    batchIovecs_.resize(batchSize_);
+    batchAddrs_.resize(batchSize_);
+
+    for (size_t i = 0; i < batchSize_; ++i) {
+        batchBuffers_[i] = arena.allocate();
+        batchIovecs_[i].iov_base = batchBuffers_[i].data();
+        batchIovecs_[i].iov_len = PACKET_CAPACITY;
+        std::memset(&batchHeaders_[i], 0, sizeof(mmsghdr));
+        batchHeaders_[i].msg_hdr.msg_iov = &batchIovecs_[i];
+        batchHeaders_[i].msg_hdr.msg_iovlen = 1;
+        batchHeaders_[i].msg_hdr.msg_name = &batchAddrs_[i];
+    }
+}
+
+void AsioUdpIo::receive() {
+    socket_.async_receive_from(
+        boost::asio::buffer(recvBuffer_.data(), PACKET_CAPACITY), remoteEndpoint_,
+        [self = shared_from_this()](const boost::system::error_code& error, size_t bytes_transferred) {
+            self->handleReceive(error, bytes_transferred);
+        }
+    );
+}
+
+void AsioUdpIo::handleReceive(const boost::system::error_code& error, size_t bytes_transferred) {
+    if (!error) {
+        if (batchHandler_) {
+            batch_.count = 1;
+            batch_.data[0] = recvBuffer_.data();
+            batch_.length[0] = bytes_transferred;
+            batch_.sender[0] = remoteEndpoint_;
+            batchHandler_(batch_);
+        } else {
+            receiveHandler_(recvBuffer_.data(), bytes_transferred, remoteEndpoint_);
+        }
+        if (socket_.is_open()) {
+            receive();
+        }
+    } else if (error != boost::asio::error::operation_aborted) {
+        Logger::getLogger()->error("Receive error: {}", error.message());
+        // Attempt to restart receive if the error is recoverable
+        receive();
+    }
+}
+
+void AsioUdpIo::waitForBatch() {
+    socket_.async_wait(boost::asio::ip::udp::socket::wait_read,
+        [self = shared_from_this()](const boost::system::error_code& error) {
+            self->handleBatch(error);
+        }
+    );
+}
+
+void AsioUdpIo::handleBatch(const boost::system::error_code& error) {
+    if (error) {
+        if (error != boost::asio::error::operation_aborted) {
+            Logger::getLogger()->error("Receive error: {}", error.message());
+            waitForBatch();
+        }
+        return;
+    }
+
+    for (int batch = 0; batch < MAX_BATCHES_PER_WAKEUP; ++batch) {
+        for (size_t i = 0; i < batchSize_; ++i) {
+            batchHeaders_[i].msg_hdr.msg_namelen = sizeof(sockaddr_storage);
+        }
+
+        int received = ::recvmmsg(socket_.native_handle(), batchHeaders_.data(), static_cast<unsigned int>(batchSize_), MSG_DONTWAIT, nullptr);
+        if (received < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                Logger::getLogger()->error("recvmmsg failed: {}", std::strerror(errno));
+            }
+            break;
+        }
+
+        if (batchHandler_) {
+            batch_.count = static_cast<size_t>(received);
+            for (int i = 0; i < received; ++i) {
+                std::memcpy(batch_.sender[i].data(), &batchAddrs_[i], batchHeaders_[i].msg_hdr.msg_namelen);
+                batch_.sender[i].resize(batchHeaders_[i].msg_hdr.msg_namelen);
+                batch_.data[i] = static_cast<uint8_t*>(batchIovecs_[i].iov_base);
+                batch_.length[i] = batchHeaders_[i].msg_len;
+            }
+            batchHandler_(batch_);
+            if (!socket_.is_open()) {
+                return;
+            }
+        } else {
+            for (int i = 0; i < received; ++i) {
+                boost::asio::ip::udp::endpoint sender;
+                std::memcpy(sender.data(), &batchAddrs_[i], batchHeaders_[i].msg_hdr.msg_namelen);
+                sender.resize(batchHeaders_[i].msg_hdr.msg_namelen);
+
+                receiveHandler_(static_cast<uint8_t*>(batchIovecs_[i].iov_base), batchHeaders_[i].msg_len, sender);
+                if (!socket_.is_open()) {
+                    return;
+                }
+            }
+        }
+
+        if (static_cast<size_t>(received) < batchSize_) {
+            break;
+        }
+    }
+
+    waitForBatch();
+}
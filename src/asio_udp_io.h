@@ -0,0 +1,69 @@
+/*
+ * Copyright 2024 nrjchnd@gmail.com
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     https://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an **"AS IS" BASIS,**
+ * **WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.**
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#ifndef ASIO_UDP_IO_H
+#define ASIO_UDP_IO_H
+
+#include "udp_io.h"
+#include "packet_arena.h"
+#include <vector>
+#include <sys/socket.h>
+
+// Reactor (epoll) backend: async_receive_from per packet, or a readiness wait
+// followed by recvmmsg when a receive batch is configured.
+class AsioUdpIo : public UdpIo, public std::enable_shared_from_this<AsioUdpIo> {
+public:
+    AsioUdpIo(boost::asio::io_context& io_context, size_t receiveBatch);
+    ~AsioUdpIo() override;
+
+    void open(uint16_t port, bool reusePort) override;
+    void adopt(int fd, uint16_t port) override;
+    void startReceive(ReceiveHandler handler) override;
+    void startReceiveBatch(BatchReceiveHandler handler) override;
+    void sendTo(const uint8_t* data, size_t len, const boost::asio::ip::udp::endpoint& destination) override;
+    void sendTo(const boost::asio::const_buffer& header, const boost::asio::const_buffer& payload,
+                const boost::asio::ip::udp::endpoint& destination) override;
+    void close() override;
+    bool isOpen() const override;
+    int nativeHandle() const override;
+
+    const char* name() const override { return "epoll"; }
+
+private:
+    // Receive buffers come from the packet arena on the IO thread, so they
+    // sit on the NUMA node of the worker that fills them
+    void allocateBuffers();
+    void beginReceive();
+    void receive();
+    void handleReceive(const boost::system::error_code& error, size_t bytes_transferred);
+    void waitForBatch();
+    void handleBatch(const boost::system::error_code& error);
+
+    boost::asio::ip::udp::socket socket_;
+    ReceiveHandler receiveHandler_;
+    BatchReceiveHandler batchHandler_;
+    ReceiveBatch batch_;
+
+    boost::asio::ip::udp::endpoint remoteEndpoint_;
+    PacketBuffer recvBuffer_;
+
+    size_t batchSize_;
+    std::vector<PacketBuffer> batchBuffers_;
+    std::vector<mmsghdr> batchHeaders_;
+    std::vector<iovec> batchIovecs_;
+    std::vector<sockaddr_storage> batchAddrs_;
+};
+
+#endif // ASIO_UDP_IO_H
@@ -0,0 +1,66 @@
+/*
+ * Copyright 2024 nrjchnd@gmail.com
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     https://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an **"AS IS" BASIS,**
+ * **WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.**
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Picks the SO_REUSEPORT socket for an RTP packet from its SSRC, using the
+// same hash the proxy shards sessions with, so every packet of a call lands
+// on the worker that owns the call regardless of source address changes.
+// Packets too short to carry an SSRC keep the kernel's default selection.
+
+#include <linux/bpf.h>
+#include <linux/udp.h>
+#include <bpf/bpf_helpers.h>
+#include <bpf/bpf_endian.h>
+#include "../session_hash.h"
+
+// Offset of the SSRC within the RTP header
+#define RTP_SSRC_OFFSET 8
+
+struct {
+    __uint(type, BPF_MAP_TYPE_REUSEPORT_SOCKARRAY);
+    __uint(max_entries, 256);
+    __type(key, __u32);
+    __type(value, __u64);
+} rtp_workers SEC(".maps");
+
+struct {
+    __uint(type, BPF_MAP_TYPE_ARRAY);
+    __uint(max_entries, 1);
+    __type(key, __u32);
+    __type(value, __u32);
+} rtp_worker_count SEC(".maps");
+
+SEC("sk_reuseport")
+int rtp_select_worker(struct sk_reuseport_md* md)
+{
+    __u32 zero = 0;
+    __u32* workers = bpf_map_lookup_elem(&rtp_worker_count, &zero);
+    if (!workers || *workers == 0) {
+        return SK_PASS;
+    }
+
+    // For UDP the packet data starts at the UDP header during socket lookup
+    __u32 ssrc;
+    if (bpf_skb_load_bytes(md, sizeof(struct udphdr) + RTP_SSRC_OFFSET, &ssrc, sizeof(ssrc)) < 0) {
+        return SK_PASS;
+    }
+
+    __u32 index = quicrtp_worker_for_ssrc(bpf_ntohl(ssrc), *workers);
+    // On failure (e.g. slot not populated yet) the kernel hash decides
+    bpf_sk_select_reuseport(md, &rtp_workers, &index, 0);
+    return SK_PASS;
+}
+
+char _license[] SEC("license") = "GPL";
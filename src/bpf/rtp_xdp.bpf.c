@@ -0,0 +1,79 @@
+/*
+ * Copyright 2024 nrjchnd@gmail.com
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     https://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an **"AS IS" BASIS,**
+ * **WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.**
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Redirects IPv4 UDP packets addressed to a port with an open RTP listener
+// to the AF_XDP socket bound to the receiving queue. Everything else (RTCP
+// on port + 1 included), and RTP on queues without a socket, continues
+// through the kernel stack.
+
+#include <linux/bpf.h>
+#include <linux/if_ether.h>
+#include <linux/in.h>
+#include <linux/ip.h>
+#include <linux/udp.h>
+#include <bpf/bpf_helpers.h>
+#include <bpf/bpf_endian.h>
+
+struct {
+    __uint(type, BPF_MAP_TYPE_XSKMAP);
+    __uint(max_entries, 64);
+    __type(key, __u32);
+    __type(value, __u32);
+} xsks_map SEC(".maps");
+
+// Indexed by destination port, non-zero while user space serves it
+struct {
+    __uint(type, BPF_MAP_TYPE_ARRAY);
+    __uint(max_entries, 65536);
+    __type(key, __u32);
+    __type(value, __u8);
+} rtp_ports SEC(".maps");
+
+SEC("xdp")
+int rtp_xdp_redirect(struct xdp_md* ctx)
+{
+    void* data = (void*)(long)ctx->data;
+    void* data_end = (void*)(long)ctx->data_end;
+
+    struct ethhdr* eth = data;
+    if ((void*)(eth + 1) > data_end || eth->h_proto != bpf_htons(ETH_P_IP)) {
+        return XDP_PASS;
+    }
+
+    struct iphdr* ip = (void*)(eth + 1);
+    if ((void*)(ip + 1) > data_end || ip->protocol != IPPROTO_UDP || ip->ihl < 5) {
+        return XDP_PASS;
+    }
+    // Fragments carry no UDP header past the first one
+    if (ip->frag_off & bpf_htons(0x3FFF)) {
+        return XDP_PASS;
+    }
+
+    struct udphdr* udp = (void*)ip + ip->ihl * 4;
+    if ((void*)(udp + 1) > data_end) {
+        return XDP_PASS;
+    }
+
+    __u32 port = bpf_ntohs(udp->dest);
+    __u8* served = bpf_map_lookup_elem(&rtp_ports, &port);
+    if (!served || !*served) {
+        return XDP_PASS;
+    }
+
+    return bpf_redirect_map(&xsks_map, ctx->rx_queue_index, XDP_PASS);
+}
+
+char _license[] SEC("license") = "GPL";
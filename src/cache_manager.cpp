@@ -19,6 +19,11 @@
 #include <stdexcept>
 
 CacheManager::CacheManager(const std::string& redisUri) {
+    // Initialize the Redis client
+    redis_ = new sw::redis::Redis(connectionOptions(redisUri));
+}
+
+sw::redis::ConnectionOptions CacheManager::connectionOptions(const std::string& redisUri) {
     sw::redis::ConnectionOptions connection_options;
 
     // Parse redisUri to extract host and port
@@ -35,9 +40,7 @@ CacheManager::CacheManager(const std::string& redisUri) {
     } else {
         throw std::invalid_argument("Invalid Redis URI format");
     }
-
-    // Initialize the Redis client
-    redis_ = new sw::redis::Redis(connection_options);
+    return connection_options;
 }
 
 CacheManager::~CacheManager() {
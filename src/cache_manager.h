@@ -27,6 +27,9 @@ public:
     void set(const std::string& key, const std::string& value);
     std::string get(const std::string& key);
 
+    // Connection options for a "tcp://host:port" URI (port defaults to 6379)
+    static sw::redis::ConnectionOptions connectionOptions(const std::string& redisUri);
+
 private:
     sw::redis::Redis* redis_;
 };
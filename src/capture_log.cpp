@@ -0,0 +1,214 @@
+/*
+ * Copyright 2024 nrjchnd@gmail.com
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     https://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an **"AS IS" BASIS,**
+ * **WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.**
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "capture_log.h"
+#include "logger.h"
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+static_assert(sizeof(CaptureFileHeader) == 64, "capture file header layout changed");
+static_assert(sizeof(CaptureRecord) == 40, "capture record layout changed");
+
+const char CAPTURE_MAGIC[8] = {'Q', 'R', 'T', 'P', 'C', 'A', 'P', 1};
+
+namespace {
+size_t paddedLength(size_t len) {
+    return (len + 7) & ~static_cast<size_t>(7);
+}
+}
+
+CaptureLog::CaptureLog()
+    : fd_(-1), area_(nullptr), size_(0), writeOffset_(sizeof(CaptureFileHeader)), fullReported_(false)
+{
+}
+
+CaptureLog::~CaptureLog() {
+    close();
+}
+
+bool CaptureLog::open(const std::string& path, size_t maxBytes) {
+    close();
+
+    // Payloads are recorded decrypted, so the file is for the owner only;
+    // an existing file keeps its mode through O_TRUNC and is tightened too
+    fd_ = ::open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0600);
+    if (fd_ < 0) {
+        Logger::getLogger()->error("Cannot create capture file {}: {}", path, std::strerror(errno));
+        return false;
+    }
+    ::fchmod(fd_, 0600);
+    size_ = std::max(maxBytes, sizeof(CaptureFileHeader) + sizeof(CaptureRecord));
+    if (::ftruncate(fd_, static_cast<off_t>(size_)) != 0) {
+        Logger::getLogger()->error("Cannot size capture file {}: {}", path, std::strerror(errno));
+        ::close(fd_);
+        fd_ = -1;
+        return false;
+    }
+    void* area = ::mmap(nullptr, size_, PROT_READ | PROT_WRITE, MAP_SHARED, fd_, 0);
+    if (area == MAP_FAILED) {
+        Logger::getLogger()->error("Cannot map capture file {}: {}", path, std::strerror(errno));
+        ::close(fd_);
+        fd_ = -1;
+        return false;
+    }
+    area_ = static_cast<uint8_t*>(area);
+
+    CaptureFileHeader* header = reinterpret_cast<CaptureFileHeader*>(area_);
+    std::memcpy(header->magic, CAPTURE_MAGIC, sizeof(header->magic));
+    header->recordHeaderSize = sizeof(CaptureRecord);
+    header->startRealtimeNs = static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::system_clock::now().time_since_epoch()).count());
+    header->dataBytes = 0;
+
+    writeOffset_ = sizeof(CaptureFileHeader);
+    fullReported_ = false;
+    start_ = std::chrono::steady_clock::now();
+
+    Logger::getLogger()->info("Capturing ingress packets to {} ({} MB max)", path, size_ >> 20);
+    return true;
+}
+
+void CaptureLog::close() {
+    if (!area_) {
+        return;
+    }
+    size_t used = std::min(writeOffset_.load(), size_);
+    reinterpret_cast<CaptureFileHeader*>(area_)->dataBytes = used - sizeof(CaptureFileHeader);
+    ::munmap(area_, size_);
+    area_ = nullptr;
+
+    if (::ftruncate(fd_, static_cast<off_t>(used)) != 0) {
+        Logger::getLogger()->warn("Cannot trim capture file: {}", std::strerror(errno));
+    }
+    ::close(fd_);
+    fd_ = -1;
+    Logger::getLogger()->info("Capture closed, {} bytes recorded", used);
+}
+
+void CaptureLog::record(CaptureKind kind, const uint8_t* data, size_t len,
+                        const boost::asio::ip::udp::endpoint* source, uint16_t localPort) {
+    // Empty packets are not recorded; a zero length marks the end of the log
+    if (!area_ || len == 0) {
+        return;
+    }
+    uint64_t timestamp = static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now() - start_).count());
+
+    size_t total = sizeof(CaptureRecord) + paddedLength(len);
+    size_t offset = writeOffset_.fetch_add(total, std::memory_order_relaxed);
+    if (offset + total > size_) {
+        // Keep the offset from wrapping on a long run against a full file
+        writeOffset_.store(size_, std::memory_order_relaxed);
+        if (!fullReported_.exchange(true)) {
+            Logger::getLogger()->warn("Capture file is full, recording stopped");
+        }
+        return;
+    }
+
+    CaptureRecord* record = reinterpret_cast<CaptureRecord*>(area_ + offset);
+    record->timestampNs = timestamp;
+    record->kind = static_cast<uint8_t>(kind);
+    record->localPort = localPort;
+    record->reserved = 0;
+    record->addressFamily = 0;
+    record->sourcePort = 0;
+    std::memset(record->sourceAddress, 0, sizeof(record->sourceAddress));
+    if (source) {
+        record->sourcePort = source->port();
+        if (source->address().is_v4()) {
+            auto bytes = source->address().to_v4().to_bytes();
+            std::memcpy(record->sourceAddress, bytes.data(), bytes.size());
+            record->addressFamily = 4;
+        } else {
+            auto bytes = source->address().to_v6().to_bytes();
+            std::memcpy(record->sourceAddress, bytes.data(), bytes.size());
+            record->addressFamily = 6;
+        }
+    }
+    std::memcpy(area_ + offset + sizeof(CaptureRecord), data, len);
+
+    // The length is published last; until then the record ends the log
+    __atomic_store_n(&record->length, static_cast<uint32_t>(len), __ATOMIC_RELEASE);
+}
+
+CaptureReader::CaptureReader()
+    : fd_(-1), area_(nullptr), size_(0), offset_(0), end_(0)
+{
+}
+
+CaptureReader::~CaptureReader() {
+    if (area_) {
+        ::munmap(const_cast<uint8_t*>(area_), size_);
+    }
+    if (fd_ >= 0) {
+        ::close(fd_);
+    }
+}
+
+bool CaptureReader::open(const std::string& path) {
+    fd_ = ::open(path.c_str(), O_RDONLY);
+    if (fd_ < 0) {
+        Logger::getLogger()->error("Cannot open capture file {}: {}", path, std::strerror(errno));
+        return false;
+    }
+    struct stat info;
+    if (::fstat(fd_, &info) != 0 || static_cast<size_t>(info.st_size) < sizeof(CaptureFileHeader)) {
+        Logger::getLogger()->error("{} is not a capture file", path);
+        return false;
+    }
+    size_ = static_cast<size_t>(info.st_size);
+    void* area = ::mmap(nullptr, size_, PROT_READ, MAP_PRIVATE, fd_, 0);
+    if (area == MAP_FAILED) {
+        Logger::getLogger()->error("Cannot map capture file {}: {}", path, std::strerror(errno));
+        return false;
+    }
+    area_ = static_cast<const uint8_t*>(area);
+    ::madvise(area, size_, MADV_SEQUENTIAL);
+
+    const CaptureFileHeader* header = reinterpret_cast<const CaptureFileHeader*>(area_);
+    if (std::memcmp(header->magic, CAPTURE_MAGIC, sizeof(header->magic)) != 0 ||
+        header->recordHeaderSize != sizeof(CaptureRecord)) {
+        Logger::getLogger()->error("{} is not a capture file of this version", path);
+        return false;
+    }
+
+    // dataBytes is zero when the writer did not close the file
+    offset_ = sizeof(CaptureFileHeader);
+    end_ = header->dataBytes ? std::min(size_, offset_ + header->dataBytes) : size_;
+    return true;
+}
+
+bool CaptureReader::next(CaptureRecord& record, const uint8_t*& data) {
+    if (!area_ || offset_ + sizeof(CaptureRecord) > end_) {
+        return false;
+    }
+    std::memcpy(&record, area_ + offset_, sizeof(CaptureRecord));
+    if (record.length == 0 || offset_ + sizeof(CaptureRecord) + record.length > end_) {
+        return false;
+    }
+    data = area_ + offset_ + sizeof(CaptureRecord);
+    offset_ += sizeof(CaptureRecord) + paddedLength(record.length);
+    return true;
+}
+
+uint64_t CaptureReader::startRealtimeNs() const {
+    return area_ ? reinterpret_cast<const CaptureFileHeader*>(area_)->startRealtimeNs : 0;
+}
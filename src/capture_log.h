@@ -0,0 +1,100 @@
+/*
+ * Copyright 2024 nrjchnd@gmail.com
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     https://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an **"AS IS" BASIS,**
+ * **WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.**
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#ifndef CAPTURE_LOG_H
+#define CAPTURE_LOG_H
+
+#include <boost/asio/ip/udp.hpp>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <string>
+
+// On-disk layout of a capture file: a CaptureFileHeader followed by records,
+// each a CaptureRecord and its payload padded to 8 bytes. A record whose
+// length is still zero ends the log, so a capture cut short by a crash
+// stays readable up to the last complete packet.
+struct CaptureFileHeader {
+    char magic[8];              // "QRTPCAP" + format version
+    uint32_t recordHeaderSize;
+    uint32_t reserved;
+    uint64_t startRealtimeNs;   // wall clock at capture start
+    uint64_t dataBytes;         // bytes of records, written on close
+    uint8_t padding[32];
+};
+
+enum class CaptureKind : uint8_t {
+    RtpIngress = 1,     // RTP after SRTP unprotect, as handed to the session layer
+    QuicIngress = 2     // QUIC stream payload as received
+};
+
+struct CaptureRecord {
+    uint64_t timestampNs;       // monotonic, since capture start
+    uint32_t length;            // payload bytes following the record
+    uint8_t kind;               // CaptureKind
+    uint8_t addressFamily;      // 4 or 6, 0 when there is no source
+    uint16_t sourcePort;
+    uint16_t localPort;
+    uint16_t reserved;
+    uint8_t sourceAddress[16];
+};
+
+// Records ingress packets into a preallocated memory-mapped file. Writers
+// on any thread reserve space with one atomic add, so recording costs a
+// copy into the page cache and no lock. Recording stops when the file is
+// full.
+class CaptureLog {
+public:
+    CaptureLog();
+    ~CaptureLog();
+
+    bool open(const std::string& path, size_t maxBytes);
+    // Trims the file to what was written; no record() may run concurrently
+    void close();
+    bool isOpen() const { return area_ != nullptr; }
+
+    void record(CaptureKind kind, const uint8_t* data, size_t len,
+                const boost::asio::ip::udp::endpoint* source = nullptr, uint16_t localPort = 0);
+
+private:
+    int fd_;
+    uint8_t* area_;
+    size_t size_;
+    std::atomic<size_t> writeOffset_;
+    std::atomic<bool> fullReported_;
+    std::chrono::steady_clock::time_point start_;
+};
+
+// Sequential reader over a capture file, for replay and analysis
+class CaptureReader {
+public:
+    CaptureReader();
+    ~CaptureReader();
+
+    bool open(const std::string& path);
+    // False at the end of the log; data points into the mapped file
+    bool next(CaptureRecord& record, const uint8_t*& data);
+
+    uint64_t startRealtimeNs() const;
+
+private:
+    int fd_;
+    const uint8_t* area_;
+    size_t size_;
+    size_t offset_;
+    size_t end_;
+};
+
+#endif // CAPTURE_LOG_H
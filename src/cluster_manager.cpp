@@ -0,0 +1,587 @@
+/*
+ * Copyright 2024 nrjchnd@gmail.com
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     https://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an **"AS IS" BASIS,**
+ * **WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.**
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "cluster_manager.h"
+#include "cache_manager.h"
+#include "logger.h"
+#include <algorithm>
+#include <cstring>
+#include <iterator>
+#include <mutex>
+#include <sstream>
+
+const std::string CLUSTER_NODES_KEY = "quicrtp:cluster:nodes";
+const std::string CLUSTER_NODE_KEY_PREFIX = "quicrtp:cluster:node:";
+const std::string CLUSTER_SESSIONS_KEY = "quicrtp:cluster:sessions";
+const std::string CLUSTER_EVENTS_CHANNEL = "quicrtp:cluster:events";
+// Sessions hash entries read per HSCAN step at start
+const long long DIRECTORY_SCAN_COUNT = 1000;
+
+namespace {
+
+uint32_t hashNodePoint(const std::string& node, size_t replica) {
+    // FNV-1a, so every node builds the same ring whatever its standard library
+    uint32_t hash = 2166136261u;
+    auto mix = [&hash](uint8_t byte) {
+        hash ^= byte;
+        hash *= 16777619u;
+    };
+    for (char c : node) {
+        mix(static_cast<uint8_t>(c));
+    }
+    mix('#');
+    for (size_t i = 0; i < sizeof(uint32_t); ++i) {
+        mix(static_cast<uint8_t>(replica >> (i * 8)));
+    }
+    hash ^= hash >> 15;
+    hash *= 0x2C1B3C6Du;
+    hash ^= hash >> 12;
+    return hash;
+}
+
+uint32_t hashSsrc(uint32_t ssrc) {
+    // murmur3 finaliser; SSRCs are random but not always well spread
+    ssrc ^= ssrc >> 16;
+    ssrc *= 0x85EBCA6Bu;
+    ssrc ^= ssrc >> 13;
+    ssrc *= 0xC2B2AE35u;
+    ssrc ^= ssrc >> 16;
+    return ssrc;
+}
+
+bool parseEndpoint(const std::string& text, boost::asio::ip::udp::endpoint& endpoint) {
+    size_t colonPos = text.rfind(':');
+    if (colonPos == std::string::npos) {
+        return false;
+    }
+    boost::system::error_code ec;
+    auto address = boost::asio::ip::make_address(text.substr(0, colonPos), ec);
+    if (ec) {
+        return false;
+    }
+    try {
+        endpoint = boost::asio::ip::udp::endpoint(address, static_cast<uint16_t>(std::stoi(text.substr(colonPos + 1))));
+    } catch (const std::exception&) {
+        return false;
+    }
+    return true;
+}
+
+size_t encodeHeader(uint8_t kind, const boost::asio::ip::udp::endpoint& peer, uint16_t localPort, uint8_t* out) {
+    std::memset(out, 0, CLUSTER_FORWARD_HEADER_SIZE);
+    out[0] = 'Q';
+    out[1] = kind;
+    out[2] = 1;
+    out[4] = peer.port() >> 8;
+    out[5] = peer.port() & 0xFF;
+    out[6] = localPort >> 8;
+    out[7] = localPort & 0xFF;
+    if (peer.address().is_v4()) {
+        out[3] = 4;
+        auto bytes = peer.address().to_v4().to_bytes();
+        std::memcpy(out + 8, bytes.data(), bytes.size());
+    } else {
+        out[3] = 6;
+        auto bytes = peer.address().to_v6().to_bytes();
+        std::memcpy(out + 8, bytes.data(), bytes.size());
+    }
+    return CLUSTER_FORWARD_HEADER_SIZE;
+}
+
+}
+
+HashRing::HashRing(size_t virtualNodes)
+    : virtualNodes_(std::max<size_t>(virtualNodes, 1))
+{
+}
+
+void HashRing::setNodes(std::vector<std::string> nodes) {
+    std::sort(nodes.begin(), nodes.end());
+    nodes_ = std::move(nodes);
+    points_.clear();
+    points_.reserve(nodes_.size() * virtualNodes_);
+    for (size_t i = 0; i < nodes_.size(); ++i) {
+        for (size_t replica = 0; replica < virtualNodes_; ++replica) {
+            points_.emplace_back(hashNodePoint(nodes_[i], replica), i);
+        }
+    }
+    std::sort(points_.begin(), points_.end());
+}
+
+const std::string* HashRing::ownerOf(uint32_t ssrc) const {
+    if (points_.empty()) {
+        return nullptr;
+    }
+    uint32_t hash = hashSsrc(ssrc);
+    auto it = std::lower_bound(points_.begin(), points_.end(), std::make_pair(hash, size_t(0)));
+    if (it == points_.end()) {
+        it = points_.begin();
+    }
+    return &nodes_[it->second];
+}
+
+ClusterManager::ClusterManager(const std::string& redisUri, const std::string& nodeId,
+                               const boost::asio::ip::udp::endpoint& forwardEndpoint, size_t virtualNodes,
+                               std::chrono::milliseconds heartbeatInterval, std::chrono::milliseconds nodeTtl)
+    : nodeId_(nodeId), heartbeatInterval_(heartbeatInterval), nodeTtl_(std::max(nodeTtl, heartbeatInterval * 2)),
+      ring_(virtualNodes), running_(false)
+{
+    if (nodeId_.empty() || nodeId_.find(' ') != std::string::npos) {
+        throw std::invalid_argument("Cluster node ID must be non-empty and without spaces");
+    }
+    forwardAddress_ = forwardEndpoint.address().to_string() + ":" + std::to_string(forwardEndpoint.port());
+
+    // The timeout lets the subscriber thread notice stop()
+    sw::redis::ConnectionOptions options = CacheManager::connectionOptions(redisUri);
+    options.socket_timeout = std::chrono::milliseconds(1000);
+    redis_ = std::make_unique<sw::redis::Redis>(options);
+
+    members_[nodeId_] = forwardEndpoint;
+    rebuildRing();
+}
+
+ClusterManager::~ClusterManager() {
+    stop();
+}
+
+bool ClusterManager::start() {
+    try {
+        redis_->set(CLUSTER_NODE_KEY_PREFIX + nodeId_, forwardAddress_, nodeTtl_);
+        redis_->sadd(CLUSTER_NODES_KEY, nodeId_);
+        refreshMembers();
+
+        redis_->publish(CLUSTER_EVENTS_CHANNEL, "join " + nodeId_ + " " + forwardAddress_);
+    } catch (const sw::redis::Error& e) {
+        Logger::getLogger()->error("Cluster registration failed: {}", e.what());
+        return false;
+    }
+
+    running_ = true;
+    heartbeatThread_ = std::thread(&ClusterManager::heartbeatLoop, this);
+    subscriberThread_ = std::thread(&ClusterManager::subscriberLoop, this);
+    ownershipThread_ = std::thread(&ClusterManager::ownershipLoop, this);
+
+    std::shared_lock<std::shared_mutex> lock(stateMutex_);
+    Logger::getLogger()->info("Cluster node {} joined ({} nodes)", nodeId_, members_.size());
+    return true;
+}
+
+void ClusterManager::stop(bool deregister) {
+    if (!running_.exchange(false)) {
+        return;
+    }
+    if (heartbeatThread_.joinable()) {
+        heartbeatThread_.join();
+    }
+    if (subscriberThread_.joinable()) {
+        subscriberThread_.join();
+    }
+    pendingReady_.notify_all();
+    if (ownershipThread_.joinable()) {
+        ownershipThread_.join();
+    }
+    if (!deregister) {
+        return;
+    }
+
+    pruneClaims(nodeId_);
+    try {
+        redis_->srem(CLUSTER_NODES_KEY, nodeId_);
+        redis_->del(CLUSTER_NODE_KEY_PREFIX + nodeId_);
+        redis_->publish(CLUSTER_EVENTS_CHANNEL, "leave " + nodeId_);
+    } catch (const sw::redis::Error& e) {
+        Logger::getLogger()->warn("Cluster deregistration failed: {}", e.what());
+    }
+}
+
+bool ClusterManager::isMember(const boost::asio::ip::udp::endpoint& endpoint) const {
+    std::shared_lock<std::shared_mutex> lock(stateMutex_);
+    for (const auto& member : members_) {
+        if (member.first != nodeId_ && member.second == endpoint) {
+            return true;
+        }
+    }
+    return false;
+}
+
+bool ClusterManager::isLocal(uint32_t ssrc, boost::asio::ip::udp::endpoint& owner) const {
+    std::shared_lock<std::shared_mutex> lock(stateMutex_);
+
+    // Sessions stay with the node that took them, as long as it is alive
+    const std::string* ownerId = nullptr;
+    auto claimed = directory_.find(ssrc);
+    if (claimed != directory_.end() && members_.count(claimed->second) != 0) {
+        ownerId = &claimed->second;
+    } else {
+        ownerId = ring_.ownerOf(ssrc);
+    }
+    if (!ownerId || *ownerId == nodeId_) {
+        return true;
+    }
+
+    auto member = members_.find(*ownerId);
+    if (member == members_.end()) {
+        return true;
+    }
+    owner = member->second;
+    return false;
+}
+
+void ClusterManager::claim(uint32_t ssrc) {
+    {
+        std::unique_lock<std::shared_mutex> lock(stateMutex_);
+        directory_[ssrc] = nodeId_;
+    }
+    {
+        std::lock_guard<std::mutex> lock(pendingMutex_);
+        pending_.emplace_back(ssrc, true);
+    }
+    pendingReady_.notify_one();
+}
+
+void ClusterManager::release(uint32_t ssrc) {
+    bool owned = false;
+    {
+        std::unique_lock<std::shared_mutex> lock(stateMutex_);
+        auto claimed = directory_.find(ssrc);
+        if (claimed != directory_.end() && claimed->second == nodeId_) {
+            directory_.erase(claimed);
+            owned = true;
+        }
+        ingress_.erase(ssrc);
+    }
+    if (!owned) {
+        return;
+    }
+    {
+        std::lock_guard<std::mutex> lock(pendingMutex_);
+        pending_.emplace_back(ssrc, false);
+    }
+    pendingReady_.notify_one();
+}
+
+void ClusterManager::setIngress(uint32_t ssrc, const boost::asio::ip::udp::endpoint& node) {
+    {
+        std::shared_lock<std::shared_mutex> lock(stateMutex_);
+        auto known = ingress_.find(ssrc);
+        if (known != ingress_.end() && known->second == node) {
+            return;
+        }
+    }
+    std::unique_lock<std::shared_mutex> lock(stateMutex_);
+    ingress_[ssrc] = node;
+}
+
+bool ClusterManager::ingressOf(uint32_t ssrc, boost::asio::ip::udp::endpoint& node) const {
+    std::shared_lock<std::shared_mutex> lock(stateMutex_);
+    auto known = ingress_.find(ssrc);
+    if (known == ingress_.end()) {
+        return false;
+    }
+    node = known->second;
+    return true;
+}
+
+bool ClusterManager::noteForwarded(uint32_t ssrc, uint16_t localPort, const boost::asio::ip::udp::endpoint& source,
+                                   std::chrono::steady_clock::time_point now) {
+    std::lock_guard<std::mutex> lock(forwardedMutex_);
+    auto result = forwarded_.emplace(ssrc, Forwarded{localPort, source, now});
+    if (!result.second) {
+        result.first->second.localPort = localPort;
+        result.first->second.source = source;
+        result.first->second.lastSeen = now;
+    }
+    return result.second;
+}
+
+bool ClusterManager::isForwarded(uint32_t ssrc, uint16_t localPort, const boost::asio::ip::udp::endpoint& peer) {
+    std::lock_guard<std::mutex> lock(forwardedMutex_);
+    auto it = forwarded_.find(ssrc);
+    return it != forwarded_.end() && it->second.localPort == localPort && it->second.source == peer;
+}
+
+void ClusterManager::forwardedPorts(std::chrono::steady_clock::time_point now, std::chrono::steady_clock::duration idleTimeout,
+                                    std::unordered_set<uint16_t>& inUse) {
+    std::lock_guard<std::mutex> lock(forwardedMutex_);
+    for (auto it = forwarded_.begin(); it != forwarded_.end();) {
+        if (now - it->second.lastSeen > idleTimeout) {
+            it = forwarded_.erase(it);
+        } else {
+            inUse.insert(it->second.localPort);
+            ++it;
+        }
+    }
+}
+
+size_t ClusterManager::encodeForward(const boost::asio::ip::udp::endpoint& source, uint16_t localPort, uint8_t* out) {
+    return encodeHeader('F', source, localPort, out);
+}
+
+size_t ClusterManager::encodeReply(const boost::asio::ip::udp::endpoint& destination, uint16_t localPort, uint8_t* out) {
+    return encodeHeader('R', destination, localPort, out);
+}
+
+size_t ClusterManager::decodeForward(const uint8_t* data, size_t len, boost::asio::ip::udp::endpoint& peer, uint16_t& localPort,
+                                     bool& reply) {
+    if (len < CLUSTER_FORWARD_HEADER_SIZE || data[0] != 'Q' || (data[1] != 'F' && data[1] != 'R') || data[2] != 1) {
+        return 0;
+    }
+    boost::asio::ip::address address;
+    if (data[3] == 4) {
+        boost::asio::ip::address_v4::bytes_type bytes;
+        std::memcpy(bytes.data(), data + 8, bytes.size());
+        address = boost::asio::ip::address_v4(bytes);
+    } else if (data[3] == 6) {
+        boost::asio::ip::address_v6::bytes_type bytes;
+        std::memcpy(bytes.data(), data + 8, bytes.size());
+        address = boost::asio::ip::address_v6(bytes);
+    } else {
+        return 0;
+    }
+    peer = boost::asio::ip::udp::endpoint(address, static_cast<uint16_t>((data[4] << 8) | data[5]));
+    localPort = static_cast<uint16_t>((data[6] << 8) | data[7]);
+    reply = data[1] == 'R';
+    return CLUSTER_FORWARD_HEADER_SIZE;
+}
+
+void ClusterManager::heartbeatLoop() {
+    auto nextBeat = std::chrono::steady_clock::now();
+    while (running_.load()) {
+        nextBeat += heartbeatInterval_;
+        try {
+            redis_->set(CLUSTER_NODE_KEY_PREFIX + nodeId_, forwardAddress_, nodeTtl_);
+            redis_->sadd(CLUSTER_NODES_KEY, nodeId_);
+            refreshMembers();
+        } catch (const sw::redis::Error& e) {
+            Logger::getLogger()->warn("Cluster heartbeat failed: {}", e.what());
+        }
+        // Sleep in short steps so stop() does not wait a whole interval
+        while (running_.load() && std::chrono::steady_clock::now() < nextBeat) {
+            std::this_thread::sleep_for(std::min(heartbeatInterval_, std::chrono::milliseconds(100)));
+        }
+    }
+}
+
+bool ClusterManager::refreshMembers() {
+    std::vector<std::string> nodes;
+    redis_->smembers(CLUSTER_NODES_KEY, std::back_inserter(nodes));
+
+    std::unordered_map<std::string, boost::asio::ip::udp::endpoint> members;
+    for (const auto& node : nodes) {
+        auto address = redis_->get(CLUSTER_NODE_KEY_PREFIX + node);
+        boost::asio::ip::udp::endpoint endpoint;
+        if (address && parseEndpoint(*address, endpoint)) {
+            members[node] = endpoint;
+        } else if (node != nodeId_) {
+            // Heartbeat expired: the node is gone, and its calls with it
+            redis_->srem(CLUSTER_NODES_KEY, node);
+            Logger::getLogger()->warn("Cluster node {} timed out", node);
+            pruneClaims(node);
+        }
+    }
+
+    std::unique_lock<std::shared_mutex> lock(stateMutex_);
+    members[nodeId_] = members_[nodeId_];
+    if (members == members_) {
+        return false;
+    }
+    members_.swap(members);
+    rebuildRing();
+    return true;
+}
+
+void ClusterManager::pruneClaims(const std::string& node) {
+    std::vector<uint32_t> claims;
+    {
+        std::unique_lock<std::shared_mutex> lock(stateMutex_);
+        for (auto it = directory_.begin(); it != directory_.end();) {
+            if (it->second == node) {
+                claims.push_back(it->first);
+                it = directory_.erase(it);
+            } else {
+                ++it;
+            }
+        }
+    }
+    if (claims.empty()) {
+        return;
+    }
+    try {
+        auto pipeline = redis_->pipeline(false);
+        for (uint32_t ssrc : claims) {
+            pipeline.hdel(CLUSTER_SESSIONS_KEY, std::to_string(ssrc));
+        }
+        pipeline.exec();
+    } catch (const sw::redis::Error& e) {
+        Logger::getLogger()->warn("Failed to drop the sessions of cluster node {}: {}", node, e.what());
+    }
+}
+
+void ClusterManager::rebuildRing() {
+    std::vector<std::string> nodes;
+    nodes.reserve(members_.size());
+    for (const auto& member : members_) {
+        nodes.push_back(member.first);
+    }
+    ring_.setNodes(std::move(nodes));
+}
+
+void ClusterManager::subscriberLoop() {
+    while (running_.load()) {
+        try {
+            auto subscriber = redis_->subscriber();
+            subscriber.on_message([this](std::string, std::string message) {
+                handleEvent(message);
+            });
+            subscriber.subscribe(CLUSTER_EVENTS_CHANNEL);
+            while (running_.load()) {
+                try {
+                    subscriber.consume();
+                } catch (const sw::redis::TimeoutError&) {
+                    // Idle channel; check running_ and wait again
+                }
+            }
+        } catch (const sw::redis::Error& e) {
+            Logger::getLogger()->warn("Cluster subscription lost: {}", e.what());
+            std::this_thread::sleep_for(heartbeatInterval_);
+        }
+    }
+}
+
+void ClusterManager::ownershipLoop() {
+    loadDirectory();
+
+    std::vector<std::pair<uint32_t, bool>> batch;
+    bool stopping = false;
+    while (!stopping) {
+        {
+            std::unique_lock<std::mutex> lock(pendingMutex_);
+            pendingReady_.wait_for(lock, std::chrono::milliseconds(100), [this]() {
+                return !pending_.empty() || !running_.load();
+            });
+            // What was claimed before stop() is still written
+            stopping = !running_.load();
+            batch.swap(pending_);
+        }
+        if (batch.empty()) {
+            continue;
+        }
+        try {
+            auto pipeline = redis_->pipeline(false);
+            for (const auto& entry : batch) {
+                std::string ssrc = std::to_string(entry.first);
+                if (entry.second) {
+                    pipeline.hset(CLUSTER_SESSIONS_KEY, ssrc, nodeId_);
+                    pipeline.publish(CLUSTER_EVENTS_CHANNEL, "own " + ssrc + " " + nodeId_);
+                } else {
+                    pipeline.hdel(CLUSTER_SESSIONS_KEY, ssrc);
+                    pipeline.publish(CLUSTER_EVENTS_CHANNEL, "free " + ssrc + " " + nodeId_);
+                }
+            }
+            pipeline.exec();
+        } catch (const sw::redis::Error& e) {
+            Logger::getLogger()->warn("Failed to publish ownership of {} sessions: {}", batch.size(), e.what());
+        }
+        batch.clear();
+    }
+}
+
+void ClusterManager::loadDirectory() {
+    // In steps, so a large directory neither blocks start() nor Redis;
+    // claims already learned from events are newer and kept
+    size_t loaded = 0;
+    long long cursor = 0;
+    try {
+        do {
+            std::unordered_map<std::string, std::string> sessions;
+            cursor = redis_->hscan(CLUSTER_SESSIONS_KEY, cursor, DIRECTORY_SCAN_COUNT, std::inserter(sessions, sessions.begin()));
+            std::unique_lock<std::shared_mutex> lock(stateMutex_);
+            for (const auto& entry : sessions) {
+                try {
+                    if (directory_.emplace(static_cast<uint32_t>(std::stoul(entry.first)), entry.second).second) {
+                        ++loaded;
+                    }
+                } catch (const std::exception&) {
+                    // Skip malformed entries
+                }
+            }
+        } while (cursor != 0 && running_.load());
+    } catch (const sw::redis::Error& e) {
+        Logger::getLogger()->warn("Cluster session directory incomplete: {}", e.what());
+    }
+    Logger::getLogger()->info("Cluster session directory loaded ({} sessions)", loaded);
+}
+
+void ClusterManager::handleEvent(const std::string& message) {
+    std::istringstream fields(message);
+    std::string event;
+    fields >> event;
+
+    if (event == "own" || event == "free") {
+        std::string ssrc;
+        std::string owner;
+        fields >> ssrc >> owner;
+        if (owner.empty() || owner == nodeId_) {
+            return;
+        }
+        try {
+            uint32_t value = static_cast<uint32_t>(std::stoul(ssrc));
+            std::unique_lock<std::shared_mutex> lock(stateMutex_);
+            if (event == "own") {
+                directory_[value] = owner;
+            } else {
+                auto claimed = directory_.find(value);
+                if (claimed != directory_.end() && claimed->second == owner) {
+                    directory_.erase(claimed);
+                }
+            }
+        } catch (const std::exception&) {
+            // Ignore malformed events
+        }
+        return;
+    }
+
+    std::string node;
+    fields >> node;
+    if (node.empty() || node == nodeId_) {
+        return;
+    }
+    if (event == "join") {
+        std::string address;
+        fields >> address;
+        boost::asio::ip::udp::endpoint endpoint;
+        if (parseEndpoint(address, endpoint)) {
+            std::unique_lock<std::shared_mutex> lock(stateMutex_);
+            members_[node] = endpoint;
+            rebuildRing();
+            Logger::getLogger()->info("Cluster node {} joined at {}", node, address);
+        }
+    } else if (event == "leave") {
+        // The node dropped its own claims from the sessions hash
+        std::unique_lock<std::shared_mutex> lock(stateMutex_);
+        if (members_.erase(node) != 0) {
+            rebuildRing();
+            Logger::getLogger()->info("Cluster node {} left", node);
+        }
+        for (auto it = directory_.begin(); it != directory_.end();) {
+            if (it->second == node) {
+                it = directory_.erase(it);
+            } else {
+                ++it;
+            }
+        }
+    }
+}
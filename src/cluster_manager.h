@@ -0,0 +1,173 @@
+/*
+ * Copyright 2024 nrjchnd@gmail.com
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     https://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an **"AS IS" BASIS,**
+ * **WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.**
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#ifndef CLUSTER_MANAGER_H
+#define CLUSTER_MANAGER_H
+
+#include <sw/redis++/redis++.h>
+#include <boost/asio.hpp>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <shared_mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
+#include <utility>
+#include <vector>
+
+// Forwarded packets carry the original source and local port in front of
+// the RTP packet: 'Q' 'F' | version | family (4/6) | source port | local
+// port | source address (16). Replies going back to the node the call
+// came in on have the same header with 'R' and the endpoint's address.
+const size_t CLUSTER_FORWARD_HEADER_SIZE = 24;
+// Longest RTP header a reply carries
+const size_t CLUSTER_REPLY_MAX_HEADER = 256;
+
+// Consistent-hash ring with virtualNodes points per node, so adding or
+// removing a node only moves about 1/N of the SSRCs
+class HashRing {
+public:
+    explicit HashRing(size_t virtualNodes);
+
+    void setNodes(std::vector<std::string> nodes);
+    const std::vector<std::string>& nodes() const { return nodes_; }
+
+    // Owner of ssrc, or null when the ring is empty
+    const std::string* ownerOf(uint32_t ssrc) const;
+
+private:
+    size_t virtualNodes_;
+    std::vector<std::string> nodes_;
+    std::vector<std::pair<uint32_t, size_t>> points_;   // hash, index into nodes_; sorted
+};
+
+// Cluster mode: several QuicRtp nodes share one Redis and split the sessions
+// between them.
+//
+// Each node keeps quicrtp:cluster:node:<id> (its forward endpoint) alive
+// with a heartbeat and is listed in quicrtp:cluster:nodes. A new SSRC
+// belongs to the node the hash ring picks; once a node has taken a session
+// it keeps it, recorded in the quicrtp:cluster:sessions hash, so sessions
+// do not move when nodes join; the claim ends with the session. Joins,
+// leaves, claims and releases are published on quicrtp:cluster:events and
+// every node applies them to a local replica, so lookups on the packet path
+// never touch Redis. Claims and releases are written by a background thread,
+// and the hash is scanned into the replica in the background at start.
+//
+// The endpoint only knows the node it sent to, so the owner of a forwarded
+// call sends the downlink back through that ingress node, which sends it on
+// from the call's port.
+class ClusterManager {
+public:
+    ClusterManager(const std::string& redisUri, const std::string& nodeId,
+                   const boost::asio::ip::udp::endpoint& forwardEndpoint, size_t virtualNodes,
+                   std::chrono::milliseconds heartbeatInterval, std::chrono::milliseconds nodeTtl);
+    ~ClusterManager();
+
+    // Registers the node, loads the directory and starts the heartbeat and
+    // subscriber threads
+    bool start();
+    // Deregisters the node so the others take over its share at once. A
+    // process handing over to its successor in a hot upgrade keeps the
+    // registration, which the new process carries on.
+    void stop(bool deregister = true);
+
+    const std::string& nodeId() const { return nodeId_; }
+    // True when endpoint is the forward endpoint of a live node; packets
+    // on the forward port from anywhere else are dropped
+    bool isMember(const boost::asio::ip::udp::endpoint& endpoint) const;
+
+    // True when ssrc should be handled here; otherwise owner is the forward
+    // endpoint of the node that should
+    bool isLocal(uint32_t ssrc, boost::asio::ip::udp::endpoint& owner) const;
+    // Records that this node took a new session
+    void claim(uint32_t ssrc);
+    // The session for ssrc ended here: the claim and any ingress are dropped
+    void release(uint32_t ssrc);
+
+    // Owner side: a forwarded session's packets came in through node
+    void setIngress(uint32_t ssrc, const boost::asio::ip::udp::endpoint& node);
+    // Forward endpoint of the node the session's downlink goes back through
+    bool ingressOf(uint32_t ssrc, boost::asio::ip::udp::endpoint& node) const;
+
+    // Ingress side: a packet for ssrc from source on localPort was
+    // forwarded to its owner; true for the first one of the SSRC
+    bool noteForwarded(uint32_t ssrc, uint16_t localPort, const boost::asio::ip::udp::endpoint& source,
+                       std::chrono::steady_clock::time_point now);
+    // True when a reply for ssrc to peer from localPort answers a call this
+    // node forwarded, so replies cannot send anywhere else
+    bool isForwarded(uint32_t ssrc, uint16_t localPort, const boost::asio::ip::udp::endpoint& peer);
+    // Drops forwarded SSRCs idle for idleTimeout and adds the ports of the
+    // others to inUse, so their listeners stay open for the replies
+    void forwardedPorts(std::chrono::steady_clock::time_point now, std::chrono::steady_clock::duration idleTimeout,
+                        std::unordered_set<uint16_t>& inUse);
+
+    static size_t encodeForward(const boost::asio::ip::udp::endpoint& source, uint16_t localPort, uint8_t* out);
+    static size_t encodeReply(const boost::asio::ip::udp::endpoint& destination, uint16_t localPort, uint8_t* out);
+    // Returns the header length, or 0 when data is neither a forwarded
+    // packet nor a reply; peer is the endpoint either way
+    static size_t decodeForward(const uint8_t* data, size_t len, boost::asio::ip::udp::endpoint& peer, uint16_t& localPort,
+                                bool& reply);
+
+private:
+    struct Forwarded {
+        uint16_t localPort;
+        boost::asio::ip::udp::endpoint source;
+        std::chrono::steady_clock::time_point lastSeen;
+    };
+
+    void heartbeatLoop();
+    void subscriberLoop();
+    void ownershipLoop();
+    void loadDirectory();
+    void handleEvent(const std::string& message);
+    bool refreshMembers();
+    // Deletes the claims of node from the sessions hash and the replica
+    void pruneClaims(const std::string& node);
+    // Expects stateMutex_ to be held exclusively
+    void rebuildRing();
+
+    std::unique_ptr<sw::redis::Redis> redis_;
+    std::string nodeId_;
+    std::string forwardAddress_;
+    std::chrono::milliseconds heartbeatInterval_;
+    std::chrono::milliseconds nodeTtl_;
+
+    mutable std::shared_mutex stateMutex_;
+    HashRing ring_;
+    std::unordered_map<std::string, boost::asio::ip::udp::endpoint> members_;   // by node ID
+    std::unordered_map<uint32_t, std::string> directory_;                      // SSRC -> node ID
+    std::unordered_map<uint32_t, boost::asio::ip::udp::endpoint> ingress_;     // SSRC -> ingress node
+
+    std::mutex forwardedMutex_;
+    std::unordered_map<uint32_t, Forwarded> forwarded_;
+
+    // Claims (true) and releases (false) waiting to be written
+    std::mutex pendingMutex_;
+    std::condition_variable pendingReady_;
+    std::vector<std::pair<uint32_t, bool>> pending_;
+
+    std::atomic<bool> running_;
+    std::thread heartbeatThread_;
+    std::thread subscriberThread_;
+    std::thread ownershipThread_;
+};
+
+#endif // CLUSTER_MANAGER_H
@@ -33,10 +33,18 @@ std::string Config::trim(const std::string& str) {
     return str.substr(start, end - start + 1);
 }
 
+const std::string& Config::defaultPath() {
+    return DEFAULT_CONFIG_PATH;
+}
+
 bool Config::loadConfig() {
-    std::ifstream file(DEFAULT_CONFIG_PATH);
+    return loadConfig(DEFAULT_CONFIG_PATH);
+}
+
+bool Config::loadConfig(const std::string& path) {
+    std::ifstream file(path);
     if (!file.is_open()) {
-        throw std::runtime_error("Unable to open configuration file: " + DEFAULT_CONFIG_PATH);
+        throw std::runtime_error("Unable to open configuration file: " + path);
     }
 
     std::string line;
@@ -111,6 +119,13 @@ int Config::getInt(const std::string& section, const std::string& key) const {
     }
 }
 
+int Config::getInt(const std::string& section, const std::string& key, int defaultValue) const {
+    if (get(section, key).empty()) {
+        return defaultValue;
+    }
+    return getInt(section, key);
+}
+
 std::vector<std::string> Config::getList(const std::string& section, const std::string& key) const {
     std::string val = get(section, key);
     std::vector<std::string> list;
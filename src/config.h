@@ -23,12 +23,17 @@
 class Config {
 public:
     bool loadConfig();
+    bool loadConfig(const std::string& path);
+    static const std::string& defaultPath();
     std::string get(const std::string& section, const std::string& key) const;
     bool getBool(const std::string& section, const std::string& key) const;
     int getInt(const std::string& section, const std::string& key) const;
+    int getInt(const std::string& section, const std::string& key, int defaultValue) const;
 
     std::vector<std::string> getList(const std::string& section, const std::string& key) const;
 
+    const std::map<std::string, std::map<std::string, std::string>>& sections() const { return data; }
+
 private:
     std::map<std::string, std::map<std::string, std::string>> data;
     static std::string trim(const std::string& str);
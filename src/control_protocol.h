@@ -0,0 +1,102 @@
+/*
+ * Copyright 2024 nrjchnd@gmail.com
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     https://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an **"AS IS" BASIS,**
+ * **WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.**
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#ifndef CONTROL_PROTOCOL_H
+#define CONTROL_PROTOCOL_H
+
+#include <cstddef>
+#include <cstdint>
+
+// Local control API, for a signalling controller on the same host to set
+// calls up without going through Redis. Each request and response is one
+// fixed-size struct in host byte order, sent as one SOCK_SEQPACKET message
+// on the [Control] socket. Requests may be pipelined; responses come back
+// in order and carry the request's requestId.
+//
+//   AllocatePort   opens an RTP port; tenant and srtpKey optional -> port
+//   ReleasePort    port; the sessions on it end with it
+//   CreateSession  ssrc and port; the source (addressFamily, sourceAddress,
+//                  sourcePort) is optional, without one the session latches
+//                  to its first packet
+//
+// AllocatePort and CreateSession are refused with Overloaded while admission
+// control ([Admission]) refuses new sessions.
+//   RemoveSession  ssrc
+//   AttachTenant   port and tenant; an empty tenant detaches the port
+//   SessionStats   ssrc -> stats
+
+enum class ControlOp : uint8_t {
+    AllocatePort = 1,
+    ReleasePort = 2,
+    CreateSession = 3,
+    RemoveSession = 4,
+    AttachTenant = 5,
+    SessionStats = 6
+};
+
+enum class ControlStatus : uint8_t {
+    Ok = 0,
+    Invalid = 1,        // malformed request or unknown op
+    NotFound = 2,       // no such session, port or tenant
+    Exists = 3,         // the SSRC already has a session
+    Exhausted = 4,      // no RTP port could be opened
+    Unsupported = 5,    // ports are not allocated in single-port mode
+    Overloaded = 6      // admission control refuses new calls
+};
+
+const uint8_t CONTROL_SRTP_KEY_LENGTH = 30;   // master key and salt
+const size_t CONTROL_TENANT_LENGTH = 32;
+
+struct ControlRequest {
+    uint32_t requestId;
+    uint8_t op;                 // ControlOp
+    uint8_t addressFamily;      // 4 or 6, 0 for no source
+    uint16_t port;
+    uint32_t ssrc;
+    uint16_t sourcePort;
+    uint8_t srtpKeyLength;      // 0 or CONTROL_SRTP_KEY_LENGTH
+    uint8_t reserved;
+    uint8_t sourceAddress[16];
+    char tenant[CONTROL_TENANT_LENGTH];   // NUL-padded tenant ID
+    uint8_t srtpKey[CONTROL_SRTP_KEY_LENGTH];
+    uint8_t reserved2[2];
+};
+
+struct ControlSessionStats {
+    uint64_t uplinkPackets;         // received from the endpoint
+    int64_t uplinkLost;
+    uint64_t downlinkPackets;       // received over QUIC
+    int64_t downlinkLost;
+    uint32_t uplinkJitterUs;
+    uint32_t downlinkJitterUs;
+    uint32_t sentPackets;           // sent to the endpoint
+    uint32_t sentOctets;
+    int32_t peerCumulativeLost;     // from the endpoint's RTCP
+    int32_t roundTripUs;            // -1 until known
+    uint8_t peerFractionLost;
+    uint8_t latched;                // 0 until the first packet
+    uint16_t localPort;
+    uint32_t reserved;
+};
+
+struct ControlResponse {
+    uint32_t requestId;
+    uint8_t op;
+    uint8_t status;             // ControlStatus
+    uint16_t port;              // AllocatePort
+    ControlSessionStats stats;  // SessionStats
+};
+
+#endif // CONTROL_PROTOCOL_H
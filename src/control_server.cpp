@@ -0,0 +1,416 @@
+/*
+ * Copyright 2024 nrjchnd@gmail.com
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     https://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an **"AS IS" BASIS,**
+ * **WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.**
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "control_server.h"
+#include "logger.h"
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+static_assert(sizeof(ControlRequest) == 96, "control request layout changed");
+static_assert(sizeof(ControlSessionStats) == 64, "control stats layout changed");
+static_assert(sizeof(ControlResponse) == 72, "control response layout changed");
+
+// Requests taken from a client per recvmmsg
+const size_t CONTROL_BATCH = 64;
+const int CONTROL_BACKLOG = 64;
+// A client that leaves its replies unread for this long is dropped
+const std::chrono::seconds CONTROL_STALL_TIMEOUT(1);
+
+namespace {
+
+std::string hexKey(const uint8_t* key, size_t len) {
+    static const char digits[] = "0123456789abcdef";
+    std::string hex;
+    hex.reserve(len * 2);
+    for (size_t i = 0; i < len; ++i) {
+        hex.push_back(digits[key[i] >> 4]);
+        hex.push_back(digits[key[i] & 0x0F]);
+    }
+    return hex;
+}
+
+std::string tenantOf(const ControlRequest& request) {
+    return std::string(request.tenant, strnlen(request.tenant, sizeof(request.tenant)));
+}
+
+bool sourceOf(const ControlRequest& request, boost::asio::ip::udp::endpoint& source) {
+    if (request.addressFamily == 0) {
+        source = boost::asio::ip::udp::endpoint();
+        return true;
+    }
+    if (request.addressFamily == 4) {
+        boost::asio::ip::address_v4::bytes_type bytes;
+        std::memcpy(bytes.data(), request.sourceAddress, bytes.size());
+        source = boost::asio::ip::udp::endpoint(boost::asio::ip::address_v4(bytes), request.sourcePort);
+        return request.sourcePort != 0;
+    }
+    if (request.addressFamily == 6) {
+        boost::asio::ip::address_v6::bytes_type bytes;
+        std::memcpy(bytes.data(), request.sourceAddress, bytes.size());
+        source = boost::asio::ip::udp::endpoint(boost::asio::ip::address_v6(bytes), request.sourcePort);
+        return request.sourcePort != 0;
+    }
+    return false;
+}
+
+uint32_t jitterUs(const RtpReceiveStats& stats) {
+    return static_cast<uint32_t>(stats.jitterMs() * 1000.0);
+}
+
+}
+
+ControlServer::ControlServer(SessionManager& sessions, RtpPortManager* portManager, TenantDirectory& tenants)
+    : sessions_(sessions), portManager_(portManager), tenants_(tenants), listenFd_(-1), epollFd_(-1),
+      handled_(0), running_(false) {
+}
+
+ControlServer::~ControlServer() {
+    stop();
+}
+
+bool ControlServer::listen(const std::string& path) {
+    sockaddr_un address;
+    if (path.size() >= sizeof(address.sun_path)) {
+        Logger::getLogger()->error("Control socket path {} is too long", path);
+        return false;
+    }
+    listenFd_ = ::socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC | SOCK_NONBLOCK, 0);
+    epollFd_ = ::epoll_create1(EPOLL_CLOEXEC);
+    if (listenFd_ < 0 || epollFd_ < 0) {
+        Logger::getLogger()->error("Cannot create control socket: {}", std::strerror(errno));
+        stop();
+        return false;
+    }
+    // Left behind by a process that did not shut down cleanly
+    ::unlink(path.c_str());
+    std::memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    std::strncpy(address.sun_path, path.c_str(), sizeof(address.sun_path) - 1);
+    epoll_event event = {};
+    event.events = EPOLLIN;
+    event.data.fd = listenFd_;
+    if (::bind(listenFd_, reinterpret_cast<sockaddr*>(&address), sizeof(address)) != 0 ||
+        ::listen(listenFd_, CONTROL_BACKLOG) != 0 || ::epoll_ctl(epollFd_, EPOLL_CTL_ADD, listenFd_, &event) != 0) {
+        Logger::getLogger()->error("Cannot listen on control socket {}: {}", path, std::strerror(errno));
+        stop();
+        return false;
+    }
+    ::chmod(path.c_str(), 0660);
+    path_ = path;
+    Logger::getLogger()->info("Control API on {}", path);
+    return true;
+}
+
+void ControlServer::start() {
+    if (listenFd_ < 0 || running_) {
+        return;
+    }
+    running_ = true;
+    thread_ = std::thread(&ControlServer::run, this);
+}
+
+void ControlServer::stop(bool unlinkPath) {
+    running_ = false;
+    if (thread_.joinable()) {
+        thread_.join();
+    }
+    for (auto& client : clients_) {
+        ::close(client.first);
+    }
+    clients_.clear();
+    if (listenFd_ >= 0) {
+        ::close(listenFd_);
+        listenFd_ = -1;
+        if (unlinkPath) {
+            ::unlink(path_.c_str());
+        }
+    }
+    if (epollFd_ >= 0) {
+        ::close(epollFd_);
+        epollFd_ = -1;
+    }
+}
+
+void ControlServer::run() {
+    epoll_event events[16];
+    while (running_) {
+        // Short waits so stop() is noticed
+        int count = ::epoll_wait(epollFd_, events, 16, 100);
+        for (int i = 0; i < count; ++i) {
+            int fd = events[i].data.fd;
+            if (fd == listenFd_) {
+                int client;
+                while ((client = ::accept4(listenFd_, nullptr, nullptr, SOCK_CLOEXEC | SOCK_NONBLOCK)) >= 0) {
+                    epoll_event event = {};
+                    event.events = EPOLLIN | EPOLLRDHUP;
+                    event.data.fd = client;
+                    if (::epoll_ctl(epollFd_, EPOLL_CTL_ADD, client, &event) != 0) {
+                        ::close(client);
+                        continue;
+                    }
+                    clients_[client] = Client();
+                }
+                continue;
+            }
+            auto client = clients_.find(fd);
+            if (client == clients_.end()) {
+                continue;
+            }
+            bool alive = true;
+            if ((events[i].events & EPOLLOUT) && !client->second.pending.empty()) {
+                alive = flush(fd, client->second);
+            }
+            if (alive && client->second.pending.empty()) {
+                alive = serve(fd, client->second);
+            }
+            if (!alive) {
+                closeClient(fd);
+            }
+        }
+
+        auto now = std::chrono::steady_clock::now();
+        std::vector<int> stalled;
+        for (const auto& client : clients_) {
+            if (!client.second.pending.empty() && now - client.second.stalledSince > CONTROL_STALL_TIMEOUT) {
+                stalled.push_back(client.first);
+            }
+        }
+        for (int fd : stalled) {
+            Logger::getLogger()->warn("Dropping a control client that does not read its replies");
+            closeClient(fd);
+        }
+    }
+}
+
+bool ControlServer::watch(int fd, bool writable) {
+    epoll_event event = {};
+    event.events = (writable ? EPOLLOUT : EPOLLIN) | EPOLLRDHUP;
+    event.data.fd = fd;
+    return ::epoll_ctl(epollFd_, EPOLL_CTL_MOD, fd, &event) == 0;
+}
+
+bool ControlServer::flush(int fd, Client& client) {
+    mmsghdr out[CONTROL_BATCH];
+    iovec vectors[CONTROL_BATCH];
+    size_t sent = 0;
+    while (sent < client.pending.size()) {
+        size_t count = std::min(client.pending.size() - sent, CONTROL_BATCH);
+        std::memset(out, 0, sizeof(mmsghdr) * count);
+        for (size_t i = 0; i < count; ++i) {
+            vectors[i] = {&client.pending[sent + i], sizeof(ControlResponse)};
+            out[i].msg_hdr.msg_iov = &vectors[i];
+            out[i].msg_hdr.msg_iovlen = 1;
+        }
+        int result = ::sendmmsg(fd, out, static_cast<unsigned int>(count), MSG_NOSIGNAL | MSG_DONTWAIT);
+        if (result < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                return false;
+            }
+            break;
+        }
+        sent += static_cast<size_t>(result);
+    }
+    client.pending.erase(client.pending.begin(), client.pending.begin() + static_cast<std::ptrdiff_t>(sent));
+    if (client.pending.empty()) {
+        return watch(fd, false);
+    }
+    if (sent > 0) {
+        client.stalledSince = std::chrono::steady_clock::now();
+    }
+    return true;
+}
+
+bool ControlServer::serve(int fd, Client& client) {
+    ControlRequest requests[CONTROL_BATCH];
+    ControlResponse responses[CONTROL_BATCH];
+    iovec requestVectors[CONTROL_BATCH];
+    iovec responseVectors[CONTROL_BATCH];
+    mmsghdr in[CONTROL_BATCH];
+    mmsghdr out[CONTROL_BATCH];
+    std::memset(in, 0, sizeof(in));
+    std::memset(out, 0, sizeof(out));
+    for (size_t i = 0; i < CONTROL_BATCH; ++i) {
+        requestVectors[i] = {&requests[i], sizeof(ControlRequest)};
+        in[i].msg_hdr.msg_iov = &requestVectors[i];
+        in[i].msg_hdr.msg_iovlen = 1;
+        responseVectors[i] = {&responses[i], sizeof(ControlResponse)};
+        out[i].msg_hdr.msg_iov = &responseVectors[i];
+        out[i].msg_hdr.msg_iovlen = 1;
+    }
+
+    // Drain what the client has queued, a batch at a time
+    for (;;) {
+        int received = ::recvmmsg(fd, in, CONTROL_BATCH, MSG_DONTWAIT, nullptr);
+        if (received < 0) {
+            return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+        }
+        // Nothing, or an empty message, is the end of the stream
+        if (received == 0) {
+            return false;
+        }
+        size_t count = static_cast<size_t>(received);
+        for (size_t i = 0; i < count; ++i) {
+            if (in[i].msg_len == 0) {
+                return false;
+            }
+            std::memset(&responses[i], 0, sizeof(ControlResponse));
+            if (in[i].msg_len != sizeof(ControlRequest) || (in[i].msg_hdr.msg_flags & MSG_TRUNC)) {
+                std::memcpy(&responses[i].requestId, &requests[i].requestId, sizeof(uint32_t));
+                responses[i].status = static_cast<uint8_t>(ControlStatus::Invalid);
+                continue;
+            }
+            responses[i].requestId = requests[i].requestId;
+            responses[i].op = requests[i].op;
+            responses[i].status = static_cast<uint8_t>(handle(requests[i], responses[i]));
+        }
+        handled_.fetch_add(count, std::memory_order_relaxed);
+
+        size_t sent = 0;
+        while (sent < count) {
+            int result = ::sendmmsg(fd, out + sent, static_cast<unsigned int>(count - sent), MSG_NOSIGNAL | MSG_DONTWAIT);
+            if (result < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                    return false;
+                }
+                // The rest waits for room; the client is not read meanwhile
+                client.pending.assign(responses + sent, responses + count);
+                client.stalledSince = std::chrono::steady_clock::now();
+                return watch(fd, true);
+            }
+            sent += static_cast<size_t>(result);
+        }
+        if (count < CONTROL_BATCH) {
+            return true;
+        }
+    }
+}
+
+ControlStatus ControlServer::handle(const ControlRequest& request, ControlResponse& response) {
+    switch (static_cast<ControlOp>(request.op)) {
+    case ControlOp::AllocatePort: {
+        if (!portManager_) {
+            return ControlStatus::Unsupported;
+        }
+        if (admissionCheck_ && admissionCheck_()) {
+            return ControlStatus::Overloaded;
+        }
+        std::string srtpKey;
+        if (request.srtpKeyLength == CONTROL_SRTP_KEY_LENGTH) {
+            srtpKey = hexKey(request.srtpKey, CONTROL_SRTP_KEY_LENGTH);
+        } else if (request.srtpKeyLength != 0) {
+            return ControlStatus::Invalid;
+        }
+        uint16_t tenant = NO_TENANT;
+        std::string tenantId = tenantOf(request);
+        if (!tenantId.empty()) {
+            tenant = tenants_.find(tenantId);
+            if (tenant == NO_TENANT) {
+                return ControlStatus::NotFound;
+            }
+        }
+        uint16_t port = portManager_->openListener(srtpKey);
+        if (port == 0) {
+            return ControlStatus::Exhausted;
+        }
+        tenants_.attachPort(port, tenant);
+        response.port = port;
+        return ControlStatus::Ok;
+    }
+    case ControlOp::ReleasePort:
+        if (!portManager_) {
+            return ControlStatus::Unsupported;
+        }
+        if (!portManager_->findListener(request.port)) {
+            return ControlStatus::NotFound;
+        }
+        for (uint32_t ssrc : sessions_.removeSessionsOnPort(request.port)) {
+            if (sessionEnded_) {
+                sessionEnded_(ssrc);
+            }
+        }
+        tenants_.attachPort(request.port, NO_TENANT);
+        portManager_->releaseListener(request.port);
+        return ControlStatus::Ok;
+    case ControlOp::CreateSession: {
+        boost::asio::ip::udp::endpoint source;
+        if (!sourceOf(request, source)) {
+            return ControlStatus::Invalid;
+        }
+        if (admissionCheck_ && !sessions_.hasSession(request.ssrc) && admissionCheck_()) {
+            return ControlStatus::Overloaded;
+        }
+        return sessions_.provisionSession(request.ssrc, source, request.port) ? ControlStatus::Ok : ControlStatus::Exists;
+    }
+    case ControlOp::RemoveSession:
+        if (!sessions_.removeSession(request.ssrc)) {
+            return ControlStatus::NotFound;
+        }
+        if (sessionEnded_) {
+            sessionEnded_(request.ssrc);
+        }
+        return ControlStatus::Ok;
+    case ControlOp::AttachTenant: {
+        if (request.port == 0) {
+            return ControlStatus::Invalid;
+        }
+        std::string tenantId = tenantOf(request);
+        uint16_t tenant = tenantId.empty() ? NO_TENANT : tenants_.find(tenantId);
+        if (!tenantId.empty() && tenant == NO_TENANT) {
+            return ControlStatus::NotFound;
+        }
+        tenants_.attachPort(request.port, tenant);
+        return ControlStatus::Ok;
+    }
+    case ControlOp::SessionStats: {
+        ControlSessionStats& stats = response.stats;
+        bool found = sessions_.updateSession(request.ssrc, [&stats](SessionInfo& info) {
+            stats.uplinkPackets = info.stats.uplink.received();
+            stats.uplinkLost = info.stats.uplink.started() ? info.stats.uplink.cumulativeLost() : 0;
+            stats.downlinkPackets = info.stats.downlink.received();
+            stats.downlinkLost = info.stats.downlink.started() ? info.stats.downlink.cumulativeLost() : 0;
+            stats.uplinkJitterUs = jitterUs(info.stats.uplink);
+            stats.downlinkJitterUs = jitterUs(info.stats.downlink);
+            stats.sentPackets = info.stats.sent.packets;
+            stats.sentOctets = info.stats.sent.octets;
+            stats.peerCumulativeLost = info.stats.peer.cumulativeLost;
+            stats.roundTripUs = info.stats.peer.roundTripMs < 0.0 ? -1 : static_cast<int32_t>(info.stats.peer.roundTripMs * 1000.0);
+            stats.peerFractionLost = info.stats.peer.fractionLost;
+            stats.latched = info.latched ? 1 : 0;
+            stats.localPort = info.localPort;
+        });
+        return found ? ControlStatus::Ok : ControlStatus::NotFound;
+    }
+    }
+    return ControlStatus::Invalid;
+}
+
+void ControlServer::closeClient(int fd) {
+    ::epoll_ctl(epollFd_, EPOLL_CTL_DEL, fd, nullptr);
+    ::close(fd);
+    clients_.erase(fd);
+}
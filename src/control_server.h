@@ -0,0 +1,92 @@
+/*
+ * Copyright 2024 nrjchnd@gmail.com
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     https://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an **"AS IS" BASIS,**
+ * **WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.**
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#ifndef CONTROL_SERVER_H
+#define CONTROL_SERVER_H
+
+#include "control_protocol.h"
+#include "rtp_port_manager.h"
+#include "session_manager.h"
+#include "tenant_directory.h"
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+// Serves the control API (control_protocol.h) on a Unix socket. One thread
+// handles every client; requests are drained and answered in batches with
+// recvmmsg/sendmmsg, and none of them touches Redis, so a controller can
+// set up and tear down calls at a high rate. Replies never block: a client
+// whose socket is full is not read until its replies went out, and is
+// dropped if that takes too long.
+class ControlServer {
+public:
+    // True while new calls are to be refused
+    using AdmissionCheck = std::function<bool()>;
+    // A session ended by a request, for the state kept elsewhere
+    using SessionEnded = std::function<void(uint32_t ssrc)>;
+
+    // portManager is null in single-port mode, where ports are not allocated
+    ControlServer(SessionManager& sessions, RtpPortManager* portManager, TenantDirectory& tenants);
+    ~ControlServer();
+
+    // Both must be set before start()
+    void setAdmissionCheck(AdmissionCheck check) { admissionCheck_ = check; }
+    void setSessionEndedHandler(SessionEnded handler) { sessionEnded_ = handler; }
+
+    bool listen(const std::string& path);
+    void start();
+    // unlinkPath is false after a hot upgrade, when the path is the
+    // successor's
+    void stop(bool unlinkPath = true);
+
+    uint64_t handledRequests() const { return handled_.load(std::memory_order_relaxed); }
+
+private:
+    struct Client {
+        // Replies the socket had no room for; the client is not read while
+        // there are any
+        std::vector<ControlResponse> pending;
+        std::chrono::steady_clock::time_point stalledSince;
+    };
+
+    void run();
+    // False when the client is gone
+    bool serve(int fd, Client& client);
+    // Sends what it can of the pending replies; false when the client is gone
+    bool flush(int fd, Client& client);
+    bool watch(int fd, bool writable);
+    ControlStatus handle(const ControlRequest& request, ControlResponse& response);
+    void closeClient(int fd);
+
+    SessionManager& sessions_;
+    RtpPortManager* portManager_;
+    TenantDirectory& tenants_;
+    AdmissionCheck admissionCheck_;
+    SessionEnded sessionEnded_;
+
+    int listenFd_;
+    int epollFd_;
+    std::unordered_map<int, Client> clients_;
+    std::string path_;
+    std::atomic<uint64_t> handled_;
+    std::atomic<bool> running_;
+    std::thread thread_;
+};
+
+#endif // CONTROL_SERVER_H
@@ -0,0 +1,168 @@
+/*
+ * Copyright 2024 nrjchnd@gmail.com
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     https://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an **"AS IS" BASIS,**
+ * **WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.**
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "datagram_fragmenter.h"
+#include <algorithm>
+#include <cstring>
+
+// Sessions the fragmenter tracks before starting over
+const size_t FRAGMENT_MAX_FLOWS = 1 << 16;
+// Incomplete messages kept per sending session and in total; beyond that
+// the oldest is given up
+const size_t REASSEMBLY_MAX_PER_FLOW = 8;
+const size_t REASSEMBLY_MAX_MESSAGES = 1024;
+
+DatagramFragmenter::DatagramFragmenter() : nextFlow_(0), fragmented_(0) {
+}
+
+bool DatagramFragmenter::frame(uint32_t ssrc, PacketBuffer& packet, size_t maxLength, std::vector<PacketBuffer>& out) {
+    if (packet.size() + FRAGMENT_WHOLE_HEADER_SIZE <= maxLength) {
+        uint8_t* header = packet.prepend(FRAGMENT_WHOLE_HEADER_SIZE);
+        if (!header) {
+            return false;
+        }
+        header[0] = 0;
+        out.push_back(std::move(packet));
+        return true;
+    }
+
+    if (maxLength <= FRAGMENT_HEADER_SIZE) {
+        return false;
+    }
+    size_t room = maxLength - FRAGMENT_HEADER_SIZE;
+    size_t count = (packet.size() + room - 1) / room;
+    if (count > FRAGMENT_MAX_COUNT) {
+        return false;
+    }
+
+    auto it = flows_.find(ssrc);
+    if (it == flows_.end()) {
+        if (flows_.size() >= FRAGMENT_MAX_FLOWS) {
+            flows_.clear();
+        }
+        it = flows_.emplace(ssrc, Flow()).first;
+        it->second.id = nextFlow_++;
+    }
+    Flow& flow = it->second;
+    uint16_t message = flow.nextMessage++;
+
+    // Equal shares rather than full fragments and a short tail, so no
+    // fragment is much larger than it has to be
+    size_t share = (packet.size() + count - 1) / count;
+    size_t offset = 0;
+    for (size_t index = 0; index < count; ++index) {
+        size_t length = std::min(share, packet.size() - offset);
+        PacketBuffer fragment = PacketArena::instance().allocate();
+        uint8_t* header = fragment.data();
+        header[0] = static_cast<uint8_t>(count);
+        header[1] = static_cast<uint8_t>(index);
+        header[2] = flow.id >> 8;
+        header[3] = flow.id & 0xFF;
+        header[4] = message >> 8;
+        header[5] = message & 0xFF;
+        std::memcpy(header + FRAGMENT_HEADER_SIZE, packet.data() + offset, length);
+        fragment.setSize(FRAGMENT_HEADER_SIZE + length);
+        out.push_back(std::move(fragment));
+        offset += length;
+    }
+    packet = PacketBuffer();
+    ++fragmented_;
+    return true;
+}
+
+DatagramReassembler::DatagramReassembler()
+    : timeout_(std::chrono::milliseconds(100)), reassembled_(0), dropped_(0) {
+}
+
+void DatagramReassembler::receive(const uint8_t* data, size_t len, std::chrono::steady_clock::time_point now,
+                                  const DeliverHandler& deliver) {
+    if (len < FRAGMENT_WHOLE_HEADER_SIZE) {
+        return;
+    }
+    size_t count = data[0];
+    if (count == 0) {
+        deliver(data + FRAGMENT_WHOLE_HEADER_SIZE, len - FRAGMENT_WHOLE_HEADER_SIZE);
+        return;
+    }
+    size_t index = data[1];
+    if (len <= FRAGMENT_HEADER_SIZE || count > FRAGMENT_MAX_COUNT || index >= count) {
+        return;
+    }
+    uint16_t flow = static_cast<uint16_t>((data[2] << 8) | data[3]);
+    uint32_t key = (static_cast<uint32_t>(flow) << 16) | ((data[4] << 8) | data[5]);
+
+    expire(now);
+
+    auto it = messages_.find(key);
+    if (it == messages_.end()) {
+        // Make room by giving up the oldest message of the flow, or of all
+        bool flowFull = pending_[flow] >= REASSEMBLY_MAX_PER_FLOW;
+        if (flowFull || messages_.size() >= REASSEMBLY_MAX_MESSAGES) {
+            for (const auto& entry : order_) {
+                auto oldest = messages_.find(entry.second);
+                if (oldest != messages_.end() && oldest->second.opened == entry.first &&
+                    (!flowFull || (entry.second >> 16) == flow)) {
+                    ++dropped_;
+                    discard(entry.second);
+                    break;
+                }
+            }
+        }
+        it = messages_.emplace(key, Message()).first;
+        it->second.count = count;
+        it->second.opened = now;
+        it->second.fragments.resize(count);
+        order_.emplace_back(now, key);
+        ++pending_[flow];
+    }
+
+    Message& message = it->second;
+    if (message.count != count || !message.fragments[index].empty()) {
+        return;   // duplicate, or a stale message number reused
+    }
+    message.fragments[index].assign(data + FRAGMENT_HEADER_SIZE, data + len);
+    if (++message.received < message.count) {
+        return;
+    }
+
+    std::vector<uint8_t> assembled;
+    for (const auto& fragment : message.fragments) {
+        assembled.insert(assembled.end(), fragment.begin(), fragment.end());
+    }
+    discard(key);
+    ++reassembled_;
+    deliver(assembled.data(), assembled.size());
+}
+
+void DatagramReassembler::expire(std::chrono::steady_clock::time_point now) {
+    // Entries of messages that completed or were given up are skipped
+    while (!order_.empty() && order_.front().first + timeout_ <= now) {
+        auto it = messages_.find(order_.front().second);
+        if (it != messages_.end() && it->second.opened == order_.front().first) {
+            ++dropped_;
+            discard(order_.front().second);
+        }
+        order_.pop_front();
+    }
+}
+
+void DatagramReassembler::discard(uint32_t key) {
+    messages_.erase(key);
+    auto it = pending_.find(static_cast<uint16_t>(key >> 16));
+    if (it != pending_.end() && --it->second == 0) {
+        pending_.erase(it);
+    }
+}
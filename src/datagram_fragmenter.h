@@ -0,0 +1,105 @@
+/*
+ * Copyright 2024 nrjchnd@gmail.com
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     https://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an **"AS IS" BASIS,**
+ * **WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.**
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#ifndef DATAGRAM_FRAGMENTER_H
+#define DATAGRAM_FRAGMENTER_H
+
+#include "packet_arena.h"
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <unordered_map>
+#include <vector>
+
+// Fragmentation of messages too long for one QUIC datagram. A datagram has
+// to fit in a single QUIC packet, so the largest one msquic accepts follows
+// the path MTU (DATAGRAM_STATE_CHANGED reports it) and a video packet near
+// 1400-1500 bytes may not fit. With fragmentation on, every datagram
+// message starts with a count byte: 0 for a whole message, which costs one
+// byte, otherwise a fragment header
+//
+//   count (8) | index (8) | flow (16) | message (16)
+//
+// where flow stands for the sender's session and message numbers the
+// session's fragmented messages. Fragments are FEC-protected one by one
+// like any other datagram. The far side must enable it too.
+
+const size_t FRAGMENT_WHOLE_HEADER_SIZE = 1;
+const size_t FRAGMENT_HEADER_SIZE = 6;
+const size_t FRAGMENT_MAX_COUNT = 16;
+
+class DatagramFragmenter {
+public:
+    DatagramFragmenter();
+
+    // Frames packet for datagrams of at most maxLength bytes and appends the
+    // result to out: packet itself with the count byte prepended when it
+    // fits, otherwise FRAGMENT_MAX_COUNT or fewer fragments of about equal
+    // size. False, with packet left alone, when it would take more
+    // fragments than that or there is no headroom.
+    bool frame(uint32_t ssrc, PacketBuffer& packet, size_t maxLength, std::vector<PacketBuffer>& out);
+
+    uint64_t fragmentedMessages() const { return fragmented_; }
+
+private:
+    struct Flow {
+        uint16_t id = 0;
+        uint16_t nextMessage = 0;
+    };
+
+    std::unordered_map<uint32_t, Flow> flows_;   // by SSRC
+    uint16_t nextFlow_;
+    uint64_t fragmented_;
+};
+
+class DatagramReassembler {
+public:
+    using DeliverHandler = std::function<void(const uint8_t* data, size_t len)>;
+
+    DatagramReassembler();
+
+    // Incomplete messages are dropped timeout after their first fragment
+    void setTimeout(std::chrono::milliseconds timeout) { timeout_ = timeout; }
+
+    // Handles one framed datagram and passes on the message it completes,
+    // if any. Not thread-safe.
+    void receive(const uint8_t* data, size_t len, std::chrono::steady_clock::time_point now,
+                 const DeliverHandler& deliver);
+
+    uint64_t reassembled() const { return reassembled_; }
+    uint64_t dropped() const { return dropped_; }
+
+private:
+    struct Message {
+        size_t count = 0;
+        size_t received = 0;
+        std::chrono::steady_clock::time_point opened;
+        std::vector<std::vector<uint8_t>> fragments;   // by index, empty until received
+    };
+
+    void expire(std::chrono::steady_clock::time_point now);
+    void discard(uint32_t key);
+
+    std::chrono::milliseconds timeout_;
+    std::unordered_map<uint32_t, Message> messages_;   // by flow << 16 | message
+    std::unordered_map<uint16_t, size_t> pending_;     // incomplete messages by flow
+    std::deque<std::pair<std::chrono::steady_clock::time_point, uint32_t>> order_;
+    uint64_t reassembled_;
+    uint64_t dropped_;
+};
+
+#endif // DATAGRAM_FRAGMENTER_H
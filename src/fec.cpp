@@ -0,0 +1,349 @@
+/*
+ * Copyright 2024 nrjchnd@gmail.com
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     https://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an **"AS IS" BASIS,**
+ * **WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.**
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "fec.h"
+#include "gf256.h"
+#include <algorithm>
+#include <cstring>
+
+// Groups the decoder keeps while waiting for repairs
+const size_t FEC_DECODER_GROUPS = 256;
+// Sessions the encoder tracks before forgetting idle ones
+const size_t FEC_MAX_FLOWS = 1 << 16;
+
+namespace {
+
+// Cauchy matrix 1 / (x_j + y_i) with x_j = j and y_i = FEC_MAX_M + i, each
+// column scaled so the first row is all ones. Column scaling keeps every
+// square submatrix of [I; C] invertible.
+struct Coefficients {
+    uint8_t value[FEC_MAX_M][FEC_MAX_K];
+
+    Coefficients() {
+        for (size_t j = 0; j < FEC_MAX_M; ++j) {
+            for (size_t i = 0; i < FEC_MAX_K; ++i) {
+                uint8_t y = static_cast<uint8_t>(FEC_MAX_M + i);
+                value[j][i] = gf256Div(static_cast<uint8_t>(0 ^ y), static_cast<uint8_t>(j ^ y));
+            }
+        }
+    }
+};
+
+uint8_t coefficient(size_t repair, size_t source) {
+    static const Coefficients coefficients;
+    return coefficients.value[repair][source];
+}
+
+void writeHeader(uint8_t* out, bool repair, size_t index, size_t k, size_t m, uint16_t flow, uint16_t group) {
+    out[0] = static_cast<uint8_t>((repair ? 0x80 : 0) | (index & 0x7F));
+    out[1] = static_cast<uint8_t>(k);
+    out[2] = static_cast<uint8_t>(m);
+    out[3] = 0;
+    out[4] = flow >> 8;
+    out[5] = flow & 0xFF;
+    out[6] = group >> 8;
+    out[7] = group & 0xFF;
+}
+
+// Inverts the n x n matrix in place by Gauss-Jordan elimination; false when
+// it is singular
+bool invert(std::vector<std::vector<uint8_t>>& matrix) {
+    size_t n = matrix.size();
+    std::vector<std::vector<uint8_t>> inverse(n, std::vector<uint8_t>(n, 0));
+    for (size_t i = 0; i < n; ++i) {
+        inverse[i][i] = 1;
+    }
+    for (size_t column = 0; column < n; ++column) {
+        size_t pivot = column;
+        while (pivot < n && matrix[pivot][column] == 0) {
+            ++pivot;
+        }
+        if (pivot == n) {
+            return false;
+        }
+        std::swap(matrix[pivot], matrix[column]);
+        std::swap(inverse[pivot], inverse[column]);
+
+        uint8_t scale = gf256Inv(matrix[column][column]);
+        for (size_t k = 0; k < n; ++k) {
+            matrix[column][k] = gf256Mul(matrix[column][k], scale);
+            inverse[column][k] = gf256Mul(inverse[column][k], scale);
+        }
+        for (size_t row = 0; row < n; ++row) {
+            uint8_t factor = matrix[row][column];
+            if (row == column || factor == 0) {
+                continue;
+            }
+            for (size_t k = 0; k < n; ++k) {
+                matrix[row][k] ^= gf256Mul(factor, matrix[column][k]);
+                inverse[row][k] ^= gf256Mul(factor, inverse[column][k]);
+            }
+        }
+    }
+    matrix.swap(inverse);
+    return true;
+}
+
+}
+
+FecEncoder::FecEncoder()
+    : k_(8), m_(1), nextFlow_(0)
+{
+}
+
+void FecEncoder::setParameters(size_t k, size_t m) {
+    k_ = std::min(std::max<size_t>(k, 1), FEC_MAX_K);
+    m_ = std::min(m, FEC_MAX_M);
+}
+
+void FecEncoder::parametersForLoss(double loss, size_t& k, size_t& m) {
+    // Enough repairs to cover the expected losses of a group with margin,
+    // and smaller groups as loss grows so recovery waits less
+    if (loss < 0.01) {
+        k = 16;
+        m = 1;
+    } else if (loss < 0.03) {
+        k = 8;
+        m = 1;
+    } else if (loss < 0.06) {
+        k = 8;
+        m = 2;
+    } else if (loss < 0.12) {
+        k = 6;
+        m = 3;
+    } else {
+        k = 4;
+        m = 4;
+    }
+}
+
+bool FecEncoder::protect(uint32_t ssrc, PacketBuffer& packet, std::chrono::steady_clock::time_point now,
+                         std::vector<PacketBuffer>& repairs) {
+    if (packet.headroom() < FEC_HEADER_SIZE) {
+        return false;
+    }
+
+    auto it = groups_.find(ssrc);
+    if (it == groups_.end()) {
+        if (groups_.size() >= FEC_MAX_FLOWS) {
+            // Forget sessions between groups; they get a new flow if they return
+            for (auto candidate = groups_.begin(); candidate != groups_.end();) {
+                candidate = candidate->second.open ? std::next(candidate) : groups_.erase(candidate);
+            }
+        }
+        it = groups_.emplace(ssrc, Group()).first;
+        it->second.flow = nextFlow_++;
+    }
+    Group& group = it->second;
+
+    if (!group.open) {
+        group.open = true;
+        group.k = k_;
+        group.m = m_;
+        group.count = 0;
+        group.symbolLength = 0;
+        group.opened = now;
+        group.symbols.resize(group.m);
+        for (auto& symbol : group.symbols) {
+            symbol.clear();
+        }
+        openGroups_.push_back({now, ssrc, group.id});
+    }
+
+    size_t index = group.count++;
+    if (group.m > 0) {
+        uint8_t length[2] = {static_cast<uint8_t>(packet.size() >> 8), static_cast<uint8_t>(packet.size() & 0xFF)};
+        size_t symbolLength = 2 + packet.size();
+        if (symbolLength > group.symbolLength) {
+            group.symbolLength = symbolLength;
+        }
+        for (size_t j = 0; j < group.m; ++j) {
+            std::vector<uint8_t>& symbol = group.symbols[j];
+            if (symbol.size() < symbolLength) {
+                symbol.resize(symbolLength, 0);
+            }
+            uint8_t c = coefficient(j, index);
+            gf256MulAdd(symbol.data(), length, c, 2);
+            gf256MulAdd(symbol.data() + 2, packet.data(), c, packet.size());
+        }
+    }
+
+    writeHeader(packet.prepend(FEC_HEADER_SIZE), false, index, group.k, group.m, group.flow, group.id);
+
+    if (group.count >= group.k) {
+        close(group, repairs);
+    }
+    return true;
+}
+
+void FecEncoder::flush(std::chrono::steady_clock::time_point now, std::chrono::milliseconds maxDelay,
+                       std::vector<PacketBuffer>& repairs) {
+    while (!openGroups_.empty() && openGroups_.front().opened + maxDelay <= now) {
+        OpenGroup entry = openGroups_.front();
+        openGroups_.pop_front();
+        auto it = groups_.find(entry.ssrc);
+        // Groups that filled up in time are already closed
+        if (it != groups_.end() && it->second.open && it->second.id == entry.id) {
+            close(it->second, repairs);
+        }
+    }
+}
+
+void FecEncoder::close(Group& group, std::vector<PacketBuffer>& repairs) {
+    for (size_t j = 0; j < group.m; ++j) {
+        PacketBuffer repair = PacketArena::instance().allocate();
+        if (FEC_HEADER_SIZE + group.symbolLength > repair.tailroom()) {
+            break;
+        }
+        writeHeader(repair.data(), true, j, group.count, group.m, group.flow, group.id);
+        std::memcpy(repair.data() + FEC_HEADER_SIZE, group.symbols[j].data(), group.symbolLength);
+        repair.setSize(FEC_HEADER_SIZE + group.symbolLength);
+        repairs.push_back(std::move(repair));
+    }
+    group.open = false;
+    ++group.id;
+}
+
+FecDecoder::Group& FecDecoder::groupFor(uint32_t key) {
+    auto it = groups_.find(key);
+    if (it != groups_.end()) {
+        return it->second;
+    }
+    if (order_.size() >= FEC_DECODER_GROUPS) {
+        groups_.erase(order_.front());
+        order_.pop_front();
+    }
+    order_.push_back(key);
+    Group& group = groups_[key];
+    group.sources.resize(FEC_MAX_K);
+    group.present.assign(FEC_MAX_K, false);
+    return group;
+}
+
+void FecDecoder::receive(const uint8_t* data, size_t len, const DeliverHandler& deliver) {
+    if (len < FEC_HEADER_SIZE) {
+        return;
+    }
+    bool repair = (data[0] & 0x80) != 0;
+    size_t index = data[0] & 0x7F;
+    size_t k = data[1];
+    size_t m = data[2];
+    uint32_t key = (static_cast<uint32_t>((data[4] << 8) | data[5]) << 16) | ((data[6] << 8) | data[7]);
+    const uint8_t* message = data + FEC_HEADER_SIZE;
+    size_t messageLength = len - FEC_HEADER_SIZE;
+
+    if (!repair) {
+        if (m == 0) {
+            // Unprotected group: nothing to keep
+            deliver(message, messageLength);
+            return;
+        }
+        if (index >= FEC_MAX_K) {
+            return;
+        }
+        Group& group = groupFor(key);
+        if (group.present[index]) {
+            return;   // already recovered
+        }
+        group.present[index] = true;
+        deliver(message, messageLength);
+        if (!group.complete) {
+            std::vector<uint8_t>& symbol = group.sources[index];
+            symbol.resize(2 + messageLength);
+            symbol[0] = static_cast<uint8_t>(messageLength >> 8);
+            symbol[1] = static_cast<uint8_t>(messageLength & 0xFF);
+            std::memcpy(symbol.data() + 2, message, messageLength);
+            recover(group, deliver);
+        }
+        return;
+    }
+
+    if (index >= FEC_MAX_M || k == 0 || k > FEC_MAX_K || messageLength < 2) {
+        return;
+    }
+    Group& group = groupFor(key);
+    if (group.complete) {
+        return;
+    }
+    if (!group.repairs.empty() && group.repairs.front().second.size() != messageLength) {
+        return;   // all repairs of a group have the same length
+    }
+    group.k = k;
+    group.repairs.emplace_back(static_cast<uint8_t>(index), std::vector<uint8_t>(message, message + messageLength));
+    recover(group, deliver);
+}
+
+void FecDecoder::recover(Group& group, const DeliverHandler& deliver) {
+    if (group.k == 0) {
+        return;
+    }
+    std::vector<size_t> missing;
+    for (size_t i = 0; i < group.k; ++i) {
+        if (!group.present[i]) {
+            missing.push_back(i);
+        }
+    }
+    if (!missing.empty() && group.repairs.size() < missing.size()) {
+        return;
+    }
+
+    if (!missing.empty()) {
+        size_t count = missing.size();
+        size_t symbolLength = group.repairs.front().second.size();
+
+        // Take the known sources out of the repairs, leaving C[missing] x = rhs
+        std::vector<std::vector<uint8_t>> rhs(count);
+        std::vector<std::vector<uint8_t>> matrix(count, std::vector<uint8_t>(count));
+        for (size_t r = 0; r < count; ++r) {
+            uint8_t repairIndex = group.repairs[r].first;
+            rhs[r] = group.repairs[r].second;
+            for (size_t i = 0; i < group.k; ++i) {
+                if (group.present[i]) {
+                    const std::vector<uint8_t>& symbol = group.sources[i];
+                    gf256MulAdd(rhs[r].data(), symbol.data(), coefficient(repairIndex, i),
+                                std::min(symbol.size(), symbolLength));
+                }
+            }
+            for (size_t c = 0; c < count; ++c) {
+                matrix[r][c] = coefficient(repairIndex, missing[c]);
+            }
+        }
+        if (!invert(matrix)) {
+            return;
+        }
+
+        std::vector<uint8_t> symbol(symbolLength);
+        for (size_t c = 0; c < count; ++c) {
+            std::fill(symbol.begin(), symbol.end(), 0);
+            for (size_t r = 0; r < count; ++r) {
+                gf256MulAdd(symbol.data(), rhs[r].data(), matrix[c][r], symbolLength);
+            }
+            size_t length = (static_cast<size_t>(symbol[0]) << 8) | symbol[1];
+            group.present[missing[c]] = true;
+            if (2 + length <= symbolLength) {
+                ++recovered_;
+                deliver(symbol.data() + 2, length);
+            }
+        }
+    }
+
+    // Nothing left to recover; keep only the present flags for late duplicates
+    group.complete = true;
+    group.sources.clear();
+    group.sources.shrink_to_fit();
+    group.repairs.clear();
+    group.repairs.shrink_to_fit();
+}
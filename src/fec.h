@@ -0,0 +1,132 @@
+/*
+ * Copyright 2024 nrjchnd@gmail.com
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     https://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an **"AS IS" BASIS,**
+ * **WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.**
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#ifndef FEC_H
+#define FEC_H
+
+#include "packet_arena.h"
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <unordered_map>
+#include <vector>
+
+// Forward error correction for messages sent as QUIC datagrams, along the
+// lines of RFC 5109 / FlexFEC. Each session's datagrams are grouped K at a
+// time and every group is followed by M repair datagrams; the receiver
+// rebuilds up to M lost messages of a group without a retransmission.
+//
+// The code is a systematic Reed-Solomon code over GF(2^8) with a Cauchy
+// generator whose first row is all ones, so M = 1 degenerates into plain
+// XOR parity. A source symbol is the message's length (2 bytes) followed by
+// the message, zero-padded to the longest in the group.
+//
+// Every protected datagram starts with an 8-byte header:
+//
+//   R | index (7) | K | M | 0 | flow (16) | group (16)
+//
+// R marks a repair datagram and index is the source or repair number within
+// the group. Source datagrams carry the K planned when the group opened;
+// repairs carry the K the group actually closed with.
+
+const size_t FEC_HEADER_SIZE = 8;
+// Bytes a protected datagram needs beyond the message itself; the repair
+// symbols also carry the 2-byte length
+const size_t FEC_OVERHEAD = FEC_HEADER_SIZE + 2;
+const size_t FEC_MAX_K = 32;
+const size_t FEC_MAX_M = 8;
+
+class FecEncoder {
+public:
+    FecEncoder();
+
+    // Applies from the next group of each session; m = 0 sends no repairs
+    void setParameters(size_t k, size_t m);
+    size_t groupSize() const { return k_; }
+    size_t repairCount() const { return m_; }
+
+    // K and M for an observed loss ratio (0-1)
+    static void parametersForLoss(double loss, size_t& k, size_t& m);
+
+    // Prepends the FEC header to packet (taken from its headroom) and folds
+    // the message into its session's repair symbols. When the packet
+    // completes the group, the group's repair datagrams are appended to
+    // repairs. False when the packet has no room for the header.
+    bool protect(uint32_t ssrc, PacketBuffer& packet, std::chrono::steady_clock::time_point now,
+                 std::vector<PacketBuffer>& repairs);
+
+    // Closes groups opened before now - maxDelay, so quiet sessions do not
+    // hold their repairs back
+    void flush(std::chrono::steady_clock::time_point now, std::chrono::milliseconds maxDelay,
+               std::vector<PacketBuffer>& repairs);
+
+private:
+    struct Group {
+        uint16_t flow = 0;
+        uint16_t id = 0;
+        bool open = false;
+        size_t k = 0;
+        size_t m = 0;
+        size_t count = 0;
+        size_t symbolLength = 0;
+        std::chrono::steady_clock::time_point opened;
+        std::vector<std::vector<uint8_t>> symbols;   // M repair symbols being accumulated
+    };
+
+    void close(Group& group, std::vector<PacketBuffer>& repairs);
+
+    size_t k_;
+    size_t m_;
+    uint16_t nextFlow_;
+    std::unordered_map<uint32_t, Group> groups_;   // by SSRC
+    // Open groups by age, for flush()
+    struct OpenGroup {
+        std::chrono::steady_clock::time_point opened;
+        uint32_t ssrc;
+        uint16_t id;
+    };
+    std::deque<OpenGroup> openGroups_;
+};
+
+class FecDecoder {
+public:
+    using DeliverHandler = std::function<void(const uint8_t* data, size_t len)>;
+
+    // Handles one protected datagram: passes its message on, and any
+    // messages of its group that can now be recovered. Not thread-safe.
+    void receive(const uint8_t* data, size_t len, const DeliverHandler& deliver);
+
+    uint64_t recovered() const { return recovered_; }
+
+private:
+    struct Group {
+        size_t k = 0;   // known once a repair has arrived
+        bool complete = false;
+        std::vector<std::vector<uint8_t>> sources;   // symbols by index, empty when missing
+        std::vector<bool> present;
+        std::vector<std::pair<uint8_t, std::vector<uint8_t>>> repairs;
+    };
+
+    Group& groupFor(uint32_t key);
+    void recover(Group& group, const DeliverHandler& deliver);
+
+    std::unordered_map<uint32_t, Group> groups_;   // by flow << 16 | group
+    std::deque<uint32_t> order_;
+    uint64_t recovered_ = 0;
+};
+
+#endif // FEC_H
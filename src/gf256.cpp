@@ -0,0 +1,184 @@
+/*
+ * Copyright 2024 nrjchnd@gmail.com
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     https://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an **"AS IS" BASIS,**
+ * **WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.**
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "gf256.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define QUICRTP_GF256_X86
+#endif
+
+namespace {
+
+struct Tables {
+    uint8_t exp[512];
+    uint8_t log[256];
+    uint8_t mul[256][256];
+    // Products of each constant with the low and the high nibble, for the
+    // PSHUFB kernels
+    uint8_t low[256][16];
+    uint8_t high[256][16];
+
+    Tables() {
+        unsigned x = 1;
+        for (int i = 0; i < 255; ++i) {
+            exp[i] = static_cast<uint8_t>(x);
+            log[x] = static_cast<uint8_t>(i);
+            x <<= 1;
+            if (x & 0x100) {
+                x ^= 0x11D;
+            }
+        }
+        for (int i = 255; i < 512; ++i) {
+            exp[i] = exp[i - 255];
+        }
+        log[0] = 0;
+
+        for (int a = 0; a < 256; ++a) {
+            for (int b = 0; b < 256; ++b) {
+                mul[a][b] = (a == 0 || b == 0) ? 0 : exp[log[a] + log[b]];
+            }
+            for (int n = 0; n < 16; ++n) {
+                low[a][n] = mul[a][n];
+                high[a][n] = mul[a][n << 4];
+            }
+        }
+    }
+};
+
+const Tables& tables() {
+    static const Tables instance;
+    return instance;
+}
+
+void mulAddScalar(uint8_t* dst, const uint8_t* src, uint8_t c, size_t len) {
+    const uint8_t* row = tables().mul[c];
+    for (size_t i = 0; i < len; ++i) {
+        dst[i] ^= row[src[i]];
+    }
+}
+
+void xorScalar(uint8_t* dst, const uint8_t* src, size_t len) {
+    size_t i = 0;
+    for (; i + 8 <= len; i += 8) {
+        uint64_t a, b;
+        __builtin_memcpy(&a, dst + i, 8);
+        __builtin_memcpy(&b, src + i, 8);
+        a ^= b;
+        __builtin_memcpy(dst + i, &a, 8);
+    }
+    for (; i < len; ++i) {
+        dst[i] ^= src[i];
+    }
+}
+
+#ifdef QUICRTP_GF256_X86
+
+__attribute__((target("ssse3")))
+void mulAddSsse3(uint8_t* dst, const uint8_t* src, uint8_t c, size_t len) {
+    const __m128i low = _mm_loadu_si128(reinterpret_cast<const __m128i*>(tables().low[c]));
+    const __m128i high = _mm_loadu_si128(reinterpret_cast<const __m128i*>(tables().high[c]));
+    const __m128i mask = _mm_set1_epi8(0x0F);
+
+    size_t i = 0;
+    for (; i + 16 <= len; i += 16) {
+        __m128i in = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + i));
+        __m128i lo = _mm_shuffle_epi8(low, _mm_and_si128(in, mask));
+        __m128i hi = _mm_shuffle_epi8(high, _mm_and_si128(_mm_srli_epi64(in, 4), mask));
+        __m128i out = _mm_loadu_si128(reinterpret_cast<const __m128i*>(dst + i));
+        out = _mm_xor_si128(out, _mm_xor_si128(lo, hi));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + i), out);
+    }
+    mulAddScalar(dst + i, src + i, c, len - i);
+}
+
+__attribute__((target("avx2")))
+void mulAddAvx2(uint8_t* dst, const uint8_t* src, uint8_t c, size_t len) {
+    const __m256i low = _mm256_broadcastsi128_si256(_mm_loadu_si128(reinterpret_cast<const __m128i*>(tables().low[c])));
+    const __m256i high = _mm256_broadcastsi128_si256(_mm_loadu_si128(reinterpret_cast<const __m128i*>(tables().high[c])));
+    const __m256i mask = _mm256_set1_epi8(0x0F);
+
+    size_t i = 0;
+    for (; i + 32 <= len; i += 32) {
+        __m256i in = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(src + i));
+        __m256i lo = _mm256_shuffle_epi8(low, _mm256_and_si256(in, mask));
+        __m256i hi = _mm256_shuffle_epi8(high, _mm256_and_si256(_mm256_srli_epi64(in, 4), mask));
+        __m256i out = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(dst + i));
+        out = _mm256_xor_si256(out, _mm256_xor_si256(lo, hi));
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(dst + i), out);
+    }
+    mulAddScalar(dst + i, src + i, c, len - i);
+}
+
+#endif
+
+using MulAddKernel = void (*)(uint8_t*, const uint8_t*, uint8_t, size_t);
+
+struct Kernel {
+    MulAddKernel mulAdd;
+    const char* name;
+
+    Kernel() : mulAdd(mulAddScalar), name("scalar") {
+#ifdef QUICRTP_GF256_X86
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx2")) {
+            mulAdd = mulAddAvx2;
+            name = "avx2";
+        } else if (__builtin_cpu_supports("ssse3")) {
+            mulAdd = mulAddSsse3;
+            name = "ssse3";
+        }
+#endif
+    }
+};
+
+const Kernel& kernel() {
+    static const Kernel instance;
+    return instance;
+}
+
+}
+
+uint8_t gf256Mul(uint8_t a, uint8_t b) {
+    return tables().mul[a][b];
+}
+
+uint8_t gf256Div(uint8_t a, uint8_t b) {
+    if (a == 0) {
+        return 0;
+    }
+    const Tables& t = tables();
+    return t.exp[t.log[a] + 255 - t.log[b]];
+}
+
+uint8_t gf256Inv(uint8_t a) {
+    return gf256Div(1, a);
+}
+
+void gf256MulAdd(uint8_t* dst, const uint8_t* src, uint8_t c, size_t len) {
+    if (c == 0) {
+        return;
+    }
+    if (c == 1) {
+        xorScalar(dst, src, len);
+        return;
+    }
+    kernel().mulAdd(dst, src, c, len);
+}
+
+const char* gf256Kernel() {
+    return kernel().name;
+}
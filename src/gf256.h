@@ -0,0 +1,37 @@
+/*
+ * Copyright 2024 nrjchnd@gmail.com
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     https://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an **"AS IS" BASIS,**
+ * **WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.**
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#ifndef GF256_H
+#define GF256_H
+
+#include <cstddef>
+#include <cstdint>
+
+// Arithmetic in GF(2^8) with the polynomial x^8 + x^4 + x^3 + x^2 + 1
+// (0x11D), as used by Reed-Solomon erasure codes.
+
+uint8_t gf256Mul(uint8_t a, uint8_t b);
+// b must not be 0
+uint8_t gf256Div(uint8_t a, uint8_t b);
+uint8_t gf256Inv(uint8_t a);
+
+// dst[i] ^= c * src[i] for len bytes. Uses AVX2 or SSSE3 (PSHUFB nibble
+// tables) when the CPU has them, a table lookup per byte otherwise.
+void gf256MulAdd(uint8_t* dst, const uint8_t* src, uint8_t c, size_t len);
+
+// Name of the kernel gf256MulAdd() picked for this CPU
+const char* gf256Kernel();
+
+#endif // GF256_H
@@ -0,0 +1,576 @@
+/*
+ * Copyright 2024 nrjchnd@gmail.com
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     https://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an **"AS IS" BASIS,**
+ * **WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.**
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "hot_upgrade.h"
+#include "logger.h"
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <thread>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+static_assert(sizeof(UpgradeSnapshotHeader) == 48, "snapshot header layout changed");
+static_assert(sizeof(UpgradeSessionRecord) == 224, "snapshot session record layout changed");
+static_assert(sizeof(UpgradePortRecord) == 136, "snapshot port record layout changed");
+static_assert(sizeof(SilenceStreamState) == 24, "snapshot silence record layout changed");
+
+const char SNAPSHOT_MAGIC[8] = {'Q', 'R', 'T', 'P', 'S', 'N', 'P', 3};
+
+// Well below the kernel's SCM_MAX_FD of 253
+const size_t MAX_FDS_PER_MESSAGE = 128;
+
+namespace {
+
+enum class UpgradeMessage : uint8_t {
+    Takeover = 'T',
+    Sockets = 'S',
+    Ready = 'R',
+    Done = 'D'
+};
+
+struct SocketsMessageHeader {
+    uint8_t type;    // UpgradeMessage::Sockets
+    uint8_t last;    // no more Sockets messages follow
+    uint16_t count;  // entries and descriptors in this message
+};
+
+struct SocketEntry {
+    uint8_t role;
+    uint8_t reserved;
+    uint16_t port;
+};
+
+bool waitReadable(int fd, std::chrono::milliseconds timeout) {
+    struct pollfd pfd = {fd, POLLIN, 0};
+    int result;
+    do {
+        result = ::poll(&pfd, 1, static_cast<int>(timeout.count()));
+    } while (result < 0 && errno == EINTR);
+    return result > 0;
+}
+
+bool sendMessage(int fd, UpgradeMessage message) {
+    uint8_t type = static_cast<uint8_t>(message);
+    return ::send(fd, &type, 1, MSG_NOSIGNAL) == 1;
+}
+
+bool receiveMessage(int fd, UpgradeMessage expected, std::chrono::milliseconds timeout) {
+    if (!waitReadable(fd, timeout)) {
+        return false;
+    }
+    uint8_t type = 0;
+    return ::recv(fd, &type, 1, 0) == 1 && type == static_cast<uint8_t>(expected);
+}
+
+// Address of endpoint into a record; the family byte is 4 or 6
+void writeAddress(const boost::asio::ip::udp::endpoint& endpoint, uint8_t& family, uint8_t* address) {
+    if (endpoint.address().is_v4()) {
+        auto bytes = endpoint.address().to_v4().to_bytes();
+        std::memcpy(address, bytes.data(), bytes.size());
+        family = 4;
+    } else {
+        auto bytes = endpoint.address().to_v6().to_bytes();
+        std::memcpy(address, bytes.data(), bytes.size());
+        family = 6;
+    }
+}
+
+boost::asio::ip::udp::endpoint readAddress(uint8_t family, const uint8_t* address, uint16_t port) {
+    if (family == 4) {
+        boost::asio::ip::address_v4::bytes_type bytes;
+        std::memcpy(bytes.data(), address, bytes.size());
+        return boost::asio::ip::udp::endpoint(boost::asio::ip::address_v4(bytes), port);
+    }
+    if (family == 6) {
+        boost::asio::ip::address_v6::bytes_type bytes;
+        std::memcpy(bytes.data(), address, bytes.size());
+        return boost::asio::ip::udp::endpoint(boost::asio::ip::address_v6(bytes), port);
+    }
+    return boost::asio::ip::udp::endpoint();
+}
+
+int64_t toNanoseconds(std::chrono::steady_clock::time_point time) {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(time.time_since_epoch()).count();
+}
+
+std::chrono::steady_clock::time_point fromNanoseconds(int64_t nanoseconds) {
+    return std::chrono::steady_clock::time_point(
+        std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::nanoseconds(nanoseconds)));
+}
+
+// Copies value into a NUL-padded field; false when it does not fit
+bool writeString(const std::string& value, char* field, size_t size) {
+    if (value.size() >= size) {
+        return false;
+    }
+    std::memcpy(field, value.data(), value.size());
+    return true;
+}
+
+std::string readString(const char* field, size_t size) {
+    return std::string(field, strnlen(field, size));
+}
+
+sockaddr_un unixAddress(const std::string& path) {
+    sockaddr_un address;
+    std::memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    std::strncpy(address.sun_path, path.c_str(), sizeof(address.sun_path) - 1);
+    return address;
+}
+
+}
+
+bool UpgradeSnapshot::write(const std::string& path, const UpgradeState& state) {
+    std::string temporary = path + ".tmp";
+    int fd = ::open(temporary.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0600);
+    if (fd < 0) {
+        Logger::getLogger()->error("Cannot create snapshot {}: {}", temporary, std::strerror(errno));
+        return false;
+    }
+    size_t size = sizeof(UpgradeSnapshotHeader) + state.sessions.size() * sizeof(UpgradeSessionRecord) +
+                  state.ports.size() * sizeof(UpgradePortRecord) +
+                  state.translator.silenceStreams.size() * sizeof(SilenceStreamState);
+    if (::ftruncate(fd, static_cast<off_t>(size)) != 0) {
+        Logger::getLogger()->error("Cannot size snapshot {}: {}", temporary, std::strerror(errno));
+        ::close(fd);
+        return false;
+    }
+    void* area = ::mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    ::close(fd);
+    if (area == MAP_FAILED) {
+        Logger::getLogger()->error("Cannot map snapshot {}: {}", temporary, std::strerror(errno));
+        return false;
+    }
+
+    UpgradeSnapshotHeader* header = static_cast<UpgradeSnapshotHeader*>(area);
+    std::memset(header, 0, sizeof(*header));
+    std::memcpy(header->magic, SNAPSHOT_MAGIC, sizeof(header->magic));
+    header->sessionRecordSize = sizeof(UpgradeSessionRecord);
+    header->sessionCount = static_cast<uint32_t>(state.sessions.size());
+    header->portRecordSize = sizeof(UpgradePortRecord);
+    header->portCount = static_cast<uint32_t>(state.ports.size());
+    header->silenceRecordSize = sizeof(SilenceStreamState);
+    header->silenceCount = static_cast<uint32_t>(state.translator.silenceStreams.size());
+    header->sequenceNumber = state.translator.sequenceNumber;
+    header->timestamp = state.translator.timestamp;
+    header->ssrc = state.translator.ssrc;
+
+    UpgradeSessionRecord* record = reinterpret_cast<UpgradeSessionRecord*>(header + 1);
+    for (const auto& session : state.sessions) {
+        const SessionInfo& info = session.second;
+        const RtpSessionStats& stats = info.stats;
+        std::memset(record, 0, sizeof(*record));
+        record->ssrc = session.first;
+        record->localPort = info.localPort;
+        record->sourcePort = info.source.port();
+        writeAddress(info.source, record->addressFamily, record->sourceAddress);
+        record->latched = info.latched ? 1 : 0;
+        auto roc = state.srtpRocs.find(session.first);
+        if (roc != state.srtpRocs.end()) {
+            record->hasSrtpRoc = 1;
+            record->srtpRoc = roc->second;
+        }
+
+        if (stats.peer.source.port() != 0) {
+            writeAddress(stats.peer.source, record->peerAddressFamily, record->peerAddress);
+            record->peerPort = stats.peer.source.port();
+        }
+        record->peerMuxed = stats.peer.muxed ? 1 : 0;
+        record->peerHasReport = stats.peer.hasReport ? 1 : 0;
+        record->peerFractionLost = stats.peer.fractionLost;
+        record->peerCumulativeLost = stats.peer.cumulativeLost;
+        record->peerJitter = stats.peer.jitter;
+        record->peerLastSrNtp = stats.peer.lastSrNtp;
+        record->peerLastSrArrival = toNanoseconds(stats.peer.lastSrArrival);
+        record->peerRoundTripMs = stats.peer.roundTripMs;
+        record->sentPackets = stats.sent.packets;
+        record->sentOctets = stats.sent.octets;
+        record->sentLastTimestamp = stats.sent.lastTimestamp;
+        record->sentClockRate = stats.sent.clockRate;
+        record->sentPacketsAtLastReport = stats.sent.packetsAtLastReport;
+        record->sentLastSent = toNanoseconds(stats.sent.lastSent);
+        record->uplink = stats.uplink.save();
+        record->downlink = stats.downlink.save();
+        ++record;
+    }
+
+    UpgradePortRecord* portRecord = reinterpret_cast<UpgradePortRecord*>(record);
+    for (const UpgradePort& port : state.ports) {
+        std::memset(portRecord, 0, sizeof(*portRecord));
+        portRecord->port = port.port;
+        writeString(port.callKey, portRecord->callKey, sizeof(portRecord->callKey));
+        if (!writeString(port.tenant, portRecord->tenant, sizeof(portRecord->tenant))) {
+            Logger::getLogger()->warn("Tenant ID of port {} is too long for the snapshot", port.port);
+        }
+        ++portRecord;
+    }
+    if (!state.translator.silenceStreams.empty()) {
+        std::memcpy(portRecord, state.translator.silenceStreams.data(),
+                    state.translator.silenceStreams.size() * sizeof(SilenceStreamState));
+    }
+    ::munmap(area, size);
+
+    if (::rename(temporary.c_str(), path.c_str()) != 0) {
+        Logger::getLogger()->error("Cannot move snapshot into place at {}: {}", path, std::strerror(errno));
+        ::unlink(temporary.c_str());
+        return false;
+    }
+    return true;
+}
+
+bool UpgradeSnapshot::read(const std::string& path, UpgradeState& state) {
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        Logger::getLogger()->error("Cannot open snapshot {}: {}", path, std::strerror(errno));
+        return false;
+    }
+    struct stat info;
+    if (::fstat(fd, &info) != 0 || static_cast<size_t>(info.st_size) < sizeof(UpgradeSnapshotHeader)) {
+        Logger::getLogger()->error("{} is not a snapshot", path);
+        ::close(fd);
+        return false;
+    }
+    size_t size = static_cast<size_t>(info.st_size);
+    void* area = ::mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    ::close(fd);
+    if (area == MAP_FAILED) {
+        Logger::getLogger()->error("Cannot map snapshot {}: {}", path, std::strerror(errno));
+        return false;
+    }
+
+    const UpgradeSnapshotHeader* header = static_cast<const UpgradeSnapshotHeader*>(area);
+    if (std::memcmp(header->magic, SNAPSHOT_MAGIC, sizeof(header->magic)) != 0 ||
+        header->sessionRecordSize != sizeof(UpgradeSessionRecord) ||
+        header->portRecordSize != sizeof(UpgradePortRecord) ||
+        header->silenceRecordSize != sizeof(SilenceStreamState) ||
+        size < sizeof(UpgradeSnapshotHeader) + static_cast<size_t>(header->sessionCount) * sizeof(UpgradeSessionRecord) +
+               static_cast<size_t>(header->portCount) * sizeof(UpgradePortRecord) +
+               static_cast<size_t>(header->silenceCount) * sizeof(SilenceStreamState)) {
+        Logger::getLogger()->error("{} is not a snapshot of this version", path);
+        ::munmap(area, size);
+        return false;
+    }
+
+    state.translator.sequenceNumber = header->sequenceNumber;
+    state.translator.timestamp = header->timestamp;
+    state.translator.ssrc = header->ssrc;
+
+    state.sessions.clear();
+    state.sessions.reserve(header->sessionCount);
+    state.srtpRocs.clear();
+    const UpgradeSessionRecord* record = reinterpret_cast<const UpgradeSessionRecord*>(header + 1);
+    for (uint32_t i = 0; i < header->sessionCount; ++i, ++record) {
+        SessionInfo session;
+        session.localPort = record->localPort;
+        session.source = readAddress(record->addressFamily, record->sourceAddress, record->sourcePort);
+        session.latched = record->latched != 0;
+        if (record->hasSrtpRoc) {
+            state.srtpRocs[record->ssrc] = record->srtpRoc;
+        }
+
+        RtpSessionStats& stats = session.stats;
+        stats.peer.source = readAddress(record->peerAddressFamily, record->peerAddress, record->peerPort);
+        stats.peer.muxed = record->peerMuxed != 0;
+        stats.peer.hasReport = record->peerHasReport != 0;
+        stats.peer.fractionLost = record->peerFractionLost;
+        stats.peer.cumulativeLost = record->peerCumulativeLost;
+        stats.peer.jitter = record->peerJitter;
+        stats.peer.lastSrNtp = record->peerLastSrNtp;
+        stats.peer.lastSrArrival = fromNanoseconds(record->peerLastSrArrival);
+        stats.peer.roundTripMs = record->peerRoundTripMs;
+        stats.sent.packets = record->sentPackets;
+        stats.sent.octets = record->sentOctets;
+        stats.sent.lastTimestamp = record->sentLastTimestamp;
+        stats.sent.clockRate = record->sentClockRate;
+        stats.sent.packetsAtLastReport = record->sentPacketsAtLastReport;
+        stats.sent.lastSent = fromNanoseconds(record->sentLastSent);
+        stats.uplink.restore(record->uplink);
+        stats.downlink.restore(record->downlink);
+        state.sessions.emplace_back(record->ssrc, session);
+    }
+
+    state.ports.clear();
+    state.ports.reserve(header->portCount);
+    const UpgradePortRecord* portRecord = reinterpret_cast<const UpgradePortRecord*>(record);
+    for (uint32_t i = 0; i < header->portCount; ++i, ++portRecord) {
+        UpgradePort port;
+        port.port = portRecord->port;
+        port.callKey = readString(portRecord->callKey, sizeof(portRecord->callKey));
+        port.tenant = readString(portRecord->tenant, sizeof(portRecord->tenant));
+        state.ports.push_back(port);
+    }
+
+    const SilenceStreamState* silence = reinterpret_cast<const SilenceStreamState*>(portRecord);
+    state.translator.silenceStreams.assign(silence, silence + header->silenceCount);
+    ::munmap(area, size);
+    return true;
+}
+
+UpgradeServer::UpgradeServer()
+    : listenFd_(-1), peerFd_(-1)
+{
+}
+
+UpgradeServer::~UpgradeServer() {
+    close(false);
+}
+
+bool UpgradeServer::listen(const std::string& path) {
+    if (path.size() >= sizeof(sockaddr_un::sun_path)) {
+        Logger::getLogger()->error("Upgrade socket path {} is too long", path);
+        return false;
+    }
+    listenFd_ = ::socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    if (listenFd_ < 0) {
+        Logger::getLogger()->error("Cannot create upgrade socket: {}", std::strerror(errno));
+        return false;
+    }
+    // A previous process has either handed over or died by now
+    ::unlink(path.c_str());
+    sockaddr_un address = unixAddress(path);
+    if (::bind(listenFd_, reinterpret_cast<sockaddr*>(&address), sizeof(address)) != 0 ||
+        ::listen(listenFd_, 1) != 0) {
+        Logger::getLogger()->error("Cannot listen on upgrade socket {}: {}", path, std::strerror(errno));
+        ::close(listenFd_);
+        listenFd_ = -1;
+        return false;
+    }
+    ::chmod(path.c_str(), 0600);
+    path_ = path;
+    Logger::getLogger()->info("Accepting hot upgrades on {}", path);
+    return true;
+}
+
+bool UpgradeServer::waitForRequest(std::chrono::milliseconds timeout) {
+    if (listenFd_ < 0) {
+        std::this_thread::sleep_for(timeout);
+        return false;
+    }
+    if (!waitReadable(listenFd_, timeout)) {
+        return false;
+    }
+    dropPeer();
+    peerFd_ = ::accept4(listenFd_, nullptr, nullptr, SOCK_CLOEXEC);
+    if (peerFd_ < 0) {
+        return false;
+    }
+    if (!receiveMessage(peerFd_, UpgradeMessage::Takeover, std::chrono::seconds(1))) {
+        Logger::getLogger()->warn("Ignoring an upgrade connection that did not ask to take over");
+        dropPeer();
+        return false;
+    }
+    Logger::getLogger()->info("New process is taking over");
+    return true;
+}
+
+bool UpgradeServer::sendSockets(const std::vector<InheritedSocket>& sockets) {
+    size_t offset = 0;
+    do {
+        size_t count = std::min(sockets.size() - offset, MAX_FDS_PER_MESSAGE);
+
+        uint8_t payload[sizeof(SocketsMessageHeader) + MAX_FDS_PER_MESSAGE * sizeof(SocketEntry)];
+        SocketsMessageHeader header = {static_cast<uint8_t>(UpgradeMessage::Sockets),
+                                       static_cast<uint8_t>(offset + count == sockets.size()),
+                                       static_cast<uint16_t>(count)};
+        std::memcpy(payload, &header, sizeof(header));
+        alignas(struct cmsghdr) uint8_t control[CMSG_SPACE(sizeof(int) * MAX_FDS_PER_MESSAGE)];
+        int fds[MAX_FDS_PER_MESSAGE];
+        for (size_t i = 0; i < count; ++i) {
+            const InheritedSocket& socket = sockets[offset + i];
+            SocketEntry entry = {static_cast<uint8_t>(socket.role), 0, socket.port};
+            std::memcpy(payload + sizeof(header) + i * sizeof(entry), &entry, sizeof(entry));
+            fds[i] = socket.fd;
+        }
+
+        struct iovec iov = {payload, sizeof(header) + count * sizeof(SocketEntry)};
+        struct msghdr message;
+        std::memset(&message, 0, sizeof(message));
+        message.msg_iov = &iov;
+        message.msg_iovlen = 1;
+        if (count > 0) {
+            message.msg_control = control;
+            message.msg_controllen = CMSG_SPACE(sizeof(int) * count);
+            struct cmsghdr* cmsg = CMSG_FIRSTHDR(&message);
+            cmsg->cmsg_level = SOL_SOCKET;
+            cmsg->cmsg_type = SCM_RIGHTS;
+            cmsg->cmsg_len = CMSG_LEN(sizeof(int) * count);
+            std::memcpy(CMSG_DATA(cmsg), fds, sizeof(int) * count);
+        }
+        if (::sendmsg(peerFd_, &message, MSG_NOSIGNAL) < 0) {
+            Logger::getLogger()->error("Handing sockets over failed: {}", std::strerror(errno));
+            dropPeer();
+            return false;
+        }
+        offset += count;
+    } while (offset < sockets.size());
+
+    Logger::getLogger()->info("Handed {} sockets over to the new process", sockets.size());
+    return true;
+}
+
+bool UpgradeServer::waitForReady(std::chrono::milliseconds timeout) {
+    if (!receiveMessage(peerFd_, UpgradeMessage::Ready, timeout)) {
+        Logger::getLogger()->error("New process did not take over, carrying on");
+        dropPeer();
+        return false;
+    }
+    return true;
+}
+
+void UpgradeServer::finish() {
+    if (peerFd_ >= 0) {
+        sendMessage(peerFd_, UpgradeMessage::Done);
+        dropPeer();
+    }
+}
+
+void UpgradeServer::close(bool unlinkPath) {
+    dropPeer();
+    if (listenFd_ >= 0) {
+        ::close(listenFd_);
+        listenFd_ = -1;
+        if (unlinkPath) {
+            ::unlink(path_.c_str());
+        }
+    }
+}
+
+void UpgradeServer::dropPeer() {
+    if (peerFd_ >= 0) {
+        ::close(peerFd_);
+        peerFd_ = -1;
+    }
+}
+
+UpgradeClient::UpgradeClient()
+    : fd_(-1)
+{
+}
+
+UpgradeClient::~UpgradeClient() {
+    close();
+}
+
+bool UpgradeClient::takeOver(const std::string& path, std::vector<InheritedSocket>& sockets,
+                             std::chrono::milliseconds timeout) {
+    fd_ = ::socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    if (fd_ < 0) {
+        Logger::getLogger()->error("Cannot create upgrade socket: {}", std::strerror(errno));
+        return false;
+    }
+    sockaddr_un address = unixAddress(path);
+    if (::connect(fd_, reinterpret_cast<sockaddr*>(&address), sizeof(address)) != 0) {
+        Logger::getLogger()->error("No running process to take over at {}: {}", path, std::strerror(errno));
+        close();
+        return false;
+    }
+    if (!sendMessage(fd_, UpgradeMessage::Takeover)) {
+        close();
+        return false;
+    }
+
+    bool last = false;
+    while (!last) {
+        // The old process answers from its main loop, so allow for a full
+        // wait interval plus writing the snapshot
+        if (!waitReadable(fd_, timeout)) {
+            Logger::getLogger()->error("Running process did not hand its sockets over");
+            break;
+        }
+
+        uint8_t payload[sizeof(SocketsMessageHeader) + MAX_FDS_PER_MESSAGE * sizeof(SocketEntry)];
+        alignas(struct cmsghdr) uint8_t control[CMSG_SPACE(sizeof(int) * MAX_FDS_PER_MESSAGE)];
+        struct iovec iov = {payload, sizeof(payload)};
+        struct msghdr message;
+        std::memset(&message, 0, sizeof(message));
+        message.msg_iov = &iov;
+        message.msg_iovlen = 1;
+        message.msg_control = control;
+        message.msg_controllen = sizeof(control);
+        ssize_t received = ::recvmsg(fd_, &message, MSG_CMSG_CLOEXEC);
+        if (received <= 0) {
+            Logger::getLogger()->error("Upgrade connection closed during the handoff");
+            break;
+        }
+
+        std::vector<int> fds;
+        for (struct cmsghdr* cmsg = CMSG_FIRSTHDR(&message); cmsg; cmsg = CMSG_NXTHDR(&message, cmsg)) {
+            if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+                size_t count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+                const uint8_t* data = CMSG_DATA(cmsg);
+                for (size_t i = 0; i < count; ++i) {
+                    int fd;
+                    std::memcpy(&fd, data + i * sizeof(int), sizeof(int));
+                    fds.push_back(fd);
+                }
+            }
+        }
+
+        SocketsMessageHeader header;
+        bool valid = static_cast<size_t>(received) >= sizeof(header) && !(message.msg_flags & (MSG_TRUNC | MSG_CTRUNC));
+        if (valid) {
+            std::memcpy(&header, payload, sizeof(header));
+            valid = header.type == static_cast<uint8_t>(UpgradeMessage::Sockets) && header.count == fds.size() &&
+                    static_cast<size_t>(received) == sizeof(header) + header.count * sizeof(SocketEntry);
+        }
+        if (!valid) {
+            Logger::getLogger()->error("Malformed socket handoff message");
+            for (int fd : fds) {
+                ::close(fd);
+            }
+            break;
+        }
+
+        for (size_t i = 0; i < fds.size(); ++i) {
+            SocketEntry entry;
+            std::memcpy(&entry, payload + sizeof(header) + i * sizeof(entry), sizeof(entry));
+            sockets.push_back(InheritedSocket{static_cast<SocketRole>(entry.role), entry.port, fds[i]});
+        }
+        last = header.last != 0;
+    }
+
+    if (!last) {
+        for (const InheritedSocket& socket : sockets) {
+            ::close(socket.fd);
+        }
+        sockets.clear();
+        close();
+        return false;
+    }
+    Logger::getLogger()->info("Inherited {} sockets from the running process", sockets.size());
+    return true;
+}
+
+bool UpgradeClient::ready(std::chrono::milliseconds timeout) {
+    if (fd_ < 0 || !sendMessage(fd_, UpgradeMessage::Ready)) {
+        return false;
+    }
+    return receiveMessage(fd_, UpgradeMessage::Done, timeout);
+}
+
+void UpgradeClient::close() {
+    if (fd_ >= 0) {
+        ::close(fd_);
+        fd_ = -1;
+    }
+}
@@ -0,0 +1,181 @@
+/*
+ * Copyright 2024 nrjchnd@gmail.com
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     https://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an **"AS IS" BASIS,**
+ * **WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.**
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#ifndef HOT_UPGRADE_H
+#define HOT_UPGRADE_H
+
+#include "session_manager.h"
+#include "translator.h"
+#include <chrono>
+#include <cstdint>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+// Hot upgrade: a new binary started with --upgrade connects to the running
+// process over a Unix socket and takes over without dropping calls.
+//
+//   new -> old  Takeover
+//   old -> new  Sockets (SCM_RIGHTS, in chunks) after writing the snapshot
+//   new -> old  Ready, once it is receiving on the inherited sockets
+//   old -> new  Done, after stopping its IO and rewriting the snapshot
+//
+// Both processes receive on the shared sockets between Sockets and Ready,
+// so there is no moment where nobody reads them. Should the new process die
+// before Ready, the old one simply carries on.
+
+enum class SocketRole : uint8_t {
+    SharedListener = 1,   // single-port mode listen socket
+    PortListener = 2,     // per-port mode listener
+    Downlink = 3,
+    Forward = 4,          // cluster forward endpoint
+    Rtcp = 5              // RTCP socket on port + 1 of the listener on port
+};
+
+struct InheritedSocket {
+    SocketRole role;
+    uint16_t port;
+    int fd;
+};
+
+// Snapshot file: an UpgradeSnapshotHeader followed by sessionCount
+// UpgradeSessionRecords, portCount UpgradePortRecords and silenceCount
+// SilenceStreamStates
+struct UpgradeSnapshotHeader {
+    char magic[8];                // "QRTPSNP" + format version
+    uint32_t sessionRecordSize;
+    uint32_t sessionCount;
+    uint32_t portRecordSize;
+    uint32_t portCount;
+    uint32_t silenceRecordSize;
+    uint32_t silenceCount;
+    uint16_t sequenceNumber;      // TranslatorState
+    uint16_t reserved;
+    uint32_t timestamp;
+    uint32_t ssrc;
+    uint32_t reserved2;
+};
+
+// Steady clock times are in nanoseconds; both processes share the clock
+struct UpgradeSessionRecord {
+    uint32_t ssrc;
+    uint16_t localPort;
+    uint16_t sourcePort;
+    uint8_t addressFamily;        // 4 or 6
+    uint8_t latched;
+    uint8_t hasSrtpRoc;
+    uint8_t peerAddressFamily;    // 0 until the endpoint's RTCP arrived
+    uint32_t srtpRoc;
+    uint8_t sourceAddress[16];
+    uint8_t peerAddress[16];      // RtcpPeerState
+    uint16_t peerPort;
+    uint8_t peerMuxed;
+    uint8_t peerHasReport;
+    uint8_t peerFractionLost;
+    uint8_t reserved[3];
+    int32_t peerCumulativeLost;
+    uint32_t peerJitter;
+    uint32_t peerLastSrNtp;
+    uint32_t sentPackets;         // RtpSendStats
+    uint32_t sentOctets;
+    uint32_t sentLastTimestamp;
+    uint32_t sentClockRate;
+    uint32_t sentPacketsAtLastReport;
+    int64_t sentLastSent;
+    int64_t peerLastSrArrival;
+    double peerRoundTripMs;
+    RtpReceiveState uplink;
+    RtpReceiveState downlink;
+};
+
+struct UpgradePortRecord {
+    uint16_t port;
+    uint16_t reserved;
+    uint32_t reserved2;
+    char callKey[64];             // hex, NUL padded; empty for the global key
+    char tenant[64];              // attached tenant's ID, NUL padded
+};
+
+// Per-port state that outlives a listener socket handoff
+struct UpgradePort {
+    uint16_t port = 0;
+    std::string callKey;
+    std::string tenant;
+};
+
+struct UpgradeState {
+    std::vector<std::pair<uint32_t, SessionInfo>> sessions;
+    // Rollover counters of the sessions' inbound SRTP streams, by SSRC
+    std::unordered_map<uint32_t, uint32_t> srtpRocs;
+    std::vector<UpgradePort> ports;
+    TranslatorState translator;
+};
+
+class UpgradeSnapshot {
+public:
+    // Written to a temporary file and renamed, so a reader never sees half
+    // a snapshot
+    static bool write(const std::string& path, const UpgradeState& state);
+    static bool read(const std::string& path, UpgradeState& state);
+};
+
+// Running side: listens for a successor and hands over to it
+class UpgradeServer {
+public:
+    UpgradeServer();
+    ~UpgradeServer();
+
+    bool listen(const std::string& path);
+    bool isListening() const { return listenFd_ >= 0; }
+
+    // Waits up to timeout for a successor asking to take over; sleeps for
+    // the timeout when not listening
+    bool waitForRequest(std::chrono::milliseconds timeout);
+    bool sendSockets(const std::vector<InheritedSocket>& sockets);
+    // False when the successor failed or went away; it has then been dropped
+    bool waitForReady(std::chrono::milliseconds timeout);
+    // Final step once the snapshot has been rewritten
+    void finish();
+    // unlinkPath is false after a handoff, when the path is the successor's
+    void close(bool unlinkPath);
+
+private:
+    void dropPeer();
+
+    int listenFd_;
+    int peerFd_;
+    std::string path_;
+};
+
+// Upgrading side
+class UpgradeClient {
+public:
+    UpgradeClient();
+    ~UpgradeClient();
+
+    // Asks the running process to hand over and collects its sockets
+    bool takeOver(const std::string& path, std::vector<InheritedSocket>& sockets,
+                  std::chrono::milliseconds timeout);
+    // Reports that the sockets are being served and waits for the old
+    // process to stop and write its final snapshot
+    bool ready(std::chrono::milliseconds timeout);
+    void close();
+
+private:
+    int fd_;
+};
+
+#endif // HOT_UPGRADE_H
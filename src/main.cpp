@@ -15,141 +15,580 @@
  */
 
 #include "config.h"
-#include "rtp_listener.h"
+#include "runtime_config.h"
+#include "rtcp.h"
+#include "admission_control.h"
+#include "capture_log.h"
+#include "packet_arena.h"
+#include "probes.h"
+#include "rtp_batch_parser.h"
+#include "rtp_port_manager.h"
+#include "udp_io.h"
+#include "xdp_io.h"
+#include "reuseport_steering.h"
 #include "quic_client.h"
 #include "translator.h"
 #include "session_manager.h"
 #include "cache_manager.h"
+#include "cluster_manager.h"
+#include "control_server.h"
+#include "hot_upgrade.h"
+#include "tenant_accounting.h"
 #include "logger.h"
 #include <boost/asio.hpp>
 #include <iostream>
 #include <thread>
 #include <functional>
 #include <vector>
+#include <map>
 #include <unordered_map>
+#include <unordered_set>
 #include <cstdlib>
+#include <cstring>
 #include <csignal>
 #include <atomic>
 #include <chrono>
+#include <algorithm>
+#include <memory>
+#include <pthread.h>
+#include <unistd.h>
 
 std::atomic<bool> running(true);
+std::atomic<bool> reloadRequested(false);
 
 void signal_handler(int) {
     running = false;
 }
 
+void reload_handler(int) {
+    reloadRequested = true;
+}
+
+void applyLogLevel(const std::string& logLevel) {
+    if (logLevel == "debug") {
+        spdlog::set_level(spdlog::level::debug);
+    } else if (logLevel == "info") {
+        spdlog::set_level(spdlog::level::info);
+    } else if (logLevel == "warn") {
+        spdlog::set_level(spdlog::level::warn);
+    } else if (logLevel == "error") {
+        spdlog::set_level(spdlog::level::err);
+    }
+}
+
+// Securely load SRTP key from environment variable or secure storage
+bool loadSrtpKey(std::string& srtpKey) {
+    const char* srtpKeyEnv = std::getenv("SRTP_KEY");
+    if (srtpKeyEnv == nullptr) {
+        Logger::getLogger()->error("SRTP is enabled but SRTP_KEY environment variable is not set");
+        return false;
+    }
+    if (std::strlen(srtpKeyEnv) != 60) { // 30 bytes in hex representation
+        Logger::getLogger()->error("Invalid SRTP key length");
+        return false;
+    }
+    srtpKey = srtpKeyEnv;
+    return true;
+}
+
 int main(int argc, char* argv[]) {
     try {
         // Initialize the logger
         Logger::init();
 
-        // Load configuration
-        Config config;
-        if (!config.loadConfig()) {
-            Logger::getLogger()->error("Failed to load configuration file");
-            return -1;
+        // Load configuration. SIGHUP or an edit of the file reloads it; the
+        // settings in RuntimeConfig apply at once, the rest on restart.
+        std::string configPath = Config::defaultPath();
+        for (int i = 1; i + 1 < argc; ++i) {
+            if (std::string(argv[i]) == "--config") {
+                configPath = argv[i + 1];
+            }
         }
+        ConfigStore configStore(configPath);
+        // Valid until the first reload, i.e. throughout startup
+        const RuntimeConfig& initial = configStore.load();
+        Config config = initial.source;
 
         // Retrieve configuration settings
-        bool isSrtp = config.getBool("SRTP", "enable");
+        bool isSrtp = initial.srtp;
         std::string srtpKey;
-
-        // Securely load SRTP key from environment variable or secure storage
-        const char* srtpKeyEnv = std::getenv("SRTP_KEY");
-        if (isSrtp) {
-            if (srtpKeyEnv == nullptr) {
-                Logger::getLogger()->error("SRTP is enabled but SRTP_KEY environment variable is not set");
-                return -1;
-            }
-            srtpKey = srtpKeyEnv;
-            if (srtpKey.length() != 60) { // 30 bytes in hex representation
-                Logger::getLogger()->error("Invalid SRTP key length");
-                return -1;
-            }
+        if (isSrtp && !loadSrtpKey(srtpKey)) {
+            return -1;
         }
 
         std::string redisUri = config.get("Cache", "redis_uri");
-        std::string logLevel = config.get("Logging", "level");
         std::string quicServerIp = config.get("QUIC", "server_ip");
         int quicServerPort = config.getInt("QUIC", "server_port");
 
-        // Set log level
-        if (!logLevel.empty()) {
-            if (logLevel == "debug") {
-                spdlog::set_level(spdlog::level::debug);
-            } else if (logLevel == "info") {
-                spdlog::set_level(spdlog::level::info);
-            } else if (logLevel == "warn") {
-                spdlog::set_level(spdlog::level::warn);
-            } else if (logLevel == "error") {
-                spdlog::set_level(spdlog::level::err);
-            }
+        applyLogLevel(initial.logLevel);
+
+        // Packet buffers for every stage come from per-NUMA-node huge page pools
+        PacketArena::init(static_cast<size_t>(std::max(config.getInt("Buffers", "pool_size", 0), 0)),
+                          config.getBool("Buffers", "huge_pages"), config.getBool("Buffers", "numa"));
+
+        // Ingress capture for replay with quicrtp_replay
+        CaptureLog capture;
+        if (config.getBool("Capture", "enable")) {
+            std::string captureFile = config.get("Capture", "file");
+            int captureMb = std::max(config.getInt("Capture", "max_size_mb", 1024), 1);
+            capture.open(captureFile.empty() ? "/var/tmp/quicrtp.cap" : captureFile, static_cast<size_t>(captureMb) << 20);
         }
 
         // Initialize components
         CacheManager cacheManager(redisUri);
-        SessionManager sessionManager;
+        // With SSRC steering every SO_REUSEPORT socket of single-port mode is a
+        // worker with its own IO thread, and the session table is sharded with
+        // the same SSRC hash so each worker only touches its own shard
+        bool steerBySsrc = (config.get("RTP", "steering") == "ssrc");
+        int listenSockets = std::max(config.getInt("RTP", "listen_sockets", 1), 1);
+        SessionManager sessionManager(steerBySsrc ? static_cast<size_t>(listenSockets) : 1);
         Translator translator;
 
+        // Hot upgrade: with --upgrade the sockets, sessions and translator
+        // state are taken over from the running process instead of being
+        // set up afresh
+        bool upgradeEnabled = config.getBool("Upgrade", "enable");
+        std::string upgradeSocket = config.get("Upgrade", "socket");
+        if (upgradeSocket.empty()) {
+            upgradeSocket = "/run/quicrtp/upgrade.sock";
+        }
+        std::string snapshotPath = config.get("Upgrade", "snapshot");
+        if (snapshotPath.empty()) {
+            snapshotPath = "/dev/shm/quicrtp.snapshot";
+        }
+        std::chrono::milliseconds handoffTimeout(std::max(config.getInt("Upgrade", "handoff_timeout_ms", 10000), 1000));
+        bool upgrade = false;
+        for (int i = 1; i < argc; ++i) {
+            if (std::string(argv[i]) == "--upgrade") {
+                upgrade = true;
+            }
+        }
+
+        // Kept after the sessions are imported: the per-port state is applied
+        // as the listeners are adopted and the tenants loaded
+        UpgradeState restored;
+        auto restoreSnapshot = [&]() {
+            if (!UpgradeSnapshot::read(snapshotPath, restored)) {
+                return;
+            }
+            for (const auto& session : restored.sessions) {
+                sessionManager.importSession(session.first, session.second);
+            }
+            translator.restoreState(restored.translator);
+            Logger::getLogger()->info("Restored {} sessions from {}", restored.sessions.size(), snapshotPath);
+        };
+        // Call key of an inherited port and the SRTP rollover counters of
+        // the sessions on it
+        auto restoredCallKey = [&restored](uint16_t port) {
+            for (const UpgradePort& entry : restored.ports) {
+                if (entry.port == port) {
+                    return entry.callKey;
+                }
+            }
+            return std::string();
+        };
+        auto restoredSrtpRocs = [&restored](uint16_t port) {
+            std::vector<std::pair<uint32_t, uint32_t>> rocs;
+            for (const auto& session : restored.sessions) {
+                auto roc = restored.srtpRocs.find(session.first);
+                if (session.second.localPort == port && roc != restored.srtpRocs.end()) {
+                    rocs.emplace_back(session.first, roc->second);
+                }
+            }
+            return rocs;
+        };
+
+        UpgradeClient upgradeClient;
+        std::vector<InheritedSocket> inherited;
+        if (upgrade) {
+            if (!upgradeClient.takeOver(upgradeSocket, inherited, handoffTimeout)) {
+                Logger::getLogger()->error("Hot upgrade failed, the running process keeps serving");
+                return -1;
+            }
+            restoreSnapshot();
+        }
+        // Inherited socket for role (and port, unless 0), or -1
+        auto takeInherited = [&inherited](SocketRole role, uint16_t port) {
+            auto it = std::find_if(inherited.begin(), inherited.end(), [role, port](const InheritedSocket& socket) {
+                return socket.role == role && (port == 0 || socket.port == port);
+            });
+            if (it == inherited.end()) {
+                return -1;
+            }
+            int fd = it->fd;
+            inherited.erase(it);
+            return fd;
+        };
+
         boost::asio::io_context io_context;
 
-        // Retrieve RTP port range from configuration
-        int portStart = config.getInt("RTP", "port_range_start");
-        int portEnd = config.getInt("RTP", "port_range_end");
+        // RTP port range, validated by RuntimeConfig
+        int portStart = initial.portStart;
+        int portEnd = initial.portEnd;
 
-        if (portStart <= 0 || portEnd <= 0 || portEnd < portStart) {
-            Logger::getLogger()->error("Invalid RTP port range specified in configuration");
+        // "per_port" gives each session its own listener from the range;
+        // "single_port" binds listen_port once (or once per socket with
+        // SO_REUSEPORT) and demultiplexes calls by SSRC and source.
+        std::string rtpMode = config.get("RTP", "mode");
+        bool singlePort = (rtpMode == "single_port");
+        if (!rtpMode.empty() && rtpMode != "per_port" && !singlePort) {
+            Logger::getLogger()->error("Unknown RTP mode '{}'", rtpMode);
             return -1;
         }
+        int recvBatch = config.getInt("RTP", "recv_batch", 1);
+        Logger::getLogger()->debug("RTP header parser: {}", rtpParserKernel());
+        // "epoll" (boost::asio reactor), "io_uring" or "xdp"
+        std::string ioBackend = config.get("RTP", "io_backend");
+
+        // The XDP fast path must be up before listeners pick their backend.
+        // During a hot upgrade the old process still holds the queue, so the
+        // new one falls back to the socket path.
+        std::shared_ptr<XdpEngine> xdpEngine;
+        if (ioBackend == "xdp") {
+            xdpEngine = std::make_shared<XdpEngine>(io_context);
+            std::string xdpProgram = config.get("XDP", "program");
+            bool skbMode = (config.get("XDP", "mode") == "skb");
+            if (xdpEngine->initialize(config.get("XDP", "interface"), static_cast<uint32_t>(config.getInt("XDP", "queue", 0)),
+                                      xdpProgram.empty() ? "/usr/local/share/quicrtp/rtp_xdp.bpf.o" : xdpProgram, skbMode)) {
+                XdpEngine::setActive(xdpEngine);
+            } else {
+                Logger::getLogger()->warn("XDP fast path unavailable, using the socket path");
+            }
+        }
+
+        // Cluster mode: sessions are split between the nodes sharing Redis,
+        // and packets reaching the wrong node are forwarded to the owner once
+        std::unique_ptr<ClusterManager> cluster;
+        std::shared_ptr<UdpIo> forwardIo;
+        uint16_t forwardPort = 0;
+        if (config.getBool("Cluster", "enable")) {
+            std::string nodeId = config.get("Cluster", "node_id");
+            if (nodeId.empty()) {
+                char hostname[256] = {0};
+                gethostname(hostname, sizeof(hostname) - 1);
+                nodeId = hostname;
+            }
+            forwardPort = static_cast<uint16_t>(config.getInt("Cluster", "forward_port", 7000));
+            boost::asio::ip::udp::endpoint forwardEndpoint(boost::asio::ip::make_address(config.get("Cluster", "forward_address")),
+                                                           forwardPort);
+            cluster = std::make_unique<ClusterManager>(redisUri, nodeId, forwardEndpoint,
+                                                       static_cast<size_t>(std::max(config.getInt("Cluster", "virtual_nodes", 128), 1)),
+                                                       std::chrono::milliseconds(std::max(config.getInt("Cluster", "heartbeat_ms", 1000), 100)),
+                                                       std::chrono::milliseconds(config.getInt("Cluster", "node_ttl_ms", 5000)));
+            forwardIo = createUdpIo(ioBackend, io_context, static_cast<size_t>(recvBatch));
+            int forwardFd = takeInherited(SocketRole::Forward, forwardPort);
+            if (forwardFd >= 0) {
+                forwardIo->adopt(forwardFd, forwardPort);
+            } else {
+                forwardIo->open(forwardPort, false);
+            }
+        }
+
+        // Admission control: while overloaded, packets of new SSRCs are
+        // dropped so the calls already up keep their quality
+        AdmissionControl admission;
+        admission.setThresholds(initial.maxUtilization, initial.maxQueueDepth);
+
+        // Tenants own ranges of local ports; they share the QUIC uplink
+        // fairly and are billed separately
+        auto loadTenants = [&redisUri](const Config& source, TenantDirectory& directory) {
+            std::string defaultTenant = source.get("Tenants", "default_tenant");
+            if (!defaultTenant.empty()) {
+                directory.setDefaultTenant(defaultTenant);
+            }
+            directory.addPortRanges(source.getList("Tenants", "tenant_ports"));
+            directory.addRates(source.getList("Tenants", "tenant_rates"));
+            directory.loadFromRedis(redisUri, source.getList("Tenants", "tenants"));
+        };
+        TenantDirectory tenants;
+        loadTenants(config, tenants);
+        // Ports the previous process had attached to a tenant for a call
+        auto restoreAttachments = [&]() {
+            for (const UpgradePort& entry : restored.ports) {
+                uint16_t tenant = entry.tenant.empty() ? NO_TENANT : tenants.find(entry.tenant);
+                if (tenant != NO_TENANT) {
+                    tenants.attachPort(entry.port, tenant);
+                }
+            }
+        };
+        restoreAttachments();
+
+        // Per-tenant traffic, flushed to the tenant:<id> hashes in batches
+        std::unique_ptr<TenantAccounting> accounting;
+        if (config.getBool("Billing", "enable")) {
+            accounting = std::make_unique<TenantAccounting>(redisUri, tenants);
+            accounting->start(std::chrono::seconds(config.getInt("Billing", "flush_interval_s", 5)));
+        }
 
-        // Prepare list of available ports
-        std::vector<uint16_t> availablePorts;
-        for (int port = portStart; port <= portEnd; ++port) {
-            availablePorts.push_back(static_cast<uint16_t>(port));
+        // RTCP is answered on each leg instead of crossing the QUIC hop
+        std::unique_ptr<RtcpAgent> rtcpAgent;
+        if (config.getBool("RTCP", "enable")) {
+            std::string cname = config.get("RTCP", "cname");
+            if (cname.empty()) {
+                char hostname[256] = {0};
+                gethostname(hostname, sizeof(hostname) - 1);
+                cname = std::string("quicrtp@") + hostname;
+            }
+            rtcpAgent = std::make_unique<RtcpAgent>(sessionManager, cname);
+            // Downlink packets kept per session to answer NACKs locally,
+            // within nack_cache_max_mb for all sessions together
+            if (config.getInt("RTCP", "nack_cache_ms", 0) > 0) {
+                sessionManager.setNackCache(static_cast<size_t>(std::max(config.getInt("RTCP", "nack_cache_packets", 256), 1)),
+                                            static_cast<size_t>(std::max(config.getInt("RTCP", "nack_cache_max_mb", 64), 1)) << 20);
+            }
         }
+        auto handleRtcp = [&](uint8_t* data, size_t len, const boost::asio::ip::udp::endpoint& sender, bool muxed) {
+            rtcpAgent->receive(data, len, sender, muxed);
+        };
+
+        // Listeners are opened on demand as sessions are set up, out of a
+        // pool of spare ones kept open for calls yet to send their first
+        // packet, and released once their calls have ended
+        RtpPortManager portManager(io_context, static_cast<uint16_t>(portStart), static_cast<uint16_t>(portEnd), isSrtp, srtpKey, ioBackend);
+        // Single-port mode: listen_sockets SO_REUSEPORT sockets on one port
+        std::vector<std::shared_ptr<RtpListener>> sharedListeners;
 
-        // Vector to hold RTP listener objects
-        std::vector<std::shared_ptr<RtpListener>> rtpListeners;
+        // Packet index of a parsed batch; its header fields are read from
+        // the batch columns all the way into the translator
+        auto processRtp = [&](const RuntimeConfig& runtime, const uint8_t* data, size_t len, const RtpHeaderBatch& headers, size_t index,
+                              const boost::asio::ip::udp::endpoint& sender, uint16_t localPort, bool forwarded,
+                              std::chrono::steady_clock::time_point now) {
+            if (capture.isOpen()) {
+                capture.record(CaptureKind::RtpIngress, data, len, &sender, localPort);
+            }
+
+            if (headers.headerLength[index] != 0) {
+                uint32_t ssrc = headers.ssrc[index];
+                QUICRTP_PROBE4(rtp_receive, ssrc, headers.sequenceNumber[index], len, localPort);
+
+                // Sessions of other nodes go to their owner; forwarded packets
+                // are always handled here so nothing bounces between nodes
+                if (cluster && !forwarded && !sessionManager.hasSession(ssrc)) {
+                    boost::asio::ip::udp::endpoint owner;
+                    if (!cluster->isLocal(ssrc, owner)) {
+                        uint8_t forwardHeader[CLUSTER_FORWARD_HEADER_SIZE];
+                        size_t headerLen = ClusterManager::encodeForward(sender, localPort, forwardHeader);
+                        forwardIo->sendTo(boost::asio::buffer(forwardHeader, headerLen), boost::asio::buffer(data, len), owner);
+                        // The owner's replies leave from this port
+                        if (cluster->noteForwarded(ssrc, localPort, sender, now) && !singlePort) {
+                            portManager.claimListener(localPort);
+                        }
+                        return;
+                    }
+                }
+
+                if (runtime.admissionEnabled && admission.overloaded() && !sessionManager.hasSession(ssrc)) {
+                    admission.refuse();
+                    return;
+                }
 
-        // Initialize RTP listeners
-        for (uint16_t port : availablePorts) {
-            try {
-                auto rtpListener = std::make_shared<RtpListener>(io_context, isSrtp, srtpKey);
-                rtpListener->start(port);
+                // Session management
+                RtpArrival arrival;
+                arrival.sequenceNumber = headers.sequenceNumber[index];
+                arrival.timestamp = headers.timestamp[index];
+                arrival.clockRate = runtime.classifier.clockRate(headers.markerPayloadType[index]);
+                arrival.time = now;
+                SessionBinding binding = sessionManager.bindSession(ssrc, sender, localPort, singlePort, arrival);
+                if (binding == SessionBinding::Rejected) {
+                    Logger::getLogger()->debug("Dropping SSRC {} from unexpected source {}:{}", ssrc, sender.address().to_string(), sender.port());
+                    return;
+                }
 
-                // Set packet handler
-                rtpListener->setPacketHandler([&](const uint8_t* data, size_t len, const boost::asio::ip::udp::endpoint& sender) {
-                    // Extract SSRC from RTP header
-                    if (len >= 12) {
-                        uint32_t ssrc = (data[8] << 24) | (data[9] << 16) | (data[10] << 8) | data[11];
+                // Cache the mapping between SSRC and sender endpoint
+                if (binding != SessionBinding::Existing) {
+                    cacheManager.set(std::to_string(ssrc), sender.address().to_string() + ":" + std::to_string(sender.port()));
+                }
+                if (cluster && binding == SessionBinding::Created) {
+                    cluster->claim(ssrc);
+                }
+                if (!singlePort && !forwarded && binding != SessionBinding::Existing) {
+                    portManager.claimListener(localPort);
+                }
 
-                        // Cache the mapping between SSRC and sender endpoint
-                        cacheManager.set(std::to_string(ssrc), sender.address().to_string() + ":" + std::to_string(sender.port()));
+                if (accounting) {
+                    accounting->record(localPort, TrafficDirection::Ingress, len);
+                }
 
-                        // Session management
-                        sessionManager.addSession(ssrc);
+                // Translation
+                translator.translateRtpToQuic(data, len, headers, index, tenants.tenantOf(localPort));
+            } else {
+                Logger::getLogger()->warn("Received invalid RTP packet from {}:{}", sender.address().to_string(), sender.port());
+            }
+        };
+        // Headers of a whole receive batch are parsed in one pass before the
+        // packets are handled one by one. The batch shares one arrival time.
+        auto handleRtp = [&](ReceiveBatch& batch, uint16_t localPort) {
+            ConfigStore::ReadGuard runtime(configStore);
+            auto start = std::chrono::steady_clock::now();
+            RtpHeaderBatch headers;
+            parseRtpBatch(batch.data, batch.length, batch.count, headers);
+            for (size_t i = 0; i < headers.count; ++i) {
+                processRtp(*runtime, batch.data[i], batch.length[i], headers, i, batch.sender[i], localPort, false, start);
+            }
+            if (runtime->admissionEnabled) {
+                admission.recordBusy(std::chrono::steady_clock::now() - start);
+            }
+        };
 
-                        // Translation
-                        translator.translateRtpToQuic(data, len);
+        if (cluster) {
+            forwardIo->startReceive([&](uint8_t* data, size_t len, const boost::asio::ip::udp::endpoint& node) {
+                if (!cluster->isMember(node)) {
+                    Logger::getLogger()->debug("Dropping forwarded packet from {}:{}, not a cluster node", node.address().to_string(), node.port());
+                    return;
+                }
+                boost::asio::ip::udp::endpoint peer;
+                uint16_t localPort = 0;
+                bool reply = false;
+                size_t headerLen = ClusterManager::decodeForward(data, len, peer, localPort, reply);
+                if (headerLen == 0) {
+                    Logger::getLogger()->debug("Dropping malformed forwarded packet");
+                    return;
+                }
+                if (reply) {
+                    // Downlink of a call this node forwarded, sent on from its
+                    // port, and only to the endpoint the call came from
+                    RtpHeaderInfo header;
+                    if (!parseRtpHeader(data + headerLen, len - headerLen, header) ||
+                        !cluster->isForwarded(header.ssrc, localPort, peer)) {
+                        Logger::getLogger()->debug("Dropping reply to {}:{}, not a forwarded call", peer.address().to_string(), peer.port());
+                        return;
+                    }
+                    std::shared_ptr<RtpListener> listener;
+                    if (singlePort) {
+                        listener = sharedListeners.empty() ? nullptr : sharedListeners.front();
                     } else {
-                        Logger::getLogger()->warn("Received RTP packet is too short from {}:{}", sender.address().to_string(), sender.port());
+                        listener = portManager.findListener(localPort);
                     }
-                });
-
-                rtpListeners.push_back(rtpListener);
-            } catch (const std::exception& e) {
-                Logger::getLogger()->warn("Port {} is unavailable: {}", port, e.what());
-                continue;
+                    if (listener) {
+                        listener->sendTo(data + headerLen, len - headerLen, peer);
+                        if (accounting) {
+                            accounting->record(localPort, TrafficDirection::Egress, len - headerLen);
+                        }
+                    }
+                    return;
+                }
+                RtpHeaderInfo header;
+                parseRtpHeader(data + headerLen, len - headerLen, header);
+                RtpHeaderBatch headers;
+                headers.count = 1;
+                headers.set(0, header);
+                ConfigStore::ReadGuard runtime(configStore);
+                processRtp(*runtime, data + headerLen, len - headerLen, headers, 0, peer, localPort, true, std::chrono::steady_clock::now());
+                if (header.valid() && sessionManager.hasSession(header.ssrc)) {
+                    cluster->setIngress(header.ssrc, node);
+                }
+            });
+            if (!cluster->start()) {
+                Logger::getLogger()->error("Failed to join the cluster");
+                return -1;
             }
         }
 
-        if (rtpListeners.empty()) {
-            Logger::getLogger()->error("No RTP listeners could be started. Exiting.");
-            return -1;
+        portManager.setPacketHandler(handleRtp);
+        if (rtcpAgent) {
+            portManager.setRtcpHandler([&handleRtcp](uint8_t* data, size_t len, const boost::asio::ip::udp::endpoint& sender, bool muxed, uint16_t) {
+                handleRtcp(data, len, sender, muxed);
+            });
+        }
+        portManager.setReceiveBatch(static_cast<size_t>(recvBatch));
+
+        std::vector<std::unique_ptr<boost::asio::io_context>> workerContexts;
+        ReuseportSteering steering;
+
+        if (singlePort) {
+            int listenPort = config.getInt("RTP", "listen_port", portStart);
+            uint16_t port = static_cast<uint16_t>(listenPort);
+            bool perWorkerContext = steerBySsrc && listenSockets > 1;
+
+            for (int i = 0; i < listenSockets; ++i) {
+                try {
+                    boost::asio::io_context* workerContext = &io_context;
+                    if (perWorkerContext) {
+                        workerContexts.push_back(std::make_unique<boost::asio::io_context>(1));
+                        workerContext = workerContexts.back().get();
+                    }
+                    auto listener = std::make_shared<RtpListener>(*workerContext, isSrtp, srtpKey, ioBackend);
+                    listener->setReceiveBatch(static_cast<size_t>(recvBatch));
+                    listener->setBatchHandler([&handleRtp, port](ReceiveBatch& batch) {
+                        handleRtp(batch, port);
+                    });
+                    if (rtcpAgent) {
+                        listener->setRtcpHandler(handleRtcp);
+                    }
+                    // Whichever socket the kernel steers a call to continues its SRTP stream
+                    for (const auto& roc : restoredSrtpRocs(port)) {
+                        listener->restoreSrtpRoc(roc.first, roc.second);
+                    }
+                    int inheritedFd = takeInherited(SocketRole::SharedListener, port);
+                    int inheritedRtcpFd = takeInherited(SocketRole::Rtcp, port);
+                    listener->start(port, listenSockets > 1, inheritedFd, inheritedRtcpFd);
+                    sharedListeners.push_back(listener);
+                } catch (const std::exception& e) {
+                    Logger::getLogger()->warn("Port {} is unavailable: {}", port, e.what());
+                }
+            }
+
+            if (sharedListeners.empty()) {
+                Logger::getLogger()->error("No RTP listeners could be started. Exiting.");
+                return -1;
+            }
+
+            if (perWorkerContext) {
+                std::vector<int> socketFds;
+                for (auto& listener : sharedListeners) {
+                    socketFds.push_back(listener->nativeHandle());
+                }
+                std::string steeringProgram = config.get("RTP", "steering_program");
+                if (!steering.attach(socketFds, steeringProgram.empty() ? "/usr/local/share/quicrtp/rtp_reuseport.bpf.o" : steeringProgram)) {
+                    Logger::getLogger()->warn("SSRC steering unavailable, using the kernel reuseport hash");
+                }
+            }
+        } else {
+            std::vector<InheritedSocket> portListeners;
+            for (auto it = inherited.begin(); it != inherited.end();) {
+                if (it->role != SocketRole::PortListener) {
+                    ++it;
+                    continue;
+                }
+                portListeners.push_back(*it);
+                it = inherited.erase(it);
+            }
+            for (const InheritedSocket& socket : portListeners) {
+                int rtcpFd = takeInherited(SocketRole::Rtcp, socket.port);
+                if (!portManager.adoptListener(socket.port, socket.fd, rtcpFd, restoredCallKey(socket.port),
+                                               restoredSrtpRocs(socket.port))) {
+                    ::close(socket.fd);
+                }
+            }
+
+            int preallocate = config.getInt("RTP", "preallocate", 8);
+            if (!portManager.setSpareListeners(static_cast<size_t>(std::max(preallocate, 0)))) {
+                Logger::getLogger()->error("No RTP listeners could be started. Exiting.");
+                return -1;
+            }
         }
 
         // Initialize QUIC client
         auto quicClient = std::make_shared<QuicClient>(quicServerIp, static_cast<uint16_t>(quicServerPort));
+        std::string quicTransport = config.get("QUIC", "transport");
+        if (quicTransport == "datagram") {
+            quicClient->setTransport(QuicClient::Transport::Datagram);
+        } else if (!quicTransport.empty() && quicTransport != "stream") {
+            Logger::getLogger()->warn("Unknown QUIC transport '{}', using streams", quicTransport);
+        }
+        if (config.getBool("QUIC", "fec")) {
+            quicClient->setFec(true, config.getBool("QUIC", "fec_adaptive"),
+                               static_cast<size_t>(std::max(config.getInt("QUIC", "fec_group_size", 8), 1)),
+                               static_cast<size_t>(std::max(config.getInt("QUIC", "fec_repair_count", 1), 0)),
+                               config.getInt("QUIC", "fec_max_delay_ms", 60));
+        }
+        if (config.getBool("QUIC", "datagram_fragmentation")) {
+            quicClient->setFragmentation(true, config.getInt("QUIC", "fragment_timeout_ms", 100));
+        }
+        quicClient->setQueueLimits(initial.sendQueueLimit, initial.sessionQueueLimit, initial.dropPolicy);
+        for (size_t tenant = 0; tenant < tenants.size(); ++tenant) {
+            quicClient->setTenantRate(static_cast<uint16_t>(tenant), tenants.rate(static_cast<uint16_t>(tenant)));
+        }
         if (!quicClient->initialize()) {
             Logger::getLogger()->error("Failed to initialize QUIC client");
             return -1;
@@ -157,19 +596,90 @@ int main(int argc, char* argv[]) {
         quicClient->start();
 
         // Set up the translator handlers
-        translator.setRtpToQuicHandler([quicClient](const uint8_t* data, size_t len) {
-            quicClient->sendData(data, len);
+        translator.setHeaderCompression(config.getBool("QUIC", "header_compression"),
+                                        static_cast<uint32_t>(std::max(config.getInt("QUIC", "compression_refresh", 32), 1)));
+        translator.setMediaClassifier(initial.classifier);
+        if (config.getBool("QUIC", "silence_suppression")) {
+            translator.setSilenceSuppression(true, config.getList("QUIC", "cn_payload_types"), config.getList("QUIC", "silence_signatures"),
+                                             config.getInt("QUIC", "silence_keepalive_ms", 500));
+        }
+        translator.setRtpToQuicHandler([quicClient](PacketBuffer packet, const SendInfo& info) {
+            quicClient->sendData(std::move(packet), info);
         });
 
         quicClient->setDataHandler([&](const uint8_t* data, size_t len) {
+            if (capture.isOpen()) {
+                capture.record(CaptureKind::QuicIngress, data, len);
+            }
             translator.translateQuicToRtp(data, len);
         });
 
-        translator.setQuicToRtpHandler([&](const uint8_t* data, size_t len) {
+        // Downlink RTP leaves through one shared socket on the same IO backend
+        auto downlinkIo = createUdpIo(ioBackend, io_context, static_cast<size_t>(recvBatch));
+        int downlinkFd = takeInherited(SocketRole::Downlink, 0);
+        if (downlinkFd >= 0) {
+            downlinkIo->adopt(downlinkFd, 0);
+        } else {
+            downlinkIo->open(0, false);
+        }
+
+        // Sockets the new configuration has no use for
+        for (const InheritedSocket& socket : inherited) {
+            Logger::getLogger()->warn("Closing unused inherited socket for port {}", socket.port);
+            ::close(socket.fd);
+        }
+        inherited.clear();
+
+        translator.setQuicToRtpHandler([&](const uint8_t* header, size_t headerLen, const uint8_t* payload, size_t payloadLen) {
             // Implement sending data back to RTP endpoints if necessary
             // Retrieve SSRC from RTP header to find the destination
-            if (len >= 12) {
-                uint32_t ssrc = (data[8] << 24) | (data[9] << 16) | (data[10] << 8) | data[11];
+            if (headerLen >= 12) {
+                uint32_t ssrc = (header[8] << 24) | (header[9] << 16) | (header[10] << 8) | header[11];
+                auto headerBuffer = boost::asio::buffer(header, headerLen);
+                auto payloadBuffer = boost::asio::buffer(payload, payloadLen);
+
+                // Local sessions reply from the port the call arrived on; the
+                // packet counts towards both the QUIC leg and the endpoint leg
+                RtpArrival arrival;
+                arrival.sequenceNumber = static_cast<uint16_t>((header[2] << 8) | header[3]);
+                arrival.timestamp = (static_cast<uint32_t>(header[4]) << 24) | (header[5] << 16) | (header[6] << 8) | header[7];
+                arrival.time = std::chrono::steady_clock::now();
+                {
+                    ConfigStore::ReadGuard runtime(configStore);
+                    arrival.clockRate = runtime->classifier.clockRate(header[1]);
+                }
+                boost::asio::ip::udp::endpoint destination;
+                uint16_t localPort = 0;
+                if (sessionManager.recordDownlink(ssrc, arrival, header, headerLen, payload, payloadLen, destination, localPort)) {
+                    // Calls forwarded here by another node are answered through it
+                    boost::asio::ip::udp::endpoint ingress;
+                    if (cluster && cluster->ingressOf(ssrc, ingress)) {
+                        if (headerLen > CLUSTER_REPLY_MAX_HEADER) {
+                            Logger::getLogger()->debug("RTP header of SSRC {} is too long to reply through {}", ssrc, ingress.address().to_string());
+                            return;
+                        }
+                        uint8_t replyHeader[CLUSTER_FORWARD_HEADER_SIZE + CLUSTER_REPLY_MAX_HEADER];
+                        size_t replyLen = ClusterManager::encodeReply(destination, localPort, replyHeader);
+                        std::memcpy(replyHeader + replyLen, header, headerLen);
+                        forwardIo->sendTo(boost::asio::buffer(replyHeader, replyLen + headerLen), payloadBuffer, ingress);
+                        QUICRTP_PROBE4(downlink_send, ssrc, arrival.sequenceNumber, headerLen + payloadLen, localPort);
+                        return;
+                    }
+                    std::shared_ptr<RtpListener> listener;
+                    if (singlePort) {
+                        listener = sharedListeners.empty() ? nullptr : sharedListeners.front();
+                    } else {
+                        listener = portManager.findListener(localPort);
+                    }
+                    if (listener) {
+                        listener->sendTo(headerBuffer, payloadBuffer, destination);
+                        QUICRTP_PROBE4(downlink_send, ssrc, arrival.sequenceNumber, headerLen + payloadLen, localPort);
+                        if (accounting) {
+                            accounting->record(localPort, TrafficDirection::Egress, headerLen + payloadLen);
+                        }
+                        return;
+                    }
+                }
 
                 // Retrieve the endpoint from cache
                 std::string endpointStr = cacheManager.get(std::to_string(ssrc));
@@ -180,13 +690,14 @@ int main(int argc, char* argv[]) {
                         std::string ipStr = endpointStr.substr(0, colonPos);
                         uint16_t port = static_cast<uint16_t>(std::stoi(endpointStr.substr(colonPos + 1)));
 
-                        // Create a socket and send the RTP packet
-                        boost::asio::ip::udp::socket socket(io_context);
+                        // Send the RTP packet
                         boost::asio::ip::udp::endpoint destination(boost::asio::ip::address::from_string(ipStr), port);
-
-                        socket.open(boost::asio::ip::udp::v4());
-                        socket.send_to(boost::asio::buffer(data, len), destination);
-                        socket.close();
+                        downlinkIo->sendTo(headerBuffer, payloadBuffer, destination);
+                        QUICRTP_PROBE4(downlink_send, ssrc, arrival.sequenceNumber, headerLen + payloadLen, 0);
+                        // The local port is unknown here: default tenant
+                        if (accounting) {
+                            accounting->record(0, TrafficDirection::Egress, headerLen + payloadLen);
+                        }
 
                         Logger::getLogger()->debug("Sent RTP packet to {}:{}", ipStr, port);
                     } else {
@@ -200,38 +711,337 @@ int main(int argc, char* argv[]) {
             }
         });
 
-        // Run the IO context in a separate thread
-        std::thread ioThread([&io_context]() {
-            try {
-                io_context.run();
-            } catch (const std::exception& e) {
-                Logger::getLogger()->error("IO context error: {}", e.what());
+        if (rtcpAgent) {
+            rtcpAgent->setSender([&](uint16_t localPort, const uint8_t* data, size_t len,
+                                     const boost::asio::ip::udp::endpoint& destination, bool muxed) {
+                std::shared_ptr<RtpListener> listener;
+                if (singlePort) {
+                    listener = sharedListeners.empty() ? nullptr : sharedListeners.front();
+                } else {
+                    listener = portManager.findListener(localPort);
+                }
+                if (listener) {
+                    listener->sendRtcp(data, len, destination, muxed);
+                }
+            });
+            int nackCacheMs = config.getInt("RTCP", "nack_cache_ms", 0);
+            if (nackCacheMs > 0) {
+                rtcpAgent->setRetransmitter([&](uint16_t localPort, const uint8_t* data, size_t len,
+                                                const boost::asio::ip::udp::endpoint& destination) {
+                    std::shared_ptr<RtpListener> listener;
+                    if (singlePort) {
+                        listener = sharedListeners.empty() ? nullptr : sharedListeners.front();
+                    } else {
+                        listener = portManager.findListener(localPort);
+                    }
+                    if (listener) {
+                        listener->sendTo(data, len, destination);
+                        if (accounting) {
+                            accounting->record(localPort, TrafficDirection::Egress, len);
+                        }
+                    }
+                }, std::chrono::milliseconds(nackCacheMs));
             }
-        });
+            rtcpAgent->start(std::chrono::seconds(config.getInt("RTCP", "report_interval_s", 5)));
+        }
+
+        // Keep run() alive while no listener is open yet
+        auto workGuard = boost::asio::make_work_guard(io_context);
+
+        // Run the IO context in separate threads; more than one lets the
+        // SO_REUSEPORT sockets of single-port mode be served in parallel
+        int ioThreadCount = config.getInt("RTP", "io_threads", 1);
+        std::vector<std::thread> ioThreads;
+        for (int i = 0; i < std::max(ioThreadCount, 1); ++i) {
+            ioThreads.emplace_back([&io_context]() {
+                try {
+                    io_context.run();
+                } catch (const std::exception& e) {
+                    Logger::getLogger()->error("IO context error: {}", e.what());
+                }
+            });
+        }
+
+        // One thread per SSRC-steered worker, optionally pinned to its own core
+        bool pinWorkers = config.getBool("RTP", "pin_workers");
+        std::vector<boost::asio::executor_work_guard<boost::asio::io_context::executor_type>> workerGuards;
+        for (size_t i = 0; i < workerContexts.size(); ++i) {
+            boost::asio::io_context& workerContext = *workerContexts[i];
+            workerGuards.push_back(boost::asio::make_work_guard(workerContext));
+            ioThreads.emplace_back([&workerContext]() {
+                try {
+                    workerContext.run();
+                } catch (const std::exception& e) {
+                    Logger::getLogger()->error("Worker IO context error: {}", e.what());
+                }
+            });
+            if (pinWorkers) {
+                cpu_set_t cpus;
+                CPU_ZERO(&cpus);
+                CPU_SET(i % std::max(std::thread::hardware_concurrency(), 1u), &cpus);
+                pthread_setaffinity_np(ioThreads.back().native_handle(), sizeof(cpus), &cpus);
+            }
+        }
 
         // Signal handling for graceful shutdown
         std::signal(SIGINT, signal_handler);
         std::signal(SIGTERM, signal_handler);
 
+        // Now that the inherited sockets are served here, let the old
+        // process stop; its final snapshot covers the sessions it set up
+        // in the meantime
+        if (upgrade) {
+            if (upgradeClient.ready(handoffTimeout)) {
+                restoreSnapshot();
+                restoreAttachments();
+            } else {
+                Logger::getLogger()->warn("Previous process did not confirm the handoff");
+            }
+            upgradeClient.close();
+        }
+
+        // Local control API for call setup; taken over from the previous
+        // process by binding its path again
+        std::unique_ptr<ControlServer> control;
+        if (config.getBool("Control", "enable")) {
+            control = std::make_unique<ControlServer>(sessionManager, singlePort ? nullptr : &portManager, tenants);
+            // Provisioned calls are held to the same admission control as
+            // the ones set up by their first packet
+            control->setAdmissionCheck([&]() {
+                ConfigStore::ReadGuard runtime(configStore);
+                if (runtime->admissionEnabled && admission.overloaded()) {
+                    admission.refuse();
+                    return true;
+                }
+                return false;
+            });
+            control->setSessionEndedHandler([&](uint32_t ssrc) {
+                translator.removeStream(ssrc);
+                if (cluster) {
+                    cluster->release(ssrc);
+                }
+            });
+            std::string controlSocket = config.get("Control", "socket");
+            if (control->listen(controlSocket.empty() ? "/run/quicrtp/control.sock" : controlSocket)) {
+                control->start();
+            }
+        }
+
+        UpgradeServer upgradeServer;
+        if (upgradeEnabled) {
+            upgradeServer.listen(upgradeSocket);
+        }
+        auto handoffSockets = [&]() {
+            std::vector<InheritedSocket> sockets;
+            for (auto& listener : sharedListeners) {
+                sockets.push_back(InheritedSocket{SocketRole::SharedListener, listener->port(), listener->nativeHandle()});
+                if (listener->nativeRtcpHandle() >= 0) {
+                    sockets.push_back(InheritedSocket{SocketRole::Rtcp, listener->port(), listener->nativeRtcpHandle()});
+                }
+            }
+            for (const auto& entry : portManager.listenerSockets()) {
+                sockets.push_back(InheritedSocket{SocketRole::PortListener, entry.port, entry.fd});
+                if (entry.rtcpFd >= 0) {
+                    sockets.push_back(InheritedSocket{SocketRole::Rtcp, entry.port, entry.rtcpFd});
+                }
+            }
+            sockets.push_back(InheritedSocket{SocketRole::Downlink, 0, downlinkIo->nativeHandle()});
+            if (forwardIo) {
+                sockets.push_back(InheritedSocket{SocketRole::Forward, forwardPort, forwardIo->nativeHandle()});
+            }
+            return sockets;
+        };
+        // Everything a successor needs to carry the calls on
+        auto snapshotState = [&]() {
+            UpgradeState state;
+            state.sessions = sessionManager.exportSessions();
+            for (const auto& session : state.sessions) {
+                uint32_t roc = 0;
+                if (singlePort) {
+                    for (auto& listener : sharedListeners) {
+                        if (listener->srtpRoc(session.first, roc)) {
+                            state.srtpRocs[session.first] = roc;
+                            break;
+                        }
+                    }
+                } else {
+                    auto listener = portManager.findListener(session.second.localPort);
+                    if (listener && listener->srtpRoc(session.first, roc)) {
+                        state.srtpRocs[session.first] = roc;
+                    }
+                }
+            }
+            std::map<uint16_t, UpgradePort> ports;
+            for (const auto& entry : portManager.listenerSockets()) {
+                if (!entry.callKey.empty()) {
+                    ports[entry.port].port = entry.port;
+                    ports[entry.port].callKey = entry.callKey;
+                }
+            }
+            for (uint32_t port = 1; port <= 0xFFFF; ++port) {
+                uint16_t tenant = tenants.attachedTenant(static_cast<uint16_t>(port));
+                if (tenant != NO_TENANT) {
+                    ports[static_cast<uint16_t>(port)].port = static_cast<uint16_t>(port);
+                    ports[static_cast<uint16_t>(port)].tenant = tenants.id(tenant);
+                }
+            }
+            for (auto& entry : ports) {
+                state.ports.push_back(entry.second);
+            }
+            state.translator = translator.saveState();
+            return state;
+        };
+
+        // Apply reloaded settings to the running components
+        configStore.onChange([&](const RuntimeConfig& previous, const RuntimeConfig& next) {
+            if (next.logLevel != previous.logLevel) {
+                applyLogLevel(next.logLevel);
+            }
+            if (next.portStart != previous.portStart || next.portEnd != previous.portEnd) {
+                try {
+                    portManager.setPortRange(next.portStart, next.portEnd);
+                } catch (const std::exception& e) {
+                    Logger::getLogger()->error("RTP port range not changed: {}", e.what());
+                }
+            }
+            if (next.srtp != previous.srtp) {
+                std::string key;
+                if (!next.srtp || loadSrtpKey(key)) {
+                    portManager.setSrtp(next.srtp, key);
+                }
+            }
+            admission.setThresholds(next.maxUtilization, next.maxQueueDepth);
+            quicClient->setQueueLimits(next.sendQueueLimit, next.sessionQueueLimit, next.dropPolicy);
+            translator.setMediaClassifier(next.classifier);
+
+            // Rates of the tenants known since startup; new tenants and port
+            // ranges need a restart
+            if (next.source.get("Tenants", "tenant_rates") != previous.source.get("Tenants", "tenant_rates")) {
+                TenantDirectory reloaded;
+                loadTenants(next.source, reloaded);
+                for (size_t tenant = 0; tenant < tenants.size(); ++tenant) {
+                    uint16_t index = reloaded.find(tenants.id(static_cast<uint16_t>(tenant)));
+                    quicClient->setTenantRate(static_cast<uint16_t>(tenant), index != NO_TENANT ? reloaded.rate(index) : TenantRate());
+                }
+            }
+        });
+        std::signal(SIGHUP, reload_handler);
+        configStore.watch();
+
+        // Calls end when no packet has passed in either direction for
+        // session_timeout_s; their ports are released in per-port mode
+        std::chrono::seconds sessionTimeout(std::max(config.getInt("RTP", "session_timeout_s", 60), 0));
+        auto expireSessions = [&]() {
+            auto now = std::chrono::steady_clock::now();
+            auto expired = sessionManager.expireSessions(now, sessionTimeout);
+            for (const auto& session : expired) {
+                Logger::getLogger()->debug("Session for SSRC {} on port {} timed out", session.first, session.second.localPort);
+                translator.removeStream(session.first);
+                if (cluster) {
+                    cluster->release(session.first);
+                }
+            }
+            // Ports of calls forwarded to other nodes carry their replies
+            std::unordered_set<uint16_t> inUse;
+            if (cluster) {
+                cluster->forwardedPorts(now, sessionTimeout, inUse);
+            }
+            if (!singlePort) {
+                sessionManager.forEachSession([&inUse](uint32_t, SessionInfo& info) {
+                    inUse.insert(info.localPort);
+                });
+                portManager.releaseIdle(inUse, now, sessionTimeout);
+            }
+        };
+
         // Keep the main thread running
         Logger::getLogger()->info("Translator is running...");
+        bool handedOff = false;
         while (running.load()) {
-            std::this_thread::sleep_for(std::chrono::seconds(1));
+            if (reloadRequested.exchange(false) || configStore.changed()) {
+                configStore.reload();
+            }
+            if (sessionTimeout.count() > 0) {
+                expireSessions();
+            }
+            {
+                ConfigStore::ReadGuard runtime(configStore);
+                if (runtime->admissionEnabled) {
+                    admission.update(std::chrono::steady_clock::now(), ioThreads.size(), quicClient->queuedPackets());
+                }
+            }
+            configStore.reclaim();
+            if (!upgradeServer.waitForRequest(std::chrono::seconds(1))) {
+                continue;
+            }
+            if (!UpgradeSnapshot::write(snapshotPath, snapshotState())) {
+                continue;
+            }
+            if (upgradeServer.sendSockets(handoffSockets()) && upgradeServer.waitForReady(handoffTimeout)) {
+                handedOff = true;
+                break;
+            }
         }
 
         // Clean up
         Logger::getLogger()->info("Shutting down...");
+        if (config.getBool("QUIC", "silence_suppression")) {
+            Logger::getLogger()->info("Silence suppression kept {} uplink packets off QUIC", translator.suppressedPackets());
+        }
 
         io_context.stop();
-        if (ioThread.joinable()) {
-            ioThread.join();
+        for (auto& workerContext : workerContexts) {
+            workerContext->stop();
+        }
+        for (auto& ioThread : ioThreads) {
+            if (ioThread.joinable()) {
+                ioThread.join();
+            }
         }
 
+        // The new process is serving the shared sockets; hand it the final
+        // state now that nothing here changes it
+        if (handedOff) {
+            UpgradeSnapshot::write(snapshotPath, snapshotState());
+            upgradeServer.finish();
+        }
+
+        // After a handoff the node stays registered under the new process
+        if (cluster) {
+            cluster->stop(!handedOff);
+            forwardIo->close();
+        }
+        if (control) {
+            control->stop(!handedOff);
+            Logger::getLogger()->info("Control API handled {} requests", control->handledRequests());
+        }
         quicClient->stop();
+        if (config.getBool("QUIC", "datagram_fragmentation")) {
+            Logger::getLogger()->info("Datagram fragmentation: {} messages sent in fragments, {} reassembled",
+                                      quicClient->fragmentedMessages(), quicClient->reassembledMessages());
+        }
+        if (rtcpAgent) {
+            rtcpAgent->stop();
+        }
+        if (accounting) {
+            accounting->stop();
+        }
+        capture.close();
+        downlinkIo->close();
+        if (xdpEngine) {
+            XdpEngine::setActive(nullptr);
+            xdpEngine->shutdown();
+        }
 
-        for (auto& listener : rtpListeners) {
+        portManager.stopAll();
+        // The reuseport group now carries the new process's steering program
+        if (!handedOff) {
+            steering.detach();
+        }
+        for (auto& listener : sharedListeners) {
             listener->stop();
         }
+        upgradeServer.close(!handedOff);
 
     } catch (const std::exception& e) {
         Logger::getLogger()->error("Application error: {}", e.what());
@@ -0,0 +1,49 @@
+/*
+ * Copyright 2024 nrjchnd@gmail.com
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     https://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an **"AS IS" BASIS,**
+ * **WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.**
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "nack_cache.h"
+#include <algorithm>
+
+NackCache::NackCache(size_t slots) {
+    size_t capacity = 1;
+    while (capacity < std::min<size_t>(std::max<size_t>(slots, 1), 1 << 15)) {
+        capacity <<= 1;
+    }
+    slots_.resize(capacity);
+    mask_ = capacity - 1;
+    bytes_ = sizeof(*this) + capacity * sizeof(Slot);
+}
+
+void NackCache::store(uint16_t sequenceNumber, const uint8_t* header, size_t headerLen, const uint8_t* payload, size_t payloadLen,
+                      std::chrono::steady_clock::time_point now) {
+    Slot& slot = slots_[sequenceNumber & mask_];
+    slot.used = true;
+    slot.sequenceNumber = sequenceNumber;
+    slot.sent = now;
+    size_t capacity = slot.packet.capacity();
+    slot.packet.assign(header, header + headerLen);
+    slot.packet.insert(slot.packet.end(), payload, payload + payloadLen);
+    bytes_ += slot.packet.capacity() - capacity;
+}
+
+const std::vector<uint8_t>* NackCache::find(uint16_t sequenceNumber, std::chrono::steady_clock::time_point now,
+                                            std::chrono::milliseconds maxAge) const {
+    const Slot& slot = slots_[sequenceNumber & mask_];
+    if (!slot.used || slot.sequenceNumber != sequenceNumber || now - slot.sent > maxAge) {
+        return nullptr;
+    }
+    return &slot.packet;
+}
@@ -0,0 +1,55 @@
+/*
+ * Copyright 2024 nrjchnd@gmail.com
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     https://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an **"AS IS" BASIS,**
+ * **WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.**
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#ifndef NACK_CACHE_H
+#define NACK_CACHE_H
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+// Recent downlink packets of one session, so NACKs (RFC 4585) from the
+// endpoint are answered on the local leg rather than across QUIC. A fixed
+// ring of slots indexed by the low bits of the sequence number bounds the
+// memory; slot buffers keep their capacity, so once warm a store is a copy.
+// bytes() is what the cache holds, for a budget across sessions.
+class NackCache {
+public:
+    // slots is rounded up to a power of two
+    explicit NackCache(size_t slots);
+
+    void store(uint16_t sequenceNumber, const uint8_t* header, size_t headerLen, const uint8_t* payload, size_t payloadLen,
+               std::chrono::steady_clock::time_point now);
+    // The packet, or null when it has been overwritten or is older than maxAge
+    const std::vector<uint8_t>* find(uint16_t sequenceNumber, std::chrono::steady_clock::time_point now,
+                                     std::chrono::milliseconds maxAge) const;
+
+    size_t bytes() const { return bytes_; }
+
+private:
+    struct Slot {
+        bool used = false;
+        uint16_t sequenceNumber = 0;
+        std::chrono::steady_clock::time_point sent;
+        std::vector<uint8_t> packet;
+    };
+
+    std::vector<Slot> slots_;
+    size_t mask_;
+    size_t bytes_;
+};
+
+#endif // NACK_CACHE_H
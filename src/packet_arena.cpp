@@ -0,0 +1,315 @@
+/*
+ * Copyright 2024 nrjchnd@gmail.com
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     https://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an **"AS IS" BASIS,**
+ * **WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.**
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "packet_arena.h"
+#include "logger.h"
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+#include <sched.h>
+#include <sys/mman.h>
+
+#ifdef QUICRTP_HAVE_NUMA
+#include <numa.h>
+#endif
+
+#ifndef MAP_HUGE_2MB
+#define MAP_HUGE_2MB (21 << 26)
+#endif
+
+static_assert(sizeof(PacketSlab) == 64, "PacketSlab header must stay one cache line");
+
+// Slabs never straddle a huge page, so a packet costs at most one TLB entry
+const size_t HUGE_PAGE_SIZE = 2 * 1024 * 1024;
+// Slabs moved between a worker cache and its node pool at a time
+const size_t CACHE_BATCH = 64;
+// Local free-list length above which a cache gives slabs back to the pool
+const size_t CACHE_LIMIT = 512;
+// Buffers per node when the configuration leaves the size at 0
+const size_t DEFAULT_BUFFERS_PER_NODE = 16384;
+
+namespace {
+thread_local PacketCache* threadCache = nullptr;
+}
+
+std::atomic<PacketArena*> PacketArena::instance_(nullptr);
+std::mutex PacketArena::instanceMutex_;
+
+PacketBuffer& PacketBuffer::operator=(PacketBuffer&& other) noexcept {
+    if (this != &other) {
+        if (slab_) {
+            PacketArena::instance().release(slab_);
+        }
+        slab_ = other.slab_;
+        other.slab_ = nullptr;
+    }
+    return *this;
+}
+
+PacketBuffer::~PacketBuffer() {
+    if (slab_) {
+        PacketArena::instance().release(slab_);
+    }
+}
+
+bool PacketBuffer::setSize(size_t len) {
+    if (slab_->offset + len > PACKET_HEADROOM + PACKET_CAPACITY) {
+        return false;
+    }
+    slab_->length = static_cast<uint32_t>(len);
+    return true;
+}
+
+uint8_t* PacketBuffer::prepend(size_t len) {
+    if (len > slab_->offset) {
+        return nullptr;
+    }
+    slab_->offset -= static_cast<uint32_t>(len);
+    slab_->length += static_cast<uint32_t>(len);
+    return data();
+}
+
+void PacketBuffer::reset() {
+    slab_->offset = PACKET_HEADROOM;
+    slab_->length = 0;
+}
+
+PacketSlab* PacketBuffer::detach() {
+    PacketSlab* slab = slab_;
+    slab_ = nullptr;
+    return slab;
+}
+
+void PacketArena::init(size_t buffersPerNode, bool hugePages, bool numaAware) {
+    std::lock_guard<std::mutex> lock(instanceMutex_);
+    if (instance_.load(std::memory_order_relaxed)) {
+        // Buffers already handed out belong to the existing pools
+        Logger::getLogger()->warn("Packet arena already in use, keeping its pools");
+        return;
+    }
+    instance_.store(new PacketArena(buffersPerNode, hugePages, numaAware), std::memory_order_release);
+}
+
+PacketArena& PacketArena::instance() {
+    PacketArena* arena = instance_.load(std::memory_order_acquire);
+    if (!arena) {
+        std::lock_guard<std::mutex> lock(instanceMutex_);
+        arena = instance_.load(std::memory_order_relaxed);
+        if (!arena) {
+            arena = new PacketArena(0, false, false);
+            instance_.store(arena, std::memory_order_release);
+        }
+    }
+    return *arena;
+}
+
+PacketArena::PacketArena(size_t buffersPerNode, bool hugePages, bool numaAware)
+    : buffersPerNode_(buffersPerNode > 0 ? buffersPerNode : DEFAULT_BUFFERS_PER_NODE), hugePages_(hugePages), numaAware_(numaAware), exhaustionReported_(false)
+{
+    size_t nodes = 1;
+#ifdef QUICRTP_HAVE_NUMA
+    if (numaAware_ && numa_available() >= 0) {
+        nodes = static_cast<size_t>(numa_max_node() + 1);
+    } else {
+        numaAware_ = false;
+    }
+#else
+    numaAware_ = false;
+#endif
+    pools_.resize(nodes);
+
+    Logger::getLogger()->info("Packet arena: {} buffers of {} bytes per node, {} node(s)",
+                              buffersPerNode_, PACKET_CAPACITY, nodes);
+}
+
+PacketArena::~PacketArena() {
+    for (auto& pool : pools_) {
+        if (pool && pool->area) {
+            ::munmap(pool->area, pool->areaSize);
+        }
+    }
+}
+
+PacketBuffer PacketArena::allocate() {
+    PacketCache* cache = currentCache();
+    if (!cache->local_) {
+        // Slabs other threads gave back first, then the node pool
+        PacketSlab* returned = cache->remote_.exchange(nullptr, std::memory_order_acquire);
+        for (PacketSlab* s = returned; s; s = s->next) {
+            ++cache->localCount_;
+        }
+        cache->local_ = returned;
+        if (!cache->local_) {
+            refill(cache);
+        }
+    }
+    PacketSlab* slab = cache->local_;
+    if (slab) {
+        cache->local_ = slab->next;
+        --cache->localCount_;
+    } else if (!exhaustionReported_.exchange(true)) {
+        Logger::getLogger()->warn("Packet arena exhausted on node {}, allocating from the heap", cache->node_);
+    }
+
+    if (!slab) {
+        slab = allocateHeap();
+    }
+    slab->next = nullptr;
+    slab->offset = PACKET_HEADROOM;
+    slab->length = 0;
+    return PacketBuffer(slab);
+}
+
+void PacketArena::release(PacketSlab* slab) {
+    PacketCache* owner = slab->owner;
+    if (!owner) {
+        std::free(slab);
+        return;
+    }
+
+    if (owner == threadCache) {
+        slab->next = owner->local_;
+        owner->local_ = slab;
+        if (++owner->localCount_ > CACHE_LIMIT) {
+            spill(owner);
+        }
+        return;
+    }
+
+    // Cross-thread return: push onto the owner's stack, drained on its next miss
+    PacketSlab* head = owner->remote_.load(std::memory_order_relaxed);
+    do {
+        slab->next = head;
+    } while (!owner->remote_.compare_exchange_weak(head, slab, std::memory_order_release, std::memory_order_relaxed));
+}
+
+PacketCache* PacketArena::currentCache() {
+    if (threadCache) {
+        return threadCache;
+    }
+
+    int node = 0;
+#ifdef QUICRTP_HAVE_NUMA
+    if (numaAware_) {
+        int cpu = sched_getcpu();
+        node = cpu >= 0 ? numa_node_of_cpu(cpu) : 0;
+        if (node < 0 || static_cast<size_t>(node) >= pools_.size()) {
+            node = 0;
+        }
+    }
+#endif
+
+    std::lock_guard<std::mutex> lock(poolsMutex_);
+    if (!pools_[node]) {
+        pools_[node].reset(new NodePool());
+        createPool(*pools_[node], node);
+    }
+    caches_.push_back(std::make_unique<PacketCache>(node));
+    threadCache = caches_.back().get();
+    return threadCache;
+}
+
+void PacketArena::createPool(NodePool& pool, int node) {
+    pool.area = nullptr;
+    pool.areaSize = 0;
+    pool.hugePages = false;
+    pool.free = nullptr;
+    pool.freeCount = 0;
+
+    size_t slabsPerPage = HUGE_PAGE_SIZE / SLAB_SIZE;
+    size_t pages = (buffersPerNode_ + slabsPerPage - 1) / slabsPerPage;
+    size_t size = pages * HUGE_PAGE_SIZE;
+
+    void* area = MAP_FAILED;
+    if (hugePages_) {
+        area = ::mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | MAP_HUGE_2MB, -1, 0);
+        pool.hugePages = (area != MAP_FAILED);
+    }
+    if (area == MAP_FAILED) {
+        area = ::mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (area == MAP_FAILED) {
+            Logger::getLogger()->error("Packet arena: cannot map {} bytes for node {}: {}", size, node, std::strerror(errno));
+            return;
+        }
+        if (hugePages_) {
+            // No reserved huge pages; transparent huge pages are the next best thing
+            ::madvise(area, size, MADV_HUGEPAGE);
+        }
+    }
+
+#ifdef QUICRTP_HAVE_NUMA
+    if (numaAware_) {
+        numa_tonode_memory(area, size, node);
+    }
+#endif
+
+    pool.area = area;
+    pool.areaSize = size;
+
+    // Carving the slabs faults the pages in, on the node they are bound to
+    uint8_t* base = static_cast<uint8_t*>(area);
+    for (size_t page = pages; page-- > 0;) {
+        for (size_t i = slabsPerPage; i-- > 0;) {
+            auto* slab = reinterpret_cast<PacketSlab*>(base + page * HUGE_PAGE_SIZE + i * SLAB_SIZE);
+            slab->owner = nullptr;
+            slab->node = node;
+            slab->next = pool.free;
+            pool.free = slab;
+            ++pool.freeCount;
+        }
+    }
+
+    Logger::getLogger()->info("Packet arena: node {} pool of {} buffers in {} {} page(s)",
+                              node, pool.freeCount, pages, pool.hugePages ? "huge" : "regular 2 MB");
+}
+
+void PacketArena::refill(PacketCache* cache) {
+    NodePool& pool = *pools_[cache->node_];
+    std::lock_guard<std::mutex> lock(pool.mutex);
+    for (size_t i = 0; i < CACHE_BATCH && pool.free; ++i) {
+        PacketSlab* slab = pool.free;
+        pool.free = slab->next;
+        --pool.freeCount;
+        slab->owner = cache;
+        slab->next = cache->local_;
+        cache->local_ = slab;
+        ++cache->localCount_;
+    }
+}
+
+void PacketArena::spill(PacketCache* cache) {
+    NodePool& pool = *pools_[cache->node_];
+    std::lock_guard<std::mutex> lock(pool.mutex);
+    while (cache->localCount_ > CACHE_LIMIT / 2) {
+        PacketSlab* slab = cache->local_;
+        cache->local_ = slab->next;
+        --cache->localCount_;
+        slab->next = pool.free;
+        pool.free = slab;
+        ++pool.freeCount;
+    }
+}
+
+PacketSlab* PacketArena::allocateHeap() {
+    auto* slab = static_cast<PacketSlab*>(std::aligned_alloc(64, SLAB_SIZE));
+    if (!slab) {
+        throw std::bad_alloc();
+    }
+    slab->owner = nullptr;
+    slab->node = -1;
+    return slab;
+}
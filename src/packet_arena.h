@@ -0,0 +1,157 @@
+/*
+ * Copyright 2024 nrjchnd@gmail.com
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     https://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an **"AS IS" BASIS,**
+ * **WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.**
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#ifndef PACKET_ARENA_H
+#define PACKET_ARENA_H
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+// Bytes in front of the packet data for prepending RTP or framing headers
+const size_t PACKET_HEADROOM = 128;
+// Largest packet a slab holds (after the headroom)
+const size_t PACKET_CAPACITY = 2048;
+
+class PacketCache;
+
+// Fixed-size slab header; the headroom and data follow it directly.
+struct PacketSlab {
+    PacketSlab* next;       // free-list link
+    PacketCache* owner;     // cache the slab returns to, null for heap slabs
+    uint32_t offset;        // start of the data, relative to the end of the header
+    uint32_t length;
+    int32_t node;
+    // Space for a descriptor that has to outlive the call handing the
+    // buffer to another component (e.g. the QUIC_BUFFER given to msquic)
+    alignas(16) uint8_t scratch[32];
+
+    uint8_t* base() { return reinterpret_cast<uint8_t*>(this + 1); }
+};
+
+// Owning handle to one slab. Move-only; the slab goes back to the cache of
+// the worker that allocated it when the handle is destroyed, from any thread.
+class PacketBuffer {
+public:
+    PacketBuffer() : slab_(nullptr) {}
+    explicit PacketBuffer(PacketSlab* slab) : slab_(slab) {}
+    PacketBuffer(PacketBuffer&& other) noexcept : slab_(other.slab_) { other.slab_ = nullptr; }
+    PacketBuffer& operator=(PacketBuffer&& other) noexcept;
+    PacketBuffer(const PacketBuffer&) = delete;
+    PacketBuffer& operator=(const PacketBuffer&) = delete;
+    ~PacketBuffer();
+
+    explicit operator bool() const { return slab_ != nullptr; }
+
+    uint8_t* data() { return slab_->base() + slab_->offset; }
+    const uint8_t* data() const { return slab_->base() + slab_->offset; }
+    size_t size() const { return slab_->length; }
+    size_t headroom() const { return slab_->offset; }
+    size_t tailroom() const { return PACKET_HEADROOM + PACKET_CAPACITY - slab_->offset - slab_->length; }
+
+    // Sets the length after writing into data(); false when it does not fit
+    bool setSize(size_t len);
+    // Grows the packet to the front by len bytes taken from the headroom and
+    // returns the new start, or null when the headroom is exhausted
+    uint8_t* prepend(size_t len);
+    // Empty packet with the full headroom in front
+    void reset();
+
+    void* scratch() { return slab_->scratch; }
+
+    // Hands the slab to a C callback context; adopt() takes it back
+    PacketSlab* detach();
+    static PacketBuffer adopt(PacketSlab* slab) { return PacketBuffer(slab); }
+
+private:
+    PacketSlab* slab_;
+};
+
+// Per-worker free list. Only the owning thread pops from it; other threads
+// give slabs back through a lock-free stack that the owner drains in one
+// exchange, so there is no ABA problem.
+class PacketCache {
+public:
+    explicit PacketCache(int node) : node_(node), local_(nullptr), localCount_(0), remote_(nullptr) {}
+
+    int node() const { return node_; }
+
+private:
+    friend class PacketArena;
+
+    int node_;
+    PacketSlab* local_;
+    size_t localCount_;
+    alignas(64) std::atomic<PacketSlab*> remote_;
+};
+
+// Packet buffer arena. Each NUMA node gets its own pool of slabs carved out
+// of 2 MB huge pages bound to that node; IO threads allocate through a
+// thread-local cache on the node they run on. Only when a pool is exhausted
+// do slabs come from the heap, so callers never have to handle a failed
+// allocation.
+class PacketArena {
+public:
+    // buffersPerNode is rounded up to fill whole 2 MB pages; 0 picks the
+    // default size. Call before the first allocation.
+    static void init(size_t buffersPerNode, bool hugePages, bool numaAware);
+    // Default-sized arena on regular pages when init() was not called
+    static PacketArena& instance();
+
+    ~PacketArena();
+
+    PacketBuffer allocate();
+    void release(PacketSlab* slab);
+
+private:
+    struct NodePool {
+        void* area;
+        size_t areaSize;
+        bool hugePages;
+        std::mutex mutex;
+        PacketSlab* free;
+        size_t freeCount;
+    };
+
+    static const size_t SLAB_SIZE = sizeof(PacketSlab) + PACKET_HEADROOM + PACKET_CAPACITY;
+
+    PacketArena(size_t buffersPerNode, bool hugePages, bool numaAware);
+
+    PacketCache* currentCache();
+    void createPool(NodePool& pool, int node);
+    void refill(PacketCache* cache);
+    void spill(PacketCache* cache);
+    PacketSlab* allocateHeap();
+
+    size_t buffersPerNode_;
+    bool hugePages_;
+    bool numaAware_;
+
+    // One entry per NUMA node, created when the first thread on that node
+    // allocates; the vector itself is never resized
+    std::mutex poolsMutex_;
+    std::vector<std::unique_ptr<NodePool>> pools_;
+    std::vector<std::unique_ptr<PacketCache>> caches_;
+    std::atomic<bool> exhaustionReported_;
+
+    // Lives for the whole process, since buffers may be released during exit
+    static std::atomic<PacketArena*> instance_;
+    static std::mutex instanceMutex_;
+};
+
+#endif // PACKET_ARENA_H
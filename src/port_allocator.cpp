@@ -0,0 +1,143 @@
+/*
+ * Copyright 2024 nrjchnd@gmail.com
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     https://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an **"AS IS" BASIS,**
+ * **WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.**
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "port_allocator.h"
+#include <stdexcept>
+
+PortAllocator::PortAllocator(uint16_t portStart, uint16_t portEnd)
+    : base_((portStart + 1u) & ~1u), slotCount_(slotCountOf(base_, portEnd)), nextUnused_(0), allocated_(0)
+{
+    inUse_.assign((slotCount_ + 63) / 64, 0);
+}
+
+uint32_t PortAllocator::slotCountOf(uint32_t base, uint16_t portEnd) {
+    // The highest usable RTP port still needs port + 1 inside the range for RTCP
+    uint32_t slotCount = portEnd > base ? (static_cast<uint32_t>(portEnd) - base + 1) / 2 : 0;
+    if (slotCount == 0) {
+        throw std::invalid_argument("RTP port range does not contain an RTP/RTCP port pair");
+    }
+    return slotCount;
+}
+
+void PortAllocator::setRange(uint16_t portStart, uint16_t portEnd) {
+    uint32_t base = (portStart + 1u) & ~1u;
+    uint32_t slotCount = slotCountOf(base, portEnd);
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    std::vector<uint32_t> inUse;
+    for (uint32_t slot = 0; slot < slotCount_; ++slot) {
+        if (testBit(slot)) {
+            inUse.push_back(base_ + slot * 2);
+        }
+    }
+
+    base_ = base;
+    slotCount_ = slotCount;
+    nextUnused_ = 0;
+    allocated_ = 0;
+    freeSlots_.clear();
+    inUse_.assign((slotCount_ + 63) / 64, 0);
+    for (uint32_t port : inUse) {
+        uint32_t slot;
+        if (slotFromPort(static_cast<uint16_t>(port), slot)) {
+            setBit(slot);
+            ++allocated_;
+        }
+    }
+}
+
+uint16_t PortAllocator::allocate() {
+    std::lock_guard<std::mutex> lock(mutex_);
+
+    // Reuse recently released slots first
+    while (!freeSlots_.empty()) {
+        uint32_t slot = freeSlots_.back();
+        freeSlots_.pop_back();
+        if (!testBit(slot)) {
+            setBit(slot);
+            ++allocated_;
+            return static_cast<uint16_t>(base_ + slot * 2);
+        }
+    }
+
+    // Otherwise advance the cursor over slots claimed through reserve()
+    while (nextUnused_ < slotCount_) {
+        uint32_t slot = nextUnused_++;
+        if (!testBit(slot)) {
+            setBit(slot);
+            ++allocated_;
+            return static_cast<uint16_t>(base_ + slot * 2);
+        }
+    }
+
+    return 0;
+}
+
+bool PortAllocator::reserve(uint16_t port) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    uint32_t slot;
+    if (!slotFromPort(port, slot) || testBit(slot)) {
+        return false;
+    }
+    setBit(slot);
+    ++allocated_;
+    return true;
+}
+
+void PortAllocator::release(uint16_t port) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    uint32_t slot;
+    if (!slotFromPort(port, slot) || !testBit(slot)) {
+        return;
+    }
+    clearBit(slot);
+    --allocated_;
+    // Slots past the cursor are picked up by the cursor again
+    if (slot < nextUnused_) {
+        freeSlots_.push_back(slot);
+    }
+}
+
+bool PortAllocator::isAllocated(uint16_t port) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    uint32_t slot;
+    return slotFromPort(port, slot) && testBit(slot);
+}
+
+size_t PortAllocator::allocatedCount() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return allocated_;
+}
+
+bool PortAllocator::slotFromPort(uint16_t port, uint32_t& slot) const {
+    if (port < base_ || (port - base_) % 2 != 0) {
+        return false;
+    }
+    slot = (port - base_) / 2;
+    return slot < slotCount_;
+}
+
+bool PortAllocator::testBit(uint32_t slot) const {
+    return (inUse_[slot / 64] >> (slot % 64)) & 1;
+}
+
+void PortAllocator::setBit(uint32_t slot) {
+    inUse_[slot / 64] |= (uint64_t(1) << (slot % 64));
+}
+
+void PortAllocator::clearBit(uint32_t slot) {
+    inUse_[slot / 64] &= ~(uint64_t(1) << (slot % 64));
+}
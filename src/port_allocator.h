@@ -0,0 +1,65 @@
+/*
+ * Copyright 2024 nrjchnd@gmail.com
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     https://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an **"AS IS" BASIS,**
+ * **WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.**
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#ifndef PORT_ALLOCATOR_H
+#define PORT_ALLOCATOR_H
+
+#include <cstdint>
+#include <cstddef>
+#include <mutex>
+#include <vector>
+
+// Hands out RTP ports from the configured range in O(1).
+// Ports are allocated as RTP/RTCP pairs: the returned port is always even and
+// port + 1 is implicitly reserved for RTCP. Slots that have never been handed
+// out are tracked by a cursor rather than pre-filled, so construction does not
+// depend on the size of the range.
+class PortAllocator {
+public:
+    PortAllocator(uint16_t portStart, uint16_t portEnd);
+
+    // Returns 0 when the range is exhausted
+    uint16_t allocate();
+    // Claims a specific port (e.g. one inherited from a previous process)
+    bool reserve(uint16_t port);
+    void release(uint16_t port);
+
+    // Moves to a new range. Ports in use inside it stay allocated; those
+    // outside it are simply forgotten when released. Throws like the
+    // constructor, leaving the old range in place.
+    void setRange(uint16_t portStart, uint16_t portEnd);
+
+    bool isAllocated(uint16_t port);
+    size_t allocatedCount();
+    size_t capacity() const { return slotCount_; }
+
+private:
+    static uint32_t slotCountOf(uint32_t base, uint16_t portEnd);
+    bool slotFromPort(uint16_t port, uint32_t& slot) const;
+    bool testBit(uint32_t slot) const;
+    void setBit(uint32_t slot);
+    void clearBit(uint32_t slot);
+
+    uint32_t base_;
+    uint32_t slotCount_;
+    uint32_t nextUnused_;
+    size_t allocated_;
+
+    std::vector<uint32_t> freeSlots_;
+    std::vector<uint64_t> inUse_;
+    std::mutex mutex_;
+};
+
+#endif // PORT_ALLOCATOR_H
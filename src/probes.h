@@ -0,0 +1,58 @@
+/*
+ * Copyright 2024 nrjchnd@gmail.com
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     https://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an **"AS IS" BASIS,**
+ * **WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.**
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#ifndef PROBES_H
+#define PROBES_H
+
+// USDT probes (provider "quicrtp") on the pipeline stages, for bpftrace or
+// perf on a running proxy. Each one is a single nop until a tracer attaches,
+// so they stay compiled in. Probes carry the SSRC, sequence number and length
+// where the stage knows them; the tracer timestamps every hit on the
+// monotonic clock (nsecs in bpftrace), which is what the scripts in
+// tools/bpftrace build their histograms from.
+//
+//   rtp_receive_batch(port, count)               listener wakeup, before SRTP
+//   srtp_unprotect(port, lenIn, lenOut)          lenOut 0 when it failed
+//   rtp_receive(ssrc, seq, len, port)            packet thread, header parsed
+//   session_create(ssrc, port)
+//   session_move(ssrc, port)
+//   session_remove(ssrc)
+//   translate_in(ssrc, seq, len)
+//   translate_out(ssrc, seq, len, mediaClass)    handed to the QUIC sender
+//   silence_drop(ssrc, seq)
+//   quic_send(ssrc, len, mediaClass, id)         given to msquic; id is the
+//   quic_send_complete(id, len, canceled)        data address, matching the
+//                                                two (FEC repairs: ssrc 0,
+//                                                mediaClass -1); canceled is
+//                                                also set for lost datagrams
+//   quic_receive(len, datagram)
+//   downlink_send(ssrc, seq, len, port)          RTP to the endpoint
+//
+// Built in when sys/sdt.h (systemtap-sdt-dev) is found.
+
+#ifdef QUICRTP_HAVE_USDT
+#include <sys/sdt.h>
+#define QUICRTP_PROBE1(name, a) DTRACE_PROBE1(quicrtp, name, a)
+#define QUICRTP_PROBE2(name, a, b) DTRACE_PROBE2(quicrtp, name, a, b)
+#define QUICRTP_PROBE3(name, a, b, c) DTRACE_PROBE3(quicrtp, name, a, b, c)
+#define QUICRTP_PROBE4(name, a, b, c, d) DTRACE_PROBE4(quicrtp, name, a, b, c, d)
+#else
+#define QUICRTP_PROBE1(name, a) do { } while (0)
+#define QUICRTP_PROBE2(name, a, b) do { } while (0)
+#define QUICRTP_PROBE3(name, a, b, c) do { } while (0)
+#define QUICRTP_PROBE4(name, a, b, c, d) do { } while (0)
+#endif
+
+#endif // PROBES_H
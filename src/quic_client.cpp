@@ -15,15 +15,46 @@
  */
 #include "quic_client.h"
 #include "logger.h"
+#include "packet_arena.h"
+#include "probes.h"
+#include <algorithm>
 #include <iostream>
 #include <stdexcept>
 #include <cstring>
 
+// Kept in the slab scratch area of a datagram until its final send state
+struct DatagramContext {
+    QUIC_BUFFER buffer;
+    bool sent;
+};
+
+static_assert(sizeof(QUIC_BUFFER) <= sizeof(PacketSlab::scratch), "QUIC_BUFFER must fit the slab scratch area");
+static_assert(sizeof(DatagramContext) <= sizeof(PacketSlab::scratch), "DatagramContext must fit the slab scratch area");
+
+// msquic serves higher stream priorities first; 0x7FFF is its default
+const uint16_t STREAM_PRIORITY[MEDIA_CLASS_COUNT] = {0xFFFF, 0xBFFF, 0x7FFF};
+// Datagrams handed to msquic but not yet sent; the rest wait in the
+// scheduler, where deadlines and priorities still apply
+const size_t DATAGRAM_WINDOW = 32;
+// Stream window until msquic reports its ideal send buffer; msquic's default
+const uint64_t INITIAL_SEND_BUDGET = 128 * 1024;
+// Streams in flight at once, however small the packets
+const size_t MAX_STREAMS_IN_FLIGHT = 256;
+// How often in-flight streams are checked against their deadlines
+const std::chrono::milliseconds DEADLINE_SWEEP_INTERVAL(5);
+// How often adaptive FEC re-reads the connection's loss
+const std::chrono::milliseconds FEC_ADAPT_INTERVAL(1000);
+
 const QUIC_API_TABLE* MsQuic;
 HQUIC registration_ = nullptr;
 
 QuicClient::QuicClient(const std::string& serverIp, uint16_t serverPort)
-    : serverIp_(serverIp), serverPort_(serverPort), configuration_(nullptr), connection_(nullptr)
+    : serverIp_(serverIp), serverPort_(serverPort), configuration_(nullptr), connection_(nullptr),
+      transport_(Transport::Stream), datagramsEnabled_(false), maxDatagramLength_(0), datagramsQueued_(0),
+      streamsInFlight_(0), streamBytesInFlight_(0), sendBudget_(INITIAL_SEND_BUDGET), sendConnection_(nullptr),
+      wakeRunning_(false), wakeAt_(std::chrono::steady_clock::time_point::max()),
+      fecEnabled_(false), fecAdaptive_(false), fecMaxDelay_(60), lastSendTotal_(0), lastSendLost_(0), smoothedLoss_(0.0),
+      fragmentation_(false)
 {
     // Initialize MsQuic
     if (QUIC_FAILED(MsQuicOpen2(&MsQuic))) {
@@ -46,6 +77,33 @@ QuicClient::~QuicClient() {
     MsQuicClose(MsQuic);
 }
 
+void QuicClient::setTransport(Transport transport) {
+    transport_ = transport;
+}
+
+void QuicClient::setFec(bool enable, bool adaptive, size_t k, size_t m, int maxDelayMs) {
+    fecEnabled_ = enable;
+    fecAdaptive_ = adaptive;
+    fecMaxDelay_ = std::chrono::milliseconds(std::max(maxDelayMs, 1));
+    fecEncoder_.setParameters(k, m);
+}
+
+void QuicClient::setFragmentation(bool enable, int timeoutMs) {
+    fragmentation_ = enable;
+    reassembler_.setTimeout(std::chrono::milliseconds(std::max(timeoutMs, 1)));
+}
+
+void QuicClient::setQueueLimits(size_t maxPackets, size_t maxPerSession, DropPolicy policy) {
+    std::lock_guard<std::mutex> schedulerLock(schedulerMutex_);
+    scheduler_.setLimits(maxPackets, maxPerSession);
+    scheduler_.setDropPolicy(policy);
+}
+
+void QuicClient::setTenantRate(uint16_t tenant, const TenantRate& rate) {
+    std::lock_guard<std::mutex> schedulerLock(schedulerMutex_);
+    scheduler_.setTenantRate(tenant, rate);
+}
+
 bool QuicClient::initialize() {
     QUIC_STATUS status;
 
@@ -62,6 +120,16 @@ bool QuicClient::initialize() {
     settings.IdleTimeoutMs = 30000;
     settings.IsSet.DisconnectTimeoutMs = TRUE;
     settings.DisconnectTimeoutMs = 10000;
+    // Without msquic's own buffering a send completes once acknowledged and
+    // msquic reports how much should be in flight (IDEAL_SEND_BUFFER_SIZE),
+    // which is what bounds the stream window. The arena buffers are held
+    // until SEND_COMPLETE anyway.
+    settings.IsSet.SendBufferingEnabled = TRUE;
+    settings.SendBufferingEnabled = FALSE;
+    if (transport_ == Transport::Datagram) {
+        settings.IsSet.DatagramReceiveEnabled = TRUE;
+        settings.DatagramReceiveEnabled = TRUE;
+    }
 
     status = MsQuic->ConfigurationOpen(registration_, &alpnBuffer, 1, &settings, sizeof(settings), nullptr, &configuration_);
     if (QUIC_FAILED(status)) {
@@ -101,11 +169,31 @@ void QuicClient::start() {
         connection_ = nullptr;
     } else {
         Logger::getLogger()->info("QUIC connection started to {}:{}", serverIp_, serverPort_);
+        std::lock_guard<std::mutex> schedulerLock(schedulerMutex_);
+        sendConnection_ = connection_;
+        if (!wakeThread_.joinable()) {
+            wakeRunning_ = true;
+            wakeThread_ = std::thread(&QuicClient::wakeLoop, this);
+        }
     }
 }
 
 void QuicClient::stop() {
+    // Before connectionMutex_, which the wake thread takes
+    {
+        std::lock_guard<std::mutex> schedulerLock(schedulerMutex_);
+        wakeRunning_ = false;
+    }
+    wakeReady_.notify_all();
+    if (wakeThread_.joinable()) {
+        wakeThread_.join();
+    }
+
     std::lock_guard<std::mutex> lock(connectionMutex_);
+    {
+        std::lock_guard<std::mutex> schedulerLock(schedulerMutex_);
+        sendConnection_ = nullptr;
+    }
     if (connection_) {
         MsQuic->ConnectionClose(connection_);
         connection_ = nullptr;
@@ -117,35 +205,309 @@ void QuicClient::stop() {
 }
 
 void QuicClient::sendData(const uint8_t* data, size_t len) {
+    PacketBuffer packet = PacketArena::instance().allocate();
+    if (len > packet.tailroom()) {
+        Logger::getLogger()->error("Packet of {} bytes is too large to send", len);
+        return;
+    }
+    std::memcpy(packet.data(), data, len);
+    packet.setSize(len);
+    sendData(std::move(packet));
+}
+
+void QuicClient::sendData(PacketBuffer packet, const SendInfo& info) {
     std::lock_guard<std::mutex> lock(connectionMutex_);
     if (!connection_) {
         Logger::getLogger()->error("QUIC connection is not established");
         return;
     }
 
+    auto now = std::chrono::steady_clock::now();
+    if (fecEnabled_ && fecAdaptive_ && now >= nextFecUpdate_) {
+        adaptFec(connection_);
+        nextFecUpdate_ = now + FEC_ADAPT_INTERVAL;
+    }
+
+    std::vector<std::pair<PacketBuffer, SendInfo>> streams;
+    {
+        std::lock_guard<std::mutex> schedulerLock(schedulerMutex_);
+        if (now >= nextSweep_) {
+            abortExpiredStreams(now);
+            nextSweep_ = now + DEADLINE_SWEEP_INTERVAL;
+        }
+        scheduler_.enqueue(std::move(packet), info);
+        drain(connection_, streams);
+    }
+
+    // Stream sends may block on msquic's worker, so they happen unlocked
+    for (auto& entry : streams) {
+        sendOnStream(connection_, std::move(entry.first), entry.second);
+    }
+}
+
+size_t QuicClient::queuedPackets() {
+    std::lock_guard<std::mutex> schedulerLock(schedulerMutex_);
+    return scheduler_.queued();
+}
+
+uint64_t QuicClient::shedPackets() {
+    std::lock_guard<std::mutex> schedulerLock(schedulerMutex_);
+    return scheduler_.shedPackets();
+}
+
+uint64_t QuicClient::fragmentedMessages() {
+    std::lock_guard<std::mutex> schedulerLock(schedulerMutex_);
+    return fragmenter_.fragmentedMessages();
+}
+
+void QuicClient::drain(HQUIC connection, std::vector<std::pair<PacketBuffer, SendInfo>>& streams) {
+    if (transport_ == Transport::Datagram && datagramsEnabled_) {
+        sendDatagrams(connection, streams);
+    } else {
+        auto now = std::chrono::steady_clock::now();
+        PacketBuffer packet;
+        SendInfo info;
+        while (streamsInFlight_ < MAX_STREAMS_IN_FLIGHT && streamBytesInFlight_ < sendBudget_ &&
+               scheduler_.dequeue(packet, info, now)) {
+            reserveStream(packet.size());
+            streams.emplace_back(std::move(packet), info);
+        }
+    }
+
+    // A tenant throttled earlier than the wake thread expects
+    std::chrono::steady_clock::time_point wakeAt;
+    if (scheduler_.wakeTime(wakeAt) && wakeAt < wakeAt_) {
+        wakeReady_.notify_one();
+    }
+}
+
+void QuicClient::wakeLoop() {
+    std::unique_lock<std::mutex> schedulerLock(schedulerMutex_);
+    std::chrono::steady_clock::time_point lastWake;
+    while (wakeRunning_) {
+        if (!scheduler_.wakeTime(wakeAt_)) {
+            wakeAt_ = std::chrono::steady_clock::time_point::max();
+            wakeReady_.wait(schedulerLock);
+            continue;
+        }
+        if (wakeAt_ == lastWake) {
+            // Still due after the last drain, which found the window full;
+            // completions drain it, so only check back now and then
+            wakeAt_ = std::chrono::steady_clock::now() + DEADLINE_SWEEP_INTERVAL;
+        }
+        if (wakeReady_.wait_until(schedulerLock, wakeAt_) == std::cv_status::no_timeout) {
+            continue;
+        }
+        scheduler_.wakeTime(lastWake);
+        wakeAt_ = std::chrono::steady_clock::time_point::max();
+        schedulerLock.unlock();
+        {
+            // As sendData() does, without a packet of its own
+            std::lock_guard<std::mutex> lock(connectionMutex_);
+            std::vector<std::pair<PacketBuffer, SendInfo>> streams;
+            if (connection_) {
+                std::lock_guard<std::mutex> drainLock(schedulerMutex_);
+                drain(connection_, streams);
+            }
+            for (auto& entry : streams) {
+                sendOnStream(connection_, std::move(entry.first), entry.second);
+            }
+        }
+        schedulerLock.lock();
+    }
+}
+
+void QuicClient::reserveStream(size_t bytes) {
+    ++streamsInFlight_;
+    streamBytesInFlight_ += bytes;
+}
+
+void QuicClient::releaseStream(size_t bytes) {
+    streamsInFlight_ = streamsInFlight_ > 0 ? streamsInFlight_ - 1 : 0;
+    streamBytesInFlight_ = streamBytesInFlight_ > bytes ? streamBytesInFlight_ - bytes : 0;
+}
+
+void QuicClient::sendDatagrams(HQUIC connection, std::vector<std::pair<PacketBuffer, SendInfo>>& overflow) {
+    auto now = std::chrono::steady_clock::now();
+    size_t overhead = fecEnabled_ ? FEC_OVERHEAD : 0;
+    // Room for the FEC header and the fragment framing taken from the front
+    size_t headroom = (fecEnabled_ ? FEC_HEADER_SIZE : 0) + (fragmentation_ ? FRAGMENT_WHOLE_HEADER_SIZE : 0);
+    std::vector<PacketBuffer> repairs;
+    std::vector<PacketBuffer> datagrams;
+    while (datagramsQueued_ < DATAGRAM_WINDOW && !heldDatagrams_.empty()) {
+        HeldDatagram& held = heldDatagrams_.front();
+        sendMediaDatagram(connection, std::move(held.datagram), held.ssrc, held.mediaClass, held.flags, now, repairs);
+        heldDatagrams_.pop_front();
+    }
+    PacketBuffer packet;
+    SendInfo info;
+    while (heldDatagrams_.empty() && datagramsQueued_ < DATAGRAM_WINDOW && scheduler_.dequeue(packet, info, now)) {
+        datagrams.clear();
+        bool framed = false;
+        if (datagramsEnabled_ && maxDatagramLength_ > overhead && packet.headroom() >= headroom) {
+            if (fragmentation_) {
+                // maxDatagramLength_ follows the path MTU, so the split does too
+                framed = fragmenter_.frame(info.ssrc, packet, maxDatagramLength_ - overhead, datagrams);
+            } else if (packet.size() + overhead <= maxDatagramLength_) {
+                datagrams.push_back(std::move(packet));
+                framed = true;
+            }
+        }
+        if (!framed) {
+            reserveStream(packet.size());
+            overflow.emplace_back(std::move(packet), info);
+            continue;
+        }
+
+        QUIC_SEND_FLAGS flags = info.mediaClass == MediaClass::Audio ? QUIC_SEND_FLAG_DGRAM_PRIORITY : QUIC_SEND_FLAG_NONE;
+        for (auto& datagram : datagrams) {
+            if (datagramsQueued_ >= DATAGRAM_WINDOW) {
+                heldDatagrams_.push_back(HeldDatagram{std::move(datagram), info.ssrc, info.mediaClass, flags});
+                continue;
+            }
+            sendMediaDatagram(connection, std::move(datagram), info.ssrc, info.mediaClass, flags, now, repairs);
+        }
+    }
+
+    // Repairs bypass the window: held back they would only arrive too late
+    if (fecEnabled_) {
+        fecEncoder_.flush(now, fecMaxDelay_, repairs);
+        for (auto& repair : repairs) {
+            if (repair.size() <= maxDatagramLength_) {
+                QUICRTP_PROBE4(quic_send, 0, repair.size(), -1, repair.data());
+                sendDatagram(connection, std::move(repair), QUIC_SEND_FLAG_NONE);
+            }
+        }
+    }
+}
+
+void QuicClient::sendMediaDatagram(HQUIC connection, PacketBuffer datagram, uint32_t ssrc, MediaClass mediaClass, QUIC_SEND_FLAGS flags,
+                                   std::chrono::steady_clock::time_point now, std::vector<PacketBuffer>& repairs) {
+    // Fragments start with the full headroom, so this cannot fail
+    if (fecEnabled_ && !fecEncoder_.protect(ssrc, datagram, now, repairs)) {
+        return;
+    }
+    QUICRTP_PROBE4(quic_send, ssrc, datagram.size(), static_cast<int>(mediaClass), datagram.data());
+    sendDatagram(connection, std::move(datagram), flags);
+}
+
+bool QuicClient::sendDatagram(HQUIC connection, PacketBuffer packet, QUIC_SEND_FLAGS flags) {
+    DatagramContext* context = static_cast<DatagramContext*>(packet.scratch());
+    context->buffer.Length = static_cast<uint32_t>(packet.size());
+    context->buffer.Buffer = packet.data();
+    context->sent = false;
+
+    PacketSlab* slab = packet.detach();
+    QUIC_STATUS status = MsQuic->DatagramSend(connection, &context->buffer, 1, flags, slab);
+    if (QUIC_FAILED(status)) {
+        Logger::getLogger()->error("DatagramSend failed");
+        PacketBuffer::adopt(slab);
+        return false;
+    }
+    ++datagramsQueued_;
+    return true;
+}
+
+void QuicClient::adaptFec(HQUIC connection) {
+    QUIC_STATISTICS_V2 stats;
+    uint32_t statsSize = sizeof(stats);
+    if (QUIC_FAILED(MsQuic->GetParam(connection, QUIC_PARAM_CONN_STATISTICS_V2, &statsSize, &stats))) {
+        return;
+    }
+
+    uint64_t sent = stats.SendTotalPackets - lastSendTotal_;
+    uint64_t lost = stats.SendSuspectedLostPackets - lastSendLost_;
+    lastSendTotal_ = stats.SendTotalPackets;
+    lastSendLost_ = stats.SendSuspectedLostPackets;
+    if (sent == 0) {
+        return;
+    }
+    // Smoothed so one bad second does not flap the group size
+    double loss = static_cast<double>(lost) / static_cast<double>(sent);
+    smoothedLoss_ = 0.7 * smoothedLoss_ + 0.3 * loss;
+
+    size_t k = 0;
+    size_t m = 0;
+    FecEncoder::parametersForLoss(smoothedLoss_, k, m);
+    std::lock_guard<std::mutex> schedulerLock(schedulerMutex_);
+    if (k != fecEncoder_.groupSize() || m != fecEncoder_.repairCount()) {
+        Logger::getLogger()->info("FEC now {}+{} at {:.1f}% loss (rtt {} us)", k, m, smoothedLoss_ * 100.0, stats.Rtt);
+        fecEncoder_.setParameters(k, m);
+    }
+}
+
+void QuicClient::abortExpiredStreams(std::chrono::steady_clock::time_point now) {
+    // A stream still sending after its deadline only burns bandwidth on
+    // retransmissions; abort it, and for video every stream of its frame
+    for (auto& entry : inFlightStreams_) {
+        InFlightStream& inFlight = entry.second;
+        if (inFlight.aborted || inFlight.deadline >= now) {
+            continue;
+        }
+        if (inFlight.frameKey != 0) {
+            scheduler_.dropFrame(inFlight.frameKey);
+        }
+    }
+    for (auto& entry : inFlightStreams_) {
+        InFlightStream& inFlight = entry.second;
+        if (inFlight.aborted) {
+            continue;
+        }
+        if (inFlight.deadline < now || scheduler_.isFrameDropped(inFlight.frameKey)) {
+            MsQuic->StreamShutdown(entry.first, QUIC_STREAM_SHUTDOWN_FLAG_ABORT_SEND, 0);
+            inFlight.aborted = true;
+        }
+    }
+}
+
+void QuicClient::sendOnStream(HQUIC connection, PacketBuffer packet, const SendInfo& info) {
     HQUIC stream = nullptr;
     QUIC_STATUS status;
 
-    status = MsQuic->StreamOpen(connection_, QUIC_STREAM_OPEN_FLAG_UNIDIRECTIONAL, ClientStreamCallback, this, &stream);
+    status = MsQuic->StreamOpen(connection, QUIC_STREAM_OPEN_FLAG_UNIDIRECTIONAL, ClientStreamCallback, this, &stream);
     if (QUIC_FAILED(status)) {
         Logger::getLogger()->error("StreamOpen failed");
+        std::lock_guard<std::mutex> schedulerLock(schedulerMutex_);
+        releaseStream(packet.size());
         return;
     }
 
+    uint16_t priority = STREAM_PRIORITY[static_cast<size_t>(info.mediaClass)];
+    MsQuic->SetParam(stream, QUIC_PARAM_STREAM_PRIORITY, sizeof(priority), &priority);
+
     status = MsQuic->StreamStart(stream, QUIC_STREAM_START_FLAG_IMMEDIATE);
     if (QUIC_FAILED(status)) {
         Logger::getLogger()->error("StreamStart failed");
         MsQuic->StreamClose(stream);
+        std::lock_guard<std::mutex> schedulerLock(schedulerMutex_);
+        releaseStream(packet.size());
         return;
     }
 
-    QUIC_BUFFER buffer;
-    buffer.Length = static_cast<uint32_t>(len);
-    buffer.Buffer = const_cast<uint8_t*>(data);
+    // Registered before the send so SEND_COMPLETE always finds it
+    bool tracked = info.deadline != std::chrono::steady_clock::time_point::max();
+    if (tracked) {
+        std::lock_guard<std::mutex> schedulerLock(schedulerMutex_);
+        inFlightStreams_[stream] = InFlightStream{info.deadline, info.frameKey, false};
+    }
+
+    // msquic reads the data and the QUIC_BUFFER until SEND_COMPLETE, so both
+    // live in the arena buffer that the completion hands back
+    QUIC_BUFFER* buffer = static_cast<QUIC_BUFFER*>(packet.scratch());
+    buffer->Length = static_cast<uint32_t>(packet.size());
+    buffer->Buffer = packet.data();
 
-    status = MsQuic->StreamSend(stream, &buffer, 1, QUIC_SEND_FLAG_FIN, nullptr);
+    QUICRTP_PROBE4(quic_send, info.ssrc, packet.size(), static_cast<int>(info.mediaClass), packet.data());
+    PacketSlab* slab = packet.detach();
+    status = MsQuic->StreamSend(stream, buffer, 1, QUIC_SEND_FLAG_FIN, slab);
     if (QUIC_FAILED(status)) {
         Logger::getLogger()->error("StreamSend failed");
+        {
+            std::lock_guard<std::mutex> schedulerLock(schedulerMutex_);
+            inFlightStreams_.erase(stream);
+            releaseStream(buffer->Length);
+        }
+        PacketBuffer::adopt(slab);
         MsQuic->StreamShutdown(stream, QUIC_STREAM_SHUTDOWN_FLAG_ABORT, 0);
         MsQuic->StreamClose(stream);
     }
@@ -167,11 +529,81 @@ QUIC_STATUS QUIC_API QuicClient::ClientConnectionCallback(HQUIC Connection, void
     case QUIC_CONNECTION_EVENT_SHUTDOWN_INITIATED_BY_PEER:
         Logger::getLogger()->warn("QUIC connection shutdown by peer");
         break;
-    case QUIC_CONNECTION_EVENT_SHUTDOWN_COMPLETE:
+    case QUIC_CONNECTION_EVENT_DATAGRAM_STATE_CHANGED: {
+        std::lock_guard<std::mutex> schedulerLock(client->schedulerMutex_);
+        client->datagramsEnabled_ = Event->DATAGRAM_STATE_CHANGED.SendEnabled;
+        client->maxDatagramLength_ = Event->DATAGRAM_STATE_CHANGED.MaxSendLength;
+        if (client->transport_ == Transport::Datagram) {
+            Logger::getLogger()->info("QUIC datagrams {}, max length {}",
+                                      client->datagramsEnabled_ ? "enabled" : "disabled", client->maxDatagramLength_);
+        }
+        break;
+    }
+    case QUIC_CONNECTION_EVENT_DATAGRAM_RECEIVED: {
+        QUICRTP_PROBE2(quic_receive, Event->DATAGRAM_RECEIVED.Buffer->Length, 1);
+        if (!client->dataHandler_) {
+            break;
+        }
+        const uint8_t* data = Event->DATAGRAM_RECEIVED.Buffer->Buffer;
+        uint32_t length = Event->DATAGRAM_RECEIVED.Buffer->Length;
+        if (client->fragmentation_) {
+            // FEC protects the framed datagrams, so reassembly comes after it
+            auto now = std::chrono::steady_clock::now();
+            auto reassemble = [client, now](const uint8_t* message, size_t len) {
+                client->reassembler_.receive(message, len, now, client->dataHandler_);
+            };
+            if (client->fecEnabled_) {
+                client->fecDecoder_.receive(data, length, reassemble);
+            } else {
+                reassemble(data, length);
+            }
+        } else if (client->fecEnabled_) {
+            client->fecDecoder_.receive(data, length, client->dataHandler_);
+        } else {
+            client->dataHandler_(data, length);
+        }
+        break;
+    }
+    case QUIC_CONNECTION_EVENT_DATAGRAM_SEND_STATE_CHANGED: {
+        PacketSlab* slab = static_cast<PacketSlab*>(Event->DATAGRAM_SEND_STATE_CHANGED.ClientContext);
+        DatagramContext* context = reinterpret_cast<DatagramContext*>(slab->scratch);
+        QUIC_DATAGRAM_SEND_STATE state = Event->DATAGRAM_SEND_STATE_CHANGED.State;
+        bool final = QUIC_DATAGRAM_SEND_STATE_IS_FINAL(state);
+
+        std::vector<std::pair<PacketBuffer, SendInfo>> overflow;
+        {
+            std::lock_guard<std::mutex> schedulerLock(client->schedulerMutex_);
+            if (!context->sent && (state == QUIC_DATAGRAM_SEND_SENT || final)) {
+                // Off msquic's queue: room for the next one from the scheduler
+                context->sent = true;
+                if (client->datagramsQueued_ > 0) {
+                    --client->datagramsQueued_;
+                }
+                client->drain(Connection, overflow);
+            }
+        }
+        if (final) {
+            QUICRTP_PROBE3(quic_send_complete, context->buffer.Buffer, context->buffer.Length,
+                           state != QUIC_DATAGRAM_SEND_ACKNOWLEDGED && state != QUIC_DATAGRAM_SEND_ACKNOWLEDGED_SPURIOUS);
+            PacketBuffer::adopt(slab);
+        }
+        for (auto& entry : overflow) {
+            client->sendOnStream(Connection, std::move(entry.first), entry.second);
+        }
+        break;
+    }
+    case QUIC_CONNECTION_EVENT_SHUTDOWN_COMPLETE: {
         Logger::getLogger()->info("QUIC shutdown complete");
+        std::lock_guard<std::mutex> schedulerLock(client->schedulerMutex_);
+        client->scheduler_.clear();
+        client->datagramsEnabled_ = false;
+        client->datagramsQueued_ = 0;
+        client->heldDatagrams_.clear();
+        client->sendConnection_ = nullptr;
         MsQuic->ConnectionClose(Connection);
         client->connection_ = nullptr;
         break;
+    }
     default:
         break;
     }
@@ -182,16 +614,60 @@ QUIC_STATUS QUIC_API QuicClient::ClientStreamCallback(HQUIC Stream, void* Contex
     QuicClient* client = static_cast<QuicClient*>(Context);
     switch (Event->Type) {
     case QUIC_STREAM_EVENT_RECEIVE:
+        QUICRTP_PROBE2(quic_receive, Event->RECEIVE.TotalBufferLength, 0);
         if (client->dataHandler_) {
             client->dataHandler_(Event->RECEIVE.Buffers->Buffer, Event->RECEIVE.Buffers->Length);
         }
         break;
-    case QUIC_STREAM_EVENT_SEND_COMPLETE:
-        MsQuic->StreamShutdown(Stream, QUIC_STREAM_SHUTDOWN_FLAG_GRACEFUL, 0);
+    case QUIC_STREAM_EVENT_SEND_COMPLETE: {
+        // Returns the send buffer to the arena
+        PacketSlab* slab = static_cast<PacketSlab*>(Event->SEND_COMPLETE.ClientContext);
+        size_t length = reinterpret_cast<QUIC_BUFFER*>(slab->scratch)->Length;
+        QUICRTP_PROBE3(quic_send_complete, reinterpret_cast<QUIC_BUFFER*>(slab->scratch)->Buffer, length,
+                       Event->SEND_COMPLETE.Canceled ? 1 : 0);
+        PacketBuffer::adopt(slab);
+
+        HQUIC connection = nullptr;
+        std::vector<std::pair<PacketBuffer, SendInfo>> streams;
+        {
+            std::lock_guard<std::mutex> schedulerLock(client->schedulerMutex_);
+            bool aborted = false;
+            auto it = client->inFlightStreams_.find(Stream);
+            if (it != client->inFlightStreams_.end()) {
+                aborted = it->second.aborted;
+                client->inFlightStreams_.erase(it);
+            }
+            if (!aborted && !Event->SEND_COMPLETE.Canceled) {
+                MsQuic->StreamShutdown(Stream, QUIC_STREAM_SHUTDOWN_FLAG_GRACEFUL, 0);
+            }
+
+            // Room in the window for what queued up meanwhile
+            client->releaseStream(length);
+            connection = client->sendConnection_;
+            if (connection) {
+                client->drain(connection, streams);
+            }
+        }
+        for (auto& entry : streams) {
+            client->sendOnStream(connection, std::move(entry.first), entry.second);
+        }
+        break;
+    }
+    case QUIC_STREAM_EVENT_IDEAL_SEND_BUFFER_SIZE: {
+        // msquic's estimate of what the connection can have in flight
+        std::lock_guard<std::mutex> schedulerLock(client->schedulerMutex_);
+        client->sendBudget_ = std::max<uint64_t>(Event->IDEAL_SEND_BUFFER_SIZE.ByteCount, PACKET_CAPACITY);
         break;
-    case QUIC_STREAM_EVENT_SHUTDOWN_COMPLETE:
+    }
+    case QUIC_STREAM_EVENT_SHUTDOWN_COMPLETE: {
+        {
+            // The handle is gone after StreamClose; nothing may abort it later
+            std::lock_guard<std::mutex> schedulerLock(client->schedulerMutex_);
+            client->inFlightStreams_.erase(Stream);
+        }
         MsQuic->StreamClose(Stream);
         break;
+    }
     default:
         break;
     }
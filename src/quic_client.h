@@ -16,25 +16,75 @@
 #ifndef QUIC_CLIENT_H
 #define QUIC_CLIENT_H
 
+#include "datagram_fragmenter.h"
+#include "fec.h"
+#include "packet_arena.h"
+#include "send_scheduler.h"
 #include <string>
 #include <functional>
 #include <msquic.h>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
 #include <memory>
 #include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <vector>
 
 class QuicClient {
 public:
+    // Stream sends every packet on its own unidirectional stream, prioritised
+    // by media class. Datagram sends QUIC datagrams and falls back to
+    // streams for packets the peer cannot take as one. Either way packets
+    // wait in a bounded priority queue until msquic has room for them.
+    enum class Transport {
+        Stream,
+        Datagram
+    };
+
     QuicClient(const std::string& serverIp, uint16_t serverPort);
     ~QuicClient();
 
+    // Must be called before initialize()
+    void setTransport(Transport transport);
+    // Protects datagrams with k source / m repair FEC groups per session (see
+    // fec.h); the far side must enable it too. Adaptive mode picks k and m
+    // from the loss msquic reports. Partial groups are closed after
+    // maxDelayMs. Only applies to the datagram transport.
+    void setFec(bool enable, bool adaptive, size_t k, size_t m, int maxDelayMs);
+    // Splits packets longer than the current datagram size into fragments
+    // instead of sending them on streams (see datagram_fragmenter.h); the
+    // far side must enable it too. Fragments of a message that do not all
+    // arrive within timeoutMs are given up. Only applies to the datagram
+    // transport.
+    void setFragmentation(bool enable, int timeoutMs);
+    // Bounds the send queue in total and per session (0 = unbounded) and
+    // picks what is dropped when it is full
+    void setQueueLimits(size_t maxPackets, size_t maxPerSession, DropPolicy policy);
+    // Token bucket for the uplink of a tenant (see SendScheduler)
+    void setTenantRate(uint16_t tenant, const TenantRate& rate);
+
     bool initialize();
     void start();
     void stop();
 
     void sendData(const uint8_t* data, size_t len);
+    // Sends the buffer as is; msquic holds it until SEND_COMPLETE. Packets
+    // still unsent when info.deadline passes are dropped, video a whole frame
+    // at a time.
+    void sendData(PacketBuffer packet, const SendInfo& info = SendInfo());
 
     void setDataHandler(std::function<void(const uint8_t* data, size_t len)> handler);
 
+    // Packets waiting for msquic, and those dropped because the queue was full
+    size_t queuedPackets();
+    uint64_t shedPackets();
+    // Messages sent as fragments, and those reassembled from the far side's
+    // fragments; the latter is only exact once the client is stopped
+    uint64_t fragmentedMessages();
+    uint64_t reassembledMessages() const { return reassembler_.reassembled(); }
+
 private:
     std::string serverIp_;
     uint16_t serverPort_;
@@ -46,6 +96,80 @@ private:
 
     std::function<void(const uint8_t* data, size_t len)> dataHandler_;
 
+    struct InFlightStream {
+        std::chrono::steady_clock::time_point deadline;
+        uint64_t frameKey;
+        bool aborted;
+    };
+
+    // A fragment the datagram window had no room for yet
+    struct HeldDatagram {
+        PacketBuffer datagram;
+        uint32_t ssrc;
+        MediaClass mediaClass;
+        QUIC_SEND_FLAGS flags;
+    };
+
+    // These expect schedulerMutex_ to be held. drain() moves packets from
+    // the scheduler to msquic while there is room and leaves those to go on
+    // streams in streams, for sendOnStream() once the lock is released.
+    void drain(HQUIC connection, std::vector<std::pair<PacketBuffer, SendInfo>>& streams);
+    // Drains the scheduler when a rate-limited tenant may send again, so
+    // its packets do not wait for the next arrival or completion
+    void wakeLoop();
+    void sendDatagrams(HQUIC connection, std::vector<std::pair<PacketBuffer, SendInfo>>& overflow);
+    void reserveStream(size_t bytes);
+    void releaseStream(size_t bytes);
+    bool sendDatagram(HQUIC connection, PacketBuffer packet, QUIC_SEND_FLAGS flags);
+    // FEC protection, then sendDatagram()
+    void sendMediaDatagram(HQUIC connection, PacketBuffer datagram, uint32_t ssrc, MediaClass mediaClass, QUIC_SEND_FLAGS flags,
+                           std::chrono::steady_clock::time_point now, std::vector<PacketBuffer>& repairs);
+    void abortExpiredStreams(std::chrono::steady_clock::time_point now);
+    void sendOnStream(HQUIC connection, PacketBuffer packet, const SendInfo& info);
+    void adaptFec(HQUIC connection);
+
+    Transport transport_;
+
+    // Lock order: connectionMutex_, then schedulerMutex_. msquic callbacks
+    // only take schedulerMutex_, so stop() can wait for them.
+    std::mutex schedulerMutex_;
+    SendScheduler scheduler_;
+    bool datagramsEnabled_;
+    uint16_t maxDatagramLength_;
+    size_t datagramsQueued_;   // handed to msquic, not yet on the wire
+    // Rest of a fragmented message, sent before anything else as the
+    // window opens; every fragment counts against the window
+    std::deque<HeldDatagram> heldDatagrams_;
+    // Streams and bytes handed to msquic and not yet acknowledged; bounded
+    // by msquic's ideal send buffer
+    size_t streamsInFlight_;
+    uint64_t streamBytesInFlight_;
+    uint64_t sendBudget_;
+    // connection_ for completions, which run without connectionMutex_
+    HQUIC sendConnection_;
+    std::unordered_map<HQUIC, InFlightStream> inFlightStreams_;
+    std::chrono::steady_clock::time_point nextSweep_;
+    std::thread wakeThread_;
+    std::condition_variable wakeReady_;
+    bool wakeRunning_;
+    std::chrono::steady_clock::time_point wakeAt_;   // what wakeLoop() waits for
+
+    bool fecEnabled_;
+    bool fecAdaptive_;
+    std::chrono::milliseconds fecMaxDelay_;
+    FecEncoder fecEncoder_;
+    // Only used from the connection callback, which msquic serialises
+    FecDecoder fecDecoder_;
+    std::chrono::steady_clock::time_point nextFecUpdate_;
+    uint64_t lastSendTotal_;
+    uint64_t lastSendLost_;
+    double smoothedLoss_;
+
+    bool fragmentation_;
+    DatagramFragmenter fragmenter_;
+    // Only used from the connection callback, like fecDecoder_
+    DatagramReassembler reassembler_;
+
     static QUIC_STATUS QUIC_API ClientConnectionCallback(HQUIC Connection, void* Context, QUIC_CONNECTION_EVENT* Event);
     static QUIC_STATUS QUIC_API ClientStreamCallback(HQUIC Stream, void* Context, QUIC_STREAM_EVENT* Event);
 };
@@ -0,0 +1,117 @@
+/*
+ * Copyright 2024 nrjchnd@gmail.com
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     https://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an **"AS IS" BASIS,**
+ * **WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.**
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "reuseport_steering.h"
+#include "logger.h"
+
+#ifdef QUICRTP_HAVE_BPF
+#include <bpf/bpf.h>
+#include <bpf/libbpf.h>
+#include <sys/socket.h>
+#include <cerrno>
+#include <cstring>
+
+#ifndef SO_DETACH_REUSEPORT_BPF
+#define SO_DETACH_REUSEPORT_BPF 68
+#endif
+#endif
+
+ReuseportSteering::ReuseportSteering()
+    : bpfObject_(nullptr), attachedFd_(-1)
+{
+}
+
+ReuseportSteering::~ReuseportSteering() {
+    detach();
+}
+
+#ifdef QUICRTP_HAVE_BPF
+
+bool ReuseportSteering::attach(const std::vector<int>& socketFds, const std::string& programPath) {
+    if (socketFds.size() < 2) {
+        return false;
+    }
+
+    bpf_object* object = bpf_object__open_file(programPath.c_str(), nullptr);
+    if (!object || libbpf_get_error(object)) {
+        Logger::getLogger()->warn("SSRC steering: cannot open BPF object {}", programPath);
+        return false;
+    }
+    bpfObject_ = object;
+    if (bpf_object__load(object) != 0) {
+        Logger::getLogger()->warn("SSRC steering: cannot load BPF object {}", programPath);
+        detach();
+        return false;
+    }
+
+    bpf_program* program = bpf_object__find_program_by_name(object, "rtp_select_worker");
+    int socketMapFd = bpf_object__find_map_fd_by_name(object, "rtp_workers");
+    int countMapFd = bpf_object__find_map_fd_by_name(object, "rtp_worker_count");
+    if (!program || socketMapFd < 0 || countMapFd < 0) {
+        Logger::getLogger()->warn("SSRC steering: BPF object {} is missing the program or its maps", programPath);
+        detach();
+        return false;
+    }
+
+    // Slot i is worker i; the program only sees the count once every slot is filled
+    for (uint32_t i = 0; i < socketFds.size(); ++i) {
+        uint64_t fd = static_cast<uint64_t>(socketFds[i]);
+        if (bpf_map_update_elem(socketMapFd, &i, &fd, BPF_ANY) != 0) {
+            Logger::getLogger()->warn("SSRC steering: cannot add socket {} to the reuseport array: {}", i, std::strerror(errno));
+            detach();
+            return false;
+        }
+    }
+    uint32_t zero = 0;
+    uint32_t workers = static_cast<uint32_t>(socketFds.size());
+    bpf_map_update_elem(countMapFd, &zero, &workers, BPF_ANY);
+
+    // The program applies to the whole reuseport group
+    int programFd = bpf_program__fd(program);
+    if (::setsockopt(socketFds.front(), SOL_SOCKET, SO_ATTACH_REUSEPORT_EBPF, &programFd, sizeof(programFd)) != 0) {
+        Logger::getLogger()->warn("SSRC steering: SO_ATTACH_REUSEPORT_EBPF failed: {}", std::strerror(errno));
+        detach();
+        return false;
+    }
+    attachedFd_ = socketFds.front();
+
+    Logger::getLogger()->info("SSRC steering attached to {} reuseport sockets", socketFds.size());
+    return true;
+}
+
+void ReuseportSteering::detach() {
+    if (attachedFd_ >= 0) {
+        int unused = 0;
+        ::setsockopt(attachedFd_, SOL_SOCKET, SO_DETACH_REUSEPORT_BPF, &unused, sizeof(unused));
+        attachedFd_ = -1;
+    }
+    if (bpfObject_) {
+        bpf_object__close(static_cast<bpf_object*>(bpfObject_));
+        bpfObject_ = nullptr;
+    }
+}
+
+#else // QUICRTP_HAVE_BPF
+
+bool ReuseportSteering::attach(const std::vector<int>&, const std::string&) {
+    Logger::getLogger()->warn("SSRC steering requested but BPF support is not compiled in");
+    return false;
+}
+
+void ReuseportSteering::detach() {
+}
+
+#endif // QUICRTP_HAVE_BPF
@@ -0,0 +1,39 @@
+/*
+ * Copyright 2024 nrjchnd@gmail.com
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     https://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an **"AS IS" BASIS,**
+ * **WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.**
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#ifndef REUSEPORT_STEERING_H
+#define REUSEPORT_STEERING_H
+
+#include <string>
+#include <vector>
+
+// Attaches bpf/rtp_reuseport.bpf.c to a SO_REUSEPORT group so packets are
+// steered to socket quicrtp_worker_for_ssrc(ssrc, workers) instead of by the
+// kernel's 4-tuple hash. Socket i of the group must belong to worker i.
+class ReuseportSteering {
+public:
+    ReuseportSteering();
+    ~ReuseportSteering();
+
+    // False when steering is unavailable; the kernel hash then stays in effect
+    bool attach(const std::vector<int>& socketFds, const std::string& programPath);
+    void detach();
+
+private:
+    void* bpfObject_;
+    int attachedFd_;
+};
+
+#endif // REUSEPORT_STEERING_H
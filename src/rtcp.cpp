@@ -0,0 +1,348 @@
+/*
+ * Copyright 2024 nrjchnd@gmail.com
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     https://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an **"AS IS" BASIS,**
+ * **WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.**
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "rtcp.h"
+#include "logger.h"
+#include "packet_arena.h"
+#include <algorithm>
+#include <cstring>
+#include <random>
+#include <vector>
+
+// Seconds from the NTP epoch (1900) to the Unix epoch
+const uint64_t NTP_UNIX_OFFSET = 2208988800ULL;
+const uint8_t SDES_CNAME = 1;
+
+namespace {
+
+uint32_t read32(const uint8_t* p) {
+    return (static_cast<uint32_t>(p[0]) << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+}
+
+uint8_t* write32(uint8_t* p, uint32_t value) {
+    p[0] = static_cast<uint8_t>(value >> 24);
+    p[1] = static_cast<uint8_t>(value >> 16);
+    p[2] = static_cast<uint8_t>(value >> 8);
+    p[3] = static_cast<uint8_t>(value);
+    return p + 4;
+}
+
+// Common header; length is the packet's size in bytes
+uint8_t* writeHeader(uint8_t* p, uint8_t count, uint8_t type, size_t length) {
+    p[0] = static_cast<uint8_t>(0x80 | count);
+    p[1] = type;
+    uint16_t words = static_cast<uint16_t>(length / 4 - 1);
+    p[2] = static_cast<uint8_t>(words >> 8);
+    p[3] = static_cast<uint8_t>(words);
+    return p + 4;
+}
+
+uint64_t ntpNow() {
+    auto micros = std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::system_clock::now().time_since_epoch()).count();
+    uint64_t seconds = static_cast<uint64_t>(micros) / 1000000 + NTP_UNIX_OFFSET;
+    uint64_t fraction = ((static_cast<uint64_t>(micros) % 1000000) << 32) / 1000000;
+    return (seconds << 32) | fraction;
+}
+
+// The middle 32 bits, as LSR and DLSR use them
+uint32_t ntpShort(uint64_t ntp) {
+    return static_cast<uint32_t>(ntp >> 16);
+}
+
+uint32_t toNtpShort(std::chrono::steady_clock::duration duration) {
+    auto micros = std::chrono::duration_cast<std::chrono::microseconds>(duration).count();
+    return static_cast<uint32_t>((static_cast<uint64_t>(std::max<int64_t>(micros, 0)) << 16) / 1000000);
+}
+
+}
+
+RtcpAgent::RtcpAgent(SessionManager& sessions, const std::string& cname)
+    : sessions_(sessions), cname_(cname.substr(0, 255)), reporterSsrc_(std::random_device()()),
+      nackWindow_(0), nackHits_(0), nackMisses_(0), loggedNacks_(0), reportInterval_(5), running_(false)
+{
+}
+
+RtcpAgent::~RtcpAgent() {
+    stop();
+}
+
+void RtcpAgent::setSender(Sender sender) {
+    sender_ = sender;
+}
+
+void RtcpAgent::setRetransmitter(Retransmitter retransmitter, std::chrono::milliseconds window) {
+    retransmitter_ = retransmitter;
+    nackWindow_ = window;
+}
+
+void RtcpAgent::start(std::chrono::seconds reportInterval) {
+    if (running_.load()) {
+        return;
+    }
+    reportInterval_ = std::max(reportInterval, std::chrono::seconds(1));
+    running_ = true;
+    reportThread_ = std::thread(&RtcpAgent::reportLoop, this);
+    Logger::getLogger()->info("Terminating RTCP, reports every {}s", reportInterval_.count());
+}
+
+void RtcpAgent::stop() {
+    if (!running_.exchange(false)) {
+        return;
+    }
+    if (reportThread_.joinable()) {
+        reportThread_.join();
+    }
+}
+
+void RtcpAgent::receive(const uint8_t* data, size_t len, const boost::asio::ip::udp::endpoint& sender, bool muxed) {
+    auto now = std::chrono::steady_clock::now();
+    uint32_t arrival = ntpShort(ntpNow());
+
+    size_t offset = 0;
+    while (offset + 8 <= len) {
+        const uint8_t* packet = data + offset;
+        if ((packet[0] >> 6) != 2) {
+            break;
+        }
+        size_t length = ((static_cast<size_t>(packet[2]) << 8 | packet[3]) + 1) * 4;
+        if (offset + length > len) {
+            break;
+        }
+        offset += length;
+
+        uint8_t type = packet[1];
+        if (type == RTCP_RTPFB) {
+            if ((packet[0] & 0x1F) == RTCP_FMT_NACK && length >= 16) {
+                handleNack(packet, length, sender);
+            }
+            continue;
+        }
+        size_t fixed = type == RTCP_SR ? 28 : 8;
+        if ((type != RTCP_SR && type != RTCP_RR) || length < fixed) {
+            continue;
+        }
+
+        // The reporter's own session: latch where its RTCP comes from
+        uint32_t reporter = read32(packet + 4);
+        sessions_.updateSession(reporter, [&](SessionInfo& session) {
+            if (sender.address() != session.source.address()) {
+                return;
+            }
+            session.stats.peer.source = sender;
+            session.stats.peer.muxed = muxed;
+            if (type == RTCP_SR) {
+                session.stats.peer.lastSrNtp = read32(packet + 10);
+                session.stats.peer.lastSrArrival = now;
+            }
+        });
+
+        // Its report blocks on the streams the proxy sends
+        size_t blocks = std::min<size_t>(packet[0] & 0x1F, (length - fixed) / 24);
+        for (size_t i = 0; i < blocks; ++i) {
+            const uint8_t* block = packet + fixed + i * 24;
+            uint32_t lostWord = read32(block + 4);
+            uint32_t lsr = read32(block + 16);
+            uint32_t dlsr = read32(block + 20);
+            sessions_.updateSession(read32(block), [&](SessionInfo& session) {
+                RtcpPeerState& peer = session.stats.peer;
+                peer.hasReport = true;
+                peer.fractionLost = static_cast<uint8_t>(lostWord >> 24);
+                // 24-bit signed
+                peer.cumulativeLost = static_cast<int32_t>(lostWord << 8) >> 8;
+                peer.jitter = read32(block + 12);
+                if (lsr != 0) {
+                    int32_t roundTrip = static_cast<int32_t>(arrival - lsr - dlsr);
+                    if (roundTrip >= 0) {
+                        peer.roundTripMs = roundTrip * 1000.0 / 65536.0;
+                    }
+                }
+            });
+        }
+    }
+}
+
+void RtcpAgent::handleNack(const uint8_t* packet, size_t length, const boost::asio::ip::udp::endpoint& sender) {
+    if (!retransmitter_) {
+        return;
+    }
+    uint32_t mediaSsrc = read32(packet + 8);
+    auto now = std::chrono::steady_clock::now();
+
+    // Copied out under the shard lock, sent after
+    std::vector<PacketBuffer> repairs;
+    uint16_t localPort = 0;
+    boost::asio::ip::udp::endpoint destination;
+    uint64_t misses = 0;
+    sessions_.updateSession(mediaSsrc, [&](SessionInfo& session) {
+        // Only the endpoint itself may ask; a NACK is an amplifier otherwise
+        if (sender.address() != session.source.address()) {
+            return;
+        }
+        localPort = session.localPort;
+        destination = session.source;
+        // Each FCI names a lost packet (PID) and a bitmask of the 16 after it
+        for (size_t offset = 12; offset + 4 <= length; offset += 4) {
+            uint16_t pid = static_cast<uint16_t>((packet[offset] << 8) | packet[offset + 1]);
+            uint16_t blp = static_cast<uint16_t>((packet[offset + 2] << 8) | packet[offset + 3]);
+            uint32_t lost = (static_cast<uint32_t>(blp) << 1) | 1;
+            for (uint16_t i = 0; i < 17; ++i) {
+                if (!(lost & (1u << i))) {
+                    continue;
+                }
+                const std::vector<uint8_t>* cached = session.nackCache
+                    ? session.nackCache->find(static_cast<uint16_t>(pid + i), now, nackWindow_) : nullptr;
+                PacketBuffer repair;
+                if (cached) {
+                    repair = PacketArena::instance().allocate();
+                    if (cached->size() <= repair.tailroom()) {
+                        std::memcpy(repair.data(), cached->data(), cached->size());
+                        repair.setSize(cached->size());
+                        repairs.push_back(std::move(repair));
+                        continue;
+                    }
+                }
+                ++misses;
+            }
+        }
+    });
+
+    nackHits_.fetch_add(repairs.size(), std::memory_order_relaxed);
+    nackMisses_.fetch_add(misses, std::memory_order_relaxed);
+    for (const PacketBuffer& repair : repairs) {
+        retransmitter_(localPort, repair.data(), repair.size(), destination);
+    }
+    if (!repairs.empty() || misses > 0) {
+        Logger::getLogger()->debug("NACK for SSRC {}: {} resent, {} no longer cached", mediaSsrc, repairs.size(), misses);
+    }
+}
+
+size_t RtcpAgent::buildReport(uint32_t ssrc, SessionInfo& session, std::chrono::steady_clock::time_point now, uint64_t ntp, uint8_t* out) {
+    RtpSessionStats& stats = session.stats;
+    RtpIntervalLoss uplinkLoss = stats.uplink.takeInterval();
+    RtpIntervalLoss downlinkLoss = stats.downlink.takeInterval();
+    bool isSender = stats.sent.packets != stats.sent.packetsAtLastReport;
+    if (!isSender && uplinkLoss.received == 0) {
+        return 0;
+    }
+    stats.sent.packetsAtLastReport = stats.sent.packets;
+
+    Logger::getLogger()->debug("SSRC {}: uplink lost {}/{} (total {}), jitter {:.1f} ms, reordered {}; "
+                               "QUIC leg lost {}/{} (total {}), jitter {:.1f} ms, reordered {}; "
+                               "endpoint reports {:.1f}% lost, jitter {}, RTT {:.1f} ms",
+                               ssrc, uplinkLoss.expected - std::min(uplinkLoss.received, uplinkLoss.expected), uplinkLoss.expected,
+                               stats.uplink.cumulativeLost(), stats.uplink.jitterMs(), stats.uplink.reordered(),
+                               downlinkLoss.expected - std::min(downlinkLoss.received, downlinkLoss.expected), downlinkLoss.expected,
+                               stats.downlink.cumulativeLost(), stats.downlink.jitterMs(), stats.downlink.reordered(),
+                               stats.peer.fractionLost * 100.0 / 256.0, stats.peer.jitter, stats.peer.roundTripMs);
+
+    // Reports go out under the proxy's own SSRC, never the endpoint's, so
+    // outbound SRTCP cannot repeat the keystream of the endpoint's RTCP.
+    // Listeners can share a master key, so each port reports under its own.
+    uint32_t reporter = reporterSsrc_ ^ session.localPort;
+    if (reporter == ssrc) {
+        reporter = ~reporter;
+    }
+    bool hasBlock = stats.uplink.started();
+    size_t length = (isSender ? 28 : 8) + (hasBlock ? 24 : 0);
+    uint8_t* p = writeHeader(out, hasBlock ? 1 : 0, isSender ? RTCP_SR : RTCP_RR, length);
+    p = write32(p, reporter);
+    if (isSender) {
+        // RTP time now, extrapolated from the last packet sent
+        uint32_t elapsed = static_cast<uint32_t>(std::chrono::duration_cast<std::chrono::microseconds>(now - stats.sent.lastSent).count()
+                                                 * stats.sent.clockRate / 1000000);
+        p = write32(p, static_cast<uint32_t>(ntp >> 32));
+        p = write32(p, static_cast<uint32_t>(ntp));
+        p = write32(p, stats.sent.lastTimestamp + elapsed);
+        p = write32(p, stats.sent.packets);
+        p = write32(p, stats.sent.octets);
+    }
+    if (hasBlock) {
+        int64_t lost = std::max<int64_t>(std::min<int64_t>(stats.uplink.cumulativeLost(), 0x7FFFFF), -0x800000);
+        p = write32(p, ssrc);
+        p = write32(p, (static_cast<uint32_t>(uplinkLoss.fraction) << 24) | (static_cast<uint32_t>(lost) & 0xFFFFFF));
+        p = write32(p, stats.uplink.extendedHighestSequence());
+        p = write32(p, stats.uplink.jitter());
+        p = write32(p, stats.peer.lastSrNtp);
+        p = write32(p, stats.peer.lastSrNtp != 0 ? toNtpShort(now - stats.peer.lastSrArrival) : 0);
+    }
+
+    // SDES with the CNAME, null terminated and padded to a word
+    size_t sdesLength = (4 + 4 + 2 + cname_.size() + 1 + 3) / 4 * 4;
+    uint8_t* sdes = p;
+    std::fill(sdes, sdes + sdesLength, 0);
+    p = writeHeader(p, 1, RTCP_SDES, sdesLength);
+    p = write32(p, reporter);
+    *p++ = SDES_CNAME;
+    *p++ = static_cast<uint8_t>(cname_.size());
+    std::copy(cname_.begin(), cname_.end(), p);
+    return length + sdesLength;
+}
+
+void RtcpAgent::sendReports() {
+    auto now = std::chrono::steady_clock::now();
+    uint64_t ntp = ntpNow();
+
+    // Built under the shard locks, sent after
+    std::vector<PendingReport> reports;
+    sessions_.forEachSession([&](uint32_t ssrc, SessionInfo& session) {
+        reports.emplace_back();
+        PendingReport& report = reports.back();
+        report.length = buildReport(ssrc, session, now, ntp, report.data);
+        if (report.length == 0) {
+            reports.pop_back();
+            return;
+        }
+        report.localPort = session.localPort;
+        const RtcpPeerState& peer = session.stats.peer;
+        if (peer.source.port() != 0) {
+            report.destination = peer.source;
+            report.muxed = peer.muxed;
+        } else {
+            // Nothing heard yet: the usual RTP port + 1
+            report.destination = boost::asio::ip::udp::endpoint(session.source.address(), static_cast<uint16_t>(session.source.port() + 1));
+            report.muxed = false;
+        }
+    });
+
+    if (sender_) {
+        for (const PendingReport& report : reports) {
+            sender_(report.localPort, report.data, report.length, report.destination, report.muxed);
+        }
+    }
+
+    uint64_t hits = nackHits();
+    uint64_t misses = nackMisses();
+    if (hits + misses != loggedNacks_) {
+        loggedNacks_ = hits + misses;
+        Logger::getLogger()->info("NACK cache: {} packets resent, {} missed ({:.1f}% hit rate)",
+                                  hits, misses, hits * 100.0 / static_cast<double>(hits + misses));
+    }
+}
+
+void RtcpAgent::reportLoop() {
+    auto nextReport = std::chrono::steady_clock::now();
+    while (running_.load()) {
+        nextReport += reportInterval_;
+        // Sleep in short steps so stop() does not wait a whole interval
+        while (running_.load() && std::chrono::steady_clock::now() < nextReport) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(100));
+        }
+        if (running_.load()) {
+            sendReports();
+        }
+    }
+}
@@ -0,0 +1,109 @@
+/*
+ * Copyright 2024 nrjchnd@gmail.com
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     https://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an **"AS IS" BASIS,**
+ * **WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.**
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#ifndef RTCP_H
+#define RTCP_H
+
+#include "session_manager.h"
+#include <boost/asio/ip/udp.hpp>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <thread>
+
+const uint8_t RTCP_SR = 200;
+const uint8_t RTCP_RR = 201;
+const uint8_t RTCP_SDES = 202;
+const uint8_t RTCP_RTPFB = 205;
+// Feedback message type of a generic NACK (RFC 4585)
+const uint8_t RTCP_FMT_NACK = 1;
+
+// Largest compound packet the agent builds
+const size_t RTCP_MAX_PACKET = 512;
+
+// RTCP multiplexed with RTP (RFC 5761): packet types 192-223 are where RTP
+// would have the marker bit and payload types 64-95
+inline bool isRtcpPacket(const uint8_t* data, size_t len) {
+    return len >= 8 && (data[0] >> 6) == 2 && data[1] >= 192 && data[1] <= 223;
+}
+
+// Terminates RTCP on the RTP leg, so it never crosses the QUIC hop. SRs and
+// RRs from an endpoint update the RtcpPeerState of its session. Every report
+// interval each session that carried traffic gets a compound packet back: an
+// SR when the proxy sent it media since the last one, an RR otherwise, with
+// a report block on its uplink stream and an SDES CNAME, all under the
+// proxy's own SSRC for that port. The quality of both legs is logged at the
+// same time. Generic NACKs are answered from the sessions' NackCaches; what
+// the cache cannot repair is not asked for again across QUIC.
+class RtcpAgent {
+public:
+    using Sender = std::function<void(uint16_t localPort, const uint8_t* data, size_t len,
+                                      const boost::asio::ip::udp::endpoint& destination, bool muxed)>;
+    using Retransmitter = std::function<void(uint16_t localPort, const uint8_t* data, size_t len,
+                                             const boost::asio::ip::udp::endpoint& destination)>;
+
+    RtcpAgent(SessionManager& sessions, const std::string& cname);
+    ~RtcpAgent();
+
+    // Must be set before start()
+    void setSender(Sender sender);
+    // Resends cached packets no older than window; without one NACKs are
+    // ignored. Must be set before start().
+    void setRetransmitter(Retransmitter retransmitter, std::chrono::milliseconds window);
+    void start(std::chrono::seconds reportInterval);
+    void stop();
+
+    // A compound packet from an endpoint, SRTCP already removed. Reports of
+    // SSRCs without a session are ignored.
+    void receive(const uint8_t* data, size_t len, const boost::asio::ip::udp::endpoint& sender, bool muxed);
+    void sendReports();
+
+    // Lost packets asked for by NACKs, and whether the cache still had them
+    uint64_t nackHits() const { return nackHits_.load(std::memory_order_relaxed); }
+    uint64_t nackMisses() const { return nackMisses_.load(std::memory_order_relaxed); }
+
+private:
+    struct PendingReport {
+        uint16_t localPort;
+        boost::asio::ip::udp::endpoint destination;
+        bool muxed;
+        size_t length;
+        uint8_t data[RTCP_MAX_PACKET];
+    };
+
+    size_t buildReport(uint32_t ssrc, SessionInfo& session, std::chrono::steady_clock::time_point now, uint64_t ntp, uint8_t* out);
+    void handleNack(const uint8_t* packet, size_t length, const boost::asio::ip::udp::endpoint& sender);
+    void reportLoop();
+
+    SessionManager& sessions_;
+    std::string cname_;
+    // Base of the proxy's SSRC in its reports, varied by local port
+    uint32_t reporterSsrc_;
+    Sender sender_;
+    Retransmitter retransmitter_;
+    std::chrono::milliseconds nackWindow_;
+    std::atomic<uint64_t> nackHits_;
+    std::atomic<uint64_t> nackMisses_;
+    uint64_t loggedNacks_;
+
+    std::chrono::seconds reportInterval_;
+    std::atomic<bool> running_;
+    std::thread reportThread_;
+};
+
+#endif // RTCP_H
@@ -0,0 +1,187 @@
+/*
+ * Copyright 2024 nrjchnd@gmail.com
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     https://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an **"AS IS" BASIS,**
+ * **WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.**
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "rtp_batch_parser.h"
+#include <algorithm>
+#include <cstring>
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#define QUICRTP_RTP_PARSER_X86
+#endif
+
+namespace {
+
+// Header length of a packet, 0 when it is not valid RTP. Simple is the
+// common case of a first byte of 0x80: version 2 and nothing but the fixed
+// header, which leaves only the length to check.
+template <bool Simple>
+uint16_t headerLengthOf(const uint8_t* data, size_t len) {
+    if (len < 12) {
+        return 0;
+    }
+    if (Simple) {
+        return 12;
+    }
+    if ((data[0] >> 6) != 2) {
+        return 0;
+    }
+    size_t length = 12 + (data[0] & 0x0F) * 4;
+    if (data[0] & 0x10) {
+        if (len < length + 4) {
+            return 0;
+        }
+        length += 4 + ((data[length + 2] << 8) | data[length + 3]) * 4;
+    }
+    if (length > len) {
+        return 0;
+    }
+    if (data[0] & 0x20) {
+        // The last byte counts the padding, itself included
+        uint8_t padding = data[len - 1];
+        if (padding == 0 || length + padding > len) {
+            return 0;
+        }
+    }
+    return static_cast<uint16_t>(length);
+}
+
+void parseLane(const uint8_t* data, size_t len, RtpHeaderBatch& batch, size_t i) {
+    if (len < 12) {
+        batch.headerLength[i] = 0;
+        batch.ssrc[i] = 0;
+        batch.timestamp[i] = 0;
+        batch.sequenceNumber[i] = 0;
+        batch.markerPayloadType[i] = 0;
+        return;
+    }
+    batch.headerLength[i] = data[0] == 0x80 ? headerLengthOf<true>(data, len) : headerLengthOf<false>(data, len);
+    batch.markerPayloadType[i] = data[1];
+    batch.sequenceNumber[i] = static_cast<uint16_t>((data[2] << 8) | data[3]);
+    batch.timestamp[i] = (static_cast<uint32_t>(data[4]) << 24) | (data[5] << 16) | (data[6] << 8) | data[7];
+    batch.ssrc[i] = (static_cast<uint32_t>(data[8]) << 24) | (data[9] << 16) | (data[10] << 8) | data[11];
+}
+
+void parseBatchScalar(const uint8_t* const* packets, const size_t* lengths, size_t count, RtpHeaderBatch& batch) {
+    for (size_t i = 0; i < count; ++i) {
+        parseLane(packets[i], lengths[i], batch, i);
+    }
+}
+
+#ifdef QUICRTP_RTP_PARSER_X86
+
+// Four packets per step: one gather fetches bytes 0-7 of each and another
+// the SSRCs, shuffles byte-swap them into host order, and the columns are
+// stored with one write each. Lanes that are not plain 12-byte headers are
+// redone by parseLane.
+__attribute__((target("avx2")))
+void parseBatchAvx2(const uint8_t* const* packets, const size_t* lengths, size_t count, RtpHeaderBatch& batch) {
+    // Reversing the first 8 bytes leaves the timestamp in the low half and
+    // sequence number, M/PT and the first byte in the high half
+    const __m256i reverse = _mm256_setr_epi8(7, 6, 5, 4, 3, 2, 1, 0, 15, 14, 13, 12, 11, 10, 9, 8,
+                                             7, 6, 5, 4, 3, 2, 1, 0, 15, 14, 13, 12, 11, 10, 9, 8);
+    const __m256i splitHalves = _mm256_setr_epi32(0, 2, 4, 6, 1, 3, 5, 7);
+    const __m128i swapSsrc = _mm_setr_epi8(3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12);
+    const __m128i takeSequence = _mm_setr_epi8(0, 1, 4, 5, 8, 9, 12, 13, -1, -1, -1, -1, -1, -1, -1, -1);
+    const __m128i takePayloadType = _mm_setr_epi8(2, 6, 10, 14, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1);
+    const __m128i takeFirstByte = _mm_setr_epi8(3, 7, 11, 15, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1);
+    const __m128i simpleFirstByte = _mm_set1_epi8(static_cast<char>(0x80));
+
+    size_t i = 0;
+    for (; i + 4 <= count; i += 4) {
+        // Gathers address each packet relative to the first of the group
+        const uint8_t* base = packets[i];
+        __m256i offsets = _mm256_setr_epi64x(
+            0,
+            static_cast<long long>(reinterpret_cast<intptr_t>(packets[i + 1]) - reinterpret_cast<intptr_t>(base)),
+            static_cast<long long>(reinterpret_cast<intptr_t>(packets[i + 2]) - reinterpret_cast<intptr_t>(base)),
+            static_cast<long long>(reinterpret_cast<intptr_t>(packets[i + 3]) - reinterpret_cast<intptr_t>(base)));
+        __m256i head = _mm256_i64gather_epi64(reinterpret_cast<const long long*>(base), offsets, 1);
+        __m128i ssrc = _mm256_i64gather_epi32(reinterpret_cast<const int*>(base + 8), offsets, 1);
+
+        __m256i fields = _mm256_permutevar8x32_epi32(_mm256_shuffle_epi8(head, reverse), splitHalves);
+        __m128i timestamps = _mm256_castsi256_si128(fields);
+        __m128i high = _mm256_extracti128_si256(fields, 1);
+
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(batch.timestamp + i), timestamps);
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(batch.ssrc + i), _mm_shuffle_epi8(ssrc, swapSsrc));
+        _mm_storel_epi64(reinterpret_cast<__m128i*>(batch.sequenceNumber + i), _mm_shuffle_epi8(high, takeSequence));
+        uint32_t payloadTypes = static_cast<uint32_t>(_mm_cvtsi128_si32(_mm_shuffle_epi8(high, takePayloadType)));
+        std::memcpy(batch.markerPayloadType + i, &payloadTypes, sizeof(payloadTypes));
+
+        unsigned simple = static_cast<unsigned>(_mm_movemask_epi8(
+            _mm_cmpeq_epi8(_mm_shuffle_epi8(high, takeFirstByte), simpleFirstByte))) & 0xF;
+        for (size_t lane = 0; lane < 4; ++lane) {
+            if (simple & (1u << lane)) {
+                batch.headerLength[i + lane] = headerLengthOf<true>(packets[i + lane], lengths[i + lane]);
+            } else {
+                parseLane(packets[i + lane], lengths[i + lane], batch, i + lane);
+            }
+        }
+    }
+    for (; i < count; ++i) {
+        parseLane(packets[i], lengths[i], batch, i);
+    }
+}
+
+#endif
+
+using BatchKernel = void (*)(const uint8_t* const*, const size_t*, size_t, RtpHeaderBatch&);
+
+struct Kernel {
+    BatchKernel parse;
+    const char* name;
+
+    Kernel() : parse(parseBatchScalar), name("scalar") {
+#ifdef QUICRTP_RTP_PARSER_X86
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx2")) {
+            parse = parseBatchAvx2;
+            name = "avx2";
+        }
+#endif
+    }
+};
+
+const Kernel& kernel() {
+    static const Kernel instance;
+    return instance;
+}
+
+}
+
+bool parseRtpHeader(const uint8_t* data, size_t len, RtpHeaderInfo& info) {
+    info = RtpHeaderInfo();
+    if (len < 12) {
+        return false;
+    }
+    info.headerLength = data[0] == 0x80 ? headerLengthOf<true>(data, len) : headerLengthOf<false>(data, len);
+    info.marker = (data[1] & 0x80) != 0;
+    info.payloadType = data[1] & 0x7F;
+    info.sequenceNumber = static_cast<uint16_t>((data[2] << 8) | data[3]);
+    info.timestamp = (static_cast<uint32_t>(data[4]) << 24) | (data[5] << 16) | (data[6] << 8) | data[7];
+    info.ssrc = (static_cast<uint32_t>(data[8]) << 24) | (data[9] << 16) | (data[10] << 8) | data[11];
+    return info.valid();
+}
+
+void parseRtpBatch(const uint8_t* const* packets, const size_t* lengths, size_t count, RtpHeaderBatch& batch) {
+    batch.count = std::min(count, RTP_BATCH_MAX);
+    kernel().parse(packets, lengths, batch.count, batch);
+}
+
+const char* rtpParserKernel() {
+    return kernel().name;
+}
@@ -0,0 +1,79 @@
+/*
+ * Copyright 2024 nrjchnd@gmail.com
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     https://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an **"AS IS" BASIS,**
+ * **WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.**
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#ifndef RTP_BATCH_PARSER_H
+#define RTP_BATCH_PARSER_H
+
+#include <cstddef>
+#include <cstdint>
+
+// Header fields of one RTP packet in host byte order
+struct RtpHeaderInfo {
+    uint32_t ssrc = 0;
+    uint32_t timestamp = 0;
+    uint16_t sequenceNumber = 0;
+    uint8_t payloadType = 0;
+    bool marker = false;
+    // Fixed header, CSRCs and extension; 0 when the packet is not valid RTP
+    uint16_t headerLength = 0;
+
+    bool valid() const { return headerLength != 0; }
+};
+
+const size_t RTP_BATCH_MAX = 64;
+
+// Headers of a receive batch as parallel arrays, so the stages after the
+// parser (session lookup, translation) walk dense columns
+struct RtpHeaderBatch {
+    size_t count = 0;
+    uint32_t ssrc[RTP_BATCH_MAX];
+    uint32_t timestamp[RTP_BATCH_MAX];
+    uint16_t sequenceNumber[RTP_BATCH_MAX];
+    uint16_t headerLength[RTP_BATCH_MAX];    // 0 for invalid packets
+    uint8_t markerPayloadType[RTP_BATCH_MAX];   // second header byte as sent
+
+    RtpHeaderInfo at(size_t i) const {
+        RtpHeaderInfo info;
+        info.ssrc = ssrc[i];
+        info.timestamp = timestamp[i];
+        info.sequenceNumber = sequenceNumber[i];
+        info.payloadType = markerPayloadType[i] & 0x7F;
+        info.marker = (markerPayloadType[i] & 0x80) != 0;
+        info.headerLength = headerLength[i];
+        return info;
+    }
+    void set(size_t i, const RtpHeaderInfo& info) {
+        ssrc[i] = info.ssrc;
+        timestamp[i] = info.timestamp;
+        sequenceNumber[i] = info.sequenceNumber;
+        markerPayloadType[i] = static_cast<uint8_t>((info.marker ? 0x80 : 0) | (info.payloadType & 0x7F));
+        headerLength[i] = info.headerLength;
+    }
+};
+
+// Validates version 2, the CSRC list, the extension and padding against the
+// packet length. False for packets that are not valid RTP.
+bool parseRtpHeader(const uint8_t* data, size_t len, RtpHeaderInfo& info);
+
+// Parses up to RTP_BATCH_MAX packets into batch. Packets whose first byte is
+// 0x80 (no padding, extension or CSRCs) take a vector path, four at a time;
+// the rest fall back to parseRtpHeader. Every buffer must be readable for
+// 12 bytes even when the packet is shorter, which receive buffers are.
+void parseRtpBatch(const uint8_t* const* packets, const size_t* lengths, size_t count, RtpHeaderBatch& batch);
+
+// Name of the batch kernel picked for this CPU
+const char* rtpParserKernel();
+
+#endif // RTP_BATCH_PARSER_H
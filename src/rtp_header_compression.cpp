@@ -0,0 +1,313 @@
+/*
+ * Copyright 2024 nrjchnd@gmail.com
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     https://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an **"AS IS" BASIS,**
+ * **WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.**
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "rtp_header_compression.h"
+#include <cstring>
+
+namespace {
+uint16_t read16(const uint8_t* p) {
+    return static_cast<uint16_t>((p[0] << 8) | p[1]);
+}
+
+uint32_t read32(const uint8_t* p) {
+    return (static_cast<uint32_t>(p[0]) << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+}
+
+void writeMessageStart(CompressedMessage type, uint16_t cid, uint8_t* out) {
+    out[0] = static_cast<uint8_t>((static_cast<uint8_t>(type) << 6) | ((cid >> 8) & 0x3F));
+    out[1] = cid & 0xFF;
+}
+
+// CRC-8 (polynomial 0x07) of a reference's sequence number and timestamp
+uint8_t referenceCheck(uint16_t sequence, uint32_t timestamp) {
+    const uint8_t bytes[6] = {
+        static_cast<uint8_t>(sequence >> 8), static_cast<uint8_t>(sequence),
+        static_cast<uint8_t>(timestamp >> 24), static_cast<uint8_t>(timestamp >> 16),
+        static_cast<uint8_t>(timestamp >> 8), static_cast<uint8_t>(timestamp)
+    };
+    uint8_t crc = 0;
+    for (uint8_t byte : bytes) {
+        crc ^= byte;
+        for (int bit = 0; bit < 8; ++bit) {
+            crc = static_cast<uint8_t>((crc & 0x80) ? (crc << 1) ^ 0x07 : crc << 1);
+        }
+    }
+    return crc;
+}
+
+// Bytes needed for a big-endian unsigned value (at least one)
+size_t bytesFor(uint32_t value) {
+    if (value <= 0xFF) {
+        return 1;
+    }
+    if (value <= 0xFFFF) {
+        return 2;
+    }
+    return value <= 0xFFFFFF ? 3 : 4;
+}
+}
+
+size_t rtpHeaderLength(const uint8_t* data, size_t len) {
+    if (len < 12 || (data[0] >> 6) != 2) {
+        return 0;
+    }
+    size_t headerLength = 12 + (data[0] & 0x0F) * 4;
+    if (data[0] & 0x10) {
+        if (len < headerLength + 4) {
+            return 0;
+        }
+        headerLength += 4 + read16(data + headerLength + 2) * 4;
+    }
+    return headerLength <= len ? headerLength : 0;
+}
+
+RtpHeaderCompressor::RtpHeaderCompressor(uint32_t refreshInterval)
+    : refreshInterval_(refreshInterval > 0 ? refreshInterval : 1),
+      cidOwners_(COMPRESSION_MAX_CONTEXTS, 0), cidInUse_(COMPRESSION_MAX_CONTEXTS, false), nextCid_(0),
+      cidStep_(1), cidCapacity_(COMPRESSION_MAX_CONTEXTS)
+{
+}
+
+void RtpHeaderCompressor::setCidPartition(uint16_t index, uint16_t count) {
+    cidStep_ = count > 0 ? count : 1;
+    nextCid_ = static_cast<uint16_t>(index % cidStep_);
+    cidCapacity_ = (COMPRESSION_MAX_CONTEXTS - nextCid_ + cidStep_ - 1) / cidStep_;
+}
+
+RtpHeaderCompressor::Context& RtpHeaderCompressor::contextFor(uint32_t ssrc) {
+    auto it = contexts_.find(ssrc);
+    if (it != contexts_.end()) {
+        lru_.splice(lru_.begin(), lru_, it->second.lru);
+        return it->second;
+    }
+
+    // New stream: take the next free CID, or the least recently used one
+    // when every CID is taken
+    uint16_t cid = nextCid_;
+    if (contexts_.size() < cidCapacity_) {
+        while (cidInUse_[cid]) {
+            cid = nextInPartition(cid);
+        }
+    } else {
+        auto oldest = contexts_.find(lru_.back());
+        cid = oldest->second.cid;
+        contexts_.erase(oldest);
+        lru_.pop_back();
+    }
+    nextCid_ = nextInPartition(cid);
+    cidInUse_[cid] = true;
+    cidOwners_[cid] = ssrc;
+
+    Context& context = contexts_[ssrc];
+    context.cid = cid;
+    context.lru = lru_.insert(lru_.begin(), ssrc);
+    return context;
+}
+
+void RtpHeaderCompressor::release(uint32_t ssrc) {
+    auto it = contexts_.find(ssrc);
+    if (it == contexts_.end()) {
+        return;
+    }
+    cidInUse_[it->second.cid] = false;
+    lru_.erase(it->second.lru);
+    contexts_.erase(it);
+}
+
+uint16_t RtpHeaderCompressor::nextInPartition(uint16_t cid) const {
+    size_t next = static_cast<size_t>(cid) + cidStep_;
+    return static_cast<uint16_t>(next < COMPRESSION_MAX_CONTEXTS ? next : cid % cidStep_);
+}
+
+size_t RtpHeaderCompressor::compress(const uint8_t* rtp, size_t headerLength, uint8_t* out) {
+    uint32_t ssrc = read32(rtp + 8);
+    Context& context = contextFor(ssrc);
+
+    bool marker = (rtp[1] & 0x80) != 0;
+    uint8_t payloadType = rtp[1] & 0x7F;
+    uint16_t sequence = read16(rtp + 2);
+    uint32_t timestamp = read32(rtp + 4);
+    bool plainHeader = (rtp[0] & 0x1F) == 0;   // no extension, no CSRCs
+
+    if (!context.valid || !plainHeader || context.refreshRequested || ++context.sinceRefresh >= refreshInterval_) {
+        // New reference under the next generation; packets compressed against
+        // the previous one stay decodable on the far side
+        context.generation = (context.generation + 1) & 0x03;
+        context.valid = plainHeader;
+        context.refreshRequested = false;
+        context.sinceRefresh = 0;
+        context.payloadType = payloadType;
+        context.sequence = sequence;
+        context.timestamp = timestamp;
+        context.check = referenceCheck(sequence, timestamp);
+
+        writeMessageStart(CompressedMessage::Full, context.cid, out);
+        out[2] = context.generation;
+        std::memcpy(out + COMPRESSION_FULL_OVERHEAD, rtp, headerLength);
+        return COMPRESSION_FULL_OVERHEAD + headerLength;
+    }
+
+    uint16_t sequenceDelta = static_cast<uint16_t>(sequence - context.sequence);
+    uint32_t timestampDelta = timestamp - context.timestamp;
+    bool payloadTypeChanged = (payloadType != context.payloadType);
+    bool wideSequence = sequenceDelta > 0xFF;
+    size_t timestampBytes = bytesFor(timestampDelta);
+
+    writeMessageStart(CompressedMessage::Compressed, context.cid, out);
+    out[2] = static_cast<uint8_t>((marker ? 0x80 : 0) |
+                                  (payloadTypeChanged ? 0x40 : 0) |
+                                  (context.generation << 4) |
+                                  (wideSequence ? 0x08 : 0) |
+                                  ((timestampBytes - 1) << 1) |
+                                  ((rtp[0] & 0x20) ? 0x01 : 0));
+    out[3] = context.check;
+    size_t offset = 4;
+    if (payloadTypeChanged) {
+        out[offset++] = payloadType;
+    }
+    if (wideSequence) {
+        out[offset++] = sequenceDelta >> 8;
+    }
+    out[offset++] = sequenceDelta & 0xFF;
+    for (size_t i = timestampBytes; i-- > 0;) {
+        out[offset++] = (timestampDelta >> (i * 8)) & 0xFF;
+    }
+    return offset;
+}
+
+void RtpHeaderCompressor::requestRefresh(uint16_t cid) {
+    if (cid >= COMPRESSION_MAX_CONTEXTS || !cidInUse_[cid]) {
+        return;
+    }
+    auto it = contexts_.find(cidOwners_[cid]);
+    if (it != contexts_.end() && it->second.cid == cid) {
+        it->second.refreshRequested = true;
+    }
+}
+
+RtpHeaderDecompressor::Result RtpHeaderDecompressor::decompress(const uint8_t* message, size_t len, uint8_t* rebuilt,
+                                                                const uint8_t*& header, size_t& headerLength,
+                                                                size_t& payloadOffset, uint16_t& cid) {
+    if (len < 2) {
+        return Result::Invalid;
+    }
+    CompressedMessage type = static_cast<CompressedMessage>(message[0] >> 6);
+    cid = static_cast<uint16_t>(((message[0] & 0x3F) << 8) | message[1]);
+
+    if (type == CompressedMessage::ContextRequest) {
+        return Result::RefreshRequested;
+    }
+
+    if (type == CompressedMessage::Full) {
+        if (len < COMPRESSION_FULL_OVERHEAD) {
+            return Result::Invalid;
+        }
+        header = message + COMPRESSION_FULL_OVERHEAD;
+        headerLength = rtpHeaderLength(header, len - COMPRESSION_FULL_OVERHEAD);
+        if (headerLength == 0) {
+            return Result::Invalid;
+        }
+        payloadOffset = COMPRESSION_FULL_OVERHEAD + headerLength;
+
+        Context& context = contexts_[cid];
+        context.refreshPending = false;
+        uint32_t ssrc = read32(header + 8);
+        // A CID handed to a new stream invalidates what the old one left
+        for (Reference& reference : context.references) {
+            if (reference.ssrc != ssrc) {
+                reference.valid = false;
+            }
+        }
+        if ((header[0] & 0x1F) == 0) {
+            Reference& reference = context.references[message[2] & 0x03];
+            reference.valid = true;
+            reference.payloadType = header[1] & 0x7F;
+            reference.sequence = read16(header + 2);
+            reference.timestamp = read32(header + 4);
+            reference.check = referenceCheck(reference.sequence, reference.timestamp);
+            reference.ssrc = ssrc;
+        }
+        return Result::Header;
+    }
+
+    if (type != CompressedMessage::Compressed || len < 4) {
+        return Result::Invalid;
+    }
+
+    uint8_t control = message[2];
+    auto it = contexts_.find(cid);
+    Reference* reference = (it != contexts_.end()) ? &it->second.references[(control >> 4) & 0x03] : nullptr;
+    if (reference && reference->valid && reference->check != message[3]) {
+        // Stale generation: the Full message that replaced it never arrived
+        reference->valid = false;
+    }
+    if (!reference || !reference->valid) {
+        Context& context = contexts_[cid];
+        if (context.refreshPending) {
+            return Result::AwaitingContext;
+        }
+        context.refreshPending = true;
+        return Result::MissingContext;
+    }
+
+    size_t sequenceBytes = (control & 0x08) ? 2 : 1;
+    size_t timestampBytes = ((control >> 1) & 0x03) + 1;
+    size_t offset = 4;
+    size_t needed = offset + ((control & 0x40) ? 1 : 0) + sequenceBytes + timestampBytes;
+    if (len < needed) {
+        return Result::Invalid;
+    }
+
+    uint8_t payloadType = reference->payloadType;
+    if (control & 0x40) {
+        payloadType = message[offset++] & 0x7F;
+    }
+    uint16_t sequenceDelta = 0;
+    for (size_t i = 0; i < sequenceBytes; ++i) {
+        sequenceDelta = static_cast<uint16_t>((sequenceDelta << 8) | message[offset++]);
+    }
+    uint32_t timestampDelta = 0;
+    for (size_t i = 0; i < timestampBytes; ++i) {
+        timestampDelta = (timestampDelta << 8) | message[offset++];
+    }
+
+    uint16_t sequence = static_cast<uint16_t>(reference->sequence + sequenceDelta);
+    uint32_t timestamp = reference->timestamp + timestampDelta;
+    uint32_t ssrc = reference->ssrc;
+
+    rebuilt[0] = 0x80 | ((control & 0x01) ? 0x20 : 0);
+    rebuilt[1] = static_cast<uint8_t>(((control & 0x80) ? 0x80 : 0) | payloadType);
+    rebuilt[2] = sequence >> 8;
+    rebuilt[3] = sequence & 0xFF;
+    rebuilt[4] = (timestamp >> 24) & 0xFF;
+    rebuilt[5] = (timestamp >> 16) & 0xFF;
+    rebuilt[6] = (timestamp >> 8) & 0xFF;
+    rebuilt[7] = timestamp & 0xFF;
+    rebuilt[8] = (ssrc >> 24) & 0xFF;
+    rebuilt[9] = (ssrc >> 16) & 0xFF;
+    rebuilt[10] = (ssrc >> 8) & 0xFF;
+    rebuilt[11] = ssrc & 0xFF;
+
+    header = rebuilt;
+    headerLength = 12;
+    payloadOffset = offset;
+    return Result::Header;
+}
+
+size_t RtpHeaderDecompressor::contextRequest(uint16_t cid, uint8_t* out) {
+    writeMessageStart(CompressedMessage::ContextRequest, cid, out);
+    return 2;
+}
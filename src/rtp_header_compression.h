@@ -0,0 +1,146 @@
+/*
+ * Copyright 2024 nrjchnd@gmail.com
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     https://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an **"AS IS" BASIS,**
+ * **WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.**
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#ifndef RTP_HEADER_COMPRESSION_H
+#define RTP_HEADER_COMPRESSION_H
+
+#include <cstddef>
+#include <cstdint>
+#include <list>
+#include <unordered_map>
+#include <vector>
+
+// RTP header compression for the QUIC leg, in the spirit of cRTP/ROHC.
+//
+// Every message starts with two bytes: the message type in the top two bits
+// and a 14-bit context ID (one per SSRC) in the rest.
+//
+//   Full            cid | generation | RTP header verbatim | payload
+//   Compressed      cid | control | check | [PT] | seq delta | ts delta | payload
+//   ContextRequest  cid
+//
+// A Full message sets the reference for its generation (0-3). Compressed
+// deltas are taken against that reference rather than the previous packet,
+// so losing or reordering compressed packets never corrupts the context,
+// and the decompressor keeps the last four generations for packets that
+// arrive after a refresh. Control byte: M | PT present | generation (2) |
+// 2-byte seq | ts delta size - 1 (2) | P. The check byte is a CRC-8 of the
+// reference's sequence number and timestamp; when the Full message of a
+// generation was lost, the slot still holds the reference from four
+// generations earlier, and the mismatch makes the decompressor ask for a
+// refresh instead of rebuilding a wrong header.
+//
+// Headers with CSRCs or an extension are always sent in full, so the
+// receiver restores every header bit for bit.
+
+const size_t COMPRESSION_FULL_OVERHEAD = 3;
+const size_t COMPRESSION_MAX_CONTEXTS = 1 << 14;
+
+enum class CompressedMessage : uint8_t {
+    Full = 0,
+    Compressed = 1,
+    ContextRequest = 2
+};
+
+// Length of the RTP header at data (fixed part, CSRCs and extension), or 0
+// when it is not a valid RTP version 2 header
+size_t rtpHeaderLength(const uint8_t* data, size_t len);
+
+class RtpHeaderCompressor {
+public:
+    // A context is refreshed with a Full message every refreshInterval packets
+    explicit RtpHeaderCompressor(uint32_t refreshInterval = 32);
+
+    // Writes the compressed form of the RTP header (headerLength bytes at
+    // rtp, see rtpHeaderLength()) to out, which must hold headerLength +
+    // COMPRESSION_FULL_OVERHEAD bytes. Returns the bytes written.
+    size_t compress(const uint8_t* rtp, size_t headerLength, uint8_t* out);
+
+    // The peer lost the context; its next packet is sent in full
+    void requestRefresh(uint16_t cid);
+    // The stream ended; its CID is free for the next new stream
+    void release(uint32_t ssrc);
+
+    void setRefreshInterval(uint32_t refreshInterval) { refreshInterval_ = refreshInterval > 0 ? refreshInterval : 1; }
+    // Use only the CIDs equal to index modulo count, so that several
+    // compressors can share one CID space. Call before the first packet.
+    void setCidPartition(uint16_t index, uint16_t count);
+
+private:
+    struct Context {
+        uint16_t cid = 0;
+        bool valid = false;
+        bool refreshRequested = false;
+        uint8_t generation = 0;
+        uint8_t payloadType = 0;
+        uint8_t check = 0;
+        uint16_t sequence = 0;
+        uint32_t timestamp = 0;
+        uint32_t sinceRefresh = 0;
+        std::list<uint32_t>::iterator lru;
+    };
+
+    Context& contextFor(uint32_t ssrc);
+    uint16_t nextInPartition(uint16_t cid) const;
+
+    uint32_t refreshInterval_;
+    std::unordered_map<uint32_t, Context> contexts_;   // by SSRC
+    std::list<uint32_t> lru_;                          // SSRCs, most recently used first
+    std::vector<uint32_t> cidOwners_;                  // SSRC using each CID
+    std::vector<bool> cidInUse_;
+    uint16_t nextCid_;
+    uint16_t cidStep_;
+    size_t cidCapacity_;
+};
+
+class RtpHeaderDecompressor {
+public:
+    enum class Result {
+        Header,             // header/payload describe an RTP packet
+        RefreshRequested,   // the peer asks our compressor to refresh cid
+        MissingContext,     // no reference for the packet; ask for a refresh
+        AwaitingContext,    // no reference, refresh already requested; drop
+        Invalid
+    };
+
+    // Parses one message. For Header, header points either into message
+    // (Full) or into rebuilt (at least 12 bytes, Compressed), and the payload
+    // starts at message + payloadOffset.
+    Result decompress(const uint8_t* message, size_t len, uint8_t* rebuilt,
+                      const uint8_t*& header, size_t& headerLength, size_t& payloadOffset, uint16_t& cid);
+
+    // ContextRequest message for cid; out must hold 2 bytes
+    static size_t contextRequest(uint16_t cid, uint8_t* out);
+
+private:
+    struct Reference {
+        bool valid = false;
+        uint8_t payloadType = 0;
+        uint8_t check = 0;
+        uint16_t sequence = 0;
+        uint32_t timestamp = 0;
+        uint32_t ssrc = 0;
+    };
+
+    struct Context {
+        Reference references[4];
+        // One request per context until a Full message answers it
+        bool refreshPending = false;
+    };
+
+    std::unordered_map<uint16_t, Context> contexts_;
+};
+
+#endif // RTP_HEADER_COMPRESSION_H
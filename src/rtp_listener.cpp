@@ -15,16 +15,44 @@
  */
 #include "rtp_listener.h"
 #include "logger.h"
+#include "probes.h"
+#include "rtcp.h"
 #include <iostream>
 #include <stdexcept>
 #include <srtp2/srtp.h>
+#include <mutex>
+#include <cstring>
+#include <unistd.h>
 
-RtpListener::RtpListener(boost::asio::io_context& io_context, bool isSrtp, const std::string& srtpKey)
-    : isSrtp_(isSrtp), srtpKey_(srtpKey), socket_(io_context)
+namespace {
+// libsrtp is initialised once for all listeners; listeners now come and go
+// with sessions, so the last one out shuts it down.
+std::mutex srtpLibraryMutex;
+int srtpLibraryUsers = 0;
+
+bool acquireSrtpLibrary() {
+    std::lock_guard<std::mutex> lock(srtpLibraryMutex);
+    if (srtpLibraryUsers == 0 && srtp_init() != srtp_err_status_ok) {
+        return false;
+    }
+    ++srtpLibraryUsers;
+    return true;
+}
+
+void releaseSrtpLibrary() {
+    std::lock_guard<std::mutex> lock(srtpLibraryMutex);
+    if (--srtpLibraryUsers == 0) {
+        srtp_shutdown();
+    }
+}
+}
+
+RtpListener::RtpListener(boost::asio::io_context& io_context, bool isSrtp, const std::string& srtpKey, const std::string& ioBackend)
+    : isSrtp_(isSrtp), srtpKey_(srtpKey), port_(0), io_context_(io_context), ioBackend_(ioBackend), batchSize_(1)
 {
     try {
         if (isSrtp_) {
-            if (srtp_init() != srtp_err_status_ok) {
+            if (!acquireSrtpLibrary()) {
                 throw std::runtime_error("Failed to initialize SRTP");
             }
             memset(&policy_, 0, sizeof(policy_));
@@ -49,8 +77,25 @@ RtpListener::RtpListener(boost::asio::io_context& io_context, bool isSrtp, const
             }
 
             if (srtp_create(&srtpSession_, &policy_) != srtp_err_status_ok) {
+                free(policy_.key);
+                releaseSrtpLibrary();
                 throw std::runtime_error("Error creating SRTP session");
             }
+            srtp_policy_t outbound = policy_;
+            outbound.ssrc.type = ssrc_any_outbound;
+            if (srtp_create(&srtcpInbound_, &policy_) != srtp_err_status_ok) {
+                srtp_dealloc(srtpSession_);
+                free(policy_.key);
+                releaseSrtpLibrary();
+                throw std::runtime_error("Error creating SRTCP session");
+            }
+            if (srtp_create(&srtcpOutbound_, &outbound) != srtp_err_status_ok) {
+                srtp_dealloc(srtcpInbound_);
+                srtp_dealloc(srtpSession_);
+                free(policy_.key);
+                releaseSrtpLibrary();
+                throw std::runtime_error("Error creating SRTCP session");
+            }
         }
     } catch (const std::exception& e) {
         Logger::getLogger()->error("RtpListener initialization error: {}", e.what());
@@ -61,21 +106,58 @@ RtpListener::RtpListener(boost::asio::io_context& io_context, bool isSrtp, const
 RtpListener::~RtpListener() {
     stop();
     if (isSrtp_) {
+        srtp_dealloc(srtcpOutbound_);
+        srtp_dealloc(srtcpInbound_);
         srtp_dealloc(srtpSession_);
-        srtp_shutdown();
         free(policy_.key);
+        releaseSrtpLibrary();
     }
 }
 
-void RtpListener::start(uint16_t port) {
+void RtpListener::start(uint16_t port, bool reusePort, int inheritedFd, int inheritedRtcpFd) {
     try {
-        boost::asio::ip::udp::endpoint endpoint(boost::asio::ip::udp::v4(), port);
-        socket_.open(endpoint.protocol());
-        socket_.bind(endpoint);
+        io_ = createUdpIo(ioBackend_, io_context_, batchSize_);
+        if (inheritedFd >= 0) {
+            io_->adopt(inheritedFd, port);
+        } else {
+            io_->open(port, reusePort);
+        }
+        port_ = port;
+
+        Logger::getLogger()->info("RTP Listener {} on port {} ({})", inheritedFd >= 0 ? "adopted" : "started", port, io_->name());
 
-        Logger::getLogger()->info("RTP Listener started on port {}", port);
+        std::weak_ptr<RtpListener> weak = shared_from_this();
+        io_->startReceiveBatch([weak](ReceiveBatch& batch) {
+            if (auto self = weak.lock()) {
+                self->processBatch(batch);
+            }
+        });
 
-        receive();
+        // RTCP is light; the reactor backend will do, and SO_REUSEPORT lets
+        // the successor of a hot upgrade bind it while this process serves it
+        if (rtcpHandler_ && port < 65535) {
+            try {
+                rtcpIo_ = createUdpIo("epoll", io_context_, 1);
+                if (inheritedRtcpFd >= 0) {
+                    rtcpIo_->adopt(inheritedRtcpFd, static_cast<uint16_t>(port + 1));
+                    inheritedRtcpFd = -1;
+                } else {
+                    rtcpIo_->open(static_cast<uint16_t>(port + 1), true);
+                }
+                rtcpIo_->startReceive([weak](uint8_t* data, size_t len, const boost::asio::ip::udp::endpoint& sender) {
+                    auto self = weak.lock();
+                    if (self && self->unprotectRtcp(data, len)) {
+                        self->rtcpHandler_(data, len, sender, false);
+                    }
+                });
+            } catch (const std::exception& e) {
+                Logger::getLogger()->warn("RTCP port {} is unavailable: {}", port + 1, e.what());
+                rtcpIo_.reset();
+            }
+        }
+        if (inheritedRtcpFd >= 0) {
+            ::close(inheritedRtcpFd);
+        }
     } catch (const std::exception& e) {
         Logger::getLogger()->error("Error starting RTP listener on port {}: {}", port, e.what());
         throw;
@@ -83,51 +165,155 @@ void RtpListener::start(uint16_t port) {
 }
 
 void RtpListener::stop() {
+    if (!io_ || !io_->isOpen()) {
+        return;
+    }
     try {
-        socket_.close();
-        Logger::getLogger()->info("RTP Listener stopped");
+        if (rtcpIo_) {
+            rtcpIo_->close();
+        }
+        io_->close();
+        Logger::getLogger()->info("RTP Listener stopped on port {}", port_);
     } catch (const std::exception& e) {
         Logger::getLogger()->error("Error stopping RTP listener: {}", e.what());
     }
 }
 
-void RtpListener::setPacketHandler(std::function<void(const uint8_t* data, size_t len, const boost::asio::ip::udp::endpoint& sender)> handler) {
-    packetHandler_ = handler;
+void RtpListener::setBatchHandler(std::function<void(ReceiveBatch& batch)> handler) {
+    batchHandler_ = handler;
+}
+
+void RtpListener::setRtcpHandler(RtcpHandler handler) {
+    rtcpHandler_ = handler;
+}
+
+void RtpListener::setReceiveBatch(size_t batchSize) {
+    batchSize_ = batchSize > 0 ? batchSize : 1;
+}
+
+void RtpListener::sendTo(const uint8_t* data, size_t len, const boost::asio::ip::udp::endpoint& destination) {
+    if (io_) {
+        io_->sendTo(data, len, destination);
+    }
+}
+
+void RtpListener::sendTo(const boost::asio::const_buffer& header, const boost::asio::const_buffer& payload,
+                         const boost::asio::ip::udp::endpoint& destination) {
+    if (io_) {
+        io_->sendTo(header, payload, destination);
+    }
 }
 
-void RtpListener::receive() {
-    socket_.async_receive_from(
-        boost::asio::buffer(recvBuffer_), remoteEndpoint_,
-        [this](const boost::system::error_code& error, size_t bytes_transferred) {
-            handleReceive(error, bytes_transferred);
+void RtpListener::sendRtcp(const uint8_t* data, size_t len, const boost::asio::ip::udp::endpoint& destination, bool muxed) {
+    std::shared_ptr<UdpIo> io = muxed ? io_ : rtcpIo_;
+    if (!io) {
+        return;
+    }
+    if (!isSrtp_) {
+        io->sendTo(data, len, destination);
+        return;
+    }
+    uint8_t packet[RTCP_MAX_PACKET + SRTP_MAX_TRAILER_LEN];
+    if (len > RTCP_MAX_PACKET) {
+        return;
+    }
+    std::memcpy(packet, data, len);
+    int srtcpLen = static_cast<int>(len);
+    {
+        std::lock_guard<std::mutex> lock(srtcpMutex_);
+        if (srtp_protect_rtcp(srtcpOutbound_, packet, &srtcpLen) != srtp_err_status_ok) {
+            Logger::getLogger()->error("Error encrypting SRTCP packet");
+            return;
         }
-    );
+    }
+    io->sendTo(packet, static_cast<size_t>(srtcpLen), destination);
 }
 
-void RtpListener::handleReceive(const boost::system::error_code& error, size_t bytes_transferred) {
-    if (!error) {
-        uint8_t* data = recvBuffer_.data();
-        size_t len = bytes_transferred;
+bool RtpListener::srtpRoc(uint32_t ssrc, uint32_t& roc) {
+    if (!isSrtp_) {
+        return false;
+    }
+    std::lock_guard<std::mutex> lock(srtpMutex_);
+    return srtp_get_stream_roc(srtpSession_, ssrc, &roc) == srtp_err_status_ok;
+}
 
-        if (isSrtp_) {
-            srtp_err_status_t status = srtp_unprotect(srtpSession_, data, (int*)&len);
-            if (status != srtp_err_status_ok) {
-                Logger::getLogger()->error("Error decrypting SRTP packet");
-                receive();
-                return;
+void RtpListener::restoreSrtpRoc(uint32_t ssrc, uint32_t roc) {
+    if (!isSrtp_) {
+        return;
+    }
+    // The stream has to exist for its counter to be set; it is added with
+    // the session's own key, as the template would on the first packet
+    srtp_policy_t policy = policy_;
+    policy.ssrc.type = ssrc_specific;
+    policy.ssrc.value = ssrc;
+    policy.next = nullptr;
+    std::lock_guard<std::mutex> lock(srtpMutex_);
+    if (srtp_add_stream(srtpSession_, &policy) != srtp_err_status_ok ||
+        srtp_set_stream_roc(srtpSession_, ssrc, roc) != srtp_err_status_ok) {
+        Logger::getLogger()->warn("Cannot restore the SRTP rollover counter of SSRC {} on port {}", ssrc, port_);
+    }
+}
+
+bool RtpListener::unprotectRtcp(uint8_t* data, size_t& len) {
+    if (!isSrtp_) {
+        return true;
+    }
+    int srtcpLen = static_cast<int>(len);
+    std::lock_guard<std::mutex> lock(srtcpMutex_);
+    if (srtp_unprotect_rtcp(srtcpInbound_, data, &srtcpLen) != srtp_err_status_ok) {
+        Logger::getLogger()->error("Error decrypting SRTCP packet");
+        return false;
+    }
+    len = static_cast<size_t>(srtcpLen);
+    return true;
+}
+
+void RtpListener::processBatch(ReceiveBatch& batch) {
+    QUICRTP_PROBE2(rtp_receive_batch, port_, batch.count);
+    if (rtcpHandler_) {
+        // Multiplexed RTCP leaves the batch here
+        size_t kept = 0;
+        for (size_t i = 0; i < batch.count; ++i) {
+            if (isRtcpPacket(batch.data[i], batch.length[i])) {
+                size_t len = batch.length[i];
+                if (unprotectRtcp(batch.data[i], len)) {
+                    rtcpHandler_(batch.data[i], len, batch.sender[i], true);
+                }
+                continue;
+            }
+            if (kept != i) {
+                batch.data[kept] = batch.data[i];
+                batch.length[kept] = batch.length[i];
+                batch.sender[kept] = batch.sender[i];
             }
+            ++kept;
         }
+        batch.count = kept;
+    }
 
-        if (packetHandler_) {
-            packetHandler_(data, len, remoteEndpoint_);
+    if (isSrtp_) {
+        // Decrypt in place and close the gaps left by packets that fail
+        std::lock_guard<std::mutex> lock(srtpMutex_);
+        size_t kept = 0;
+        for (size_t i = 0; i < batch.count; ++i) {
+            int srtpLen = static_cast<int>(batch.length[i]);
+            srtp_err_status_t status = srtp_unprotect(srtpSession_, batch.data[i], &srtpLen);
+            QUICRTP_PROBE3(srtp_unprotect, port_, batch.length[i], status == srtp_err_status_ok ? srtpLen : 0);
+            if (status != srtp_err_status_ok) {
+                Logger::getLogger()->error("Error decrypting SRTP packet");
+                continue;
+            }
+            if (kept != i) {
+                batch.data[kept] = batch.data[i];
+                batch.sender[kept] = batch.sender[i];
+            }
+            batch.length[kept] = static_cast<size_t>(srtpLen);
+            ++kept;
         }
+        batch.count = kept;
+    }
 
-        receive();
-    } else {
-        Logger::getLogger()->error("Receive error: {}", error.message());
-        // Attempt to restart receive if the error is recoverable
-        if (error != boost::asio::error::operation_aborted) {
-            receive();
-        }
+    if (batchHandler_ && batch.count > 0) {
+        batchHandler_(batch);
     }
 }
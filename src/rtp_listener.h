@@ -23,32 +23,80 @@
 #include <srtp2/srtp.h>
 #include <boost/asio.hpp>
 #include <memory>
+#include <mutex>
+#include "udp_io.h"
 
-class RtpListener {
+class RtpListener : public std::enable_shared_from_this<RtpListener> {
 public:
-    RtpListener(boost::asio::io_context& io_context, bool isSrtp, const std::string& srtpKey);
+    // muxed: the packet came in on the RTP port (RFC 5761)
+    using RtcpHandler = std::function<void(uint8_t* data, size_t len, const boost::asio::ip::udp::endpoint& sender, bool muxed)>;
+
+    RtpListener(boost::asio::io_context& io_context, bool isSrtp, const std::string& srtpKey, const std::string& ioBackend = "epoll");
     ~RtpListener();
 
-    void start(uint16_t port);
+    // reusePort lets several listeners share one port (SO_REUSEPORT) so the
+    // kernel spreads flows across them. inheritedFd, when set, is a socket
+    // already bound to port (hot upgrade) and is used instead of a new one;
+    // inheritedRtcpFd likewise for port + 1.
+    void start(uint16_t port, bool reusePort = false, int inheritedFd = -1, int inheritedRtcpFd = -1);
     void stop();
 
-    void setPacketHandler(std::function<void(const uint8_t* data, size_t len, const boost::asio::ip::udp::endpoint& sender)> handler);
+    // Datagrams drained per wakeup (recvmmsg batch, io_uring buffer sizing);
+    // 1 keeps one receive per packet. Must be called before start().
+    void setReceiveBatch(size_t batchSize);
+
+    // Sends from the listening socket so replies leave from the RTP port
+    void sendTo(const uint8_t* data, size_t len, const boost::asio::ip::udp::endpoint& destination);
+    void sendTo(const boost::asio::const_buffer& header, const boost::asio::const_buffer& payload,
+                const boost::asio::ip::udp::endpoint& destination);
+
+    uint16_t port() const { return port_; }
+    int nativeHandle() const { return io_ ? io_->nativeHandle() : -1; }
+    int nativeRtcpHandle() const { return rtcpIo_ ? rtcpIo_->nativeHandle() : -1; }
+
+    // SRTP rollover counter of an inbound stream, for the upgrade snapshot;
+    // false without SRTP or before the stream's first packet
+    bool srtpRoc(uint32_t ssrc, uint32_t& roc);
+    // Continues a stream of the previous process at its rollover counter.
+    // The replay window is not carried over; it starts with the next packet.
+    void restoreSrtpRoc(uint32_t ssrc, uint32_t roc);
+
+    // Receives whole batches, SRTP already removed and failed packets dropped
+    void setBatchHandler(std::function<void(ReceiveBatch& batch)> handler);
+
+    // With a handler, start() also listens for RTCP on port + 1, and RTCP
+    // multiplexed on the RTP port is taken out of the batches. Both arrive
+    // with SRTCP removed. Must be called before start().
+    void setRtcpHandler(RtcpHandler handler);
+    // Sends from the RTCP socket, or the RTP one when muxed; SRTCP protected
+    // when SRTP is on
+    void sendRtcp(const uint8_t* data, size_t len, const boost::asio::ip::udp::endpoint& destination, bool muxed);
 
 private:
-    void receive();
-    void handleReceive(const boost::system::error_code& error, size_t bytes_transferred);
+    void processBatch(ReceiveBatch& batch);
+    bool unprotectRtcp(uint8_t* data, size_t& len);
 
     bool isSrtp_;
     std::string srtpKey_;
+    uint16_t port_;
 
     srtp_t srtpSession_;
     srtp_policy_t policy_;
+    // Taken per batch; only the upgrade snapshot contends for it
+    std::mutex srtpMutex_;
+    // RTCP has its own contexts, since it is handled on other threads
+    srtp_t srtcpInbound_;
+    srtp_t srtcpOutbound_;
+    std::mutex srtcpMutex_;
 
-    std::function<void(const uint8_t* data, size_t len, const boost::asio::ip::udp::endpoint& sender)> packetHandler_;
+    std::function<void(ReceiveBatch& batch)> batchHandler_;
+    RtcpHandler rtcpHandler_;
 
-    boost::asio::ip::udp::socket socket_;
-    boost::asio::ip::udp::endpoint remoteEndpoint_;
-    std::array<uint8_t, 2048> recvBuffer_;
+    boost::asio::io_context& io_context_;
+    std::string ioBackend_;
+    size_t batchSize_;
+    std::shared_ptr<UdpIo> io_;
+    std::shared_ptr<UdpIo> rtcpIo_;
 };
 
 #endif // RTP_LISTENER_H
@@ -0,0 +1,299 @@
+/*
+ * Copyright 2024 nrjchnd@gmail.com
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     https://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an **"AS IS" BASIS,**
+ * **WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.**
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "rtp_port_manager.h"
+#include "logger.h"
+#include <unistd.h>
+
+// Ports held by other processes are skipped; give up after this many in a row
+const int MAX_BIND_ATTEMPTS = 16;
+
+RtpPortManager::RtpPortManager(boost::asio::io_context& io_context, uint16_t portStart, uint16_t portEnd, bool isSrtp, const std::string& srtpKey, const std::string& ioBackend)
+    : io_context_(io_context), allocator_(std::make_shared<PortAllocator>(portStart, portEnd)),
+      closing_(std::make_shared<Closing>()), isSrtp_(isSrtp), srtpKey_(srtpKey), ioBackend_(ioBackend), receiveBatch_(1),
+      spareTarget_(0), spareCount_(0)
+{
+}
+
+RtpPortManager::~RtpPortManager() {
+    stopAll();
+}
+
+void RtpPortManager::setPacketHandler(PacketHandler handler) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    packetHandler_ = handler;
+}
+
+void RtpPortManager::setRtcpHandler(RtcpHandler handler) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    rtcpHandler_ = handler;
+}
+
+void RtpPortManager::setReceiveBatch(size_t batchSize) {
+    receiveBatch_ = batchSize;
+}
+
+void RtpPortManager::setPortRange(uint16_t portStart, uint16_t portEnd) {
+    allocator_->setRange(portStart, portEnd);
+}
+
+void RtpPortManager::setSrtp(bool isSrtp, const std::string& srtpKey) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    isSrtp_ = isSrtp;
+    srtpKey_ = srtpKey;
+}
+
+uint16_t RtpPortManager::openListener(const std::string& srtpKey) {
+    return openPort(srtpKey, false);
+}
+
+uint16_t RtpPortManager::openPort(const std::string& srtpKey, bool spare) {
+    for (int attempt = 0; attempt < MAX_BIND_ATTEMPTS; ++attempt) {
+        uint16_t port = allocator_->allocate();
+        if (port == 0) {
+            Logger::getLogger()->warn("RTP port range exhausted ({} ports in use)", allocator_->allocatedCount());
+            return 0;
+        }
+        if (startListener(port, -1, srtpKey, spare)) {
+            return port;
+        }
+        allocator_->release(port);
+    }
+    Logger::getLogger()->error("Unable to open an RTP listener after {} attempts", MAX_BIND_ATTEMPTS);
+    return 0;
+}
+
+bool RtpPortManager::setSpareListeners(size_t count) {
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        spareTarget_ = count;
+    }
+    topUpSpares();
+    std::lock_guard<std::mutex> lock(mutex_);
+    return count == 0 || spareCount_ > 0;
+}
+
+void RtpPortManager::topUpSpares() {
+    for (;;) {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            if (spareCount_ >= spareTarget_) {
+                return;
+            }
+        }
+        if (openPort(std::string(), true) == 0) {
+            return;
+        }
+    }
+}
+
+void RtpPortManager::claimListener(uint16_t port) {
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        auto it = listeners_.find(port);
+        if (it == listeners_.end() || !it->second.spare) {
+            return;
+        }
+        it->second.spare = false;
+        --spareCount_;
+    }
+    topUpSpares();
+}
+
+void RtpPortManager::releaseIdle(const std::unordered_set<uint16_t>& inUse, std::chrono::steady_clock::time_point now,
+                                 std::chrono::steady_clock::duration idleTimeout) {
+    std::vector<uint16_t> idle;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        for (auto& entry : listeners_) {
+            OpenPort& open = entry.second;
+            if (open.spare) {
+                continue;
+            }
+            if (inUse.count(entry.first) != 0) {
+                open.lastUsed = now;
+            } else if (now - open.lastUsed >= idleTimeout) {
+                if (spareCount_ < spareTarget_ && open.callKey.empty()) {
+                    open.spare = true;
+                    ++spareCount_;
+                } else {
+                    idle.push_back(entry.first);
+                }
+            }
+        }
+    }
+    for (uint16_t port : idle) {
+        releaseListener(port);
+    }
+    if (!idle.empty()) {
+        Logger::getLogger()->debug("Released {} RTP listeners without a session", idle.size());
+    }
+}
+
+bool RtpPortManager::adoptListener(uint16_t port, int fd, int rtcpFd, const std::string& callKey,
+                                   const std::vector<std::pair<uint32_t, uint32_t>>& srtpRocs) {
+    if (!allocator_->reserve(port)) {
+        Logger::getLogger()->warn("Inherited RTP port {} is outside the range or already in use", port);
+        if (rtcpFd >= 0) {
+            ::close(rtcpFd);
+        }
+        return false;
+    }
+    if (startListener(port, fd, callKey, false, rtcpFd, srtpRocs)) {
+        return true;
+    }
+    // The RTCP socket is only taken over once the RTP one is listening
+    if (rtcpFd >= 0) {
+        ::close(rtcpFd);
+    }
+    allocator_->release(port);
+    return false;
+}
+
+std::vector<RtpPortManager::ListenerSocket> RtpPortManager::listenerSockets() {
+    std::vector<ListenerSocket> sockets;
+    std::lock_guard<std::mutex> lock(mutex_);
+    sockets.reserve(listeners_.size());
+    for (const auto& entry : listeners_) {
+        int fd = entry.second.listener->nativeHandle();
+        if (fd >= 0) {
+            sockets.push_back(ListenerSocket{entry.first, fd, entry.second.listener->nativeRtcpHandle(), entry.second.callKey});
+        }
+    }
+    return sockets;
+}
+
+bool RtpPortManager::startListener(uint16_t port, int inheritedFd, const std::string& callKey, bool spare,
+                                   int inheritedRtcpFd, const std::vector<std::pair<uint32_t, uint32_t>>& srtpRocs) {
+    bool isSrtp;
+    std::string srtpKey;
+    bool rtcp;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        isSrtp = isSrtp_;
+        srtpKey = srtpKey_;
+        rtcp = static_cast<bool>(rtcpHandler_);
+    }
+    if (!callKey.empty()) {
+        isSrtp = true;
+        srtpKey = callKey;
+    }
+    try {
+        auto listener = std::make_shared<RtpListener>(io_context_, isSrtp, srtpKey, ioBackend_);
+        listener->setBatchHandler([this, port](ReceiveBatch& batch) {
+            if (packetHandler_) {
+                packetHandler_(batch, port);
+            }
+        });
+        if (rtcp) {
+            listener->setRtcpHandler([this, port](uint8_t* data, size_t len, const boost::asio::ip::udp::endpoint& sender, bool muxed) {
+                rtcpHandler_(data, len, sender, muxed, port);
+            });
+        }
+        listener->setReceiveBatch(receiveBatch_);
+        for (const auto& roc : srtpRocs) {
+            listener->restoreSrtpRoc(roc.first, roc.second);
+        }
+        listener->start(port, false, inheritedFd, inheritedRtcpFd);
+
+        std::lock_guard<std::mutex> lock(mutex_);
+        OpenPort& open = listeners_[port];
+        open.listener = listener;
+        open.spare = spare;
+        open.callKey = callKey;
+        open.lastUsed = std::chrono::steady_clock::now();
+        if (spare) {
+            ++spareCount_;
+        }
+        return true;
+    } catch (const std::exception& e) {
+        Logger::getLogger()->warn("Port {} is unavailable: {}", port, e.what());
+        return false;
+    }
+}
+
+void RtpPortManager::releaseListener(uint16_t port) {
+    std::shared_ptr<RtpListener> listener;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        auto it = listeners_.find(port);
+        if (it == listeners_.end()) {
+            return;
+        }
+        listener = it->second.listener;
+        if (it->second.spare) {
+            --spareCount_;
+        }
+        listeners_.erase(it);
+    }
+    {
+        std::lock_guard<std::mutex> lock(closing_->mutex);
+        closing_->listeners[port] = listener;
+    }
+
+    // The socket belongs to the IO thread; close it there and only hand the
+    // port back once it is actually unbound. stopAll() closes whatever is
+    // still queued, and the handler then finds nothing left to do.
+    boost::asio::post(io_context_, [allocator = allocator_, closing = closing_, port]() {
+        std::shared_ptr<RtpListener> listener;
+        {
+            std::lock_guard<std::mutex> lock(closing->mutex);
+            auto it = closing->listeners.find(port);
+            if (it == closing->listeners.end()) {
+                return;
+            }
+            listener = it->second;
+            closing->listeners.erase(it);
+        }
+        listener->stop();
+        allocator->release(port);
+    });
+}
+
+std::shared_ptr<RtpListener> RtpPortManager::findListener(uint16_t port) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto it = listeners_.find(port);
+    return it != listeners_.end() ? it->second.listener : nullptr;
+}
+
+size_t RtpPortManager::activeCount() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return listeners_.size();
+}
+
+void RtpPortManager::stopAll() {
+    std::unordered_map<uint16_t, OpenPort> listeners;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        listeners.swap(listeners_);
+        spareTarget_ = 0;
+        spareCount_ = 0;
+    }
+    for (auto& entry : listeners) {
+        entry.second.listener->stop();
+        allocator_->release(entry.first);
+    }
+
+    std::unordered_map<uint16_t, std::shared_ptr<RtpListener>> closing;
+    {
+        std::lock_guard<std::mutex> lock(closing_->mutex);
+        closing.swap(closing_->listeners);
+    }
+    for (auto& entry : closing) {
+        entry.second->stop();
+        allocator_->release(entry.first);
+    }
+}
@@ -0,0 +1,127 @@
+/*
+ * Copyright 2024 nrjchnd@gmail.com
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     https://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an **"AS IS" BASIS,**
+ * **WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.**
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#ifndef RTP_PORT_MANAGER_H
+#define RTP_PORT_MANAGER_H
+
+#include "port_allocator.h"
+#include "rtp_listener.h"
+#include <boost/asio.hpp>
+#include <chrono>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <utility>
+#include <vector>
+
+// Opens RTP listeners on demand as sessions are set up and releases them on
+// teardown, so sockets and SRTP contexts track active calls rather than the
+// size of the configured port range. A pool of spare listeners stays open
+// for calls whose first packet has not arrived yet; it is topped up as
+// calls take ports from it.
+class RtpPortManager {
+public:
+    // An open listener as the upgrade handoff sees it
+    struct ListenerSocket {
+        uint16_t port;
+        int fd;
+        int rtcpFd;               // -1 without an RTCP socket
+        std::string callKey;      // empty unless the port has a call's own key
+    };
+
+    using PacketHandler = std::function<void(ReceiveBatch& batch, uint16_t localPort)>;
+    using RtcpHandler = std::function<void(uint8_t* data, size_t len, const boost::asio::ip::udp::endpoint& sender, bool muxed, uint16_t localPort)>;
+
+    RtpPortManager(boost::asio::io_context& io_context, uint16_t portStart, uint16_t portEnd, bool isSrtp, const std::string& srtpKey, const std::string& ioBackend);
+    ~RtpPortManager();
+
+    void setPacketHandler(PacketHandler handler);
+    // Listeners opened from now on also terminate RTCP on port + 1
+    void setRtcpHandler(RtcpHandler handler);
+    void setReceiveBatch(size_t batchSize);
+    // Apply to listeners opened from now on; open ones keep their settings
+    void setPortRange(uint16_t portStart, uint16_t portEnd);
+    void setSrtp(bool isSrtp, const std::string& srtpKey);
+
+    // Allocates a port from the range and starts listening on it.
+    // Returns 0 when no port could be opened. A non-empty srtpKey (master
+    // key and salt, as for the [SRTP] key) turns SRTP on for this port
+    // with that key, whatever the global setting.
+    uint16_t openListener(const std::string& srtpKey = std::string());
+    void releaseListener(uint16_t port);
+    // Keeps count listeners open without a call; false when none could be
+    // opened although some were asked for
+    bool setSpareListeners(size_t count);
+    // A session was set up on port: takes it out of the spare pool and
+    // opens another in its place
+    void claimListener(uint16_t port);
+    // Listeners that carried no session (ports not in inUse) for
+    // idleTimeout go back to the spare pool while it is short, and are
+    // released otherwise
+    void releaseIdle(const std::unordered_set<uint16_t>& inUse, std::chrono::steady_clock::time_point now,
+                     std::chrono::steady_clock::duration idleTimeout);
+    // Takes over a listener socket (and its RTCP socket, unless -1) handed
+    // over by the previous process, with the call key the port had there.
+    // srtpRocs continue the SRTP streams of its sessions by SSRC.
+    bool adoptListener(uint16_t port, int fd, int rtcpFd, const std::string& callKey,
+                       const std::vector<std::pair<uint32_t, uint32_t>>& srtpRocs);
+    // Every open listener, for the upgrade handoff
+    std::vector<ListenerSocket> listenerSockets();
+
+    std::shared_ptr<RtpListener> findListener(uint16_t port);
+    size_t activeCount();
+    void stopAll();
+
+private:
+    struct OpenPort {
+        std::shared_ptr<RtpListener> listener;
+        bool spare = false;
+        std::string callKey;      // SRTP key of one call; never reused as a spare
+        std::chrono::steady_clock::time_point lastUsed;
+    };
+
+    // Listeners released but not yet closed on the IO thread. Shared with
+    // the posted close, which can outlive the manager.
+    struct Closing {
+        std::mutex mutex;
+        std::unordered_map<uint16_t, std::shared_ptr<RtpListener>> listeners;
+    };
+
+    uint16_t openPort(const std::string& srtpKey, bool spare);
+    bool startListener(uint16_t port, int inheritedFd = -1, const std::string& callKey = std::string(), bool spare = false,
+                       int inheritedRtcpFd = -1, const std::vector<std::pair<uint32_t, uint32_t>>& srtpRocs = {});
+    void topUpSpares();
+
+    boost::asio::io_context& io_context_;
+    std::shared_ptr<PortAllocator> allocator_;
+    std::shared_ptr<Closing> closing_;
+    bool isSrtp_;
+    std::string srtpKey_;
+    std::string ioBackend_;
+    size_t receiveBatch_;
+
+    PacketHandler packetHandler_;
+    RtcpHandler rtcpHandler_;
+
+    std::unordered_map<uint16_t, OpenPort> listeners_;
+    size_t spareTarget_;
+    size_t spareCount_;
+    std::mutex mutex_;
+};
+
+#endif // RTP_PORT_MANAGER_H
@@ -0,0 +1,130 @@
+/*
+ * Copyright 2024 nrjchnd@gmail.com
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     https://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an **"AS IS" BASIS,**
+ * **WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.**
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "rtp_stats.h"
+#include <cstring>
+
+// RFC 3550 A.1
+const uint32_t RTP_SEQ_MOD = 1 << 16;
+const uint16_t MAX_DROPOUT = 3000;
+const uint16_t MAX_MISORDER = 100;
+
+void RtpReceiveStats::restart(uint16_t seq) {
+    maxSeq_ = seq;
+    cycles_ = 0;
+    baseSeq_ = seq;
+    badSeq_ = RTP_SEQ_MOD + 1;     // so seq == badSeq_ is false
+    received_ = 0;
+    reordered_ = 0;
+    expectedPrior_ = 0;
+    receivedPrior_ = 0;
+}
+
+void RtpReceiveStats::update(const RtpArrival& arrival) {
+    uint16_t seq = arrival.sequenceNumber;
+    if (received_ == 0) {
+        restart(seq);
+    } else {
+        uint16_t udelta = static_cast<uint16_t>(seq - maxSeq_);
+        if (udelta < MAX_DROPOUT) {
+            // In order, with a permissible gap
+            if (seq < maxSeq_) {
+                cycles_ += RTP_SEQ_MOD;
+            }
+            maxSeq_ = seq;
+        } else if (udelta <= RTP_SEQ_MOD - MAX_MISORDER) {
+            // A very large jump: two in a row mean the source restarted
+            if (seq != badSeq_) {
+                badSeq_ = (seq + 1) & (RTP_SEQ_MOD - 1);
+                return;
+            }
+            restart(seq);
+        } else {
+            // Late or duplicate
+            ++reordered_;
+        }
+    }
+    ++received_;
+
+    // A.8: the transit time is only compared, so the arrival clock needs the
+    // stream's rate but not its origin
+    if (arrival.clockRate == 0) {
+        return;
+    }
+    if (arrival.clockRate != clockRate_) {
+        clockRate_ = arrival.clockRate;
+        hasTransit_ = false;
+    }
+    auto micros = std::chrono::duration_cast<std::chrono::microseconds>(arrival.time.time_since_epoch()).count();
+    uint32_t arrivalUnits = static_cast<uint32_t>(static_cast<uint64_t>(micros) * clockRate_ / 1000000);
+    int32_t transit = static_cast<int32_t>(arrivalUnits - arrival.timestamp);
+    if (hasTransit_) {
+        int64_t d = static_cast<int64_t>(transit) - transit_;
+        if (d < 0) {
+            d = -d;
+        }
+        jitter_ = static_cast<uint32_t>(static_cast<int64_t>(jitter_) + d - ((jitter_ + 8) >> 4));
+    }
+    transit_ = transit;
+    hasTransit_ = true;
+}
+
+RtpIntervalLoss RtpReceiveStats::takeInterval() {
+    RtpIntervalLoss loss;
+    uint32_t expected = this->expected();
+    uint32_t received = static_cast<uint32_t>(received_);
+    loss.expected = expected - expectedPrior_;
+    loss.received = received - receivedPrior_;
+    expectedPrior_ = expected;
+    receivedPrior_ = received;
+    if (loss.expected != 0 && loss.received < loss.expected) {
+        loss.fraction = static_cast<uint8_t>((static_cast<uint64_t>(loss.expected - loss.received) << 8) / loss.expected);
+    }
+    return loss;
+}
+
+RtpReceiveState RtpReceiveStats::save() const {
+    RtpReceiveState state;
+    std::memset(&state, 0, sizeof(state));
+    state.received = received_;
+    state.reordered = reordered_;
+    state.cycles = cycles_;
+    state.baseSeq = baseSeq_;
+    state.badSeq = badSeq_;
+    state.expectedPrior = expectedPrior_;
+    state.receivedPrior = receivedPrior_;
+    state.clockRate = clockRate_;
+    state.jitter = jitter_;
+    state.transit = transit_;
+    state.maxSeq = maxSeq_;
+    state.hasTransit = hasTransit_ ? 1 : 0;
+    return state;
+}
+
+void RtpReceiveStats::restore(const RtpReceiveState& state) {
+    received_ = state.received;
+    reordered_ = state.reordered;
+    cycles_ = state.cycles;
+    baseSeq_ = state.baseSeq;
+    badSeq_ = state.badSeq;
+    expectedPrior_ = state.expectedPrior;
+    receivedPrior_ = state.receivedPrior;
+    clockRate_ = state.clockRate;
+    jitter_ = state.jitter;
+    transit_ = state.transit;
+    maxSeq_ = state.maxSeq;
+    hasTransit_ = state.hasTransit != 0;
+}
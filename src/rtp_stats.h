@@ -0,0 +1,145 @@
+/*
+ * Copyright 2024 nrjchnd@gmail.com
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     https://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an **"AS IS" BASIS,**
+ * **WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.**
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#ifndef RTP_STATS_H
+#define RTP_STATS_H
+
+#include <boost/asio/ip/udp.hpp>
+#include <chrono>
+#include <cstdint>
+
+// One received RTP packet as the statistics see it
+struct RtpArrival {
+    uint16_t sequenceNumber = 0;
+    uint32_t timestamp = 0;
+    // Of the payload type; 0 when unknown, which leaves the jitter alone
+    uint32_t clockRate = 0;
+    std::chrono::steady_clock::time_point time;
+};
+
+// Loss over one reporting interval, as a report block carries it
+struct RtpIntervalLoss {
+    uint32_t expected = 0;
+    uint32_t received = 0;
+    uint8_t fraction = 0;       // lost / expected in 1/256
+};
+
+// RtpReceiveStats with a fixed layout, as the upgrade snapshot carries it
+struct RtpReceiveState {
+    uint64_t received;
+    uint64_t reordered;
+    uint32_t cycles;
+    uint32_t baseSeq;
+    uint32_t badSeq;
+    uint32_t expectedPrior;
+    uint32_t receivedPrior;
+    uint32_t clockRate;
+    uint32_t jitter;
+    int32_t transit;
+    uint16_t maxSeq;
+    uint8_t hasTransit;
+    uint8_t reserved;
+    uint32_t reserved2;
+};
+
+// Receiver statistics of one RTP stream after RFC 3550 A.1 and A.8: the
+// extended highest sequence number, cumulative and interval loss and the
+// interarrival jitter, plus a count of packets that arrived behind the
+// highest sequence number. O(1) per packet without allocation, so they are
+// kept inline in the session table.
+class RtpReceiveStats {
+public:
+    void update(const RtpArrival& arrival);
+
+    bool started() const { return received_ > 0; }
+    uint64_t received() const { return received_; }
+    uint32_t extendedHighestSequence() const { return cycles_ + maxSeq_; }
+    uint32_t expected() const { return extendedHighestSequence() - baseSeq_ + 1; }
+    // Negative when duplicates outnumber the losses
+    int64_t cumulativeLost() const { return static_cast<int64_t>(expected()) - static_cast<int64_t>(received_); }
+    uint64_t reordered() const { return reordered_; }
+    // In timestamp units, as a report block carries it
+    uint32_t jitter() const { return jitter_ >> 4; }
+    double jitterMs() const { return clockRate_ != 0 ? jitter() * 1000.0 / clockRate_ : 0.0; }
+
+    // Loss since the previous call, which starts the next interval
+    RtpIntervalLoss takeInterval();
+
+    RtpReceiveState save() const;
+    void restore(const RtpReceiveState& state);
+
+private:
+    void restart(uint16_t seq);
+
+    uint16_t maxSeq_ = 0;
+    uint32_t cycles_ = 0;          // sequence number wraps << 16
+    uint32_t baseSeq_ = 0;
+    uint32_t badSeq_ = 0;
+    uint64_t received_ = 0;
+    uint64_t reordered_ = 0;
+    uint32_t expectedPrior_ = 0;
+    uint32_t receivedPrior_ = 0;
+
+    uint32_t clockRate_ = 0;
+    int32_t transit_ = 0;
+    bool hasTransit_ = false;
+    uint32_t jitter_ = 0;          // scaled by 16 (A.8)
+};
+
+// What the proxy sent on one leg, for its sender reports. The counts wrap
+// like the RTCP fields.
+struct RtpSendStats {
+    uint32_t packets = 0;
+    uint32_t octets = 0;           // payload only
+    uint32_t lastTimestamp = 0;
+    uint32_t clockRate = 0;
+    std::chrono::steady_clock::time_point lastSent;
+    uint32_t packetsAtLastReport = 0;
+
+    void update(uint32_t timestamp, uint32_t rate, size_t payloadBytes, std::chrono::steady_clock::time_point now) {
+        ++packets;
+        octets += static_cast<uint32_t>(payloadBytes);
+        lastTimestamp = timestamp;
+        clockRate = rate;
+        lastSent = now;
+    }
+};
+
+// What the endpoint's RTCP told us about the leg
+struct RtcpPeerState {
+    // Where its RTCP comes from; reports go back there
+    boost::asio::ip::udp::endpoint source;
+    bool muxed = false;            // RTCP shares the RTP port (RFC 5761)
+    // Middle 32 bits of the NTP time of its last SR, and when it arrived
+    uint32_t lastSrNtp = 0;
+    std::chrono::steady_clock::time_point lastSrArrival;
+
+    // Its last report block about the downlink stream
+    bool hasReport = false;
+    uint8_t fractionLost = 0;
+    int32_t cumulativeLost = 0;
+    uint32_t jitter = 0;           // timestamp units
+    double roundTripMs = -1.0;     // -1 until an SR of ours is echoed
+};
+
+// Per-leg quality of one session
+struct RtpSessionStats {
+    RtpReceiveStats uplink;        // endpoint to proxy
+    RtpReceiveStats downlink;      // QUIC hop to proxy
+    RtpSendStats sent;             // proxy to endpoint
+    RtcpPeerState peer;
+};
+
+#endif // RTP_STATS_H
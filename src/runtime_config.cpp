@@ -0,0 +1,267 @@
+/*
+ * Copyright 2024 nrjchnd@gmail.com
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     https://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an **"AS IS" BASIS,**
+ * **WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.**
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "runtime_config.h"
+#include "logger.h"
+#include <sys/inotify.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cerrno>
+#include <climits>
+#include <cstring>
+#include <set>
+#include <stdexcept>
+
+namespace {
+
+// Keys a reload applies; the rest need a restart
+const std::map<std::string, std::set<std::string>> RELOADABLE_KEYS = {
+    {"Logging", {"level"}},
+    {"RTP", {"port_range_start", "port_range_end"}},
+    {"SRTP", {"enable"}},
+    {"Admission", {"enable", "max_utilization_percent", "max_queue_depth"}},
+    {"QUIC", {"send_queue_limit", "session_queue_limit", "drop_policy", "audio_payload_types",
+              "video_payload_types", "audio_deadline_ms", "video_deadline_ms", "other_deadline_ms"}},
+    {"Tenants", {"tenant_rates"}},
+};
+
+bool isReloadable(const std::string& section, const std::string& key) {
+    auto it = RELOADABLE_KEYS.find(section);
+    return it != RELOADABLE_KEYS.end() && it->second.count(key) != 0;
+}
+
+thread_local const void* readerOwner = nullptr;
+thread_local std::atomic<uint64_t>* readerSlot = nullptr;
+thread_local unsigned readDepth = 0;
+
+}
+
+std::unique_ptr<RuntimeConfig> RuntimeConfig::parse(Config config) {
+    auto runtime = std::make_unique<RuntimeConfig>();
+
+    runtime->logLevel = config.get("Logging", "level");
+
+    int portStart = config.getInt("RTP", "port_range_start");
+    int portEnd = config.getInt("RTP", "port_range_end");
+    if (portStart <= 0 || portEnd <= 0 || portEnd < portStart || portEnd > 65535) {
+        throw std::runtime_error("Invalid RTP port range specified in configuration");
+    }
+    runtime->portStart = static_cast<uint16_t>(portStart);
+    runtime->portEnd = static_cast<uint16_t>(portEnd);
+    runtime->srtp = config.getBool("SRTP", "enable");
+
+    runtime->admissionEnabled = config.getBool("Admission", "enable");
+    runtime->maxUtilization = std::max(config.getInt("Admission", "max_utilization_percent", 85), 0) / 100.0;
+    runtime->maxQueueDepth = static_cast<size_t>(std::max(config.getInt("Admission", "max_queue_depth", 768), 0));
+
+    runtime->sendQueueLimit = static_cast<size_t>(std::max(config.getInt("QUIC", "send_queue_limit", 1024), 0));
+    runtime->sessionQueueLimit = static_cast<size_t>(std::max(config.getInt("QUIC", "session_queue_limit", 64), 0));
+    std::string dropPolicy = config.get("QUIC", "drop_policy");
+    if (!dropPolicy.empty() && dropPolicy != "drop_oldest" && dropPolicy != "audio_protected") {
+        Logger::getLogger()->warn("Unknown drop policy '{}', using drop_oldest", dropPolicy);
+    }
+    runtime->dropPolicy = dropPolicy == "audio_protected" ? DropPolicy::AudioProtected : DropPolicy::DropOldest;
+
+    runtime->classifier.setPayloadTypes(MediaClass::Audio, config.getList("QUIC", "audio_payload_types"));
+    runtime->classifier.setPayloadTypes(MediaClass::Video, config.getList("QUIC", "video_payload_types"));
+    runtime->classifier.setDeadline(MediaClass::Audio, config.getInt("QUIC", "audio_deadline_ms", 100));
+    runtime->classifier.setDeadline(MediaClass::Video, config.getInt("QUIC", "video_deadline_ms", 200));
+    runtime->classifier.setDeadline(MediaClass::Other, config.getInt("QUIC", "other_deadline_ms", 0));
+
+    runtime->source = std::move(config);
+    return runtime;
+}
+
+std::vector<std::string> RuntimeConfig::restartOnlyChanges(const RuntimeConfig& next) const {
+    std::set<std::pair<std::string, std::string>> keys;
+    for (const Config* config : {&source, &next.source}) {
+        for (const auto& section : config->sections()) {
+            for (const auto& entry : section.second) {
+                keys.emplace(section.first, entry.first);
+            }
+        }
+    }
+
+    std::vector<std::string> changes;
+    for (const auto& key : keys) {
+        if (!isReloadable(key.first, key.second) &&
+            source.get(key.first, key.second) != next.source.get(key.first, key.second)) {
+            changes.push_back("[" + key.first + "] " + key.second);
+        }
+    }
+    return changes;
+}
+
+ConfigStore::ConfigStore(const std::string& path)
+    : path_(path), current_(nullptr), epoch_(1), nextReader_(0), overflowReaders_(0), inotifyFd_(-1)
+{
+}
+
+ConfigStore::~ConfigStore() {
+    if (inotifyFd_ >= 0) {
+        ::close(inotifyFd_);
+    }
+    delete current_.load();
+    for (const auto& entry : retired_) {
+        delete entry.first;
+    }
+}
+
+const RuntimeConfig& ConfigStore::load() {
+    Config config;
+    config.loadConfig(path_);
+    publish(RuntimeConfig::parse(std::move(config)));
+    return *current_.load();
+}
+
+bool ConfigStore::reload() {
+    // Writes seen so far are in what is read now; without this a SIGHUP
+    // after saving the file reloads it a second time on the next check
+    changed();
+    std::unique_ptr<RuntimeConfig> next;
+    try {
+        Config config;
+        config.loadConfig(path_);
+        next = RuntimeConfig::parse(std::move(config));
+    } catch (const std::exception& e) {
+        Logger::getLogger()->error("Configuration not reloaded: {}", e.what());
+        return false;
+    }
+
+    // Only this thread publishes, so previous stays valid here
+    const RuntimeConfig* previous = current_.load();
+    const RuntimeConfig* published = next.get();
+    publish(std::move(next));
+    for (const std::string& change : previous->restartOnlyChanges(*published)) {
+        Logger::getLogger()->warn("Change to {} takes effect after a restart", change);
+    }
+    for (const auto& handler : handlers_) {
+        handler(*previous, *published);
+    }
+    Logger::getLogger()->info("Configuration reloaded from {}", path_);
+    reclaim();
+    return true;
+}
+
+void ConfigStore::onChange(ChangeHandler handler) {
+    std::lock_guard<std::mutex> lock(writerMutex_);
+    handlers_.push_back(std::move(handler));
+}
+
+void ConfigStore::publish(std::unique_ptr<RuntimeConfig> next) {
+    std::lock_guard<std::mutex> lock(writerMutex_);
+    const RuntimeConfig* previous = current_.exchange(next.release());
+    if (previous) {
+        // Guards that announced this epoch or an earlier one may hold previous
+        retired_.emplace_back(previous, epoch_.fetch_add(1));
+    }
+}
+
+void ConfigStore::reclaim() {
+    std::lock_guard<std::mutex> lock(writerMutex_);
+    if (retired_.empty() || overflowReaders_.load() != 0) {
+        return;
+    }
+    uint64_t oldest = UINT64_MAX;
+    for (const ReaderSlot& reader : readers_) {
+        uint64_t epoch = reader.epoch.load();
+        if (epoch != 0) {
+            oldest = std::min(oldest, epoch);
+        }
+    }
+    auto keep = std::stable_partition(retired_.begin(), retired_.end(), [oldest](const std::pair<const RuntimeConfig*, uint64_t>& entry) {
+        return entry.second >= oldest;
+    });
+    for (auto it = keep; it != retired_.end(); ++it) {
+        delete it->first;
+    }
+    retired_.erase(keep, retired_.end());
+}
+
+bool ConfigStore::watch() {
+    inotifyFd_ = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (inotifyFd_ < 0) {
+        Logger::getLogger()->warn("inotify unavailable: {}", std::strerror(errno));
+        return false;
+    }
+    // The directory, since editors and config management replace the file
+    size_t slash = path_.rfind('/');
+    std::string directory = slash == std::string::npos ? "." : (slash == 0 ? "/" : path_.substr(0, slash));
+    if (inotify_add_watch(inotifyFd_, directory.c_str(), IN_CLOSE_WRITE | IN_MOVED_TO | IN_CREATE) < 0) {
+        Logger::getLogger()->warn("Cannot watch {}: {}", directory, std::strerror(errno));
+        ::close(inotifyFd_);
+        inotifyFd_ = -1;
+        return false;
+    }
+    return true;
+}
+
+bool ConfigStore::changed() {
+    if (inotifyFd_ < 0) {
+        return false;
+    }
+    size_t slash = path_.rfind('/');
+    std::string name = slash == std::string::npos ? path_ : path_.substr(slash + 1);
+
+    bool changed = false;
+    alignas(struct inotify_event) char buffer[4096];
+    ssize_t length;
+    while ((length = ::read(inotifyFd_, buffer, sizeof(buffer))) > 0) {
+        for (char* p = buffer; p < buffer + length;) {
+            const struct inotify_event* event = reinterpret_cast<const struct inotify_event*>(p);
+            if (event->len > 0 && name == event->name) {
+                changed = true;
+            }
+            p += sizeof(struct inotify_event) + event->len;
+        }
+    }
+    return changed;
+}
+
+std::atomic<uint64_t>* ConfigStore::threadSlot() {
+    if (readerOwner != this) {
+        readerOwner = this;
+        size_t index = nextReader_.fetch_add(1);
+        readerSlot = index < MAX_READERS ? &readers_[index].epoch : nullptr;
+    }
+    return readerSlot;
+}
+
+ConfigStore::ReadGuard::ReadGuard(ConfigStore& store)
+    : store_(store), slot_(nullptr), overflow_(false)
+{
+    if (readDepth++ == 0) {
+        slot_ = store_.threadSlot();
+        if (slot_) {
+            // Announce the epoch before loading the pointer; sequentially
+            // consistent so reclaim() cannot miss a reader that loads it
+            slot_->store(store_.epoch_.load());
+        } else {
+            store_.overflowReaders_.fetch_add(1);
+            overflow_ = true;
+        }
+    }
+    config_ = store_.current_.load();
+}
+
+ConfigStore::ReadGuard::~ReadGuard() {
+    --readDepth;
+    if (slot_) {
+        slot_->store(0, std::memory_order_release);
+    } else if (overflow_) {
+        store_.overflowReaders_.fetch_sub(1, std::memory_order_release);
+    }
+}
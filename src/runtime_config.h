@@ -0,0 +1,128 @@
+/*
+ * Copyright 2024 nrjchnd@gmail.com
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     https://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an **"AS IS" BASIS,**
+ * **WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.**
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#ifndef RUNTIME_CONFIG_H
+#define RUNTIME_CONFIG_H
+
+#include "config.h"
+#include "send_scheduler.h"
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <utility>
+#include <vector>
+
+// The settings that can change while running, parsed once per load. A
+// snapshot is immutable; a reload publishes a new one.
+struct RuntimeConfig {
+    Config source;                // as read, to tell what a reload changed
+
+    std::string logLevel;
+    uint16_t portStart = 0;
+    uint16_t portEnd = 0;
+    bool srtp = false;
+
+    bool admissionEnabled = false;
+    double maxUtilization = 0;
+    size_t maxQueueDepth = 0;
+
+    size_t sendQueueLimit = 0;
+    size_t sessionQueueLimit = 0;
+    DropPolicy dropPolicy = DropPolicy::DropOldest;
+    MediaClassifier classifier;
+
+    // Throws std::runtime_error for invalid values
+    static std::unique_ptr<RuntimeConfig> parse(Config config);
+
+    // "[Section] key" of every change next makes that only a restart applies
+    std::vector<std::string> restartOnlyChanges(const RuntimeConfig& next) const;
+};
+
+// Publishes RuntimeConfig snapshots RCU style. Readers take a ReadGuard,
+// which pins the snapshots current while it lives; reading through it is
+// one pointer load. A reload swaps the pointer atomically and the old
+// snapshot is freed once no guard from its epoch is left (epoch-based
+// reclamation), so readers never lock or wait.
+class ConfigStore {
+public:
+    using ChangeHandler = std::function<void(const RuntimeConfig& previous, const RuntimeConfig& next)>;
+
+    explicit ConfigStore(const std::string& path);
+    ~ConfigStore();
+
+    // First load; throws when the file is missing or invalid
+    const RuntimeConfig& load();
+    // Re-reads the file, publishes it and runs the change handlers on this
+    // thread. An invalid file is logged and the running snapshot kept.
+    // Consumes the writes changed() would report, as they are read here.
+    bool reload();
+    void onChange(ChangeHandler handler);
+
+    // Watches the file with inotify, catching editors that replace it too
+    bool watch();
+    // True when the file was written since the last call
+    bool changed();
+
+    // Frees retired snapshots no reader can still hold; called periodically
+    void reclaim();
+
+    const std::string& path() const { return path_; }
+
+    class ReadGuard {
+    public:
+        explicit ReadGuard(ConfigStore& store);
+        ~ReadGuard();
+        ReadGuard(const ReadGuard&) = delete;
+        ReadGuard& operator=(const ReadGuard&) = delete;
+
+        const RuntimeConfig* operator->() const { return config_; }
+        const RuntimeConfig& operator*() const { return *config_; }
+
+    private:
+        ConfigStore& store_;
+        std::atomic<uint64_t>* slot_;   // null for an inner or overflow guard
+        bool overflow_;
+        const RuntimeConfig* config_;
+    };
+
+private:
+    static const size_t MAX_READERS = 64;
+
+    struct alignas(64) ReaderSlot {
+        std::atomic<uint64_t> epoch{0};   // 0 while not reading
+    };
+
+    void publish(std::unique_ptr<RuntimeConfig> next);
+    std::atomic<uint64_t>* threadSlot();
+
+    std::string path_;
+    std::atomic<const RuntimeConfig*> current_;
+    std::atomic<uint64_t> epoch_;
+    ReaderSlot readers_[MAX_READERS];
+    std::atomic<size_t> nextReader_;
+    // Readers beyond MAX_READERS threads; reclamation waits while any is in
+    std::atomic<size_t> overflowReaders_;
+
+    std::mutex writerMutex_;
+    std::vector<std::pair<const RuntimeConfig*, uint64_t>> retired_;   // with the epoch they were retired in
+    std::vector<ChangeHandler> handlers_;
+    int inotifyFd_;
+};
+
+#endif // RUNTIME_CONFIG_H
@@ -0,0 +1,433 @@
+/*
+ * Copyright 2024 nrjchnd@gmail.com
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     https://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an **"AS IS" BASIS,**
+ * **WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.**
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "send_scheduler.h"
+#include <algorithm>
+
+// Frames remembered as dropped while waiting for their marker packet
+const size_t MAX_DROPPED_FRAMES = 256;
+// Bytes a tenant or session may send per round; at least one full packet
+const size_t DRR_QUANTUM = PACKET_CAPACITY;
+
+const char* mediaClassName(MediaClass mediaClass) {
+    switch (mediaClass) {
+    case MediaClass::Audio:
+        return "audio";
+    case MediaClass::Video:
+        return "video";
+    default:
+        return "other";
+    }
+}
+
+MediaClassifier::MediaClassifier() {
+    classes_.fill(MediaClass::Other);
+    // RFC 3551 static assignments
+    for (int pt = 0; pt <= 23; ++pt) {
+        classes_[pt] = MediaClass::Audio;
+    }
+    for (int pt : {25, 26, 28, 31, 32, 33, 34}) {
+        classes_[pt] = MediaClass::Video;
+    }
+    clockRates_.fill(0);
+    for (int pt : {0, 3, 4, 5, 7, 8, 9, 12, 13, 15, 18}) {
+        clockRates_[pt] = 8000;
+    }
+    clockRates_[6] = 16000;
+    clockRates_[10] = 44100;
+    clockRates_[11] = 44100;
+    clockRates_[16] = 11025;
+    clockRates_[17] = 22050;
+    for (int pt : {14, 25, 26, 28, 31, 32, 33, 34}) {
+        clockRates_[pt] = 90000;
+    }
+    deadlines_.fill(std::chrono::milliseconds(0));
+}
+
+void MediaClassifier::setPayloadTypes(MediaClass mediaClass, const std::vector<std::string>& payloadTypes) {
+    for (const auto& value : payloadTypes) {
+        try {
+            int pt = std::stoi(value);
+            if (pt >= 0 && pt < 128) {
+                classes_[pt] = mediaClass;
+                if (pt >= 96) {
+                    clockRates_[pt] = mediaClass == MediaClass::Audio ? 48000 : mediaClass == MediaClass::Video ? 90000 : 0;
+                }
+            }
+        } catch (const std::exception&) {
+            // Ignore entries that are not numbers
+        }
+    }
+}
+
+void MediaClassifier::setDeadline(MediaClass mediaClass, int milliseconds) {
+    deadlines_[static_cast<size_t>(mediaClass)] = std::chrono::milliseconds(std::max(milliseconds, 0));
+}
+
+SendInfo MediaClassifier::classify(const RtpHeaderBatch& headers, size_t index, std::chrono::steady_clock::time_point now) const {
+    uint8_t markerPayloadType = headers.markerPayloadType[index];
+    SendInfo info;
+    info.mediaClass = classes_[markerPayloadType & 0x7F];
+    info.ssrc = headers.ssrc[index];
+    info.endOfFrame = (markerPayloadType & 0x80) != 0;
+
+    auto budget = deadlines_[static_cast<size_t>(info.mediaClass)];
+    if (budget.count() > 0) {
+        info.deadline = now + budget;
+    }
+    if (info.mediaClass == MediaClass::Video) {
+        info.frameKey = (static_cast<uint64_t>(info.ssrc) << 32) | headers.timestamp[index];
+    }
+    return info;
+}
+
+SendScheduler::SendScheduler()
+    : queued_(0), maxPackets_(0), maxPerSession_(0), dropPolicy_(DropPolicy::DropOldest),
+      droppedPackets_(0), droppedFrameCount_(0), shedPackets_(0)
+{
+}
+
+void SendScheduler::setLimits(size_t maxPackets, size_t maxPerSession) {
+    maxPackets_ = maxPackets;
+    maxPerSession_ = maxPerSession;
+}
+
+void SendScheduler::setDropPolicy(DropPolicy policy) {
+    dropPolicy_ = policy;
+}
+
+void SendScheduler::setTenantRate(uint16_t id, const TenantRate& rate) {
+    Tenant& entry = tenant(id);
+    entry.rate = rate;
+    if (entry.rate.bytesPerSecond != 0) {
+        entry.rate.burstBytes = std::max<uint64_t>(entry.rate.burstBytes, DRR_QUANTUM);
+    }
+    entry.tokens = static_cast<double>(entry.rate.burstBytes);
+    entry.refilled = std::chrono::steady_clock::now();
+}
+
+SendScheduler::Tenant& SendScheduler::tenant(uint16_t id) {
+    return tenants_[id];
+}
+
+bool SendScheduler::admit(const SendInfo& info) {
+    if (info.frameKey == 0 || droppedFrames_.count(info.frameKey) == 0) {
+        return true;
+    }
+    ++droppedPackets_;
+    if (info.endOfFrame) {
+        forgetFrame(info.frameKey);
+    }
+    return false;
+}
+
+void SendScheduler::enqueue(PacketBuffer packet, const SendInfo& info) {
+    if (!admit(info)) {
+        return;
+    }
+    if (maxPerSession_ != 0) {
+        auto depth = sessionDepth_.find(info.ssrc);
+        if (depth != sessionDepth_.end() && depth->second >= maxPerSession_) {
+            evictSession(info.ssrc);
+        }
+    }
+    if (maxPackets_ != 0 && queued_ >= maxPackets_ && !evictFor(info.mediaClass)) {
+        // Nothing may give way to this packet, so it is the one dropped
+        ++shedPackets_;
+        discard(Entry{PacketBuffer(), info});
+        return;
+    }
+
+    ClassQueue& queue = queues_[static_cast<size_t>(info.mediaClass)];
+    Flow& flow = queue.flows[info.ssrc];
+    if (!flow.tenant) {
+        flow.ssrc = info.ssrc;
+        flow.mediaClass = info.mediaClass;
+        flow.tenant = &tenant(info.tenant);
+    }
+    flow.entries.push_back({std::move(packet), info});
+    if (!flow.listed) {
+        TenantClass& tenantClass = flow.tenant->classes[static_cast<size_t>(info.mediaClass)];
+        tenantClass.flows.push_back(&flow);
+        flow.listed = true;
+        if (!tenantClass.listed && !flow.tenant->throttled) {
+            queue.tenants.push_back(flow.tenant);
+            tenantClass.listed = true;
+        }
+    }
+    if (!queue.busiest || flow.entries.size() > queue.busiest->entries.size()) {
+        queue.busiest = &flow;
+    }
+    ++queue.queued;
+    ++queued_;
+    ++sessionDepth_[info.ssrc];
+}
+
+bool SendScheduler::dequeue(PacketBuffer& packet, SendInfo& info, std::chrono::steady_clock::time_point now) {
+    wakeTenants(now);
+    for (size_t mediaClass = 0; mediaClass < MEDIA_CLASS_COUNT; ++mediaClass) {
+        ClassQueue& queue = queues_[mediaClass];
+        while (!queue.tenants.empty()) {
+            Tenant* current = queue.tenants.front();
+            TenantClass& tenantClass = current->classes[mediaClass];
+            Flow* flow = current->throttled ? nullptr : nextFlow(queue, tenantClass);
+            if (!flow) {
+                // Throttled or out of packets: leaves the round
+                queue.tenants.pop_front();
+                tenantClass.listed = false;
+                tenantClass.turn = false;
+                if (!current->throttled) {
+                    tenantClass.deficit = 0;
+                }
+                continue;
+            }
+
+            Entry& entry = flow->entries.front();
+            bool frameDropped = entry.info.frameKey != 0 && droppedFrames_.count(entry.info.frameKey) != 0;
+            if (frameDropped || entry.info.deadline < now) {
+                // Stale: drop it, and for video the rest of its frame.
+                // Nobody is charged for it.
+                removed(entry);
+                discard(entry);
+                flow->entries.pop_front();
+                continue;
+            }
+
+            size_t size = entry.packet.size();
+            if (!tenantClass.turn) {
+                tenantClass.deficit += DRR_QUANTUM;
+                tenantClass.turn = true;
+            }
+            if (tenantClass.deficit < size) {
+                // Turn used up; next tenant
+                tenantClass.turn = false;
+                queue.tenants.pop_front();
+                queue.tenants.push_back(current);
+                continue;
+            }
+            if (!takeTokens(*current, size, now)) {
+                throttle(*current, size, now);
+                continue;
+            }
+
+            tenantClass.deficit -= size;
+            flow->deficit -= size;
+            packet = std::move(entry.packet);
+            info = entry.info;
+            removed(entry);
+            flow->entries.pop_front();
+            return true;
+        }
+    }
+    return false;
+}
+
+SendScheduler::Flow* SendScheduler::nextFlow(ClassQueue& queue, TenantClass& tenantClass) {
+    // The quantum covers the largest packet, so a session whose turn starts
+    // can always send and this rotates at most once per call
+    while (!tenantClass.flows.empty()) {
+        Flow* flow = tenantClass.flows.front();
+        if (flow->entries.empty()) {
+            tenantClass.flows.pop_front();
+            releaseFlow(queue, flow);
+            continue;
+        }
+        if (!flow->turn) {
+            flow->deficit += DRR_QUANTUM;
+            flow->turn = true;
+        }
+        if (flow->deficit >= flow->entries.front().packet.size()) {
+            return flow;
+        }
+        flow->turn = false;
+        tenantClass.flows.pop_front();
+        tenantClass.flows.push_back(flow);
+    }
+    return nullptr;
+}
+
+void SendScheduler::releaseFlow(ClassQueue& queue, Flow* flow) {
+    if (queue.busiest == flow) {
+        queue.busiest = nullptr;
+    }
+    queue.flows.erase(flow->ssrc);
+}
+
+bool SendScheduler::takeTokens(Tenant& tenant, size_t bytes, std::chrono::steady_clock::time_point now) {
+    if (tenant.rate.bytesPerSecond == 0) {
+        return true;
+    }
+    double elapsed = std::chrono::duration<double>(now - tenant.refilled).count();
+    if (elapsed > 0) {
+        tenant.tokens = std::min(tenant.tokens + elapsed * static_cast<double>(tenant.rate.bytesPerSecond),
+                                 static_cast<double>(tenant.rate.burstBytes));
+        tenant.refilled = now;
+    }
+    if (tenant.tokens < static_cast<double>(bytes)) {
+        return false;
+    }
+    tenant.tokens -= static_cast<double>(bytes);
+    return true;
+}
+
+void SendScheduler::throttle(Tenant& tenant, size_t bytes, std::chrono::steady_clock::time_point now) {
+    // Leaves the class rounds lazily as dequeue() comes across it
+    double wait = (static_cast<double>(bytes) - tenant.tokens) / static_cast<double>(tenant.rate.bytesPerSecond);
+    tenant.readyAt = now + std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<double>(wait));
+    tenant.throttled = true;
+    if (throttled_.empty() || tenant.readyAt < nextWake_) {
+        nextWake_ = tenant.readyAt;
+    }
+    throttled_.push_back(&tenant);
+}
+
+void SendScheduler::wakeTenants(std::chrono::steady_clock::time_point now) {
+    if (throttled_.empty() || now < nextWake_) {
+        return;
+    }
+    nextWake_ = std::chrono::steady_clock::time_point::max();
+    for (size_t i = 0; i < throttled_.size();) {
+        Tenant* tenant = throttled_[i];
+        if (tenant->readyAt > now) {
+            nextWake_ = std::min(nextWake_, tenant->readyAt);
+            ++i;
+            continue;
+        }
+        tenant->throttled = false;
+        for (size_t mediaClass = 0; mediaClass < MEDIA_CLASS_COUNT; ++mediaClass) {
+            TenantClass& tenantClass = tenant->classes[mediaClass];
+            if (!tenantClass.flows.empty() && !tenantClass.listed) {
+                queues_[mediaClass].tenants.push_back(tenant);
+                tenantClass.listed = true;
+            }
+        }
+        throttled_[i] = throttled_.back();
+        throttled_.pop_back();
+    }
+}
+
+void SendScheduler::discard(const Entry& entry) {
+    ++droppedPackets_;
+    if (entry.info.frameKey != 0) {
+        dropFrame(entry.info.frameKey);
+        if (entry.info.endOfFrame) {
+            forgetFrame(entry.info.frameKey);
+        }
+    }
+}
+
+void SendScheduler::removed(const Entry& entry) {
+    --queued_;
+    --queues_[static_cast<size_t>(entry.info.mediaClass)].queued;
+    auto depth = sessionDepth_.find(entry.info.ssrc);
+    if (depth != sessionDepth_.end() && --depth->second == 0) {
+        sessionDepth_.erase(depth);
+    }
+}
+
+void SendScheduler::shed(Flow& flow) {
+    // The emptied flow stays listed until its round comes across it
+    ++shedPackets_;
+    removed(flow.entries.front());
+    discard(flow.entries.front());
+    flow.entries.pop_front();
+}
+
+bool SendScheduler::evictSession(uint32_t ssrc) {
+    for (auto& queue : queues_) {
+        auto flow = queue.flows.find(ssrc);
+        if (flow != queue.flows.end() && !flow->second.entries.empty()) {
+            shed(flow->second);
+            return true;
+        }
+    }
+    return false;
+}
+
+bool SendScheduler::evictFor(MediaClass mediaClass) {
+    ClassQueue* victim = nullptr;
+    if (dropPolicy_ == DropPolicy::DropOldest && queues_[static_cast<size_t>(mediaClass)].queued != 0) {
+        victim = &queues_[static_cast<size_t>(mediaClass)];
+    } else {
+        // Lowest priority first; with AudioProtected only audio gives way to audio
+        for (size_t i = MEDIA_CLASS_COUNT; i-- > 0;) {
+            bool audio = (i == static_cast<size_t>(MediaClass::Audio));
+            if (dropPolicy_ == DropPolicy::AudioProtected && audio && mediaClass != MediaClass::Audio) {
+                continue;
+            }
+            if (queues_[i].queued != 0) {
+                victim = &queues_[i];
+                break;
+            }
+        }
+    }
+    if (!victim) {
+        return false;
+    }
+
+    // The busiest session pays. The pointer is only a hint once that session
+    // has drained, so it is looked up again then.
+    if (!victim->busiest || victim->busiest->entries.empty()) {
+        victim->busiest = nullptr;
+        for (auto& entry : victim->flows) {
+            if (!victim->busiest || entry.second.entries.size() > victim->busiest->entries.size()) {
+                victim->busiest = &entry.second;
+            }
+        }
+    }
+    shed(*victim->busiest);
+    return true;
+}
+
+void SendScheduler::dropFrame(uint64_t frameKey) {
+    if (frameKey == 0 || droppedFrames_.count(frameKey) != 0) {
+        return;
+    }
+    ++droppedFrameCount_;
+    droppedFrames_.emplace(frameKey, droppedFrameOrder_.insert(droppedFrameOrder_.end(), frameKey));
+    if (droppedFrameOrder_.size() > MAX_DROPPED_FRAMES) {
+        droppedFrames_.erase(droppedFrameOrder_.front());
+        droppedFrameOrder_.pop_front();
+    }
+}
+
+void SendScheduler::forgetFrame(uint64_t frameKey) {
+    // The frame's last packet has gone; later packets are a new frame
+    auto it = droppedFrames_.find(frameKey);
+    if (it != droppedFrames_.end()) {
+        droppedFrameOrder_.erase(it->second);
+        droppedFrames_.erase(it);
+    }
+}
+
+void SendScheduler::clear() {
+    droppedPackets_ += queued_;
+    for (auto& queue : queues_) {
+        queue.tenants.clear();
+        queue.flows.clear();
+        queue.queued = 0;
+        queue.busiest = nullptr;
+    }
+    for (auto& entry : tenants_) {
+        entry.second.classes = {};
+        entry.second.throttled = false;
+    }
+    throttled_.clear();
+    queued_ = 0;
+    sessionDepth_.clear();
+    droppedFrames_.clear();
+    droppedFrameOrder_.clear();
+}
@@ -0,0 +1,227 @@
+/*
+ * Copyright 2024 nrjchnd@gmail.com
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     https://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an **"AS IS" BASIS,**
+ * **WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.**
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#ifndef SEND_SCHEDULER_H
+#define SEND_SCHEDULER_H
+
+#include "packet_arena.h"
+#include "rtp_batch_parser.h"
+#include "tenant_directory.h"
+#include <array>
+#include <chrono>
+#include <cstdint>
+#include <deque>
+#include <list>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// Scheduling classes, in priority order
+enum class MediaClass : uint8_t {
+    Audio = 0,
+    Video = 1,
+    Other = 2
+};
+
+const size_t MEDIA_CLASS_COUNT = 3;
+
+const char* mediaClassName(MediaClass mediaClass);
+
+// What the QUIC sender needs to know about one uplink packet
+struct SendInfo {
+    MediaClass mediaClass = MediaClass::Other;
+    uint32_t ssrc = 0;
+    // Index in the TenantDirectory; packets without one share a bucket
+    uint16_t tenant = NO_TENANT;
+    // After this the packet is useless to the receiver and is dropped
+    std::chrono::steady_clock::time_point deadline = std::chrono::steady_clock::time_point::max();
+    // Video frame the packet belongs to (SSRC and RTP timestamp), 0 otherwise
+    uint64_t frameKey = 0;
+    // Marker bit: last packet of the frame
+    bool endOfFrame = false;
+};
+
+// Maps RTP payload types to media classes and clock rates, and classes to
+// send deadlines. Static payload types follow RFC 3551; dynamic ones (96-127)
+// must be listed in the configuration and count as Other otherwise. Listed
+// dynamic types are clocked at 48 kHz for audio (Opus) and 90 kHz for video.
+class MediaClassifier {
+public:
+    MediaClassifier();
+
+    void setPayloadTypes(MediaClass mediaClass, const std::vector<std::string>& payloadTypes);
+    // 0 disables the deadline for the class
+    void setDeadline(MediaClass mediaClass, int milliseconds);
+
+    // Packet index of a parsed batch, read from its columns
+    SendInfo classify(const RtpHeaderBatch& headers, size_t index, std::chrono::steady_clock::time_point now) const;
+    // 0 when unknown
+    uint32_t clockRate(uint8_t payloadType) const { return clockRates_[payloadType & 0x7F]; }
+
+private:
+    std::array<MediaClass, 128> classes_;
+    std::array<uint32_t, 128> clockRates_;
+    std::array<std::chrono::milliseconds, MEDIA_CLASS_COUNT> deadlines_;
+};
+
+// What a full queue gives up to make room
+enum class DropPolicy {
+    DropOldest,       // the oldest packet of the busiest session in the arriving packet's class
+    AudioProtected    // other, then video; audio only ever displaces audio
+};
+
+// Scheduler in front of the QUIC connection. Classes go in strict priority,
+// audio before video before other. Within a class, tenants share the link
+// by deficit round robin in bytes, and so do the sessions of a tenant, so
+// one tenant's burst cannot starve the others. Each tenant can also be held
+// to a token-bucket rate; its packets wait while the bucket is empty.
+// Queueing, sending and frame bookkeeping are O(1) per packet. Making room
+// in a full queue rescans the class's sessions when its busiest one has
+// drained, and a wake-up walks the throttled tenants, at most once per
+// wake time.
+//
+// A video packet whose deadline passes while queued takes the rest of its
+// frame with it, since a partial frame cannot be decoded anyway. The queue
+// is bounded in total and per session, so an overload turns into dropped
+// packets rather than memory and delay. Not thread-safe; the QuicClient
+// serialises access.
+class SendScheduler {
+public:
+    SendScheduler();
+
+    // 0 leaves a limit off. A session over its limit loses its own oldest
+    // packet, so one busy call cannot crowd out the others.
+    void setLimits(size_t maxPackets, size_t maxPerSession);
+    void setDropPolicy(DropPolicy policy);
+    // A bucket smaller than one packet is raised to one
+    void setTenantRate(uint16_t tenant, const TenantRate& rate);
+
+    // False when the packet belongs to a frame that is already being dropped
+    bool admit(const SendInfo& info);
+    void enqueue(PacketBuffer packet, const SendInfo& info);
+    // Next packet whose deadline has not passed; false when nothing is left
+    // or everything left waits for its tenant's bucket. Rate-limited packets
+    // go out on a later call, which the next arrival or send completion
+    // makes.
+    bool dequeue(PacketBuffer& packet, SendInfo& info, std::chrono::steady_clock::time_point now);
+
+    // A packet of this frame missed its deadline elsewhere (e.g. in flight)
+    void dropFrame(uint64_t frameKey);
+    bool isFrameDropped(uint64_t frameKey) const { return frameKey != 0 && droppedFrames_.count(frameKey) != 0; }
+
+    // Drops everything queued, e.g. when the connection goes away
+    void clear();
+
+    // When the first throttled tenant may send again; false when none is
+    // throttled. The caller is to dequeue() then, whether or not anything
+    // else has happened.
+    bool wakeTime(std::chrono::steady_clock::time_point& at) const {
+        if (throttled_.empty()) {
+            return false;
+        }
+        at = nextWake_;
+        return true;
+    }
+
+    size_t queued() const { return queued_; }
+    uint64_t droppedPackets() const { return droppedPackets_; }
+    uint64_t droppedFrames() const { return droppedFrameCount_; }
+    // Of droppedPackets, those dropped because a queue limit was reached
+    uint64_t shedPackets() const { return shedPackets_; }
+
+private:
+    struct Entry {
+        PacketBuffer packet;
+        SendInfo info;
+    };
+
+    struct Tenant;
+
+    // Packets of one session in one class
+    struct Flow {
+        uint32_t ssrc = 0;
+        MediaClass mediaClass = MediaClass::Other;
+        Tenant* tenant = nullptr;
+        std::deque<Entry> entries;
+        size_t deficit = 0;
+        bool turn = false;        // quantum added for the current round
+        bool listed = false;      // in the tenant's round; removed lazily once empty
+    };
+
+    // A tenant's sessions with packets in one class
+    struct TenantClass {
+        std::deque<Flow*> flows;
+        size_t deficit = 0;
+        bool turn = false;
+        bool listed = false;      // in the class round
+    };
+
+    struct Tenant {
+        std::array<TenantClass, MEDIA_CLASS_COUNT> classes;
+        TenantRate rate;
+        double tokens = 0;
+        std::chrono::steady_clock::time_point refilled;
+        bool throttled = false;   // out of every class round until readyAt
+        std::chrono::steady_clock::time_point readyAt;
+    };
+
+    struct ClassQueue {
+        std::deque<Tenant*> tenants;   // round of tenants with packets
+        std::unordered_map<uint32_t, Flow> flows;   // by SSRC
+        size_t queued = 0;
+        // Largest session queue seen, the victim when the class must shed
+        Flow* busiest = nullptr;
+    };
+
+    Tenant& tenant(uint16_t id);
+    // Session of the tenant whose turn it is, null once none has packets
+    Flow* nextFlow(ClassQueue& queue, TenantClass& tenantClass);
+    void releaseFlow(ClassQueue& queue, Flow* flow);
+    bool takeTokens(Tenant& tenant, size_t bytes, std::chrono::steady_clock::time_point now);
+    void throttle(Tenant& tenant, size_t bytes, std::chrono::steady_clock::time_point now);
+    // Returns tenants whose bucket has refilled to their rounds
+    void wakeTenants(std::chrono::steady_clock::time_point now);
+    // Removes the oldest packet of flow as shed
+    void shed(Flow& flow);
+
+    void forgetFrame(uint64_t frameKey);
+    // Accounts for an entry leaving the queue without being sent
+    void discard(const Entry& entry);
+    void removed(const Entry& entry);
+    // Drops the oldest queued packet of ssrc
+    bool evictSession(uint32_t ssrc);
+    // Drops one packet to make room for one of mediaClass
+    bool evictFor(MediaClass mediaClass);
+
+    std::array<ClassQueue, MEDIA_CLASS_COUNT> queues_;
+    std::unordered_map<uint16_t, Tenant> tenants_;
+    std::vector<Tenant*> throttled_;
+    std::chrono::steady_clock::time_point nextWake_;
+    size_t queued_;
+    size_t maxPackets_;
+    size_t maxPerSession_;
+    DropPolicy dropPolicy_;
+    std::unordered_map<uint32_t, size_t> sessionDepth_;   // queued packets by SSRC
+    // Each dropped frame's place in droppedFrameOrder_, so it is forgotten
+    // without a search
+    std::unordered_map<uint64_t, std::list<uint64_t>::iterator> droppedFrames_;
+    // Insertion order of droppedFrames_, to bound it when marker packets are lost
+    std::list<uint64_t> droppedFrameOrder_;
+    uint64_t droppedPackets_;
+    uint64_t droppedFrameCount_;
+    uint64_t shedPackets_;
+};
+
+#endif // SEND_SCHEDULER_H
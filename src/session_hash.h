@@ -0,0 +1,31 @@
+/*
+ * Copyright 2024 nrjchnd@gmail.com
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     https://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an **"AS IS" BASIS,**
+ * **WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.**
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#ifndef SESSION_HASH_H
+#define SESSION_HASH_H
+
+/*
+ * Maps an SSRC to the worker that owns its session. Kept in plain C so the
+ * SO_REUSEPORT steering program (bpf/rtp_reuseport.bpf.c) includes the very
+ * same function the proxy uses to shard its session table.
+ */
+static inline unsigned int quicrtp_worker_for_ssrc(unsigned int ssrc, unsigned int workers)
+{
+    unsigned int hash = ssrc * 0x9E3779B1u;
+    hash ^= hash >> 16;
+    return workers > 1 ? hash % workers : 0;
+}
+
+#endif /* SESSION_HASH_H */
@@ -14,10 +14,25 @@
  * limitations under the License.
  */
 #include "session_manager.h"
+#include "session_hash.h"
+#include "probes.h"
 #include <stdexcept>
 
-SessionManager::SessionManager() {
-    // Constructor implementation
+SessionManager::SessionManager(size_t shardCount)
+    : shards_(shardCount > 0 ? shardCount : 1), nackCacheSlots_(0), nackCacheLimit_(0), nackCacheBytes_(0)
+{
+}
+
+void SessionManager::setNackCache(size_t slots, size_t maxBytes) {
+    nackCacheSlots_ = slots;
+    nackCacheLimit_ = maxBytes;
+}
+
+void SessionManager::releaseNackCache(SessionInfo& info) {
+    if (info.nackCache) {
+        nackCacheBytes_.fetch_sub(info.nackCache->bytes(), std::memory_order_relaxed);
+        info.nackCache.reset();
+    }
 }
 
 SessionManager::~SessionManager() {
@@ -25,16 +40,210 @@ SessionManager::~SessionManager() {
 }
 
 void SessionManager::addSession(uint32_t ssrc) {
-    std::lock_guard<std::mutex> lock(mutex_);
-    sessions_[ssrc] = SessionInfo();
+    Shard& shard = shardFor(ssrc);
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    SessionInfo& info = shard.sessions[ssrc];
+    releaseNackCache(info);
+    info = SessionInfo();
+    info.lastActivity = std::chrono::steady_clock::now();
+}
+
+bool SessionManager::provisionSession(uint32_t ssrc, const boost::asio::ip::udp::endpoint& source, uint16_t localPort) {
+    Shard& shard = shardFor(ssrc);
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    auto inserted = shard.sessions.emplace(ssrc, SessionInfo());
+    if (!inserted.second) {
+        return false;
+    }
+    SessionInfo& info = inserted.first->second;
+    info.source = source;
+    info.localPort = localPort;
+    info.latched = false;
+    info.lastActivity = std::chrono::steady_clock::now();
+    return true;
+}
+
+SessionBinding SessionManager::bindSession(uint32_t ssrc, const boost::asio::ip::udp::endpoint& source, uint16_t localPort, bool strictSource,
+                                           const RtpArrival& arrival) {
+    Shard& shard = shardFor(ssrc);
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    auto it = shard.sessions.find(ssrc);
+    if (it == shard.sessions.end()) {
+        SessionInfo& info = shard.sessions[ssrc];
+        info.source = source;
+        info.localPort = localPort;
+        info.lastActivity = arrival.time;
+        info.stats.uplink.update(arrival);
+        QUICRTP_PROBE2(session_create, ssrc, localPort);
+        return SessionBinding::Created;
+    }
+
+    SessionInfo& info = it->second;
+    if (!info.latched) {
+        if (strictSource && info.source.port() != 0 && info.source != source) {
+            return SessionBinding::Rejected;
+        }
+        info.source = source;
+        info.localPort = localPort;
+        info.latched = true;
+        info.lastActivity = arrival.time;
+        info.stats.uplink.update(arrival);
+        QUICRTP_PROBE2(session_create, ssrc, localPort);
+        return SessionBinding::Created;
+    }
+    if (info.source == source && info.localPort == localPort) {
+        info.lastActivity = arrival.time;
+        info.stats.uplink.update(arrival);
+        return SessionBinding::Existing;
+    }
+    if (strictSource) {
+        return SessionBinding::Rejected;
+    }
+    info.source = source;
+    info.localPort = localPort;
+    info.lastActivity = arrival.time;
+    info.stats.uplink.update(arrival);
+    QUICRTP_PROBE2(session_move, ssrc, localPort);
+    return SessionBinding::Moved;
+}
+
+bool SessionManager::recordDownlink(uint32_t ssrc, const RtpArrival& arrival, const uint8_t* header, size_t headerLen,
+                                    const uint8_t* payload, size_t payloadLen,
+                                    boost::asio::ip::udp::endpoint& destination, uint16_t& localPort) {
+    Shard& shard = shardFor(ssrc);
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    auto it = shard.sessions.find(ssrc);
+    if (it == shard.sessions.end()) {
+        return false;
+    }
+    SessionInfo& info = it->second;
+    if (!info.latched && info.source.port() == 0) {
+        return false;   // provisioned, and nowhere to send until it latches
+    }
+    info.lastActivity = arrival.time;
+    info.stats.downlink.update(arrival);
+    info.stats.sent.update(arrival.timestamp, arrival.clockRate, payloadLen, arrival.time);
+    if (nackCacheSlots_ > 0 && nackCacheBytes_.load(std::memory_order_relaxed) < nackCacheLimit_) {
+        if (!info.nackCache) {
+            info.nackCache = std::make_shared<NackCache>(nackCacheSlots_);
+            nackCacheBytes_.fetch_add(info.nackCache->bytes(), std::memory_order_relaxed);
+        }
+        size_t before = info.nackCache->bytes();
+        info.nackCache->store(arrival.sequenceNumber, header, headerLen, payload, payloadLen, arrival.time);
+        nackCacheBytes_.fetch_add(info.nackCache->bytes() - before, std::memory_order_relaxed);
+    }
+    destination = info.source;
+    localPort = info.localPort;
+    return true;
 }
 
-void SessionManager::removeSession(uint32_t ssrc) {
-    std::lock_guard<std::mutex> lock(mutex_);
-    sessions_.erase(ssrc);
+bool SessionManager::removeSession(uint32_t ssrc) {
+    Shard& shard = shardFor(ssrc);
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    auto it = shard.sessions.find(ssrc);
+    if (it == shard.sessions.end()) {
+        return false;
+    }
+    releaseNackCache(it->second);
+    shard.sessions.erase(it);
+    QUICRTP_PROBE1(session_remove, ssrc);
+    return true;
+}
+
+std::vector<uint32_t> SessionManager::removeSessionsOnPort(uint16_t localPort) {
+    std::vector<uint32_t> removed;
+    for (Shard& shard : shards_) {
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        for (auto it = shard.sessions.begin(); it != shard.sessions.end();) {
+            if (it->second.localPort != localPort) {
+                ++it;
+                continue;
+            }
+            QUICRTP_PROBE1(session_remove, it->first);
+            releaseNackCache(it->second);
+            removed.push_back(it->first);
+            it = shard.sessions.erase(it);
+        }
+    }
+    return removed;
+}
+
+std::vector<std::pair<uint32_t, SessionInfo>> SessionManager::expireSessions(std::chrono::steady_clock::time_point now,
+                                                                             std::chrono::steady_clock::duration timeout) {
+    std::vector<std::pair<uint32_t, SessionInfo>> expired;
+    for (Shard& shard : shards_) {
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        for (auto it = shard.sessions.begin(); it != shard.sessions.end();) {
+            if (now - it->second.lastActivity < timeout) {
+                ++it;
+                continue;
+            }
+            QUICRTP_PROBE1(session_remove, it->first);
+            releaseNackCache(it->second);
+            expired.emplace_back(it->first, std::move(it->second));
+            it = shard.sessions.erase(it);
+        }
+    }
+    return expired;
 }
 
 bool SessionManager::hasSession(uint32_t ssrc) {
-    std::lock_guard<std::mutex> lock(mutex_);
-    return sessions_.find(ssrc) != sessions_.end();
+    Shard& shard = shardFor(ssrc);
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    return shard.sessions.find(ssrc) != shard.sessions.end();
+}
+
+bool SessionManager::findSession(uint32_t ssrc, SessionInfo& info) {
+    Shard& shard = shardFor(ssrc);
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    auto it = shard.sessions.find(ssrc);
+    if (it == shard.sessions.end()) {
+        return false;
+    }
+    info = it->second;
+    return true;
+}
+
+bool SessionManager::updateSession(uint32_t ssrc, const std::function<void(SessionInfo& info)>& visit) {
+    Shard& shard = shardFor(ssrc);
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    auto it = shard.sessions.find(ssrc);
+    if (it == shard.sessions.end()) {
+        return false;
+    }
+    visit(it->second);
+    return true;
+}
+
+void SessionManager::forEachSession(const std::function<void(uint32_t ssrc, SessionInfo& info)>& visit) {
+    for (Shard& shard : shards_) {
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        for (auto& entry : shard.sessions) {
+            visit(entry.first, entry.second);
+        }
+    }
+}
+
+std::vector<std::pair<uint32_t, SessionInfo>> SessionManager::exportSessions() {
+    std::vector<std::pair<uint32_t, SessionInfo>> sessions;
+    for (Shard& shard : shards_) {
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        sessions.insert(sessions.end(), shard.sessions.begin(), shard.sessions.end());
+    }
+    return sessions;
+}
+
+void SessionManager::importSession(uint32_t ssrc, const SessionInfo& info) {
+    Shard& shard = shardFor(ssrc);
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    SessionInfo& imported = shard.sessions[ssrc];
+    releaseNackCache(imported);
+    imported = info;
+    // Cached packets are not carried over
+    imported.nackCache.reset();
+    imported.lastActivity = std::chrono::steady_clock::now();
+}
+
+SessionManager::Shard& SessionManager::shardFor(uint32_t ssrc) {
+    return shards_[quicrtp_worker_for_ssrc(ssrc, static_cast<unsigned int>(shards_.size()))];
 }
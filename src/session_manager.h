@@ -16,26 +16,109 @@
 #ifndef SESSION_MANAGER_H
 #define SESSION_MANAGER_H
 
-#include <map>
+#include "nack_cache.h"
+#include "rtp_stats.h"
+#include <unordered_map>
+#include <functional>
+#include <memory>
 #include <mutex>
 #include <cstdint>
+#include <cstddef>
+#include <utility>
+#include <vector>
+#include <boost/asio/ip/udp.hpp>
+#include <atomic>
+#include <chrono>
 
 struct SessionInfo {
-    // Add session-related members if needed
+    // Source the SSRC was first seen from and the local port it arrived on;
+    // together with the SSRC this is the demux key in single-port mode
+    boost::asio::ip::udp::endpoint source;
+    uint16_t localPort = 0;
+    // False for a session set up through the control API that has not seen
+    // a packet yet; source is then the expected one, or unset for any
+    bool latched = true;
+    // Last packet in either direction, or when the session was set up
+    std::chrono::steady_clock::time_point lastActivity;
+    // Carried through a hot upgrade
+    RtpSessionStats stats;
+    // Downlink packets for NACK repair, created with the first one; a new
+    // process starts it afresh
+    std::shared_ptr<NackCache> nackCache;
+};
+
+enum class SessionBinding {
+    Existing,   // SSRC known and source unchanged
+    Created,    // first packet of a new session
+    Moved,      // source changed and the session was re-latched to it
+    Rejected    // source changed and strict demux refused it
 };
 
 class SessionManager {
 public:
-    SessionManager();
+    // The table is split into shards keyed by quicrtp_worker_for_ssrc(), so
+    // with SSRC-steered workers each shard is only ever touched by one core
+    explicit SessionManager(size_t shardCount = 1);
     ~SessionManager();
 
+    // Slots of each session's NackCache; 0, the default, keeps none. Once
+    // the caches of all sessions hold maxBytes, new sessions get none and
+    // the others stop storing until sessions end.
+    void setNackCache(size_t slots, size_t maxBytes);
+    size_t nackCacheBytes() const { return nackCacheBytes_.load(std::memory_order_relaxed); }
+
     void addSession(uint32_t ssrc);
-    void removeSession(uint32_t ssrc);
+    // Sets a session up ahead of its first packet (control API). It latches
+    // to the first packet from source, or from anywhere when source is
+    // unspecified (port 0), and that packet binds as Created. False when the
+    // SSRC already has a session.
+    bool provisionSession(uint32_t ssrc, const boost::asio::ip::udp::endpoint& source, uint16_t localPort);
+    // Looks the SSRC up and checks the packet's 5-tuple against the session.
+    // With strictSource a different source is rejected instead of re-latched,
+    // which keeps calls apart when many share one listening port. Packets
+    // that are not rejected go into the session's uplink statistics.
+    SessionBinding bindSession(uint32_t ssrc, const boost::asio::ip::udp::endpoint& source, uint16_t localPort, bool strictSource,
+                               const RtpArrival& arrival);
+    // Downlink packet from the QUIC hop: counts it, keeps it for NACKs and
+    // returns where it goes. False when the SSRC has no local session, or
+    // one provisioned without a source that has not latched yet.
+    bool recordDownlink(uint32_t ssrc, const RtpArrival& arrival, const uint8_t* header, size_t headerLen,
+                        const uint8_t* payload, size_t payloadLen,
+                        boost::asio::ip::udp::endpoint& destination, uint16_t& localPort);
+    // False when the SSRC had no session
+    bool removeSession(uint32_t ssrc);
+    // Removes the sessions on localPort and returns their SSRCs
+    std::vector<uint32_t> removeSessionsOnPort(uint16_t localPort);
+    // Removes the sessions without a packet for timeout and returns them
+    std::vector<std::pair<uint32_t, SessionInfo>> expireSessions(std::chrono::steady_clock::time_point now,
+                                                                 std::chrono::steady_clock::duration timeout);
     bool hasSession(uint32_t ssrc);
+    bool findSession(uint32_t ssrc, SessionInfo& info);
+    // Runs visit on the session under its shard's lock; false when unknown
+    bool updateSession(uint32_t ssrc, const std::function<void(SessionInfo& info)>& visit);
+    // Visits every session, one shard locked at a time
+    void forEachSession(const std::function<void(uint32_t ssrc, SessionInfo& info)>& visit);
+
+    // Copies out / restores the whole table, for the hot upgrade snapshot.
+    // Restored sessions count as active from the moment they are imported.
+    std::vector<std::pair<uint32_t, SessionInfo>> exportSessions();
+    void importSession(uint32_t ssrc, const SessionInfo& info);
 
 private:
-    std::map<uint32_t, SessionInfo> sessions_;
-    std::mutex mutex_;
+    struct alignas(64) Shard {
+        std::unordered_map<uint32_t, SessionInfo> sessions;
+        std::mutex mutex;
+    };
+
+    Shard& shardFor(uint32_t ssrc);
+    // Frees the session's NackCache and takes it off the budget; expects the
+    // shard lock to be held
+    void releaseNackCache(SessionInfo& info);
+
+    std::vector<Shard> shards_;
+    size_t nackCacheSlots_;
+    size_t nackCacheLimit_;
+    std::atomic<size_t> nackCacheBytes_;
 };
 
 #endif // SESSION_MANAGER_H
@@ -0,0 +1,226 @@
+/*
+ * Copyright 2024 nrjchnd@gmail.com
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     https://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an **"AS IS" BASIS,**
+ * **WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.**
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "silence_suppressor.h"
+#include "logger.h"
+#include <algorithm>
+#include <cstring>
+#include <sstream>
+
+const uint8_t COMFORT_NOISE_PAYLOAD_TYPE = 13;
+// Streams quiet for this long are forgotten when the table is swept
+const std::chrono::seconds STREAM_IDLE_TIMEOUT(30);
+const size_t SWEEP_THRESHOLD = 1024;
+
+SilenceSuppressor::SilenceSuppressor()
+    : keepalive_(500), sweepAt_(SWEEP_THRESHOLD), dropped_(0)
+{
+    signatures_[COMFORT_NOISE_PAYLOAD_TYPE].comfortNoise = true;
+}
+
+void SilenceSuppressor::setComfortNoiseTypes(const std::vector<std::string>& payloadTypes) {
+    for (auto& signature : signatures_) {
+        signature.comfortNoise = false;
+    }
+    for (const auto& value : payloadTypes) {
+        try {
+            int pt = std::stoi(value);
+            if (pt >= 0 && pt < 128) {
+                signatures_[pt].comfortNoise = true;
+            }
+        } catch (const std::exception&) {
+            // Ignore entries that are not numbers
+        }
+    }
+}
+
+void SilenceSuppressor::setSignatures(const std::vector<std::string>& signatures) {
+    for (const auto& entry : signatures) {
+        size_t colon = entry.find(':');
+        size_t equals = entry.find('=', colon);
+        try {
+            if (colon == std::string::npos || equals == std::string::npos) {
+                throw std::invalid_argument("expected <pt>:fill=<hex>|... or <pt>:max=<bytes>");
+            }
+            int pt = std::stoi(entry.substr(0, colon));
+            if (pt < 0 || pt >= 128) {
+                throw std::invalid_argument("payload type out of range");
+            }
+            std::string rule = entry.substr(colon + 1, equals - colon - 1);
+            std::string value = entry.substr(equals + 1);
+            Signature& signature = signatures_[pt];
+            if (rule == "max") {
+                signature.maxLength = static_cast<size_t>(std::max(std::stoi(value), 1));
+            } else if (rule == "fill") {
+                std::stringstream bytes(value);
+                std::string byte;
+                while (std::getline(bytes, byte, '|')) {
+                    int parsed = std::stoi(byte, nullptr, 16);
+                    if (parsed < 0 || parsed > 255) {
+                        throw std::invalid_argument("fill byte out of range");
+                    }
+                    signature.fill[parsed] = true;
+                    signature.hasFill = true;
+                }
+            } else {
+                throw std::invalid_argument("unknown rule " + rule);
+            }
+        } catch (const std::exception& e) {
+            Logger::getLogger()->warn("Ignoring silence signature '{}': {}", entry, e.what());
+        }
+    }
+}
+
+bool SilenceSuppressor::isSilent(const RtpHeaderInfo& header, const uint8_t* payload, size_t payloadLen) const {
+    const Signature& signature = signatures_[header.payloadType];
+    if (signature.comfortNoise) {
+        return true;
+    }
+    if (signature.maxLength != 0 && payloadLen <= signature.maxLength) {
+        return true;
+    }
+    if (!signature.hasFill || payloadLen == 0) {
+        return false;
+    }
+    for (size_t i = 0; i < payloadLen; ++i) {
+        if (!signature.fill[payload[i]]) {
+            return false;
+        }
+    }
+    return true;
+}
+
+SilenceSuppressor::Verdict SilenceSuppressor::process(const RtpHeaderInfo& header, const uint8_t* payload, size_t payloadLen,
+                                                      std::chrono::steady_clock::time_point now, uint16_t& sequenceNumber, bool& marker) {
+    if (streams_.size() >= sweepAt_) {
+        sweep(now);
+    }
+    auto found = streams_.find(header.ssrc);
+    if (found == streams_.end()) {
+        found = streams_.emplace(header.ssrc, Stream()).first;
+        found->second.highestSequence = static_cast<uint16_t>(header.sequenceNumber - 1);
+    }
+    Stream& stream = found->second;
+    stream.lastSeen = now;
+
+    if (static_cast<int16_t>(header.sequenceNumber - stream.highestSequence) <= 0) {
+        // Late or reordered: it takes the offset in force at its number
+        size_t index = stream.shiftCount;
+        while (index > 0 && static_cast<int16_t>(header.sequenceNumber - stream.shifts[index - 1].from) < 0) {
+            --index;
+        }
+        if (index == 0 && stream.shiftsForgotten) {
+            return Verdict::Drop;
+        }
+        uint16_t offset = index > 0 ? stream.shifts[index - 1].dropped : 0;
+        if (offset == 0) {
+            return Verdict::Send;
+        }
+        sequenceNumber = static_cast<uint16_t>(header.sequenceNumber - offset);
+        marker = header.marker;
+        return Verdict::Rewrite;
+    }
+    stream.highestSequence = header.sequenceNumber;
+
+    bool startOfTalkspurt = false;
+    if (isSilent(header, payload, payloadLen)) {
+        // The first silent packet tells the far side the pause began
+        if (stream.silent && now - stream.lastSent < keepalive_) {
+            shift(stream, header.sequenceNumber);
+            ++dropped_;
+            return Verdict::Drop;
+        }
+        stream.silent = true;
+    } else if (stream.silent) {
+        stream.silent = false;
+        startOfTalkspurt = true;
+    }
+
+    stream.lastSent = now;
+    if (stream.dropped == 0 && !startOfTalkspurt) {
+        return Verdict::Send;
+    }
+    sequenceNumber = static_cast<uint16_t>(header.sequenceNumber - stream.dropped);
+    marker = header.marker || startOfTalkspurt;
+    return Verdict::Rewrite;
+}
+
+void SilenceSuppressor::shift(Stream& stream, uint16_t sequenceNumber) {
+    ++stream.dropped;
+    Shift next;
+    next.from = static_cast<uint16_t>(sequenceNumber + 1);
+    next.dropped = stream.dropped;
+    // A run of drops is one change of the offset
+    if (stream.shiftCount > 0 && stream.shifts[stream.shiftCount - 1].from == sequenceNumber) {
+        stream.shifts[stream.shiftCount - 1] = next;
+        return;
+    }
+    if (stream.shiftCount == stream.shifts.size()) {
+        std::move(stream.shifts.begin() + 1, stream.shifts.end(), stream.shifts.begin());
+        --stream.shiftCount;
+        stream.shiftsForgotten = true;
+    }
+    stream.shifts[stream.shiftCount++] = next;
+}
+
+std::vector<SilenceStreamState> SilenceSuppressor::saveStreams() const {
+    std::vector<SilenceStreamState> states;
+    states.reserve(streams_.size());
+    for (const auto& entry : streams_) {
+        SilenceStreamState state;
+        std::memset(&state, 0, sizeof(state));
+        state.ssrc = entry.first;
+        state.dropped = entry.second.dropped;
+        state.highestSequence = entry.second.highestSequence;
+        state.offsetFrom = entry.second.shiftCount > 0 ? entry.second.shifts[entry.second.shiftCount - 1].from : 0;
+        state.silent = entry.second.silent ? 1 : 0;
+        state.lastSent = std::chrono::duration_cast<std::chrono::nanoseconds>(
+            entry.second.lastSent.time_since_epoch()).count();
+        states.push_back(state);
+    }
+    return states;
+}
+
+void SilenceSuppressor::restoreStream(const SilenceStreamState& state) {
+    Stream& stream = streams_[state.ssrc];
+    stream.dropped = state.dropped;
+    stream.highestSequence = state.highestSequence;
+    // Only the last change of the offset is carried, so late packets from
+    // before it are dropped
+    stream.shiftCount = 0;
+    stream.shiftsForgotten = state.dropped != 0;
+    if (state.dropped != 0) {
+        stream.shifts[0].from = state.offsetFrom;
+        stream.shifts[0].dropped = state.dropped;
+        stream.shiftCount = 1;
+    }
+    stream.silent = state.silent != 0;
+    stream.lastSent = std::chrono::steady_clock::time_point(
+        std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::nanoseconds(state.lastSent)));
+    // Counts as seen now, so the sweep does not take it before its next packet
+    stream.lastSeen = std::chrono::steady_clock::now();
+}
+
+void SilenceSuppressor::sweep(std::chrono::steady_clock::time_point now) {
+    for (auto it = streams_.begin(); it != streams_.end();) {
+        if (now - it->second.lastSeen > STREAM_IDLE_TIMEOUT) {
+            it = streams_.erase(it);
+        } else {
+            ++it;
+        }
+    }
+    sweepAt_ = std::max(SWEEP_THRESHOLD, streams_.size() * 2);
+}
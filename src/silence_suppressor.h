@@ -0,0 +1,124 @@
+/*
+ * Copyright 2024 nrjchnd@gmail.com
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     https://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an **"AS IS" BASIS,**
+ * **WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.**
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#ifndef SILENCE_SUPPRESSOR_H
+#define SILENCE_SUPPRESSOR_H
+
+#include "rtp_batch_parser.h"
+#include <array>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// Drops the uplink packets of silent periods so they do not cost a QUIC
+// send each. A packet is silent when its payload type is comfort noise
+// (RFC 3389) or its payload matches a configured signature of a codec's
+// silence. The first silent packet of a pause still goes out, then one per
+// keepalive interval; the first packet after the pause gets the marker bit.
+//
+// Sequence numbers of the packets sent are lowered by the number dropped so
+// far, so what crosses QUIC is a valid DTX stream: contiguous sequence
+// numbers with a timestamp jump over each pause. The far side and the
+// endpoint need no support for it, and real losses still show as gaps.
+// Packets arriving behind the highest sequence number seen neither drop nor
+// move the offset: they get the offset that was in force at their sequence
+// number, looked up in a short history of the offset's changes. A late
+// packet older than the history is dropped, since its rewritten number
+// could collide with one already sent.
+
+// A stream's state, carried through a hot upgrade; times are steady clock
+// nanoseconds
+struct SilenceStreamState {
+    uint32_t ssrc;
+    uint16_t dropped;
+    uint16_t highestSequence;
+    uint16_t offsetFrom;        // where the current offset took effect
+    uint8_t silent;
+    uint8_t reserved[5];
+    int64_t lastSent;
+};
+
+// Offset changes kept per stream for late packets
+const size_t SILENCE_SHIFT_HISTORY = 8;
+
+class SilenceSuppressor {
+public:
+    enum class Verdict {
+        Send,        // unchanged
+        Rewrite,     // send with the sequence number and marker given
+        Drop
+    };
+
+    SilenceSuppressor();
+
+    // Payload types that are comfort noise; 13 by default
+    void setComfortNoiseTypes(const std::vector<std::string>& payloadTypes);
+    // "<pt>:fill=<hex>|<hex>..." for payloads made only of those bytes (e.g.
+    // G.711 silence), "<pt>:max=<bytes>" for payloads no longer than that
+    // (e.g. Opus DTX frames)
+    void setSignatures(const std::vector<std::string>& signatures);
+    void setKeepalive(std::chrono::milliseconds keepalive) { keepalive_ = keepalive; }
+
+    Verdict process(const RtpHeaderInfo& header, const uint8_t* payload, size_t payloadLen,
+                    std::chrono::steady_clock::time_point now, uint16_t& sequenceNumber, bool& marker);
+
+    uint64_t droppedPackets() const { return dropped_; }
+
+    std::vector<SilenceStreamState> saveStreams() const;
+    void restoreStream(const SilenceStreamState& state);
+
+private:
+    struct Signature {
+        bool comfortNoise = false;
+        size_t maxLength = 0;               // 0: no length rule
+        std::array<bool, 256> fill{};       // bytes a silent payload may contain
+        bool hasFill = false;
+    };
+
+    // From sequence number from on, dropped were taken out
+    struct Shift {
+        uint16_t from = 0;
+        uint16_t dropped = 0;
+    };
+
+    struct Stream {
+        bool silent = false;
+        uint16_t dropped = 0;               // sequence numbers taken out so far
+        uint16_t highestSequence = 0;
+        // Changes of the offset, oldest first; packets before the oldest had
+        // none unless older ones were forgotten
+        std::array<Shift, SILENCE_SHIFT_HISTORY> shifts;
+        uint8_t shiftCount = 0;
+        bool shiftsForgotten = false;
+        std::chrono::steady_clock::time_point lastSent;
+        std::chrono::steady_clock::time_point lastSeen;
+    };
+
+    bool isSilent(const RtpHeaderInfo& header, const uint8_t* payload, size_t payloadLen) const;
+    // Records that sequenceNumber was dropped
+    static void shift(Stream& stream, uint16_t sequenceNumber);
+    void sweep(std::chrono::steady_clock::time_point now);
+
+    std::array<Signature, 128> signatures_;
+    std::chrono::milliseconds keepalive_;
+    std::unordered_map<uint32_t, Stream> streams_;
+    size_t sweepAt_;
+    uint64_t dropped_;
+};
+
+#endif // SILENCE_SUPPRESSOR_H
@@ -0,0 +1,134 @@
+/*
+ * Copyright 2024 nrjchnd@gmail.com
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     https://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an **"AS IS" BASIS,**
+ * **WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.**
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "tenant_accounting.h"
+#include "cache_manager.h"
+#include "logger.h"
+#include <algorithm>
+
+const std::string TENANT_KEY_PREFIX = "tenant:";
+const char* TENANT_FIELDS[] = {"rtp_in_bytes", "rtp_in_packets", "rtp_out_bytes", "rtp_out_packets"};
+
+namespace {
+
+thread_local const void* workerOwner = nullptr;
+thread_local size_t workerSlot = 0;
+
+}
+
+TenantAccounting::TenantAccounting(const std::string& redisUri, const TenantDirectory& tenants)
+    : redis_(std::make_unique<sw::redis::Redis>(CacheManager::connectionOptions(redisUri))), tenants_(tenants),
+      linesPerWorker_(0), nextWorker_(0), flushInterval_(5), running_(false)
+{
+}
+
+TenantAccounting::~TenantAccounting() {
+    stop();
+}
+
+void TenantAccounting::start(std::chrono::seconds flushInterval) {
+    if (running_.load()) {
+        return;
+    }
+    linesPerWorker_ = (tenants_.size() * FIELDS + COUNTERS_PER_LINE - 1) / COUNTERS_PER_LINE;
+    workers_.clear();
+    for (size_t i = 0; i < MAX_WORKERS; ++i) {
+        workers_.push_back(std::unique_ptr<CounterLine[]>(new CounterLine[std::max(linesPerWorker_, size_t(1))]()));
+    }
+    flushed_.assign(tenants_.size() * FIELDS, 0);
+    flushInterval_ = std::max(flushInterval, std::chrono::seconds(1));
+
+    running_ = true;
+    flushThread_ = std::thread(&TenantAccounting::flushLoop, this);
+    Logger::getLogger()->info("Accounting traffic of {} tenants, flushed every {}s", tenants_.size(), flushInterval_.count());
+}
+
+void TenantAccounting::stop() {
+    if (!running_.exchange(false)) {
+        return;
+    }
+    if (flushThread_.joinable()) {
+        flushThread_.join();
+    }
+    flush();
+}
+
+TenantAccounting::CounterLine* TenantAccounting::threadCounters() {
+    if (workerOwner != this) {
+        workerOwner = this;
+        workerSlot = nextWorker_.fetch_add(1, std::memory_order_relaxed) % MAX_WORKERS;
+    }
+    return workers_[workerSlot].get();
+}
+
+bool TenantAccounting::flush() {
+    std::vector<uint64_t> totals(flushed_.size(), 0);
+    for (const auto& worker : workers_) {
+        for (size_t i = 0; i < totals.size(); ++i) {
+            totals[i] += worker[i / COUNTERS_PER_LINE].value[i % COUNTERS_PER_LINE].load(std::memory_order_relaxed);
+        }
+    }
+
+    size_t commands = 0;
+    try {
+        auto pipeline = redis_->pipeline(false);
+        for (size_t tenant = 0; tenant < tenants_.size(); ++tenant) {
+            const std::string key = TENANT_KEY_PREFIX + tenants_.id(static_cast<uint16_t>(tenant));
+            uint64_t usage = 0;
+            for (size_t field = 0; field < FIELDS; ++field) {
+                size_t index = tenant * FIELDS + field;
+                uint64_t delta = totals[index] - flushed_[index];
+                if (delta == 0) {
+                    continue;
+                }
+                pipeline.hincrby(key, TENANT_FIELDS[field], static_cast<long long>(delta));
+                ++commands;
+                if (field % 2 == 0) {
+                    usage += delta;
+                }
+            }
+            if (usage != 0) {
+                pipeline.hincrby(key, "usage", static_cast<long long>(usage));
+                ++commands;
+            }
+        }
+        if (commands == 0) {
+            return true;
+        }
+        pipeline.exec();
+    } catch (const sw::redis::Error& e) {
+        Logger::getLogger()->warn("Tenant usage flush failed: {}", e.what());
+        return false;
+    }
+
+    flushed_ = std::move(totals);
+    Logger::getLogger()->debug("Flushed tenant usage with {} commands", commands);
+    return true;
+}
+
+void TenantAccounting::flushLoop() {
+    auto nextFlush = std::chrono::steady_clock::now();
+    while (running_.load()) {
+        nextFlush += flushInterval_;
+        // Sleep in short steps so stop() does not wait a whole interval
+        while (running_.load() && std::chrono::steady_clock::now() < nextFlush) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(100));
+        }
+        if (running_.load()) {
+            flush();
+        }
+    }
+}
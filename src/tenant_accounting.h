@@ -0,0 +1,94 @@
+/*
+ * Copyright 2024 nrjchnd@gmail.com
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     https://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an **"AS IS" BASIS,**
+ * **WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.**
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#ifndef TENANT_ACCOUNTING_H
+#define TENANT_ACCOUNTING_H
+
+#include "tenant_directory.h"
+#include <sw/redis++/redis++.h>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+enum class TrafficDirection : uint8_t {
+    Ingress = 0,   // RTP received from endpoints
+    Egress = 1     // RTP sent back to them
+};
+
+// Per-tenant byte and packet counts, added to the tenant:<id> hashes the
+// config UI keeps. "usage" grows by the bytes of both directions, as the
+// Python proxies counted it; rtp_in_bytes, rtp_in_packets, rtp_out_bytes and
+// rtp_out_packets break it down.
+//
+// Tenants come from the TenantDirectory. Each IO thread counts into its own
+// cache-line aligned block of relaxed atomics, and a flush thread adds up
+// the blocks and sends the increments since the last flush as one
+// pipelined batch of HINCRBYs. A failed flush is retried with the next one.
+class TenantAccounting {
+public:
+    // tenants must be complete by start() and outlive this
+    TenantAccounting(const std::string& redisUri, const TenantDirectory& tenants);
+    ~TenantAccounting();
+
+    void start(std::chrono::seconds flushInterval);
+    // Flushes what is left
+    void stop();
+
+    // Packet path; lock free. Traffic of ports without a tenant is not counted.
+    void record(uint16_t localPort, TrafficDirection direction, size_t bytes) {
+        uint16_t tenant = tenants_.tenantOf(localPort);
+        if (tenant == NO_TENANT) {
+            return;
+        }
+        // Bytes and packets of one direction share a line
+        size_t index = tenant * FIELDS + static_cast<size_t>(direction) * 2;
+        CounterLine& line = threadCounters()[index / COUNTERS_PER_LINE];
+        line.value[index % COUNTERS_PER_LINE].fetch_add(bytes, std::memory_order_relaxed);
+        line.value[index % COUNTERS_PER_LINE + 1].fetch_add(1, std::memory_order_relaxed);
+    }
+
+private:
+    static const size_t FIELDS = 4;          // bytes and packets per direction
+    static const size_t MAX_WORKERS = 64;    // threads beyond share blocks
+    static const size_t COUNTERS_PER_LINE = 8;
+
+    struct alignas(64) CounterLine {
+        std::atomic<uint64_t> value[COUNTERS_PER_LINE];
+    };
+
+    CounterLine* threadCounters();
+    bool flush();
+    void flushLoop();
+
+    std::unique_ptr<sw::redis::Redis> redis_;
+    const TenantDirectory& tenants_;
+
+    // One block of FIELDS counters per tenant for each worker slot
+    std::vector<std::unique_ptr<CounterLine[]>> workers_;
+    size_t linesPerWorker_;
+    std::atomic<size_t> nextWorker_;
+    std::vector<uint64_t> flushed_;          // totals already in Redis
+
+    std::chrono::seconds flushInterval_;
+    std::atomic<bool> running_;
+    std::thread flushThread_;
+};
+
+#endif // TENANT_ACCOUNTING_H
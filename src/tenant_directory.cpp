@@ -0,0 +1,185 @@
+/*
+ * Copyright 2024 nrjchnd@gmail.com
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     https://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an **"AS IS" BASIS,**
+ * **WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.**
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "tenant_directory.h"
+#include "cache_manager.h"
+#include "logger.h"
+#include <sw/redis++/redis++.h>
+#include <sstream>
+#include <stdexcept>
+
+const std::string TENANT_KEY_PREFIX = "tenant:";
+const std::string TENANT_CONFIG_KEY_PREFIX = "config:";
+
+namespace {
+
+// The config UI hands its handlers the whole hash key as tenant ID
+std::string normalizeTenantId(const std::string& tenantId) {
+    if (tenantId.compare(0, TENANT_KEY_PREFIX.size(), TENANT_KEY_PREFIX) == 0) {
+        return tenantId.substr(TENANT_KEY_PREFIX.size());
+    }
+    return tenantId;
+}
+
+// "<first>-<last>" or a single port
+bool parsePortRange(const std::string& range, uint16_t& firstPort, uint16_t& lastPort) {
+    try {
+        size_t dash = range.find('-');
+        int first = std::stoi(range.substr(0, dash));
+        int last = dash == std::string::npos ? first : std::stoi(range.substr(dash + 1));
+        if (first < 1 || last > 65535 || first > last) {
+            return false;
+        }
+        firstPort = static_cast<uint16_t>(first);
+        lastPort = static_cast<uint16_t>(last);
+        return true;
+    } catch (const std::exception&) {
+        return false;
+    }
+}
+
+TenantRate rateOf(uint64_t kbps, uint64_t burstKb) {
+    TenantRate rate;
+    rate.bytesPerSecond = kbps * 1000 / 8;
+    rate.burstBytes = burstKb * 1000;
+    return rate;
+}
+
+}
+
+TenantDirectory::TenantDirectory()
+    : portTenants_(65536, NO_TENANT), attachedTenants_(new std::atomic<uint16_t>[65536]), defaultTenant_(NO_TENANT)
+{
+    for (size_t port = 0; port < 65536; ++port) {
+        attachedTenants_[port].store(NO_TENANT, std::memory_order_relaxed);
+    }
+}
+
+uint16_t TenantDirectory::find(const std::string& tenantId) const {
+    std::string id = normalizeTenantId(tenantId);
+    for (size_t i = 0; i < ids_.size(); ++i) {
+        if (ids_[i] == id) {
+            return static_cast<uint16_t>(i);
+        }
+    }
+    return NO_TENANT;
+}
+
+uint16_t TenantDirectory::add(const std::string& tenantId) {
+    uint16_t existing = find(tenantId);
+    if (existing != NO_TENANT) {
+        return existing;
+    }
+    std::string id = normalizeTenantId(tenantId);
+    if (ids_.size() >= NO_TENANT) {
+        throw std::length_error("Too many tenants");
+    }
+    ids_.push_back(id);
+    rates_.emplace_back();
+    return static_cast<uint16_t>(ids_.size() - 1);
+}
+
+void TenantDirectory::assignPorts(const std::string& tenantId, uint16_t firstPort, uint16_t lastPort) {
+    uint16_t tenant = add(tenantId);
+    for (uint32_t port = firstPort; port <= lastPort; ++port) {
+        portTenants_[port] = tenant;
+    }
+}
+
+void TenantDirectory::setDefaultTenant(const std::string& tenantId) {
+    defaultTenant_ = add(tenantId);
+}
+
+void TenantDirectory::setRate(const std::string& tenantId, const TenantRate& rate) {
+    rates_[add(tenantId)] = rate;
+}
+
+void TenantDirectory::addPortRanges(const std::vector<std::string>& entries) {
+    for (const std::string& entry : entries) {
+        // Tenant IDs are UUIDs, so the last colon separates the range
+        size_t colonPos = entry.rfind(':');
+        uint16_t firstPort = 0;
+        uint16_t lastPort = 0;
+        if (colonPos == std::string::npos || !parsePortRange(entry.substr(colonPos + 1), firstPort, lastPort)) {
+            Logger::getLogger()->warn("Ignoring invalid tenant port range '{}'", entry);
+            continue;
+        }
+        assignPorts(entry.substr(0, colonPos), firstPort, lastPort);
+    }
+}
+
+void TenantDirectory::addRates(const std::vector<std::string>& entries) {
+    for (const std::string& entry : entries) {
+        size_t colonPos = entry.rfind(':');
+        size_t slashPos = entry.find('/', colonPos == std::string::npos ? 0 : colonPos);
+        try {
+            if (colonPos == std::string::npos || slashPos == std::string::npos) {
+                throw std::invalid_argument(entry);
+            }
+            setRate(entry.substr(0, colonPos), rateOf(std::stoull(entry.substr(colonPos + 1, slashPos - colonPos - 1)),
+                                                      std::stoull(entry.substr(slashPos + 1))));
+        } catch (const std::exception&) {
+            Logger::getLogger()->warn("Ignoring invalid tenant rate '{}'", entry);
+        }
+    }
+}
+
+void TenantDirectory::loadFromRedis(const std::string& redisUri, const std::vector<std::string>& tenantIds) {
+    if (tenantIds.empty()) {
+        return;
+    }
+    sw::redis::Redis redis(CacheManager::connectionOptions(redisUri));
+    for (const std::string& tenantId : tenantIds) {
+        std::string id = normalizeTenantId(tenantId);
+        add(id);
+        sw::redis::OptionalString ports;
+        sw::redis::OptionalString kbps;
+        sw::redis::OptionalString burstKb;
+        try {
+            // Older config UI versions stored it under config:tenant:<id>
+            ports = redis.hget(TENANT_CONFIG_KEY_PREFIX + id, "rtp_ports");
+            if (!ports) {
+                ports = redis.hget(TENANT_CONFIG_KEY_PREFIX + TENANT_KEY_PREFIX + id, "rtp_ports");
+            }
+            kbps = redis.hget(TENANT_KEY_PREFIX + id, "rate_kbps");
+            burstKb = redis.hget(TENANT_KEY_PREFIX + id, "burst_kb");
+        } catch (const sw::redis::Error& e) {
+            Logger::getLogger()->warn("Failed to load the settings of tenant {}: {}", id, e.what());
+            continue;
+        }
+
+        if (ports) {
+            std::stringstream ss(*ports);
+            std::string range;
+            while (std::getline(ss, range, ',')) {
+                uint16_t firstPort = 0;
+                uint16_t lastPort = 0;
+                if (parsePortRange(range, firstPort, lastPort)) {
+                    assignPorts(id, firstPort, lastPort);
+                } else {
+                    Logger::getLogger()->warn("Ignoring invalid port range '{}' of tenant {}", range, id);
+                }
+            }
+        }
+        if (kbps) {
+            try {
+                setRate(id, rateOf(std::stoull(*kbps), burstKb ? std::stoull(*burstKb) : 0));
+            } catch (const std::exception&) {
+                Logger::getLogger()->warn("Ignoring invalid rate limit of tenant {}", id);
+            }
+        }
+    }
+}
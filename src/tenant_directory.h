@@ -0,0 +1,92 @@
+/*
+ * Copyright 2024 nrjchnd@gmail.com
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     https://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an **"AS IS" BASIS,**
+ * **WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.**
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#ifndef TENANT_DIRECTORY_H
+#define TENANT_DIRECTORY_H
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+const uint16_t NO_TENANT = 0xFFFF;
+
+// Token bucket of a tenant's uplink; a rate of 0 leaves it unlimited
+struct TenantRate {
+    uint64_t bytesPerSecond = 0;
+    uint64_t burstBytes = 0;
+};
+
+// Tenants by index, and the ranges of local ports each one owns. Built at
+// startup and read-only afterwards, so lookups on the packet path take no
+// lock; only per-call port attachments (attachPort) change at run time.
+// IDs are those of the config UI's tenant:<id> hashes.
+class TenantDirectory {
+public:
+    TenantDirectory();
+
+    // Index of the tenant, NO_TENANT when unknown
+    uint16_t find(const std::string& tenantId) const;
+    // Index of the tenant, added when new
+    uint16_t add(const std::string& tenantId);
+    // Later ranges override earlier ones
+    void assignPorts(const std::string& tenantId, uint16_t firstPort, uint16_t lastPort);
+    // Tenant of ports that no range covers
+    void setDefaultTenant(const std::string& tenantId);
+    void setRate(const std::string& tenantId, const TenantRate& rate);
+
+    // "<tenant id>:<first port>-<last port>" entries
+    void addPortRanges(const std::vector<std::string>& entries);
+    // "<tenant id>:<rate kbit/s>/<burst kB>" entries
+    void addRates(const std::vector<std::string>& entries);
+    // Settings kept through the config UI: rtp_ports ("10000-10099,10200")
+    // of config:<id> and rate_kbps / burst_kb of tenant:<id>
+    void loadFromRedis(const std::string& redisUri, const std::vector<std::string>& tenantIds);
+
+    // Puts one port under a known tenant for the duration of a call, ahead
+    // of the configured ranges; NO_TENANT detaches it again. Safe while
+    // packets are being looked up.
+    void attachPort(uint16_t localPort, uint16_t tenant) {
+        attachedTenants_[localPort].store(tenant, std::memory_order_relaxed);
+    }
+
+    // NO_TENANT when the port is not attached
+    uint16_t attachedTenant(uint16_t localPort) const {
+        return attachedTenants_[localPort].load(std::memory_order_relaxed);
+    }
+
+    uint16_t tenantOf(uint16_t localPort) const {
+        uint16_t tenant = attachedTenants_[localPort].load(std::memory_order_relaxed);
+        if (tenant == NO_TENANT) {
+            tenant = portTenants_[localPort];
+        }
+        return tenant == NO_TENANT ? defaultTenant_ : tenant;
+    }
+
+    size_t size() const { return ids_.size(); }
+    const std::string& id(uint16_t tenant) const { return ids_[tenant]; }
+    const TenantRate& rate(uint16_t tenant) const { return rates_[tenant]; }
+
+private:
+    std::vector<std::string> ids_;
+    std::vector<TenantRate> rates_;
+    std::vector<uint16_t> portTenants_;   // by local port
+    std::unique_ptr<std::atomic<uint16_t>[]> attachedTenants_;
+    uint16_t defaultTenant_;
+};
+
+#endif // TENANT_DIRECTORY_H
@@ -15,88 +15,255 @@
  */
 
 #include "translator.h"
+#include "probes.h"
+#include <algorithm>
 #include <cstring>
 #include <iostream>
 
+// Largest UDP payload over IPv4
+const size_t MAX_UDP_PAYLOAD = 65507;
+
 Translator::Translator()
-    : sequenceNumber_(0), timestamp_(0), ssrc_(0x12345678) {
+    : rtpToQuicReady_(false), quicToRtpReady_(false), headerCompression_(false), silenceSuppression_(false),
+      sequenceNumber_(0), timestamp_(0), ssrc_(0x12345678) {
+    for (size_t i = 0; i < TRANSLATOR_SHARDS; ++i) {
+        shards_.push_back(std::make_unique<Shard>());
+        shards_.back()->compressor.setCidPartition(static_cast<uint16_t>(i), static_cast<uint16_t>(TRANSLATOR_SHARDS));
+    }
 }
 
 Translator::~Translator() {
 }
 
-void Translator::setRtpToQuicHandler(std::function<void(const uint8_t* data, size_t len)> handler) {
-    std::lock_guard<std::mutex> lock(translatorMutex_);
-    rtpToQuicHandler_ = handler;
+TranslatorState Translator::saveState() {
+    TranslatorState state;
+    {
+        std::lock_guard<std::mutex> lock(downlinkMutex_);
+        state.sequenceNumber = sequenceNumber_;
+        state.timestamp = timestamp_;
+        state.ssrc = ssrc_;
+    }
+    for (auto& shard : shards_) {
+        std::lock_guard<std::mutex> lock(shard->mutex);
+        std::vector<SilenceStreamState> streams = shard->suppressor.saveStreams();
+        state.silenceStreams.insert(state.silenceStreams.end(), streams.begin(), streams.end());
+    }
+    return state;
 }
 
-void Translator::setQuicToRtpHandler(std::function<void(const uint8_t* data, size_t len)> handler) {
-    std::lock_guard<std::mutex> lock(translatorMutex_);
-    quicToRtpHandler_ = handler;
+void Translator::restoreState(const TranslatorState& state) {
+    {
+        std::lock_guard<std::mutex> lock(downlinkMutex_);
+        sequenceNumber_ = state.sequenceNumber;
+        timestamp_ = state.timestamp;
+        ssrc_ = state.ssrc;
+    }
+    for (const SilenceStreamState& stream : state.silenceStreams) {
+        Shard& shard = uplinkShard(stream.ssrc);
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        shard.suppressor.restoreStream(stream);
+    }
 }
 
-void Translator::translateRtpToQuic(const uint8_t* data, size_t len) {
-    std::lock_guard<std::mutex> lock(translatorMutex_);
-
-    // Ensure the RTP packet is at least the minimum size
-    if (len < 12) {
-        std::cerr << "Invalid RTP packet: too short" << std::endl;
+void Translator::setRtpToQuicHandler(RtpToQuicHandler handler) {
+    if (rtpToQuicReady_.load()) {
+        std::cerr << "RTP to QUIC handler is already set" << std::endl;
         return;
     }
+    rtpToQuicHandler_ = handler;
+    rtpToQuicReady_.store(true, std::memory_order_release);
+}
 
-    // Parse RTP header
-    uint8_t version = (data[0] >> 6) & 0x03;
-    uint8_t padding = (data[0] >> 5) & 0x01;
-    uint8_t extension = (data[0] >> 4) & 0x01;
-    uint8_t csrcCount = data[0] & 0x0F;
-    uint8_t marker = (data[1] >> 7) & 0x01;
-    uint8_t payloadType = data[1] & 0x7F;
-    uint16_t sequenceNumber = (data[2] << 8) | data[3];
-    uint32_t timestamp = (data[4] << 24) | (data[5] << 16) | (data[6] << 8) | data[7];
-    uint32_t ssrc = (data[8] << 24) | (data[9] << 16) | (data[10] << 8) | data[11];
+void Translator::setQuicToRtpHandler(QuicToRtpHandler handler) {
+    if (quicToRtpReady_.load()) {
+        std::cerr << "QUIC to RTP handler is already set" << std::endl;
+        return;
+    }
+    quicToRtpHandler_ = handler;
+    quicToRtpReady_.store(true, std::memory_order_release);
+}
 
-    size_t headerLength = 12 + csrcCount * 4;
+void Translator::setHeaderCompression(bool enable, uint32_t refreshInterval) {
+    for (auto& shard : shards_) {
+        std::lock_guard<std::mutex> lock(shard->mutex);
+        shard->compressor.setRefreshInterval(refreshInterval);
+    }
+    headerCompression_ = enable;
+}
 
-    if (len < headerLength) {
-        std::cerr << "Invalid RTP packet: incorrect header length" << std::endl;
-        return;
+void Translator::setMediaClassifier(const MediaClassifier& classifier) {
+    for (auto& shard : shards_) {
+        std::lock_guard<std::mutex> lock(shard->mutex);
+        shard->classifier = classifier;
     }
+}
 
-    // Handle extension header if present
-    if (extension) {
-        if (len < headerLength + 4) {
-            std::cerr << "Invalid RTP packet: missing extension header" << std::endl;
-            return;
+void Translator::setSilenceSuppression(bool enable, const std::vector<std::string>& comfortNoiseTypes,
+                                       const std::vector<std::string>& signatures, int keepaliveMs) {
+    for (auto& shard : shards_) {
+        std::lock_guard<std::mutex> lock(shard->mutex);
+        if (!comfortNoiseTypes.empty()) {
+            shard->suppressor.setComfortNoiseTypes(comfortNoiseTypes);
         }
-        uint16_t extensionProfile = (data[headerLength] << 8) | data[headerLength + 1];
-        uint16_t extensionLength = (data[headerLength + 2] << 8) | data[headerLength + 3];
-        headerLength += 4 + extensionLength * 4;
+        shard->suppressor.setSignatures(signatures);
+        shard->suppressor.setKeepalive(std::chrono::milliseconds(std::max(keepaliveMs, 0)));
+    }
+    silenceSuppression_ = enable;
+}
 
-        if (len < headerLength) {
-            std::cerr << "Invalid RTP packet: incomplete extension data" << std::endl;
-            return;
-        }
+uint64_t Translator::suppressedPackets() {
+    uint64_t dropped = 0;
+    for (auto& shard : shards_) {
+        std::lock_guard<std::mutex> lock(shard->mutex);
+        dropped += shard->suppressor.droppedPackets();
+    }
+    return dropped;
+}
+
+void Translator::translateRtpToQuic(const uint8_t* data, size_t len) {
+    RtpHeaderInfo header;
+    parseRtpHeader(data, len, header);
+    translateRtpToQuic(data, len, header);
+}
+
+void Translator::translateRtpToQuic(const uint8_t* data, size_t len, const RtpHeaderInfo& header, uint16_t tenant) {
+    RtpHeaderBatch headers;
+    headers.count = 1;
+    headers.set(0, header);
+    translateRtpToQuic(data, len, headers, 0, tenant);
+}
+
+void Translator::translateRtpToQuic(const uint8_t* data, size_t len, const RtpHeaderBatch& headers, size_t index, uint16_t tenant) {
+    // Version, CSRC list, extension and padding were checked by the parser
+    size_t headerLength = headers.headerLength[index];
+    if (headerLength == 0) {
+        std::cerr << "Invalid RTP packet: malformed header" << std::endl;
+        return;
     }
+    uint32_t ssrc = headers.ssrc[index];
+    QUICRTP_PROBE3(translate_in, ssrc, headers.sequenceNumber[index], len);
 
     // Calculate payload length and pointer
     size_t payloadLength = len - headerLength;
     const uint8_t* payloadData = data + headerLength;
 
-    // Send the payload over QUIC
-    if (rtpToQuicHandler_) {
-        rtpToQuicHandler_(payloadData, payloadLength);
-    } else {
+    if (!rtpToQuicReady_.load(std::memory_order_acquire)) {
         std::cerr << "RTP to QUIC handler is not set" << std::endl;
+        return;
     }
+
+    auto now = std::chrono::steady_clock::now();
+    bool headerCompression = headerCompression_;
+    PacketBuffer packet;
+    SendInfo info;
+    {
+        Shard& shard = uplinkShard(ssrc);
+        std::lock_guard<std::mutex> lock(shard.mutex);
+
+        const uint8_t* rtpHeader = data;
+        if (silenceSuppression_) {
+            RtpHeaderInfo header = headers.at(index);
+            uint16_t sequenceNumber = header.sequenceNumber;
+            bool marker = header.marker;
+            switch (shard.suppressor.process(header, payloadData, payloadLength, now, sequenceNumber, marker)) {
+            case SilenceSuppressor::Verdict::Drop:
+                QUICRTP_PROBE2(silence_drop, ssrc, header.sequenceNumber);
+                return;
+            case SilenceSuppressor::Verdict::Rewrite:
+                shard.rewrittenHeader.assign(data, data + headerLength);
+                shard.rewrittenHeader[1] = static_cast<uint8_t>((shard.rewrittenHeader[1] & 0x7F) | (marker ? 0x80 : 0));
+                shard.rewrittenHeader[2] = static_cast<uint8_t>(sequenceNumber >> 8);
+                shard.rewrittenHeader[3] = static_cast<uint8_t>(sequenceNumber);
+                rtpHeader = shard.rewrittenHeader.data();
+                break;
+            case SilenceSuppressor::Verdict::Send:
+                break;
+            }
+        }
+
+        // Compressed header (if enabled) and payload in one message
+        packet = PacketArena::instance().allocate();
+        size_t maxMessageLength = payloadLength + (headerCompression ? headerLength + COMPRESSION_FULL_OVERHEAD : 0);
+        if (maxMessageLength > packet.tailroom()) {
+            std::cerr << "RTP packet too large for a QUIC message" << std::endl;
+            return;
+        }
+        size_t compressedLength = headerCompression ? shard.compressor.compress(rtpHeader, headerLength, packet.data()) : 0;
+        std::memcpy(packet.data() + compressedLength, payloadData, payloadLength);
+        packet.setSize(compressedLength + payloadLength);
+        info = shard.classifier.classify(headers, index, now);
+    }
+
+    // Send it over QUIC, outside the shard lock
+    info.tenant = tenant;
+    QUICRTP_PROBE4(translate_out, ssrc, headers.sequenceNumber[index], packet.size(), static_cast<int>(info.mediaClass));
+    rtpToQuicHandler_(std::move(packet), info);
 }
 
 void Translator::translateQuicToRtp(const uint8_t* data, size_t len) {
-    std::lock_guard<std::mutex> lock(translatorMutex_);
+    if (!quicToRtpReady_.load(std::memory_order_acquire)) {
+        std::cerr << "QUIC to RTP handler is not set" << std::endl;
+        return;
+    }
+
+    if (headerCompression_) {
+        if (len < 2) {
+            std::cerr << "Invalid compressed RTP message" << std::endl;
+            return;
+        }
+        uint8_t rebuilt[12];
+        const uint8_t* header = nullptr;
+        size_t headerLength = 0;
+        size_t payloadOffset = 0;
+        uint16_t cid = static_cast<uint16_t>(((data[0] & 0x3F) << 8) | data[1]);
+        RtpHeaderDecompressor::Result result;
+        {
+            Shard& shard = downlinkShard(cid);
+            std::lock_guard<std::mutex> lock(shard.mutex);
+            result = shard.decompressor.decompress(data, len, rebuilt, header, headerLength, payloadOffset, cid);
+            if (result == RtpHeaderDecompressor::Result::RefreshRequested) {
+                shard.compressor.requestRefresh(cid);
+            }
+        }
+
+        switch (result) {
+        case RtpHeaderDecompressor::Result::Header:
+            quicToRtpHandler_(header, headerLength, data + payloadOffset, len - payloadOffset);
+            break;
+        case RtpHeaderDecompressor::Result::RefreshRequested:
+            break;
+        case RtpHeaderDecompressor::Result::MissingContext:
+            // Ask the far side's compressor for a full header; the request
+            // goes with the audio class so it is not stuck behind video
+            if (rtpToQuicReady_.load(std::memory_order_acquire)) {
+                PacketBuffer request = PacketArena::instance().allocate();
+                request.setSize(RtpHeaderDecompressor::contextRequest(cid, request.data()));
+                SendInfo info;
+                info.mediaClass = MediaClass::Audio;
+                rtpToQuicHandler_(std::move(request), info);
+            }
+            break;
+        case RtpHeaderDecompressor::Result::AwaitingContext:
+            break;
+        case RtpHeaderDecompressor::Result::Invalid:
+            std::cerr << "Invalid compressed RTP message" << std::endl;
+            break;
+        }
+        return;
+    }
 
-    // Prepare an RTP packet buffer
-    uint8_t rtpPacket[1500]; // Max RTP packet size
+    size_t headerLength = 12;
+
+    // Without header compression the far side sends bare payloads and the
+    // header is synthesised. The payload is sent from the QUIC buffer as is;
+    // only the length of a UDP datagram limits it
+    if (headerLength + len > MAX_UDP_PAYLOAD) {
+        std::cerr << "Data too large for RTP packet" << std::endl;
+        return;
+    }
 
     // Construct RTP header
+    uint8_t rtpHeader[12];
     uint8_t version = 2;
     uint8_t padding = 0;
     uint8_t extension = 0;
@@ -105,37 +272,36 @@ void Translator::translateQuicToRtp(const uint8_t* data, size_t len) {
     uint8_t payloadType = 96; // Dynamic payload type
 
     // Increment sequence number and timestamp for each packet
-    sequenceNumber_++;
-    timestamp_ += 160; // Adjust as per your media's timestamp increment
-
-    size_t headerLength = 12;
-
-    rtpPacket[0] = (version << 6) | (padding << 5) | (extension << 4) | csrcCount;
-    rtpPacket[1] = (marker << 7) | payloadType;
-    rtpPacket[2] = (sequenceNumber_ >> 8) & 0xFF;
-    rtpPacket[3] = sequenceNumber_ & 0xFF;
-    rtpPacket[4] = (timestamp_ >> 24) & 0xFF;
-    rtpPacket[5] = (timestamp_ >> 16) & 0xFF;
-    rtpPacket[6] = (timestamp_ >> 8) & 0xFF;
-    rtpPacket[7] = timestamp_ & 0xFF;
-    rtpPacket[8] = (ssrc_ >> 24) & 0xFF;
-    rtpPacket[9] = (ssrc_ >> 16) & 0xFF;
-    rtpPacket[10] = (ssrc_ >> 8) & 0xFF;
-    rtpPacket[11] = ssrc_ & 0xFF;
-
-    // Copy the QUIC data into the RTP payload
-    if (len > sizeof(rtpPacket) - headerLength) {
-        std::cerr << "Data too large for RTP packet" << std::endl;
-        return;
+    uint16_t sequenceNumber;
+    uint32_t timestamp;
+    uint32_t ssrc;
+    {
+        std::lock_guard<std::mutex> lock(downlinkMutex_);
+        sequenceNumber = ++sequenceNumber_;
+        timestamp_ += 160; // Adjust as per your media's timestamp increment
+        timestamp = timestamp_;
+        ssrc = ssrc_;
     }
 
-    std::memcpy(rtpPacket + headerLength, data, len);
-    size_t rtpPacketLength = headerLength + len;
+    rtpHeader[0] = (version << 6) | (padding << 5) | (extension << 4) | csrcCount;
+    rtpHeader[1] = (marker << 7) | payloadType;
+    rtpHeader[2] = (sequenceNumber >> 8) & 0xFF;
+    rtpHeader[3] = sequenceNumber & 0xFF;
+    rtpHeader[4] = (timestamp >> 24) & 0xFF;
+    rtpHeader[5] = (timestamp >> 16) & 0xFF;
+    rtpHeader[6] = (timestamp >> 8) & 0xFF;
+    rtpHeader[7] = timestamp & 0xFF;
+    rtpHeader[8] = (ssrc >> 24) & 0xFF;
+    rtpHeader[9] = (ssrc >> 16) & 0xFF;
+    rtpHeader[10] = (ssrc >> 8) & 0xFF;
+    rtpHeader[11] = ssrc & 0xFF;
 
-    // Send the RTP packet to the handler
-    if (quicToRtpHandler_) {
-        quicToRtpHandler_(rtpPacket, rtpPacketLength);
-    } else {
-        std::cerr << "QUIC to RTP handler is not set" << std::endl;
-    }
+    // Header and payload go out as one datagram through a gather send
+    quicToRtpHandler_(rtpHeader, headerLength, data, len);
+}
+
+void Translator::removeStream(uint32_t ssrc) {
+    Shard& shard = uplinkShard(ssrc);
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    shard.compressor.release(ssrc);
 }
@@ -16,29 +16,106 @@
 #ifndef TRANSLATOR_H
 #define TRANSLATOR_H
 
+#include "packet_arena.h"
+#include "rtp_header_compression.h"
+#include "send_scheduler.h"
+#include "silence_suppressor.h"
+#include <atomic>
 #include <functional>
 #include <cstdint>
 #include <cstddef>
+#include <memory>
 #include <mutex>
 #include <vector>
 
+// Synthetic downlink header state, carried across a hot upgrade so the RTP
+// sequence and timestamp continue where the previous process left off, and
+// the silence suppressor's offsets, so the streams it rewrote stay
+// contiguous
+struct TranslatorState {
+    uint16_t sequenceNumber;
+    uint32_t timestamp;
+    uint32_t ssrc;
+    std::vector<SilenceStreamState> silenceStreams;
+};
+
+// Uplink state is split into shards by SSRC and downlink compression state
+// by context ID, each shard under its own lock, so the packet threads only
+// contend when they carry the same streams. Each shard's compressor hands
+// out the context IDs of its own shard, so the far side's decompressor and
+// our refresh requests land on the same shard as the stream.
+const size_t TRANSLATOR_SHARDS = 32;
+
 class Translator {
 public:
+    // Uplink messages are built in an arena buffer that the handler takes
+    // over, together with the packet's media class and send deadline
+    using RtpToQuicHandler = std::function<void(PacketBuffer packet, const SendInfo& info)>;
+    // Downlink packets are handed over as RTP header plus the untouched QUIC
+    // payload, to be sent as one datagram
+    using QuicToRtpHandler = std::function<void(const uint8_t* header, size_t headerLen, const uint8_t* payload, size_t payloadLen)>;
+
     Translator();
     ~Translator();
 
-    void setRtpToQuicHandler(std::function<void(const uint8_t* data, size_t len)> handler);
-    void setQuicToRtpHandler(std::function<void(const uint8_t* data, size_t len)> handler);
+    // Handlers are called without a lock held, so they are set once, before
+    // packets are translated; packets arriving earlier are dropped
+    void setRtpToQuicHandler(RtpToQuicHandler handler);
+    void setQuicToRtpHandler(QuicToRtpHandler handler);
+
+    // With compression the RTP header crosses the QUIC hop compressed and is
+    // restored exactly on the far side; both ends must agree. Without it
+    // only the payload is sent and the downlink gets a synthetic header.
+    void setHeaderCompression(bool enable, uint32_t refreshInterval);
+    void setMediaClassifier(const MediaClassifier& classifier);
+    // Uplink silence is thinned out by a SilenceSuppressor; see there for
+    // the signature format
+    void setSilenceSuppression(bool enable, const std::vector<std::string>& comfortNoiseTypes,
+                               const std::vector<std::string>& signatures, int keepaliveMs);
+    uint64_t suppressedPackets();
+
+    TranslatorState saveState();
+    // Header compression contexts are not restored; the compressor starts
+    // over with full headers and the decompressor asks for refreshes
+    void restoreState(const TranslatorState& state);
 
     void translateRtpToQuic(const uint8_t* data, size_t len);
+    // Same, with the header already parsed (see rtp_batch_parser.h) and the
+    // tenant the packet is scheduled for
+    void translateRtpToQuic(const uint8_t* data, size_t len, const RtpHeaderInfo& header, uint16_t tenant = NO_TENANT);
+    // Packet index of a receive batch, with its header read from the batch
+    // columns as parsed
+    void translateRtpToQuic(const uint8_t* data, size_t len, const RtpHeaderBatch& headers, size_t index, uint16_t tenant = NO_TENANT);
     void translateQuicToRtp(const uint8_t* data, size_t len);
 
+    // The session for ssrc ended; its compression context is freed
+    void removeStream(uint32_t ssrc);
+
 private:
-    std::function<void(const uint8_t* data, size_t len)> rtpToQuicHandler_;
-    std::function<void(const uint8_t* data, size_t len)> quicToRtpHandler_;
-    std::mutex translatorMutex_;
+    struct Shard {
+        std::mutex mutex;
+        RtpHeaderCompressor compressor;
+        RtpHeaderDecompressor decompressor;
+        MediaClassifier classifier;
+        SilenceSuppressor suppressor;
+        // Header with the sequence number and marker the suppressor rewrote
+        std::vector<uint8_t> rewrittenHeader;
+    };
+
+    Shard& uplinkShard(uint32_t ssrc) { return *shards_[ssrc % TRANSLATOR_SHARDS]; }
+    Shard& downlinkShard(uint16_t cid) { return *shards_[cid % TRANSLATOR_SHARDS]; }
+
+    RtpToQuicHandler rtpToQuicHandler_;
+    QuicToRtpHandler quicToRtpHandler_;
+    std::atomic<bool> rtpToQuicReady_;
+    std::atomic<bool> quicToRtpReady_;
+
+    std::atomic<bool> headerCompression_;
+    std::atomic<bool> silenceSuppression_;
+    std::vector<std::unique_ptr<Shard>> shards_;
 
     // Additional private members for RTP packet construction
+    std::mutex downlinkMutex_;
     uint16_t sequenceNumber_;
     uint32_t timestamp_;
     uint32_t ssrc_;
@@ -0,0 +1,67 @@
+/*
+ * Copyright 2024 nrjchnd@gmail.com
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     https://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an **"AS IS" BASIS,**
+ * **WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.**
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "udp_io.h"
+#include "asio_udp_io.h"
+#include "uring_udp_io.h"
+#include "xdp_io.h"
+#include "logger.h"
+#include <atomic>
+
+namespace {
+// Listeners are created per session; only report a fallback once
+std::atomic<bool> fallbackReported(false);
+}
+
+void UdpIo::startReceiveBatch(BatchReceiveHandler handler) {
+    auto batch = std::make_shared<ReceiveBatch>();
+    startReceive([handler, batch](uint8_t* data, size_t len, const boost::asio::ip::udp::endpoint& sender) {
+        batch->count = 1;
+        batch->data[0] = data;
+        batch->length[0] = len;
+        batch->sender[0] = sender;
+        handler(*batch);
+    });
+}
+
+std::shared_ptr<UdpIo> createUdpIo(const std::string& backend, boost::asio::io_context& io_context, size_t receiveBatch) {
+    if (backend == "io_uring") {
+#ifdef QUICRTP_HAVE_IO_URING
+        auto uring = std::make_shared<UringUdpIo>(io_context, receiveBatch);
+        if (uring->initialize()) {
+            return uring;
+        }
+        if (!fallbackReported.exchange(true)) {
+            Logger::getLogger()->warn("io_uring unavailable, falling back to epoll");
+        }
+#else
+        if (!fallbackReported.exchange(true)) {
+            Logger::getLogger()->warn("io_uring support not compiled in, falling back to epoll");
+        }
+#endif
+    } else if (backend == "xdp") {
+        auto engine = XdpEngine::active();
+        if (engine) {
+            return std::make_shared<XdpUdpIo>(engine, std::make_shared<AsioUdpIo>(io_context, receiveBatch));
+        }
+        if (!fallbackReported.exchange(true)) {
+            Logger::getLogger()->warn("XDP fast path not active, falling back to epoll");
+        }
+    } else if (!backend.empty() && backend != "epoll") {
+        Logger::getLogger()->warn("Unknown IO backend '{}', using epoll", backend);
+    }
+    return std::make_shared<AsioUdpIo>(io_context, receiveBatch);
+}
@@ -0,0 +1,72 @@
+/*
+ * Copyright 2024 nrjchnd@gmail.com
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     https://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an **"AS IS" BASIS,**
+ * **WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.**
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#ifndef UDP_IO_H
+#define UDP_IO_H
+
+#include <boost/asio.hpp>
+#include <functional>
+#include <memory>
+#include <string>
+
+const size_t UDP_RECEIVE_BATCH_MAX = 64;
+
+// Datagrams drained in one wakeup, as parallel arrays. The buffers are only
+// valid during the handler call; handlers may shorten a datagram in place.
+struct ReceiveBatch {
+    size_t count = 0;
+    uint8_t* data[UDP_RECEIVE_BATCH_MAX];
+    size_t length[UDP_RECEIVE_BATCH_MAX];
+    boost::asio::ip::udp::endpoint sender[UDP_RECEIVE_BATCH_MAX];
+};
+
+// UDP socket backend shared by the RTP listeners and the downlink sender.
+// Receive handlers always run on the io_context the backend was created with.
+class UdpIo {
+public:
+    using ReceiveHandler = std::function<void(uint8_t* data, size_t len, const boost::asio::ip::udp::endpoint& sender)>;
+    using BatchReceiveHandler = std::function<void(ReceiveBatch& batch)>;
+
+    virtual ~UdpIo() = default;
+
+    // Port 0 binds an ephemeral port (send-only use)
+    virtual void open(uint16_t port, bool reusePort) = 0;
+    // Takes over a socket that is already bound to port, e.g. one inherited
+    // from the previous process during a hot upgrade
+    virtual void adopt(int fd, uint16_t port) = 0;
+    virtual void startReceive(ReceiveHandler handler) = 0;
+    // Hands over everything one wakeup received (recvmmsg) in one call;
+    // backends that receive a datagram at a time deliver batches of one
+    virtual void startReceiveBatch(BatchReceiveHandler handler);
+    // Safe to call from any thread
+    virtual void sendTo(const uint8_t* data, size_t len, const boost::asio::ip::udp::endpoint& destination) = 0;
+    // One datagram gathered from header and payload (sendmsg with two
+    // iovecs), so a header can go in front of a buffer the caller does not own
+    virtual void sendTo(const boost::asio::const_buffer& header, const boost::asio::const_buffer& payload,
+                        const boost::asio::ip::udp::endpoint& destination) = 0;
+    virtual void close() = 0;
+    virtual bool isOpen() const = 0;
+    // Underlying socket descriptor, -1 when not open
+    virtual int nativeHandle() const = 0;
+
+    virtual const char* name() const = 0;
+};
+
+// backend is "epoll" (boost::asio reactor), "io_uring" or "xdp". io_uring
+// falls back to epoll when it is not compiled in or the kernel refuses to set
+// it up; xdp does so when no XdpEngine has been activated.
+std::shared_ptr<UdpIo> createUdpIo(const std::string& backend, boost::asio::io_context& io_context, size_t receiveBatch);
+
+#endif // UDP_IO_H
@@ -0,0 +1,569 @@
+/*
+ * Copyright 2024 nrjchnd@gmail.com
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     https://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an **"AS IS" BASIS,**
+ * **WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.**
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifdef QUICRTP_HAVE_IO_URING
+
+#include "uring_udp_io.h"
+#include "logger.h"
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
+#include <netinet/in.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+// Provided buffer group used for multishot receive
+const int RECV_BUFFER_GROUP = 0;
+// Each provided buffer holds an io_uring_recvmsg_out header, the source
+// address and the datagram
+const size_t RECV_BUFFER_SIZE = 2048 + sizeof(io_uring_recvmsg_out) + sizeof(sockaddr_storage);
+// Shared by every socket of the ring
+const unsigned MIN_RECV_BUFFERS = 1024;
+const unsigned RING_ENTRIES = 1024;
+const uint32_t SEND_SLOTS = 1024;
+// Sockets beyond this use their plain descriptor
+const unsigned FILE_TABLE_SIZE = 4096;
+
+// user_data tags; receives carry the socket id
+const uint64_t SEND_TAG = uint64_t(1) << 63;
+const uint64_t CANCEL_TAG = uint64_t(1) << 62;
+
+namespace {
+unsigned roundUpPowerOfTwo(unsigned value) {
+    unsigned result = 1;
+    while (result < value) {
+        result <<= 1;
+    }
+    return result;
+}
+}
+
+std::shared_ptr<UringRing> UringRing::forContext(boost::asio::io_context& io_context, size_t receiveBatch) {
+    static std::mutex registryMutex;
+    static std::unordered_map<boost::asio::io_context*, std::weak_ptr<UringRing>> rings;
+
+    std::lock_guard<std::mutex> lock(registryMutex);
+    std::shared_ptr<UringRing> ring = rings[&io_context].lock();
+    if (ring) {
+        return ring;
+    }
+    ring = std::make_shared<UringRing>(io_context, receiveBatch);
+    if (!ring->initialize()) {
+        rings.erase(&io_context);
+        return nullptr;
+    }
+    rings[&io_context] = ring;
+    return ring;
+}
+
+UringRing::UringRing(boost::asio::io_context& io_context, size_t receiveBatch)
+    : io_context_(io_context),
+      sendBatch_(receiveBatch > 0 ? receiveBatch : 1),
+      ringReady_(false),
+      bufferRing_(nullptr),
+      bufferCount_(roundUpPowerOfTwo(std::max<unsigned>(MIN_RECV_BUFFERS, static_cast<unsigned>(receiveBatch * 4)))),
+      eventFd_(-1),
+      eventDescriptor_(io_context),
+      eventCount_(0),
+      nextSocketId_(1),
+      fileTable_(false),
+      queuedSends_(0),
+      flushPending_(false)
+{
+    std::memset(&ring_, 0, sizeof(ring_));
+    std::memset(&recvMsg_, 0, sizeof(recvMsg_));
+    recvMsg_.msg_namelen = sizeof(sockaddr_storage);
+}
+
+UringRing::~UringRing() {
+    boost::system::error_code error;
+    if (eventDescriptor_.is_open()) {
+        eventDescriptor_.close(error);
+    } else if (eventFd_ >= 0) {
+        ::close(eventFd_);
+    }
+    if (bufferRing_) {
+        io_uring_free_buf_ring(&ring_, bufferRing_, bufferCount_, RECV_BUFFER_GROUP);
+    }
+    if (ringReady_) {
+        io_uring_queue_exit(&ring_);
+    }
+}
+
+bool UringRing::initialize() {
+    int ret = io_uring_queue_init(RING_ENTRIES, &ring_, 0);
+    if (ret < 0) {
+        Logger::getLogger()->warn("io_uring_queue_init failed: {}", std::strerror(-ret));
+        return false;
+    }
+    ringReady_ = true;
+
+    bufferRing_ = io_uring_setup_buf_ring(&ring_, bufferCount_, RECV_BUFFER_GROUP, 0, &ret);
+    if (!bufferRing_) {
+        Logger::getLogger()->warn("io_uring provided buffer ring unavailable: {}", std::strerror(-ret));
+        return false;
+    }
+
+    bufferStorage_.resize(static_cast<size_t>(bufferCount_) * RECV_BUFFER_SIZE);
+    int mask = io_uring_buf_ring_mask(bufferCount_);
+    for (unsigned i = 0; i < bufferCount_; ++i) {
+        io_uring_buf_ring_add(bufferRing_, bufferStorage_.data() + i * RECV_BUFFER_SIZE, RECV_BUFFER_SIZE, i, mask, i);
+    }
+    io_uring_buf_ring_advance(bufferRing_, bufferCount_);
+
+    if (!probeMultishotReceive()) {
+        Logger::getLogger()->warn("io_uring multishot recvmsg unsupported by this kernel");
+        return false;
+    }
+
+    // Sockets come and go with calls, so the table starts empty and slots
+    // are filled in and cleared one at a time
+    ret = io_uring_register_files_sparse(&ring_, FILE_TABLE_SIZE);
+    if (ret == 0) {
+        fileTable_ = true;
+        freeFileIndexes_.reserve(FILE_TABLE_SIZE);
+        for (unsigned i = FILE_TABLE_SIZE; i > 0; --i) {
+            freeFileIndexes_.push_back(static_cast<int>(i - 1));
+        }
+    } else {
+        Logger::getLogger()->debug("io_uring file table unavailable ({}), using plain descriptors", std::strerror(-ret));
+    }
+
+    eventFd_ = ::eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (eventFd_ < 0 || io_uring_register_eventfd(&ring_, eventFd_) < 0) {
+        Logger::getLogger()->warn("io_uring eventfd registration failed");
+        return false;
+    }
+    eventDescriptor_.assign(eventFd_);
+
+    sendSlots_.resize(SEND_SLOTS);
+    freeSendSlots_.reserve(SEND_SLOTS);
+    for (uint32_t i = SEND_SLOTS; i > 0; --i) {
+        freeSendSlots_.push_back(i - 1);
+    }
+
+    waitForCompletions();
+    return true;
+}
+
+bool UringRing::probeMultishotReceive() {
+    // Buffer rings (5.19) predate multishot recvmsg (6.0); on kernels in
+    // between every armed receive fails at once with EINVAL and no
+    // IORING_CQE_F_MORE, so try one on a scratch socket before relying on it
+    int fd = ::socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        return false;
+    }
+    // Socket ids start at 1, so id 0 is free for the probe
+    io_uring_sqe* sqe = io_uring_get_sqe(&ring_);
+    io_uring_prep_recvmsg_multishot(sqe, fd, &recvMsg_, 0);
+    sqe->flags |= IOSQE_BUFFER_SELECT;
+    sqe->buf_group = RECV_BUFFER_GROUP;
+    io_uring_sqe_set_data64(sqe, 0);
+    io_uring_submit(&ring_);
+
+    // A supported receive just waits for data, so cancel it again
+    sqe = io_uring_get_sqe(&ring_);
+    io_uring_prep_cancel64(sqe, 0, 0);
+    io_uring_sqe_set_data64(sqe, CANCEL_TAG);
+    io_uring_submit(&ring_);
+
+    int result = 0;
+    bool finished = false;
+    while (!finished) {
+        io_uring_cqe* cqe;
+        int ret = io_uring_wait_cqe(&ring_, &cqe);
+        if (ret < 0) {
+            result = ret;
+            break;
+        }
+        if (io_uring_cqe_get_data64(cqe) == 0) {
+            result = cqe->res;
+            finished = !(cqe->flags & IORING_CQE_F_MORE);
+        }
+        io_uring_cqe_seen(&ring_, cqe);
+    }
+    ::close(fd);
+    return result >= 0 || result == -ECANCELED;
+}
+
+uint32_t UringRing::addSocket(int fd, const std::shared_ptr<UringUdpIo>& owner) {
+    std::lock_guard<std::mutex> lock(ringMutex_);
+    Socket socket;
+    socket.fd = fd;
+    socket.fileIndex = -1;
+    socket.receiving = false;
+    socket.owner = owner;
+    if (!freeFileIndexes_.empty() && io_uring_register_files_update(&ring_, freeFileIndexes_.back(), &fd, 1) == 1) {
+        socket.fileIndex = freeFileIndexes_.back();
+        freeFileIndexes_.pop_back();
+    }
+
+    uint32_t id = nextSocketId_++;
+    if (nextSocketId_ == 0) {
+        nextSocketId_ = 1;
+    }
+    sockets_[id] = socket;
+    return id;
+}
+
+void UringRing::removeSocket(uint32_t id) {
+    std::lock_guard<std::mutex> lock(ringMutex_);
+    auto it = sockets_.find(id);
+    if (it == sockets_.end()) {
+        return;
+    }
+    if (it->second.receiving) {
+        io_uring_sqe* sqe = nextSqe();
+        if (sqe) {
+            io_uring_prep_cancel64(sqe, id, 0);
+            io_uring_sqe_set_data64(sqe, CANCEL_TAG);
+        }
+    }
+    // Sends already queued for the socket go out before its slot is cleared
+    io_uring_submit(&ring_);
+    queuedSends_ = 0;
+    if (it->second.fileIndex >= 0) {
+        int none = -1;
+        io_uring_register_files_update(&ring_, static_cast<unsigned>(it->second.fileIndex), &none, 1);
+        freeFileIndexes_.push_back(it->second.fileIndex);
+    }
+    sockets_.erase(it);
+}
+
+void UringRing::startReceive(uint32_t id) {
+    std::lock_guard<std::mutex> lock(ringMutex_);
+    auto it = sockets_.find(id);
+    if (it == sockets_.end()) {
+        return;
+    }
+    it->second.receiving = true;
+    if (armReceive(id, it->second)) {
+        io_uring_submit(&ring_);
+        queuedSends_ = 0;
+    }
+}
+
+io_uring_sqe* UringRing::nextSqe() {
+    io_uring_sqe* sqe = io_uring_get_sqe(&ring_);
+    if (!sqe) {
+        io_uring_submit(&ring_);
+        queuedSends_ = 0;
+        sqe = io_uring_get_sqe(&ring_);
+    }
+    return sqe;
+}
+
+bool UringRing::armReceive(uint32_t id, const Socket& socket) {
+    io_uring_sqe* sqe = nextSqe();
+    if (!sqe) {
+        Logger::getLogger()->error("io_uring submission queue full, receive not armed");
+        return false;
+    }
+    if (socket.fileIndex >= 0) {
+        io_uring_prep_recvmsg_multishot(sqe, socket.fileIndex, &recvMsg_, 0);
+        sqe->flags |= IOSQE_FIXED_FILE;
+    } else {
+        io_uring_prep_recvmsg_multishot(sqe, socket.fd, &recvMsg_, 0);
+    }
+    sqe->flags |= IOSQE_BUFFER_SELECT;
+    sqe->buf_group = RECV_BUFFER_GROUP;
+    io_uring_sqe_set_data64(sqe, id);
+    return true;
+}
+
+void UringRing::send(uint32_t id, const boost::asio::const_buffer& header, const boost::asio::const_buffer& payload,
+                     const boost::asio::ip::udp::endpoint& destination) {
+    std::lock_guard<std::mutex> lock(ringMutex_);
+    auto it = sockets_.find(id);
+    if (it == sockets_.end()) {
+        return;
+    }
+    const Socket& socket = it->second;
+    size_t len = header.size() + payload.size();
+    if (len > sizeof(SendSlot::data)) {
+        // Larger than a send slot (jumbo or video frames): gather straight
+        // from the caller's buffers with a synchronous sendmsg instead
+        iovec iov[2] = {{const_cast<void*>(header.data()), header.size()},
+                        {const_cast<void*>(payload.data()), payload.size()}};
+        msghdr msg;
+        std::memset(&msg, 0, sizeof(msg));
+        msg.msg_name = const_cast<sockaddr*>(destination.data());
+        msg.msg_namelen = static_cast<socklen_t>(destination.size());
+        msg.msg_iov = iov;
+        msg.msg_iovlen = 2;
+        if (::sendmsg(socket.fd, &msg, MSG_DONTWAIT) < 0) {
+            Logger::getLogger()->warn("UDP send of {} bytes failed: {}", len, std::strerror(errno));
+        }
+        return;
+    }
+    if (freeSendSlots_.empty()) {
+        // Every slot is in flight; push what is queued and shed this packet
+        io_uring_submit(&ring_);
+        queuedSends_ = 0;
+        Logger::getLogger()->debug("io_uring send slots exhausted, dropping datagram");
+        return;
+    }
+
+    io_uring_sqe* sqe = nextSqe();
+    if (!sqe) {
+        return;
+    }
+
+    uint32_t index = freeSendSlots_.back();
+    freeSendSlots_.pop_back();
+
+    SendSlot& slot = sendSlots_[index];
+    // The caller's buffers are only valid for this call, so the slot keeps a copy
+    std::memcpy(slot.data.data(), header.data(), header.size());
+    std::memcpy(slot.data.data() + header.size(), payload.data(), payload.size());
+    std::memcpy(&slot.addr, destination.data(), destination.size());
+    slot.iov.iov_base = slot.data.data();
+    slot.iov.iov_len = len;
+    std::memset(&slot.msg, 0, sizeof(slot.msg));
+    slot.msg.msg_name = &slot.addr;
+    slot.msg.msg_namelen = static_cast<socklen_t>(destination.size());
+    slot.msg.msg_iov = &slot.iov;
+    slot.msg.msg_iovlen = 1;
+
+    if (socket.fileIndex >= 0) {
+        io_uring_prep_sendmsg(sqe, socket.fileIndex, &slot.msg, 0);
+        sqe->flags |= IOSQE_FIXED_FILE;
+    } else {
+        io_uring_prep_sendmsg(sqe, socket.fd, &slot.msg, 0);
+    }
+    io_uring_sqe_set_data64(sqe, SEND_TAG | index);
+
+    if (++queuedSends_ >= sendBatch_) {
+        io_uring_submit(&ring_);
+        queuedSends_ = 0;
+    } else {
+        scheduleFlush();
+    }
+}
+
+void UringRing::scheduleFlush() {
+    // Sends issued during one burst of callbacks, from any socket of the
+    // ring, share a single submit
+    if (flushPending_) {
+        return;
+    }
+    flushPending_ = true;
+    boost::asio::post(io_context_, [self = shared_from_this()]() {
+        self->flushSends();
+    });
+}
+
+void UringRing::flushSends() {
+    std::lock_guard<std::mutex> lock(ringMutex_);
+    flushPending_ = false;
+    if (queuedSends_ > 0) {
+        io_uring_submit(&ring_);
+        queuedSends_ = 0;
+    }
+}
+
+void UringRing::waitForCompletions() {
+    // Weak, so the last socket going away can destroy the ring; that
+    // cancels the read
+    std::weak_ptr<UringRing> weak = shared_from_this();
+    eventDescriptor_.async_read_some(boost::asio::buffer(&eventCount_, sizeof(eventCount_)),
+        [weak](const boost::system::error_code& error, size_t) {
+            if (auto self = weak.lock()) {
+                self->handleCompletions(error);
+            }
+        }
+    );
+}
+
+void UringRing::handleCompletions(const boost::system::error_code& error) {
+    if (error) {
+        if (error != boost::asio::error::operation_aborted) {
+            Logger::getLogger()->error("io_uring eventfd error: {}", error.message());
+        }
+        return;
+    }
+
+    std::vector<uint32_t> rearm;
+    io_uring_cqe* cqe;
+    while (io_uring_peek_cqe(&ring_, &cqe) == 0) {
+        uint64_t tag = io_uring_cqe_get_data64(cqe);
+        if (tag & SEND_TAG) {
+            if (cqe->res < 0) {
+                Logger::getLogger()->debug("io_uring send failed: {}", std::strerror(-cqe->res));
+            }
+            std::lock_guard<std::mutex> lock(ringMutex_);
+            freeSendSlots_.push_back(static_cast<uint32_t>(tag & 0xFFFFFFFF));
+        } else if (!(tag & CANCEL_TAG)) {
+            handleReceiveCompletion(cqe);
+            if (!(cqe->flags & IORING_CQE_F_MORE)) {
+                rearm.push_back(static_cast<uint32_t>(tag));
+            }
+        }
+        io_uring_cqe_seen(&ring_, cqe);
+    }
+
+    if (!rearm.empty()) {
+        std::lock_guard<std::mutex> lock(ringMutex_);
+        bool armed = false;
+        for (uint32_t id : rearm) {
+            auto it = sockets_.find(id);
+            if (it != sockets_.end() && it->second.receiving) {
+                armed = armReceive(id, it->second) || armed;
+            }
+        }
+        if (armed) {
+            io_uring_submit(&ring_);
+            queuedSends_ = 0;
+        }
+    }
+    waitForCompletions();
+}
+
+void UringRing::handleReceiveCompletion(const io_uring_cqe* cqe) {
+    if (cqe->res < 0) {
+        // ENOBUFS just means the buffer ring ran dry; the re-arm recovers
+        if (cqe->res != -ENOBUFS && cqe->res != -ECANCELED) {
+            Logger::getLogger()->error("io_uring receive error: {}", std::strerror(-cqe->res));
+        }
+        return;
+    }
+    if (!(cqe->flags & IORING_CQE_F_BUFFER)) {
+        return;
+    }
+
+    unsigned bufferId = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+    uint8_t* buffer = bufferStorage_.data() + static_cast<size_t>(bufferId) * RECV_BUFFER_SIZE;
+
+    std::shared_ptr<UringUdpIo> owner;
+    {
+        std::lock_guard<std::mutex> lock(ringMutex_);
+        auto it = sockets_.find(static_cast<uint32_t>(io_uring_cqe_get_data64(cqe)));
+        if (it != sockets_.end()) {
+            owner = it->second.owner.lock();
+        }
+    }
+
+    io_uring_recvmsg_out* out = io_uring_recvmsg_validate(buffer, cqe->res, &recvMsg_);
+    if (out && !(out->flags & MSG_TRUNC) && owner) {
+        boost::asio::ip::udp::endpoint sender;
+        size_t nameLen = std::min<size_t>(out->namelen, sizeof(sockaddr_storage));
+        std::memcpy(sender.data(), io_uring_recvmsg_name(out), nameLen);
+        sender.resize(nameLen);
+
+        uint8_t* payload = static_cast<uint8_t*>(io_uring_recvmsg_payload(out, &recvMsg_));
+        size_t payloadLen = io_uring_recvmsg_payload_length(out, cqe->res, &recvMsg_);
+        owner->deliver(payload, payloadLen, sender);
+    }
+
+    // Hand the buffer back to the kernel
+    io_uring_buf_ring_add(bufferRing_, buffer, RECV_BUFFER_SIZE, bufferId, io_uring_buf_ring_mask(bufferCount_), 0);
+    io_uring_buf_ring_advance(bufferRing_, 1);
+}
+
+UringUdpIo::UringUdpIo(boost::asio::io_context& io_context, size_t receiveBatch)
+    : io_context_(io_context),
+      receiveBatch_(receiveBatch),
+      socketId_(0),
+      socketFd_(-1)
+{
+}
+
+UringUdpIo::~UringUdpIo() {
+    close();
+}
+
+bool UringUdpIo::initialize() {
+    ring_ = UringRing::forContext(io_context_, receiveBatch_);
+    return ring_ != nullptr;
+}
+
+void UringUdpIo::open(uint16_t port, bool reusePort) {
+    int fd = ::socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        throw std::runtime_error(std::string("socket failed: ") + std::strerror(errno));
+    }
+
+    int one = 1;
+    if (reusePort && ::setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one)) < 0) {
+        int optionError = errno;
+        ::close(fd);
+        throw std::runtime_error(std::string("SO_REUSEPORT failed: ") + std::strerror(optionError));
+    }
+
+    sockaddr_in addr;
+    std::memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    addr.sin_port = htons(port);
+    if (::bind(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) < 0) {
+        int bindError = errno;
+        ::close(fd);
+        throw std::runtime_error(std::string("bind failed: ") + std::strerror(bindError));
+    }
+
+    attach(fd);
+}
+
+void UringUdpIo::adopt(int fd, uint16_t) {
+    attach(fd);
+}
+
+void UringUdpIo::attach(int fd) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    socketFd_ = fd;
+    socketId_ = ring_->addSocket(fd, shared_from_this());
+}
+
+void UringUdpIo::startReceive(ReceiveHandler handler) {
+    receiveHandler_ = handler;
+    ring_->startReceive(socketId_);
+}
+
+void UringUdpIo::deliver(uint8_t* data, size_t len, const boost::asio::ip::udp::endpoint& sender) {
+    if (receiveHandler_) {
+        receiveHandler_(data, len, sender);
+    }
+}
+
+void UringUdpIo::sendTo(const uint8_t* data, size_t len, const boost::asio::ip::udp::endpoint& destination) {
+    sendTo(boost::asio::const_buffer(), boost::asio::buffer(data, len), destination);
+}
+
+void UringUdpIo::sendTo(const boost::asio::const_buffer& header, const boost::asio::const_buffer& payload,
+                        const boost::asio::ip::udp::endpoint& destination) {
+    if (socketFd_ < 0) {
+        return;
+    }
+    ring_->send(socketId_, header, payload, destination);
+}
+
+void UringUdpIo::close() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (socketFd_ < 0) {
+        return;
+    }
+    ring_->removeSocket(socketId_);
+    ::close(socketFd_);
+    socketFd_ = -1;
+}
+
+bool UringUdpIo::isOpen() const {
+    return socketFd_ >= 0;
+}
+
+#endif // QUICRTP_HAVE_IO_URING
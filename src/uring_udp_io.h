@@ -0,0 +1,149 @@
+/*
+ * Copyright 2024 nrjchnd@gmail.com
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     https://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an **"AS IS" BASIS,**
+ * **WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.**
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#ifndef URING_UDP_IO_H
+#define URING_UDP_IO_H
+
+#ifdef QUICRTP_HAVE_IO_URING
+
+#include "udp_io.h"
+#include <liburing.h>
+#include <array>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+class UringUdpIo;
+
+// io_uring instance shared by every UringUdpIo of one io_context, so each
+// IO thread (or SSRC-steered worker) has a single ring however many ports
+// are open. Receives are multishot IORING_OP_RECVMSG drawing from one
+// provided buffer ring, sockets are registered in a sparse file table, and
+// sends of all sockets are queued as SQEs and submitted in batches.
+// Completions are signalled through one eventfd watched by the io_context,
+// so handlers run on the same threads as with the epoll backend.
+class UringRing : public std::enable_shared_from_this<UringRing> {
+public:
+    // The ring of io_context, set up on first use; null when the kernel
+    // does not support it
+    static std::shared_ptr<UringRing> forContext(boost::asio::io_context& io_context, size_t receiveBatch);
+
+    UringRing(boost::asio::io_context& io_context, size_t receiveBatch);
+    ~UringRing();
+
+    // Adds a bound socket; returns its id, which tags its completions
+    uint32_t addSocket(int fd, const std::shared_ptr<UringUdpIo>& owner);
+    // Cancels the socket's receive and drops it from the file table. The
+    // caller closes the descriptor.
+    void removeSocket(uint32_t id);
+    void startReceive(uint32_t id);
+    void send(uint32_t id, const boost::asio::const_buffer& header, const boost::asio::const_buffer& payload,
+              const boost::asio::ip::udp::endpoint& destination);
+
+private:
+    struct Socket {
+        int fd;
+        int fileIndex;      // slot in the registered file table, -1 if full
+        bool receiving;
+        std::weak_ptr<UringUdpIo> owner;
+    };
+
+    struct SendSlot {
+        msghdr msg;
+        iovec iov;
+        sockaddr_storage addr;
+        std::array<uint8_t, 2048> data;
+    };
+
+    bool initialize();
+    bool probeMultishotReceive();
+    // Called with ringMutex_ held
+    io_uring_sqe* nextSqe();
+    bool armReceive(uint32_t id, const Socket& socket);
+    void waitForCompletions();
+    void handleCompletions(const boost::system::error_code& error);
+    void handleReceiveCompletion(const io_uring_cqe* cqe);
+    void scheduleFlush();
+    void flushSends();
+
+    boost::asio::io_context& io_context_;
+    size_t sendBatch_;
+
+    io_uring ring_;
+    bool ringReady_;
+
+    io_uring_buf_ring* bufferRing_;
+    unsigned bufferCount_;
+    std::vector<uint8_t> bufferStorage_;
+    msghdr recvMsg_;
+
+    int eventFd_;
+    boost::asio::posix::stream_descriptor eventDescriptor_;
+    uint64_t eventCount_;
+
+    // Guards the submission queue, the sockets and the send slots
+    std::mutex ringMutex_;
+    std::unordered_map<uint32_t, Socket> sockets_;
+    uint32_t nextSocketId_;
+    bool fileTable_;
+    std::vector<int> freeFileIndexes_;
+    std::vector<SendSlot> sendSlots_;
+    std::vector<uint32_t> freeSendSlots_;
+    size_t queuedSends_;
+    bool flushPending_;
+};
+
+// One UDP socket on its io_context's UringRing
+class UringUdpIo : public UdpIo, public std::enable_shared_from_this<UringUdpIo> {
+public:
+    UringUdpIo(boost::asio::io_context& io_context, size_t receiveBatch);
+    ~UringUdpIo() override;
+
+    // Joins the context's ring; false when the kernel does not support it
+    bool initialize();
+
+    void open(uint16_t port, bool reusePort) override;
+    void adopt(int fd, uint16_t port) override;
+    void startReceive(ReceiveHandler handler) override;
+    void sendTo(const uint8_t* data, size_t len, const boost::asio::ip::udp::endpoint& destination) override;
+    void sendTo(const boost::asio::const_buffer& header, const boost::asio::const_buffer& payload,
+                const boost::asio::ip::udp::endpoint& destination) override;
+    void close() override;
+    bool isOpen() const override;
+    int nativeHandle() const override { return socketFd_; }
+
+    const char* name() const override { return "io_uring"; }
+
+private:
+    friend class UringRing;
+
+    void attach(int fd);
+    // Called by the ring on the io_context
+    void deliver(uint8_t* data, size_t len, const boost::asio::ip::udp::endpoint& sender);
+
+    boost::asio::io_context& io_context_;
+    size_t receiveBatch_;
+    std::shared_ptr<UringRing> ring_;
+    uint32_t socketId_;
+    int socketFd_;
+    std::mutex mutex_;
+
+    ReceiveHandler receiveHandler_;
+};
+
+#endif // QUICRTP_HAVE_IO_URING
+
+#endif // URING_UDP_IO_H
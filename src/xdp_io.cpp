@@ -0,0 +1,584 @@
+/*
+ * Copyright 2024 nrjchnd@gmail.com
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     https://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an **"AS IS" BASIS,**
+ * **WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.**
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "xdp_io.h"
+#include "logger.h"
+#include <cstring>
+
+#ifdef QUICRTP_HAVE_XDP
+#include <xdp/xsk.h>
+#include <bpf/bpf.h>
+#include <bpf/libbpf.h>
+#include <linux/if_ether.h>
+#include <linux/if_link.h>
+#include <linux/ip.h>
+#include <linux/udp.h>
+#include <arpa/inet.h>
+#include <net/if.h>
+#include <netinet/in.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+namespace {
+std::mutex activeEngineMutex;
+std::shared_ptr<XdpEngine> activeEngine;
+}
+
+std::shared_ptr<XdpEngine> XdpEngine::active() {
+    std::lock_guard<std::mutex> lock(activeEngineMutex);
+    return activeEngine;
+}
+
+void XdpEngine::setActive(std::shared_ptr<XdpEngine> engine) {
+    std::lock_guard<std::mutex> lock(activeEngineMutex);
+    activeEngine = engine;
+}
+
+#ifdef QUICRTP_HAVE_XDP
+
+const uint32_t FRAME_SIZE = XSK_UMEM__DEFAULT_FRAME_SIZE;
+// First half of the UMEM feeds the RX fill ring, second half is the TX pool
+const uint32_t RX_FRAMES = 2048;
+const uint32_t TX_FRAMES = 2048;
+const uint32_t RX_BATCH = 64;
+static_assert(RX_BATCH <= UDP_RECEIVE_BATCH_MAX, "an XDP ring batch must fit in one ReceiveBatch");
+const size_t HEADERS_LEN = sizeof(ethhdr) + sizeof(iphdr) + sizeof(udphdr);
+
+struct XdpEngine::Rings {
+    xsk_ring_prod fill;
+    xsk_ring_cons completion;
+    xsk_ring_cons rx;
+    xsk_ring_prod tx;
+};
+
+namespace {
+uint16_t ipChecksum(const iphdr* ip) {
+    const uint16_t* words = reinterpret_cast<const uint16_t*>(ip);
+    uint32_t sum = 0;
+    for (size_t i = 0; i < sizeof(iphdr) / 2; ++i) {
+        sum += words[i];
+    }
+    while (sum >> 16) {
+        sum = (sum & 0xFFFF) + (sum >> 16);
+    }
+    return static_cast<uint16_t>(~sum);
+}
+}
+
+XdpEngine::XdpEngine(boost::asio::io_context& io_context)
+    : io_context_(io_context), descriptor_(io_context), ifindex_(0), xdpFlags_(0),
+      localMac_{}, localIp_(0), umemArea_(nullptr), umemSize_(0), umem_(nullptr), xsk_(nullptr),
+      rings_(new Rings()), bpfObject_(nullptr), portMapFd_(-1)
+{
+}
+
+XdpEngine::~XdpEngine() {
+    shutdown();
+}
+
+bool XdpEngine::initialize(const std::string& interfaceName, uint32_t queueId, const std::string& programPath, bool skbMode) {
+    ifindex_ = static_cast<int>(if_nametoindex(interfaceName.c_str()));
+    if (ifindex_ == 0) {
+        Logger::getLogger()->warn("XDP: unknown interface {}", interfaceName);
+        return false;
+    }
+
+    // Source addressing for egress frames
+    int fd = ::socket(AF_INET, SOCK_DGRAM, 0);
+    ifreq ifr;
+    std::memset(&ifr, 0, sizeof(ifr));
+    std::strncpy(ifr.ifr_name, interfaceName.c_str(), IFNAMSIZ - 1);
+    bool addressed = fd >= 0 && ::ioctl(fd, SIOCGIFHWADDR, &ifr) == 0;
+    if (addressed) {
+        std::memcpy(localMac_.data(), ifr.ifr_hwaddr.sa_data, 6);
+        addressed = ::ioctl(fd, SIOCGIFADDR, &ifr) == 0;
+        if (addressed) {
+            localIp_ = reinterpret_cast<sockaddr_in*>(&ifr.ifr_addr)->sin_addr.s_addr;
+        }
+    }
+    if (fd >= 0) {
+        ::close(fd);
+    }
+    if (!addressed) {
+        Logger::getLogger()->warn("XDP: cannot read MAC/IPv4 address of {}", interfaceName);
+        return false;
+    }
+
+    // Load the redirect program; ports are published to it as they register
+    bpf_object* object = bpf_object__open_file(programPath.c_str(), nullptr);
+    if (!object || libbpf_get_error(object)) {
+        Logger::getLogger()->warn("XDP: cannot open BPF object {}", programPath);
+        return false;
+    }
+    bpfObject_ = object;
+    if (bpf_object__load(object) != 0) {
+        Logger::getLogger()->warn("XDP: cannot load BPF object {}", programPath);
+        shutdown();
+        return false;
+    }
+
+    bpf_program* program = bpf_object__find_program_by_name(object, "rtp_xdp_redirect");
+    portMapFd_ = bpf_object__find_map_fd_by_name(object, "rtp_ports");
+    int xskMapFd = bpf_object__find_map_fd_by_name(object, "xsks_map");
+    if (!program || portMapFd_ < 0 || xskMapFd < 0) {
+        Logger::getLogger()->warn("XDP: BPF object {} is missing the program or its maps", programPath);
+        shutdown();
+        return false;
+    }
+
+    xdpFlags_ = skbMode ? XDP_FLAGS_SKB_MODE : XDP_FLAGS_DRV_MODE;
+    if (bpf_xdp_attach(ifindex_, bpf_program__fd(program), xdpFlags_, nullptr) != 0) {
+        Logger::getLogger()->warn("XDP: cannot attach program to {} in {} mode", interfaceName, skbMode ? "skb" : "native");
+        xdpFlags_ = 0;
+        shutdown();
+        return false;
+    }
+
+    // UMEM shared by RX and TX
+    umemSize_ = static_cast<size_t>(RX_FRAMES + TX_FRAMES) * FRAME_SIZE;
+    umemArea_ = ::mmap(nullptr, umemSize_, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE, -1, 0);
+    if (umemArea_ == MAP_FAILED) {
+        umemArea_ = nullptr;
+        Logger::getLogger()->warn("XDP: cannot map UMEM");
+        shutdown();
+        return false;
+    }
+
+    xsk_umem_config umemConfig;
+    std::memset(&umemConfig, 0, sizeof(umemConfig));
+    umemConfig.fill_size = RX_FRAMES;
+    umemConfig.comp_size = TX_FRAMES;
+    umemConfig.frame_size = FRAME_SIZE;
+    umemConfig.frame_headroom = 0;
+    if (xsk_umem__create(&umem_, umemArea_, umemSize_, &rings_->fill, &rings_->completion, &umemConfig) != 0) {
+        umem_ = nullptr;
+        Logger::getLogger()->warn("XDP: cannot create UMEM");
+        shutdown();
+        return false;
+    }
+
+    xsk_socket_config socketConfig;
+    std::memset(&socketConfig, 0, sizeof(socketConfig));
+    socketConfig.rx_size = XSK_RING_CONS__DEFAULT_NUM_DESCS;
+    socketConfig.tx_size = XSK_RING_PROD__DEFAULT_NUM_DESCS;
+    socketConfig.libxdp_flags = XSK_LIBXDP_FLAGS__INHIBIT_PROG_LOAD;
+    socketConfig.xdp_flags = xdpFlags_;
+    socketConfig.bind_flags = XDP_USE_NEED_WAKEUP;
+    if (xsk_socket__create(&xsk_, interfaceName.c_str(), queueId, umem_, &rings_->rx, &rings_->tx, &socketConfig) != 0) {
+        xsk_ = nullptr;
+        Logger::getLogger()->warn("XDP: cannot create AF_XDP socket on {} queue {}", interfaceName, queueId);
+        shutdown();
+        return false;
+    }
+    if (xsk_socket__update_xskmap(xsk_, xskMapFd) != 0) {
+        Logger::getLogger()->warn("XDP: cannot register AF_XDP socket in xsks_map");
+        shutdown();
+        return false;
+    }
+
+    std::vector<uint64_t> rxFrames;
+    rxFrames.reserve(RX_FRAMES);
+    for (uint32_t i = 0; i < RX_FRAMES; ++i) {
+        rxFrames.push_back(static_cast<uint64_t>(i) * FRAME_SIZE);
+    }
+    refill(rxFrames);
+
+    freeTxFrames_.reserve(TX_FRAMES);
+    for (uint32_t i = 0; i < TX_FRAMES; ++i) {
+        freeTxFrames_.push_back(static_cast<uint64_t>(RX_FRAMES + i) * FRAME_SIZE);
+    }
+
+    descriptor_.assign(xsk_socket__fd(xsk_));
+    waitForRx();
+
+    Logger::getLogger()->info("XDP fast path active on {} queue {}", interfaceName, queueId);
+    return true;
+}
+
+void XdpEngine::shutdown() {
+    if (descriptor_.is_open()) {
+        // The fd belongs to the xsk socket; only drop the reactor registration
+        descriptor_.release();
+    }
+    if (xsk_) {
+        xsk_socket__delete(xsk_);
+        xsk_ = nullptr;
+    }
+    if (umem_) {
+        xsk_umem__delete(umem_);
+        umem_ = nullptr;
+    }
+    if (umemArea_) {
+        ::munmap(umemArea_, umemSize_);
+        umemArea_ = nullptr;
+    }
+    if (xdpFlags_ != 0) {
+        bpf_xdp_detach(ifindex_, xdpFlags_, nullptr);
+        xdpFlags_ = 0;
+    }
+    if (bpfObject_) {
+        bpf_object__close(static_cast<bpf_object*>(bpfObject_));
+        bpfObject_ = nullptr;
+    }
+    portMapFd_ = -1;
+}
+
+bool XdpEngine::registerPort(uint16_t port, UdpIo::BatchReceiveHandler handler) {
+    {
+        std::unique_lock<std::shared_mutex> lock(tableMutex_);
+        if (!handlers_.emplace(port, std::make_shared<UdpIo::BatchReceiveHandler>(handler)).second) {
+            return false;
+        }
+    }
+    setPortServed(port, true);
+    return true;
+}
+
+void XdpEngine::unregisterPort(uint16_t port) {
+    // Stop the redirect first so nothing is left without a handler
+    setPortServed(port, false);
+    std::unique_lock<std::shared_mutex> lock(tableMutex_);
+    handlers_.erase(port);
+}
+
+void XdpEngine::setPortServed(uint16_t port, bool served) {
+    if (portMapFd_ < 0) {
+        return;
+    }
+    uint32_t key = port;
+    uint8_t value = served ? 1 : 0;
+    if (bpf_map_update_elem(portMapFd_, &key, &value, BPF_ANY) != 0) {
+        Logger::getLogger()->warn("XDP: cannot {} port {} in the redirect map", served ? "add" : "remove", port);
+    }
+}
+
+void XdpEngine::waitForRx() {
+    descriptor_.async_wait(boost::asio::posix::stream_descriptor::wait_read,
+        [this](const boost::system::error_code& error) {
+            handleRx(error);
+        }
+    );
+}
+
+void XdpEngine::handleRx(const boost::system::error_code& error) {
+    if (error) {
+        if (error != boost::asio::error::operation_aborted) {
+            Logger::getLogger()->error("XDP receive error: {}", error.message());
+        }
+        return;
+    }
+
+    uint32_t index = 0;
+    uint32_t received = xsk_ring_cons__peek(&rings_->rx, RX_BATCH, &index);
+    std::vector<uint64_t> consumed;
+    consumed.reserve(received);
+    size_t batches = 0;
+
+    for (uint32_t i = 0; i < received; ++i) {
+        const xdp_desc* desc = xsk_ring_cons__rx_desc(&rings_->rx, index + i);
+        uint8_t* frame = static_cast<uint8_t*>(xsk_umem__get_data(umemArea_, desc->addr));
+        consumed.push_back(desc->addr - (desc->addr % FRAME_SIZE));
+
+        if (desc->len < HEADERS_LEN) {
+            continue;
+        }
+        const ethhdr* eth = reinterpret_cast<const ethhdr*>(frame);
+        const iphdr* ip = reinterpret_cast<const iphdr*>(frame + sizeof(ethhdr));
+        size_t ipHeaderLen = ip->ihl * 4u;
+        if (eth->h_proto != htons(ETH_P_IP) || ip->protocol != IPPROTO_UDP || ipHeaderLen < sizeof(iphdr) ||
+            desc->len < sizeof(ethhdr) + ipHeaderLen + sizeof(udphdr)) {
+            continue;
+        }
+        const udphdr* udp = reinterpret_cast<const udphdr*>(frame + sizeof(ethhdr) + ipHeaderLen);
+        size_t udpLen = ntohs(udp->len);
+        size_t available = desc->len - sizeof(ethhdr) - ipHeaderLen;
+        if (udpLen < sizeof(udphdr) || udpLen > available) {
+            continue;
+        }
+
+        uint16_t port = ntohs(udp->dest);
+        size_t slot = 0;
+        while (slot < batches && rxBatches_[slot].port != port) {
+            ++slot;
+        }
+        std::shared_ptr<UdpIo::BatchReceiveHandler> handler = slot < batches ? rxBatches_[slot].handler : nullptr;
+        {
+            std::shared_lock<std::shared_mutex> lock(tableMutex_);
+            if (!handler) {
+                auto it = handlers_.find(port);
+                if (it != handlers_.end()) {
+                    handler = it->second;
+                }
+            }
+            auto neighbor = neighbors_.find(ip->saddr);
+            bool learn = neighbor == neighbors_.end() || std::memcmp(neighbor->second.data(), eth->h_source, 6) != 0;
+            if (learn) {
+                lock.unlock();
+                std::unique_lock<std::shared_mutex> writeLock(tableMutex_);
+                std::memcpy(neighbors_[ip->saddr].data(), eth->h_source, 6);
+            }
+        }
+        if (!handler) {
+            continue;
+        }
+
+        if (slot == batches) {
+            if (batches == rxBatches_.size()) {
+                rxBatches_.emplace_back();
+            }
+            rxBatches_[slot].port = port;
+            rxBatches_[slot].handler = handler;
+            rxBatches_[slot].batch.count = 0;
+            ++batches;
+        }
+        ReceiveBatch& batch = rxBatches_[slot].batch;
+        batch.data[batch.count] = const_cast<uint8_t*>(reinterpret_cast<const uint8_t*>(udp + 1));
+        batch.length[batch.count] = udpLen - sizeof(udphdr);
+        batch.sender[batch.count] = boost::asio::ip::udp::endpoint(boost::asio::ip::address_v4(ntohl(ip->saddr)), ntohs(udp->source));
+        ++batch.count;
+    }
+
+    // The frames stay in the UMEM until they are refilled below
+    for (size_t slot = 0; slot < batches; ++slot) {
+        (*rxBatches_[slot].handler)(rxBatches_[slot].batch);
+        rxBatches_[slot].handler.reset();
+    }
+
+    if (received > 0) {
+        xsk_ring_cons__release(&rings_->rx, received);
+        refill(consumed);
+    }
+
+    // More may be pending than one batch; let other handlers run in between
+    if (received == RX_BATCH) {
+        boost::asio::post(io_context_, [this]() { handleRx(boost::system::error_code()); });
+    } else {
+        waitForRx();
+    }
+}
+
+void XdpEngine::refill(const std::vector<uint64_t>& frames) {
+    size_t offset = 0;
+    while (offset < frames.size()) {
+        uint32_t index = 0;
+        uint32_t count = static_cast<uint32_t>(frames.size() - offset);
+        uint32_t reserved = xsk_ring_prod__reserve(&rings_->fill, count, &index);
+        if (reserved == 0) {
+            break;
+        }
+        for (uint32_t i = 0; i < reserved; ++i) {
+            *xsk_ring_prod__fill_addr(&rings_->fill, index + i) = frames[offset + i];
+        }
+        xsk_ring_prod__submit(&rings_->fill, reserved);
+        offset += reserved;
+    }
+}
+
+void XdpEngine::reclaimTx() {
+    uint32_t index = 0;
+    uint32_t completed = xsk_ring_cons__peek(&rings_->completion, TX_FRAMES, &index);
+    for (uint32_t i = 0; i < completed; ++i) {
+        freeTxFrames_.push_back(*xsk_ring_cons__comp_addr(&rings_->completion, index + i));
+    }
+    if (completed > 0) {
+        xsk_ring_cons__release(&rings_->completion, completed);
+    }
+}
+
+bool XdpEngine::transmit(uint16_t sourcePort, const boost::asio::const_buffer& header, const boost::asio::const_buffer& payload,
+                         const boost::asio::ip::udp::endpoint& destination) {
+    size_t len = header.size() + payload.size();
+    if (!xsk_ || !destination.address().is_v4() || HEADERS_LEN + len > FRAME_SIZE) {
+        return false;
+    }
+
+    uint32_t destinationIp = htonl(destination.address().to_v4().to_uint());
+    std::array<uint8_t, 6> destinationMac;
+    {
+        std::shared_lock<std::shared_mutex> lock(tableMutex_);
+        auto neighbor = neighbors_.find(destinationIp);
+        if (neighbor == neighbors_.end()) {
+            return false;
+        }
+        destinationMac = neighbor->second;
+    }
+
+    std::lock_guard<std::mutex> lock(txMutex_);
+    reclaimTx();
+    if (freeTxFrames_.empty()) {
+        return false;
+    }
+
+    uint32_t index = 0;
+    if (xsk_ring_prod__reserve(&rings_->tx, 1, &index) != 1) {
+        return false;
+    }
+
+    uint64_t address = freeTxFrames_.back();
+    freeTxFrames_.pop_back();
+    uint8_t* frame = static_cast<uint8_t*>(xsk_umem__get_data(umemArea_, address));
+
+    ethhdr* eth = reinterpret_cast<ethhdr*>(frame);
+    std::memcpy(eth->h_dest, destinationMac.data(), 6);
+    std::memcpy(eth->h_source, localMac_.data(), 6);
+    eth->h_proto = htons(ETH_P_IP);
+
+    iphdr* ip = reinterpret_cast<iphdr*>(frame + sizeof(ethhdr));
+    std::memset(ip, 0, sizeof(iphdr));
+    ip->version = 4;
+    ip->ihl = 5;
+    ip->ttl = 64;
+    ip->protocol = IPPROTO_UDP;
+    ip->tot_len = htons(static_cast<uint16_t>(sizeof(iphdr) + sizeof(udphdr) + len));
+    ip->saddr = localIp_;
+    ip->daddr = destinationIp;
+    ip->check = ipChecksum(ip);
+
+    udphdr* udp = reinterpret_cast<udphdr*>(frame + sizeof(ethhdr) + sizeof(iphdr));
+    udp->source = htons(sourcePort);
+    udp->dest = htons(destination.port());
+    udp->len = htons(static_cast<uint16_t>(sizeof(udphdr) + len));
+    udp->check = 0; // optional for IPv4
+
+    std::memcpy(frame + HEADERS_LEN, header.data(), header.size());
+    std::memcpy(frame + HEADERS_LEN + header.size(), payload.data(), payload.size());
+
+    xdp_desc* desc = xsk_ring_prod__tx_desc(&rings_->tx, index);
+    desc->addr = address;
+    desc->len = static_cast<uint32_t>(HEADERS_LEN + len);
+    xsk_ring_prod__submit(&rings_->tx, 1);
+
+    if (xsk_ring_prod__needs_wakeup(&rings_->tx)) {
+        ::sendto(xsk_socket__fd(xsk_), nullptr, 0, MSG_DONTWAIT, nullptr, 0);
+    }
+    return true;
+}
+
+#else // QUICRTP_HAVE_XDP
+
+struct XdpEngine::Rings {};
+
+XdpEngine::XdpEngine(boost::asio::io_context& io_context)
+    : io_context_(io_context), descriptor_(io_context), ifindex_(0), xdpFlags_(0),
+      localMac_{}, localIp_(0), umemArea_(nullptr), umemSize_(0), umem_(nullptr), xsk_(nullptr), bpfObject_(nullptr),
+      portMapFd_(-1)
+{
+}
+
+XdpEngine::~XdpEngine() {
+}
+
+bool XdpEngine::initialize(const std::string&, uint32_t, const std::string&, bool) {
+    Logger::getLogger()->warn("XDP support not compiled in");
+    return false;
+}
+
+void XdpEngine::shutdown() {
+}
+
+bool XdpEngine::registerPort(uint16_t, UdpIo::BatchReceiveHandler) {
+    return false;
+}
+
+void XdpEngine::unregisterPort(uint16_t) {
+}
+
+void XdpEngine::setPortServed(uint16_t, bool) {
+}
+
+bool XdpEngine::transmit(uint16_t, const boost::asio::const_buffer&, const boost::asio::const_buffer&,
+                         const boost::asio::ip::udp::endpoint&) {
+    return false;
+}
+
+#endif // QUICRTP_HAVE_XDP
+
+XdpUdpIo::XdpUdpIo(std::shared_ptr<XdpEngine> engine, std::shared_ptr<UdpIo> kernelIo)
+    : engine_(engine), kernelIo_(kernelIo), port_(0), registered_(false), receiveMutex_(std::make_shared<std::mutex>())
+{
+}
+
+XdpUdpIo::~XdpUdpIo() {
+    close();
+}
+
+void XdpUdpIo::open(uint16_t port, bool reusePort) {
+    kernelIo_->open(port, reusePort);
+    port_ = port;
+}
+
+void XdpUdpIo::adopt(int fd, uint16_t port) {
+    kernelIo_->adopt(fd, port);
+    port_ = port;
+}
+
+void XdpUdpIo::startReceive(ReceiveHandler handler) {
+    auto receiveMutex = receiveMutex_;
+    ReceiveHandler serialized = [handler, receiveMutex](uint8_t* data, size_t len, const boost::asio::ip::udp::endpoint& sender) {
+        std::lock_guard<std::mutex> lock(*receiveMutex);
+        handler(data, len, sender);
+    };
+    if (port_ != 0) {
+        registered_ = engine_->registerPort(port_, [handler, receiveMutex](ReceiveBatch& batch) {
+            std::lock_guard<std::mutex> lock(*receiveMutex);
+            for (size_t i = 0; i < batch.count; ++i) {
+                handler(batch.data[i], batch.length[i], batch.sender[i]);
+            }
+        });
+    }
+    kernelIo_->startReceive(serialized);
+}
+
+void XdpUdpIo::startReceiveBatch(BatchReceiveHandler handler) {
+    auto receiveMutex = receiveMutex_;
+    BatchReceiveHandler serialized = [handler, receiveMutex](ReceiveBatch& batch) {
+        std::lock_guard<std::mutex> lock(*receiveMutex);
+        handler(batch);
+    };
+    if (port_ != 0) {
+        registered_ = engine_->registerPort(port_, serialized);
+    }
+    kernelIo_->startReceiveBatch(serialized);
+}
+
+void XdpUdpIo::sendTo(const uint8_t* data, size_t len, const boost::asio::ip::udp::endpoint& destination) {
+    if (port_ != 0 && engine_->transmit(port_, boost::asio::const_buffer(), boost::asio::buffer(data, len), destination)) {
+        return;
+    }
+    kernelIo_->sendTo(data, len, destination);
+}
+
+void XdpUdpIo::sendTo(const boost::asio::const_buffer& header, const boost::asio::const_buffer& payload,
+                      const boost::asio::ip::udp::endpoint& destination) {
+    if (port_ != 0 && engine_->transmit(port_, header, payload, destination)) {
+        return;
+    }
+    kernelIo_->sendTo(header, payload, destination);
+}
+
+void XdpUdpIo::close() {
+    if (registered_) {
+        engine_->unregisterPort(port_);
+        registered_ = false;
+    }
+    kernelIo_->close();
+}
+
+bool XdpUdpIo::isOpen() const {
+    return kernelIo_->isOpen();
+}
@@ -0,0 +1,141 @@
+/*
+ * Copyright 2024 nrjchnd@gmail.com
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     https://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an **"AS IS" BASIS,**
+ * **WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.**
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#ifndef XDP_IO_H
+#define XDP_IO_H
+
+#include "udp_io.h"
+#include <array>
+#include <memory>
+#include <mutex>
+#include <shared_mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+struct xsk_umem;
+struct xsk_socket;
+
+// AF_XDP fast path for one interface queue. A small XDP program
+// (bpf/rtp_xdp.bpf.c) redirects UDP to the registered ports into a UMEM shared
+// with user space; frames are parsed in place and the UDP payloads of each
+// ring batch are handed to the handler of their destination port as one
+// ReceiveBatch, without a copy. Egress
+// builds Ethernet/IPv4/UDP frames into the same UMEM, addressed to the MAC
+// learned from the peer's ingress traffic.
+class XdpEngine {
+public:
+    explicit XdpEngine(boost::asio::io_context& io_context);
+    ~XdpEngine();
+
+    // False when XDP cannot be used (not compiled in, no privileges, driver
+    // refuses the program); callers then stay on the socket path
+    bool initialize(const std::string& interfaceName, uint32_t queueId, const std::string& programPath, bool skbMode);
+    void shutdown();
+
+    // Only registered ports are redirected by the program; packets to any
+    // other port, such as RTCP on port + 1, stay with the kernel. A port has
+    // one handler: false when it is registered already, and the caller then
+    // keeps to its socket. With several SO_REUSEPORT sockets on one port the
+    // first takes every redirected packet, so SSRC steering between them
+    // does not apply on the XDP path.
+    bool registerPort(uint16_t port, UdpIo::BatchReceiveHandler handler);
+    void unregisterPort(uint16_t port);
+
+    // False when the frame cannot be sent through XDP (unknown next hop,
+    // no free frame); the caller sends through the kernel instead. The UDP
+    // payload is header followed by payload; header may be empty.
+    bool transmit(uint16_t sourcePort, const boost::asio::const_buffer& header, const boost::asio::const_buffer& payload,
+                  const boost::asio::ip::udp::endpoint& destination);
+
+    // Engine used by createUdpIo("xdp"); null when XDP is not active
+    static std::shared_ptr<XdpEngine> active();
+    static void setActive(std::shared_ptr<XdpEngine> engine);
+
+private:
+    struct Rings;
+
+    void waitForRx();
+    void handleRx(const boost::system::error_code& error);
+    void refill(const std::vector<uint64_t>& frames);
+    void reclaimTx();
+    void setPortServed(uint16_t port, bool served);
+
+    boost::asio::io_context& io_context_;
+    boost::asio::posix::stream_descriptor descriptor_;
+
+    int ifindex_;
+    uint32_t xdpFlags_;
+    std::array<uint8_t, 6> localMac_;
+    uint32_t localIp_;
+
+    void* umemArea_;
+    size_t umemSize_;
+    xsk_umem* umem_;
+    xsk_socket* xsk_;
+    std::unique_ptr<Rings> rings_;
+    void* bpfObject_;
+    int portMapFd_;
+
+    std::vector<uint64_t> freeTxFrames_;
+    std::mutex txMutex_;
+
+    // Payloads of one ring batch grouped by port; only touched by handleRx
+    struct PortBatch {
+        uint16_t port = 0;
+        std::shared_ptr<UdpIo::BatchReceiveHandler> handler;
+        ReceiveBatch batch;
+    };
+    std::vector<PortBatch> rxBatches_;
+
+    std::unordered_map<uint16_t, std::shared_ptr<UdpIo::BatchReceiveHandler>> handlers_;
+    std::unordered_map<uint32_t, std::array<uint8_t, 6>> neighbors_;
+    std::shared_mutex tableMutex_;
+};
+
+// UdpIo over the XDP engine. A regular socket stays bound to the port so the
+// port is reserved, packets the XDP program passes to the kernel are still
+// received, and egress can fall back when XDP cannot send. The two receive
+// paths may complete on different threads, so each fills its own batch and
+// the handler is entered by one of them at a time.
+class XdpUdpIo : public UdpIo {
+public:
+    XdpUdpIo(std::shared_ptr<XdpEngine> engine, std::shared_ptr<UdpIo> kernelIo);
+    ~XdpUdpIo() override;
+
+    void open(uint16_t port, bool reusePort) override;
+    void adopt(int fd, uint16_t port) override;
+    void startReceive(ReceiveHandler handler) override;
+    void startReceiveBatch(BatchReceiveHandler handler) override;
+    void sendTo(const uint8_t* data, size_t len, const boost::asio::ip::udp::endpoint& destination) override;
+    void sendTo(const boost::asio::const_buffer& header, const boost::asio::const_buffer& payload,
+                const boost::asio::ip::udp::endpoint& destination) override;
+    void close() override;
+    bool isOpen() const override;
+    int nativeHandle() const override { return kernelIo_->nativeHandle(); }
+
+    const char* name() const override { return "xdp"; }
+
+private:
+    std::shared_ptr<XdpEngine> engine_;
+    std::shared_ptr<UdpIo> kernelIo_;
+    uint16_t port_;
+    bool registered_;
+    // Shared with the handlers, which the engine may still be running
+    // after close()
+    std::shared_ptr<std::mutex> receiveMutex_;
+};
+
+#endif // XDP_IO_H
@@ -0,0 +1,161 @@
+/*
+ * Copyright 2024 nrjchnd@gmail.com
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     https://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an **"AS IS" BASIS,**
+ * **WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.**
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include "datagram_fragmenter.h"
+#include "logger.h"
+#include "test_check.h"
+#include <algorithm>
+#include <cstring>
+#include <utility>
+#include <vector>
+
+namespace {
+using Message = std::vector<uint8_t>;
+const size_t MAX_DATAGRAM = 1200;
+
+Message message(size_t length, uint8_t seed) {
+    Message bytes(length);
+    for (size_t i = 0; i < length; ++i) {
+        bytes[i] = static_cast<uint8_t>(seed + i * 7);
+    }
+    return bytes;
+}
+
+// Frames bytes and returns the datagrams, empty when frame() refused
+std::vector<Message> frame(DatagramFragmenter& fragmenter, uint32_t ssrc, const Message& bytes, size_t maxLength = MAX_DATAGRAM) {
+    PacketBuffer packet = PacketArena::instance().allocate();
+    std::memcpy(packet.data(), bytes.data(), bytes.size());
+    packet.setSize(bytes.size());
+    std::vector<PacketBuffer> out;
+    std::vector<Message> datagrams;
+    if (!fragmenter.frame(ssrc, packet, maxLength, out)) {
+        CHECK(packet.size() == bytes.size());   // left alone
+        return datagrams;
+    }
+    for (const PacketBuffer& datagram : out) {
+        CHECK(datagram.size() <= maxLength);
+        datagrams.emplace_back(datagram.data(), datagram.data() + datagram.size());
+    }
+    return datagrams;
+}
+
+std::vector<Message> receive(DatagramReassembler& reassembler, const std::vector<Message>& datagrams,
+                             std::chrono::steady_clock::time_point now) {
+    std::vector<Message> delivered;
+    for (const Message& datagram : datagrams) {
+        reassembler.receive(datagram.data(), datagram.size(), now, [&](const uint8_t* data, size_t len) {
+            delivered.emplace_back(data, data + len);
+        });
+    }
+    return delivered;
+}
+
+void testWhole() {
+    DatagramFragmenter fragmenter;
+    DatagramReassembler reassembler;
+    Message bytes = message(MAX_DATAGRAM - FRAGMENT_WHOLE_HEADER_SIZE, 1);
+    auto datagrams = frame(fragmenter, 1, bytes);
+    CHECK(datagrams.size() == 1);
+    CHECK(receive(reassembler, datagrams, std::chrono::steady_clock::now()) == std::vector<Message>{bytes});
+    CHECK(fragmenter.fragmentedMessages() == 0);
+}
+
+void testFragmented() {
+    DatagramFragmenter fragmenter;
+    DatagramReassembler reassembler;
+    auto now = std::chrono::steady_clock::now();
+    // Down to a path that takes the most fragments for a full packet
+    const size_t smallest = PACKET_CAPACITY / FRAGMENT_MAX_COUNT + FRAGMENT_HEADER_SIZE;
+    const std::pair<size_t, size_t> cases[] = {
+        {MAX_DATAGRAM, MAX_DATAGRAM}, {1500, MAX_DATAGRAM}, {PACKET_CAPACITY, MAX_DATAGRAM},
+        {1000, 300}, {PACKET_CAPACITY, smallest}
+    };
+    for (const auto& entry : cases) {
+        Message bytes = message(entry.first, static_cast<uint8_t>(entry.second));
+        auto datagrams = frame(fragmenter, 2, bytes, entry.second);
+        CHECK(datagrams.size() > 1 && datagrams.size() <= FRAGMENT_MAX_COUNT);
+        // Shares are about equal rather than full fragments and a short tail
+        auto sizes = std::minmax_element(datagrams.begin(), datagrams.end(), [](const Message& a, const Message& b) {
+            return a.size() < b.size();
+        });
+        CHECK(sizes.second->size() - sizes.first->size() <= 1);
+
+        // Out of order and with a duplicate, delivered once and whole
+        std::reverse(datagrams.begin(), datagrams.end());
+        datagrams.insert(datagrams.begin() + 1, datagrams.front());
+        CHECK(receive(reassembler, datagrams, now) == std::vector<Message>{bytes});
+    }
+    CHECK(reassembler.reassembled() == 5);
+    CHECK(reassembler.dropped() == 0);
+    CHECK(frame(fragmenter, 2, message(PACKET_CAPACITY, 0), smallest).size() == FRAGMENT_MAX_COUNT);
+
+    // Too many fragments: refused, and the packet is left for the caller
+    CHECK(frame(fragmenter, 2, message(PACKET_CAPACITY, 0), smallest - 1).empty());
+}
+
+void testInterleaved() {
+    // Messages of two sessions with their fragments interleaved
+    DatagramFragmenter fragmenter;
+    DatagramReassembler reassembler;
+    Message first = message(2000, 10);
+    Message second = message(1500, 20);
+    auto a = frame(fragmenter, 10, first, 400);
+    auto b = frame(fragmenter, 20, second, 400);
+    std::vector<Message> datagrams;
+    for (size_t i = 0; i < std::max(a.size(), b.size()); ++i) {
+        if (i < a.size()) {
+            datagrams.push_back(a[i]);
+        }
+        if (i < b.size()) {
+            datagrams.push_back(b[i]);
+        }
+    }
+    auto delivered = receive(reassembler, datagrams, std::chrono::steady_clock::now());
+    CHECK(delivered.size() == 2);
+    CHECK(std::count(delivered.begin(), delivered.end(), first) == 1);
+    CHECK(std::count(delivered.begin(), delivered.end(), second) == 1);
+}
+
+void testLostFragment() {
+    DatagramFragmenter fragmenter;
+    DatagramReassembler reassembler;
+    reassembler.setTimeout(std::chrono::milliseconds(100));
+    auto now = std::chrono::steady_clock::now();
+
+    Message incomplete = message(2000, 30);
+    auto datagrams = frame(fragmenter, 3, incomplete);
+    datagrams.erase(datagrams.begin() + 1);
+    CHECK(receive(reassembler, datagrams, now).empty());
+
+    // The next message of the session still gets through, and the broken
+    // one is given up once its timeout passes
+    Message next = message(1500, 31);
+    CHECK(receive(reassembler, frame(fragmenter, 3, next), now + std::chrono::milliseconds(50)) == std::vector<Message>{next});
+    CHECK(reassembler.dropped() == 0);
+    Message later = message(1500, 32);
+    CHECK(receive(reassembler, frame(fragmenter, 3, later), now + std::chrono::milliseconds(150)) == std::vector<Message>{later});
+    CHECK(reassembler.dropped() == 1);
+    CHECK(reassembler.reassembled() == 2);
+}
+}
+
+int main() {
+    Logger::init();
+    testWhole();
+    testFragmented();
+    testInterleaved();
+    testLostFragment();
+    return testResult();
+}
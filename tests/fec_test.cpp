@@ -0,0 +1,184 @@
+/*
+ * Copyright 2024 nrjchnd@gmail.com
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     https://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an **"AS IS" BASIS,**
+ * **WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.**
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include "fec.h"
+#include "logger.h"
+#include "test_check.h"
+#include <algorithm>
+#include <cstring>
+#include <set>
+#include <vector>
+
+namespace {
+using Message = std::vector<uint8_t>;
+
+Message message(uint32_t number) {
+    // Lengths differ so that symbols are padded
+    Message bytes(40 + (number * 37) % 200);
+    for (size_t i = 0; i < bytes.size(); ++i) {
+        bytes[i] = static_cast<uint8_t>(number * 31 + i);
+    }
+    return bytes;
+}
+
+// One session's datagrams as the encoder sent them, repairs after their
+// group
+struct Run {
+    std::vector<Message> datagrams;
+    std::vector<bool> repair;
+};
+
+Run encode(FecEncoder& encoder, uint32_t ssrc, uint32_t first, size_t count) {
+    Run run;
+    auto now = std::chrono::steady_clock::now();
+    for (uint32_t number = first; number < first + count; ++number) {
+        Message bytes = message(number);
+        PacketBuffer packet = PacketArena::instance().allocate();
+        std::memcpy(packet.data(), bytes.data(), bytes.size());
+        packet.setSize(bytes.size());
+        std::vector<PacketBuffer> repairs;
+        CHECK(encoder.protect(ssrc, packet, now, repairs));
+        run.datagrams.emplace_back(packet.data(), packet.data() + packet.size());
+        run.repair.push_back(false);
+        for (const PacketBuffer& repair : repairs) {
+            run.datagrams.emplace_back(repair.data(), repair.data() + repair.size());
+            run.repair.push_back(true);
+        }
+    }
+    return run;
+}
+
+// Messages delivered when the datagrams at the positions in lost are lost
+std::multiset<Message> decode(FecDecoder& decoder, const Run& run, const std::set<size_t>& lost) {
+    std::multiset<Message> delivered;
+    for (size_t i = 0; i < run.datagrams.size(); ++i) {
+        if (lost.count(i) == 0) {
+            decoder.receive(run.datagrams[i].data(), run.datagrams[i].size(), [&](const uint8_t* data, size_t len) {
+                delivered.emplace(data, data + len);
+            });
+        }
+    }
+    return delivered;
+}
+
+std::multiset<Message> expected(uint32_t first, size_t count) {
+    std::multiset<Message> messages;
+    for (uint32_t number = first; number < first + count; ++number) {
+        messages.insert(message(number));
+    }
+    return messages;
+}
+
+// Positions of the source datagrams of each group, in send order
+std::vector<std::vector<size_t>> sourcesByGroup(const Run& run) {
+    std::vector<std::vector<size_t>> groups(1);
+    for (size_t i = 0; i < run.datagrams.size(); ++i) {
+        if (!run.repair[i]) {
+            if (i > 0 && run.repair[i - 1]) {
+                groups.emplace_back();
+            }
+            groups.back().push_back(i);
+        }
+    }
+    return groups;
+}
+
+void testRecoversUpToM() {
+    for (size_t m : {1, 2, 4}) {
+        FecEncoder encoder;
+        encoder.setParameters(8, m);
+        Run run = encode(encoder, 1, 0, 64);
+        CHECK(std::count(run.repair.begin(), run.repair.end(), true) == static_cast<long>(8 * m));
+
+        // m sources of every group lost, a different set each time
+        std::set<size_t> lost;
+        auto groups = sourcesByGroup(run);
+        CHECK(groups.size() == 8);
+        for (size_t group = 0; group < groups.size(); ++group) {
+            for (size_t i = 0; i < m; ++i) {
+                lost.insert(groups[group][(group + i * 3) % groups[group].size()]);
+            }
+        }
+        FecDecoder decoder;
+        CHECK(decode(decoder, run, lost) == expected(0, 64));
+        CHECK(decoder.recovered() == 8 * m);
+    }
+}
+
+void testRepairsLostToo() {
+    // Any M of the K + M datagrams may go, repairs included
+    FecEncoder encoder;
+    encoder.setParameters(4, 2);
+    Run run = encode(encoder, 7, 100, 4);
+    CHECK(run.datagrams.size() == 6);
+    for (size_t a = 0; a < run.datagrams.size(); ++a) {
+        for (size_t b = a + 1; b < run.datagrams.size(); ++b) {
+            FecDecoder decoder;
+            CHECK(decode(decoder, run, {a, b}) == expected(100, 4));
+        }
+    }
+}
+
+void testTooManyLost() {
+    // More than M lost: what arrived is delivered once, nothing is made up
+    FecEncoder encoder;
+    encoder.setParameters(6, 2);
+    Run run = encode(encoder, 3, 0, 6);
+    auto groups = sourcesByGroup(run);
+    std::set<size_t> lost(groups[0].begin(), groups[0].begin() + 3);
+    FecDecoder decoder;
+    std::multiset<Message> delivered = decode(decoder, run, lost);
+    CHECK(delivered == expected(3, 3));
+    CHECK(decoder.recovered() == 0);
+}
+
+void testFlushedGroup() {
+    // A quiet session's group is closed short by flush(), and the repairs
+    // carry the K it closed with
+    FecEncoder encoder;
+    encoder.setParameters(8, 1);
+    Run run = encode(encoder, 9, 0, 3);
+    CHECK(run.datagrams.size() == 3);
+    std::vector<PacketBuffer> repairs;
+    encoder.flush(std::chrono::steady_clock::now() + std::chrono::milliseconds(100), std::chrono::milliseconds(20), repairs);
+    CHECK(repairs.size() == 1);
+    for (const PacketBuffer& repair : repairs) {
+        run.datagrams.emplace_back(repair.data(), repair.data() + repair.size());
+        run.repair.push_back(true);
+    }
+    FecDecoder decoder;
+    CHECK(decode(decoder, run, {1}) == expected(0, 3));
+    CHECK(decoder.recovered() == 1);
+}
+
+void testUnprotected() {
+    FecEncoder encoder;
+    encoder.setParameters(8, 0);
+    Run run = encode(encoder, 5, 0, 10);
+    CHECK(run.datagrams.size() == 10);
+    FecDecoder decoder;
+    CHECK(decode(decoder, run, {}) == expected(0, 10));
+}
+}
+
+int main() {
+    Logger::init();
+    testRecoversUpToM();
+    testRepairsLostToo();
+    testTooManyLost();
+    testFlushedGroup();
+    testUnprotected();
+    return testResult();
+}
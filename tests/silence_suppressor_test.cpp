@@ -0,0 +1,153 @@
+/*
+ * Copyright 2024 nrjchnd@gmail.com
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     https://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an **"AS IS" BASIS,**
+ * **WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.**
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include "silence_suppressor.h"
+#include "logger.h"
+#include "test_check.h"
+#include <set>
+
+namespace {
+const uint8_t SPEECH = 0;
+const uint8_t COMFORT_NOISE = 13;
+
+struct Stream {
+    SilenceSuppressor suppressor;
+    std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+    std::set<uint16_t> sent;   // sequence numbers that went out
+
+    Stream() {
+        suppressor.setKeepalive(std::chrono::seconds(10));
+    }
+
+    // Sequence number the packet went out with, or -1 when dropped
+    int send(uint16_t sequence, uint8_t payloadType, bool* marker = nullptr) {
+        RtpHeaderInfo header;
+        header.ssrc = 1;
+        header.sequenceNumber = sequence;
+        header.timestamp = 160u * sequence;
+        header.payloadType = payloadType;
+        header.headerLength = 12;
+        uint8_t payload[20] = {};
+        now += std::chrono::milliseconds(20);
+        uint16_t rewritten = sequence;
+        bool rewrittenMarker = false;
+        switch (suppressor.process(header, payload, sizeof(payload), now, rewritten, rewrittenMarker)) {
+        case SilenceSuppressor::Verdict::Drop:
+            return -1;
+        case SilenceSuppressor::Verdict::Send:
+            rewritten = sequence;
+            rewrittenMarker = header.marker;
+            break;
+        case SilenceSuppressor::Verdict::Rewrite:
+            break;
+        }
+        CHECK(sent.insert(rewritten).second);   // never the same number twice
+        if (marker) {
+            *marker = rewrittenMarker;
+        }
+        return rewritten;
+    }
+};
+
+void testPause() {
+    Stream stream;
+    CHECK(stream.send(1, SPEECH) == 1);
+    CHECK(stream.send(2, COMFORT_NOISE) == 2);   // the pause begins
+    CHECK(stream.send(3, COMFORT_NOISE) == -1);
+    CHECK(stream.send(4, COMFORT_NOISE) == -1);
+    bool marker = false;
+    CHECK(stream.send(5, SPEECH, &marker) == 3);
+    CHECK(marker);
+    CHECK(stream.send(6, SPEECH, &marker) == 4);
+    CHECK(!marker);
+    CHECK(stream.suppressor.droppedPackets() == 2);
+}
+
+void testLateAcrossPauses() {
+    Stream stream;
+    for (uint16_t sequence = 1; sequence <= 4; ++sequence) {
+        CHECK(stream.send(sequence, SPEECH) == sequence);
+    }
+    CHECK(stream.send(5, COMFORT_NOISE) == 5);
+    for (uint16_t sequence = 6; sequence <= 8; ++sequence) {
+        CHECK(stream.send(sequence, COMFORT_NOISE) == -1);
+    }
+    for (uint16_t sequence = 9; sequence <= 12; ++sequence) {
+        CHECK(stream.send(sequence, SPEECH) == sequence - 3);
+    }
+    // 13 is held up in the network
+    CHECK(stream.send(14, SPEECH) == 11);
+    CHECK(stream.send(15, SPEECH) == 12);
+    CHECK(stream.send(16, COMFORT_NOISE) == 13);
+    for (uint16_t sequence = 17; sequence <= 19; ++sequence) {
+        CHECK(stream.send(sequence, COMFORT_NOISE) == -1);
+    }
+    // It gets the offset of the first pause, not none and not the second's
+    CHECK(stream.send(13, SPEECH) == 10);
+    CHECK(stream.send(20, SPEECH) == 14);
+    // Before the first pause it goes out unchanged; 3 was already sent, and
+    // a duplicate keeps its original number
+    stream.sent.erase(3);
+    CHECK(stream.send(3, SPEECH) == 3);
+}
+
+void testForgottenHistory() {
+    Stream stream;
+    uint16_t sequence = 1;
+    CHECK(stream.send(sequence++, SPEECH) == 1);
+    // More pauses than the history holds
+    for (size_t pause = 0; pause < SILENCE_SHIFT_HISTORY + 2; ++pause) {
+        stream.send(sequence++, COMFORT_NOISE);
+        CHECK(stream.send(sequence++, COMFORT_NOISE) == -1);
+        stream.send(sequence++, SPEECH);
+    }
+    // A packet from before all of them can no longer be numbered safely
+    stream.sent.erase(1);
+    CHECK(stream.send(1, SPEECH) == -1);
+    // Recent late packets still are
+    stream.sent.erase(static_cast<uint16_t>(sequence - 1 - (SILENCE_SHIFT_HISTORY + 2)));
+    CHECK(stream.send(static_cast<uint16_t>(sequence - 1), SPEECH) == sequence - 1 - static_cast<int>(SILENCE_SHIFT_HISTORY + 2));
+}
+
+void testRestored() {
+    Stream stream;
+    CHECK(stream.send(1, SPEECH) == 1);
+    CHECK(stream.send(2, COMFORT_NOISE) == 2);
+    CHECK(stream.send(3, COMFORT_NOISE) == -1);
+    CHECK(stream.send(4, SPEECH) == 3);
+
+    // A new process continues the offset; late packets from before the
+    // carried change are dropped
+    Stream upgraded;
+    upgraded.now = stream.now;
+    upgraded.sent = stream.sent;
+    for (const SilenceStreamState& state : stream.suppressor.saveStreams()) {
+        upgraded.suppressor.restoreStream(state);
+    }
+    CHECK(upgraded.send(5, SPEECH) == 4);
+    upgraded.sent.erase(3);
+    CHECK(upgraded.send(4, SPEECH) == 3);
+    CHECK(upgraded.send(2, COMFORT_NOISE) == -1);
+}
+}
+
+int main() {
+    Logger::init();
+    testPause();
+    testLateAcrossPauses();
+    testForgottenHistory();
+    testRestored();
+    return testResult();
+}
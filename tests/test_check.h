@@ -0,0 +1,45 @@
+/*
+ * Copyright 2024 nrjchnd@gmail.com
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     https://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an **"AS IS" BASIS,**
+ * **WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.**
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#ifndef TEST_CHECK_H
+#define TEST_CHECK_H
+
+#include <cstdio>
+
+// Minimal checks for the unit tests, which have no framework to pull in.
+// A failed check is reported and the test carries on; testResult() is what
+// main returns.
+inline int& testFailures() {
+    static int failures = 0;
+    return failures;
+}
+
+#define CHECK(condition)                                                              \
+    do {                                                                              \
+        if (!(condition)) {                                                           \
+            std::fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #condition); \
+            ++testFailures();                                                         \
+        }                                                                             \
+    } while (0)
+
+inline int testResult() {
+    if (testFailures() > 0) {
+        std::fprintf(stderr, "%d check(s) failed\n", testFailures());
+        return 1;
+    }
+    return 0;
+}
+
+#endif // TEST_CHECK_H
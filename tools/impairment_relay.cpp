@@ -0,0 +1,317 @@
+/*
+ * Copyright 2024 nrjchnd@gmail.com
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     https://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an **"AS IS" BASIS,**
+ * **WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.**
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "impairment_relay.h"
+#include "logger.h"
+#include <algorithm>
+#include <cerrno>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <poll.h>
+#include <unistd.h>
+
+namespace {
+
+const size_t MAX_DATAGRAM = 65536;
+
+// "2%" or "2" are both two percent
+bool parsePercent(const std::string& value, double& fraction) {
+    char* end = nullptr;
+    double number = std::strtod(value.c_str(), &end);
+    if (end == value.c_str() || (*end != '\0' && std::strcmp(end, "%") != 0) || number < 0.0 || number > 100.0) {
+        return false;
+    }
+    fraction = number / 100.0;
+    return true;
+}
+
+bool parseNumber(const std::string& value, double& number) {
+    char* end = nullptr;
+    number = std::strtod(value.c_str(), &end);
+    return end != value.c_str() && *end == '\0' && number >= 0.0;
+}
+
+}
+
+bool ImpairmentProfile::parse(const std::string& spec, ImpairmentProfile& profile, std::string& error) {
+    profile = ImpairmentProfile();
+    size_t start = 0;
+    while (start < spec.size()) {
+        size_t end = spec.find(',', start);
+        if (end == std::string::npos) {
+            end = spec.size();
+        }
+        std::string item = spec.substr(start, end - start);
+        start = end + 1;
+        if (item.empty()) {
+            continue;
+        }
+        size_t equals = item.find('=');
+        if (equals == std::string::npos) {
+            error = "expected key=value: " + item;
+            return false;
+        }
+        std::string key = item.substr(0, equals);
+        std::string value = item.substr(equals + 1);
+        double number = 0.0;
+        bool ok = true;
+        if (key == "delay") {
+            ok = parseNumber(value, profile.delayMs);
+        } else if (key == "jitter") {
+            ok = parseNumber(value, profile.jitterMs);
+        } else if (key == "dist") {
+            if (value == "uniform") {
+                profile.distribution = Distribution::Uniform;
+            } else if (value == "normal") {
+                profile.distribution = Distribution::Normal;
+            } else {
+                ok = false;
+            }
+        } else if (key == "loss") {
+            ok = parsePercent(value, profile.loss);
+        } else if (key == "ge") {
+            size_t slash = value.find('/');
+            ok = slash != std::string::npos && parsePercent(value.substr(0, slash), profile.goodToBad) &&
+                 parsePercent(value.substr(slash + 1), profile.badToGood);
+            profile.gilbertElliott = ok;
+        } else if (key == "ge_good_loss") {
+            ok = parsePercent(value, profile.goodLoss);
+        } else if (key == "ge_bad_loss") {
+            ok = parsePercent(value, profile.badLoss);
+        } else if (key == "reorder") {
+            ok = parsePercent(value, profile.reorder);
+        } else if (key == "rate") {
+            ok = parseNumber(value, profile.rateKbps);
+        } else if (key == "mtu") {
+            ok = parseNumber(value, number);
+            profile.mtu = static_cast<size_t>(number);
+        } else if (key == "seed") {
+            ok = parseNumber(value, number);
+            profile.seed = static_cast<uint32_t>(number);
+        } else {
+            error = "unknown impairment: " + key;
+            return false;
+        }
+        if (!ok) {
+            error = "bad value for " + key + ": " + value;
+            return false;
+        }
+    }
+    return true;
+}
+
+void ImpairmentRelay::Direction::admit(const uint8_t* data, size_t len, std::chrono::steady_clock::time_point now) {
+    if (profile.mtu > 0 && len > profile.mtu) {
+        ++counters.tooLarge;
+        return;
+    }
+
+    std::uniform_real_distribution<double> unit(0.0, 1.0);
+    bool lost = false;
+    if (profile.gilbertElliott) {
+        // State transition first, then the loss of the state the packet meets
+        if (badState) {
+            badState = unit(random) >= profile.badToGood;
+        } else {
+            badState = unit(random) < profile.goodToBad;
+        }
+        lost = unit(random) < (badState ? profile.badLoss : profile.goodLoss);
+    } else if (profile.loss > 0.0) {
+        lost = unit(random) < profile.loss;
+    }
+    if (lost) {
+        ++counters.lost;
+        return;
+    }
+
+    // The bottleneck serializes packets one after another
+    auto departure = now;
+    if (profile.rateKbps > 0.0) {
+        departure = std::max(now, linkFree);
+        linkFree = departure + std::chrono::nanoseconds(
+            static_cast<int64_t>(static_cast<double>(len) * 8.0 * 1e6 / profile.rateKbps));
+        departure = linkFree;
+    }
+
+    double delayMs = profile.delayMs;
+    bool reordered = profile.reorder > 0.0 && !queue.empty() && unit(random) < profile.reorder;
+    if (reordered) {
+        // Overtakes everything still in flight, as netem does
+        delayMs = 0.0;
+        ++counters.reordered;
+    } else if (profile.jitterMs > 0.0) {
+        if (profile.distribution == ImpairmentProfile::Distribution::Normal) {
+            std::normal_distribution<double> spread(0.0, profile.jitterMs);
+            delayMs += spread(random);
+        } else {
+            std::uniform_real_distribution<double> spread(-profile.jitterMs, profile.jitterMs);
+            delayMs += spread(random);
+        }
+        delayMs = std::max(delayMs, 0.0);
+    }
+
+    Pending pending;
+    pending.due = departure + std::chrono::microseconds(static_cast<int64_t>(delayMs * 1000.0));
+    pending.data.assign(data, data + len);
+    // Jitter alone does not reorder: a link delivers in order, so a packet
+    // is never due before the one queued ahead of it
+    if (!reordered && !queue.empty() && pending.due < queue.back().due) {
+        pending.due = queue.back().due;
+    }
+    auto it = std::upper_bound(queue.begin(), queue.end(), pending.due,
+                               [](std::chrono::steady_clock::time_point due, const Pending& p) { return due < p.due; });
+    queue.insert(it, std::move(pending));
+}
+
+ImpairmentRelay::ImpairmentRelay(const ImpairmentProfile& up, const ImpairmentProfile& down)
+    : up_(up), down_(down), clientFd_(-1), serverFd_(-1), localPort_(0), client_(), clientLength_(0), running_(false) {
+}
+
+ImpairmentRelay::~ImpairmentRelay() {
+    stop();
+}
+
+bool ImpairmentRelay::start(const std::string& targetHost, uint16_t targetPort) {
+    addrinfo hints;
+    std::memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_DGRAM;
+    addrinfo* result = nullptr;
+    std::string port = std::to_string(targetPort);
+    if (getaddrinfo(targetHost.c_str(), port.c_str(), &hints, &result) != 0 || !result) {
+        Logger::getLogger()->error("Impairment relay cannot resolve {}", targetHost);
+        return false;
+    }
+    serverFd_ = socket(result->ai_family, SOCK_DGRAM, 0);
+    bool connected = serverFd_ >= 0 && connect(serverFd_, result->ai_addr, result->ai_addrlen) == 0;
+    freeaddrinfo(result);
+    if (!connected) {
+        Logger::getLogger()->error("Impairment relay cannot reach {}:{}: {}", targetHost, targetPort, std::strerror(errno));
+        stop();
+        return false;
+    }
+
+    sockaddr_in local;
+    std::memset(&local, 0, sizeof(local));
+    local.sin_family = AF_INET;
+    local.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    socklen_t localLength = sizeof(local);
+    clientFd_ = socket(AF_INET, SOCK_DGRAM, 0);
+    if (clientFd_ < 0 || bind(clientFd_, reinterpret_cast<sockaddr*>(&local), sizeof(local)) != 0 ||
+        getsockname(clientFd_, reinterpret_cast<sockaddr*>(&local), &localLength) != 0) {
+        Logger::getLogger()->error("Impairment relay cannot bind: {}", std::strerror(errno));
+        stop();
+        return false;
+    }
+    localPort_ = ntohs(local.sin_port);
+
+    running_ = true;
+    thread_ = std::thread(&ImpairmentRelay::run, this);
+    Logger::getLogger()->info("Impairment relay on 127.0.0.1:{} for {}:{}", localPort_, targetHost, targetPort);
+    return true;
+}
+
+void ImpairmentRelay::stop() {
+    running_ = false;
+    if (thread_.joinable()) {
+        thread_.join();
+    }
+    if (clientFd_ >= 0) {
+        close(clientFd_);
+        clientFd_ = -1;
+    }
+    if (serverFd_ >= 0) {
+        close(serverFd_);
+        serverFd_ = -1;
+    }
+}
+
+ImpairmentCounters ImpairmentRelay::upCounters() {
+    std::lock_guard<std::mutex> lock(countersMutex_);
+    return up_.counters;
+}
+
+ImpairmentCounters ImpairmentRelay::downCounters() {
+    std::lock_guard<std::mutex> lock(countersMutex_);
+    return down_.counters;
+}
+
+void ImpairmentRelay::flush(Direction& direction, int fd, bool toClient, std::chrono::steady_clock::time_point now) {
+    while (!direction.queue.empty() && direction.queue.front().due <= now) {
+        const std::vector<uint8_t>& data = direction.queue.front().data;
+        ssize_t sent = toClient
+            ? sendto(fd, data.data(), data.size(), 0, reinterpret_cast<const sockaddr*>(&client_), clientLength_)
+            : send(fd, data.data(), data.size(), 0);
+        if (sent >= 0) {
+            ++direction.counters.forwarded;
+        }
+        direction.queue.pop_front();
+    }
+}
+
+void ImpairmentRelay::run() {
+    std::vector<uint8_t> buffer(MAX_DATAGRAM);
+    while (running_) {
+        // Sleep until the next packet is due, but look at running_ often
+        auto now = std::chrono::steady_clock::now();
+        auto wake = now + std::chrono::milliseconds(100);
+        if (!up_.queue.empty()) {
+            wake = std::min(wake, up_.queue.front().due);
+        }
+        if (!down_.queue.empty()) {
+            wake = std::min(wake, down_.queue.front().due);
+        }
+        int64_t waitNs = std::max<int64_t>(
+            std::chrono::duration_cast<std::chrono::nanoseconds>(wake - now).count(), 0);
+        timespec timeout = {static_cast<time_t>(waitNs / 1000000000), static_cast<long>(waitNs % 1000000000)};
+
+        pollfd fds[2] = {{clientFd_, POLLIN, 0}, {serverFd_, POLLIN, 0}};
+        if (ppoll(fds, 2, &timeout, nullptr) < 0 && errno != EINTR) {
+            Logger::getLogger()->error("Impairment relay poll failed: {}", std::strerror(errno));
+            break;
+        }
+
+        std::lock_guard<std::mutex> lock(countersMutex_);
+        now = std::chrono::steady_clock::now();
+        if (fds[0].revents & POLLIN) {
+            sockaddr_storage from;
+            socklen_t fromLength = sizeof(from);
+            ssize_t len;
+            while ((len = recvfrom(clientFd_, buffer.data(), buffer.size(), MSG_DONTWAIT,
+                                   reinterpret_cast<sockaddr*>(&from), &fromLength)) >= 0) {
+                client_ = from;
+                clientLength_ = fromLength;
+                up_.admit(buffer.data(), static_cast<size_t>(len), now);
+                fromLength = sizeof(from);
+            }
+        }
+        if (fds[1].revents & POLLIN) {
+            ssize_t len;
+            while ((len = recv(serverFd_, buffer.data(), buffer.size(), MSG_DONTWAIT)) >= 0) {
+                // Nothing to answer before the client has spoken
+                if (clientLength_ > 0) {
+                    down_.admit(buffer.data(), static_cast<size_t>(len), now);
+                }
+            }
+        }
+        flush(up_, serverFd_, false, now);
+        flush(down_, clientFd_, true, now);
+    }
+}
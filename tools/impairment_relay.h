@@ -0,0 +1,123 @@
+/*
+ * Copyright 2024 nrjchnd@gmail.com
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     https://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an **"AS IS" BASIS,**
+ * **WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.**
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#ifndef IMPAIRMENT_RELAY_H
+#define IMPAIRMENT_RELAY_H
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <deque>
+#include <mutex>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+#include <sys/socket.h>
+
+// Network conditions for one direction of the relay, netem style. Given as
+// comma-separated key=value pairs:
+//
+//   delay=40        one-way delay in ms
+//   jitter=10       added delay spread in ms, around delay
+//   dist=normal     jitter distribution: uniform (default) or normal
+//   loss=2%         Bernoulli loss
+//   ge=1%/20%       Gilbert-Elliott loss instead: p (good -> bad) and r
+//                   (bad -> good) per packet; every packet in the bad state
+//                   is lost unless ge_bad_loss says otherwise
+//   ge_good_loss=0% ge_bad_loss=100%
+//   reorder=1%      packets sent at once, ahead of those still delayed
+//   rate=2000       bottleneck in kbit/s; packets queue behind each other
+//   mtu=1200        larger datagrams are dropped
+//   seed=1          random seed, so runs are reproducible
+struct ImpairmentProfile {
+    enum class Distribution { Uniform, Normal };
+
+    double delayMs = 0.0;
+    double jitterMs = 0.0;
+    Distribution distribution = Distribution::Uniform;
+    double loss = 0.0;
+    bool gilbertElliott = false;
+    double goodToBad = 0.0;
+    double badToGood = 1.0;
+    double goodLoss = 0.0;
+    double badLoss = 1.0;
+    double reorder = 0.0;
+    double rateKbps = 0.0;       // 0: unlimited
+    size_t mtu = 0;              // 0: no limit
+    uint32_t seed = 1;
+
+    // False with error set when the spec has an unknown key or bad value
+    static bool parse(const std::string& spec, ImpairmentProfile& profile, std::string& error);
+};
+
+struct ImpairmentCounters {
+    uint64_t forwarded = 0;
+    uint64_t lost = 0;
+    uint64_t tooLarge = 0;
+    uint64_t reordered = 0;
+};
+
+// UDP relay on loopback in front of a QUIC server, so a client pointed at
+// localPort() sees the impaired network on its own UDP datapath without tc
+// or root. Up is client to server, down is server to client. One client
+// at a time: the relay answers whichever address sent to it last.
+class ImpairmentRelay {
+public:
+    ImpairmentRelay(const ImpairmentProfile& up, const ImpairmentProfile& down);
+    ~ImpairmentRelay();
+
+    bool start(const std::string& targetHost, uint16_t targetPort);
+    void stop();
+    uint16_t localPort() const { return localPort_; }
+
+    ImpairmentCounters upCounters();
+    ImpairmentCounters downCounters();
+
+private:
+    struct Pending {
+        std::chrono::steady_clock::time_point due;
+        std::vector<uint8_t> data;
+    };
+
+    // Impairment state of one direction
+    struct Direction {
+        ImpairmentProfile profile;
+        std::mt19937 random;
+        bool badState = false;
+        std::chrono::steady_clock::time_point linkFree;
+        std::deque<Pending> queue;       // ordered by due
+        ImpairmentCounters counters;
+
+        explicit Direction(const ImpairmentProfile& p) : profile(p), random(p.seed) {}
+        void admit(const uint8_t* data, size_t len, std::chrono::steady_clock::time_point now);
+    };
+
+    void run();
+    void flush(Direction& direction, int fd, bool toClient, std::chrono::steady_clock::time_point now);
+
+    Direction up_;
+    Direction down_;
+    std::mutex countersMutex_;
+    int clientFd_;       // faces the QUIC client
+    int serverFd_;       // connected to the server
+    uint16_t localPort_;
+    sockaddr_storage client_;
+    socklen_t clientLength_;     // 0 until the client has sent
+    std::atomic<bool> running_;
+    std::thread thread_;
+};
+
+#endif // IMPAIRMENT_RELAY_H
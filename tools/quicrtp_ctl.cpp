@@ -0,0 +1,245 @@
+/*
+ * Copyright 2024 nrjchnd@gmail.com
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     https://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an **"AS IS" BASIS,**
+ * **WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.**
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Command line client for the control API (src/control_protocol.h).
+//
+//   quicrtp_ctl <socket> allocate [<tenant> [<srtp key hex>]]
+//   quicrtp_ctl <socket> release <port>
+//   quicrtp_ctl <socket> create <ssrc> <port> [<ip>:<port>]
+//   quicrtp_ctl <socket> remove <ssrc>
+//   quicrtp_ctl <socket> tenant <port> [<tenant>]
+//   quicrtp_ctl <socket> stats <ssrc>
+//   quicrtp_ctl <socket> bench <calls> [<window>]
+//
+// bench creates and removes <calls> sessions with up to <window> requests
+// in flight and reports the setup rate.
+
+#include "control_protocol.h"
+#include <boost/asio/ip/address.hpp>
+#include <cerrno>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+namespace {
+
+const char* STATUS_NAMES[] = {"ok", "invalid", "not found", "exists", "exhausted", "unsupported", "overloaded"};
+
+void usage() {
+    std::cerr << "usage: quicrtp_ctl <socket> allocate [<tenant> [<srtp key hex>]] | release <port> |\n"
+                 "       create <ssrc> <port> [<ip>:<port>] | remove <ssrc> | tenant <port> [<tenant>] |\n"
+                 "       stats <ssrc> | bench <calls> [<window>]" << std::endl;
+}
+
+int connectTo(const std::string& path) {
+    int fd = ::socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    sockaddr_un address;
+    std::memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    std::strncpy(address.sun_path, path.c_str(), sizeof(address.sun_path) - 1);
+    if (fd < 0 || ::connect(fd, reinterpret_cast<sockaddr*>(&address), sizeof(address)) != 0) {
+        std::cerr << "Cannot connect to " << path << ": " << std::strerror(errno) << std::endl;
+        if (fd >= 0) {
+            ::close(fd);
+        }
+        return -1;
+    }
+    return fd;
+}
+
+bool call(int fd, const ControlRequest& request, ControlResponse& response) {
+    if (::send(fd, &request, sizeof(request), 0) != static_cast<ssize_t>(sizeof(request)) ||
+        ::recv(fd, &response, sizeof(response), 0) != static_cast<ssize_t>(sizeof(response))) {
+        std::cerr << "Control request failed" << std::endl;
+        return false;
+    }
+    return true;
+}
+
+void setTenant(ControlRequest& request, const std::string& tenant) {
+    std::strncpy(request.tenant, tenant.c_str(), sizeof(request.tenant));
+}
+
+bool setKey(ControlRequest& request, const std::string& hex) {
+    if (hex.size() != CONTROL_SRTP_KEY_LENGTH * 2u) {
+        return false;
+    }
+    for (size_t i = 0; i < CONTROL_SRTP_KEY_LENGTH; ++i) {
+        request.srtpKey[i] = static_cast<uint8_t>(std::stoul(hex.substr(i * 2, 2), nullptr, 16));
+    }
+    request.srtpKeyLength = CONTROL_SRTP_KEY_LENGTH;
+    return true;
+}
+
+bool setSource(ControlRequest& request, const std::string& source) {
+    size_t colonPos = source.rfind(':');
+    if (colonPos == std::string::npos) {
+        return false;
+    }
+    boost::system::error_code error;
+    boost::asio::ip::address address = boost::asio::ip::make_address(source.substr(0, colonPos), error);
+    if (error) {
+        return false;
+    }
+    if (address.is_v4()) {
+        auto bytes = address.to_v4().to_bytes();
+        std::memcpy(request.sourceAddress, bytes.data(), bytes.size());
+        request.addressFamily = 4;
+    } else {
+        auto bytes = address.to_v6().to_bytes();
+        std::memcpy(request.sourceAddress, bytes.data(), bytes.size());
+        request.addressFamily = 6;
+    }
+    request.sourcePort = static_cast<uint16_t>(std::stoi(source.substr(colonPos + 1)));
+    return true;
+}
+
+// Creates and removes calls sessions, keeping up to window requests in flight
+int bench(int fd, uint32_t calls, uint32_t window) {
+    auto start = std::chrono::steady_clock::now();
+    uint32_t total = calls * 2;
+    uint32_t sent = 0;
+    uint32_t received = 0;
+    uint32_t failed = 0;
+    while (received < total) {
+        while (sent < total && sent - received < window) {
+            ControlRequest request;
+            std::memset(&request, 0, sizeof(request));
+            request.requestId = sent;
+            // All creates first, then the removes
+            request.ssrc = 0x40000000 + (sent % calls);
+            request.op = static_cast<uint8_t>(sent < calls ? ControlOp::CreateSession : ControlOp::RemoveSession);
+            if (::send(fd, &request, sizeof(request), 0) != static_cast<ssize_t>(sizeof(request))) {
+                std::cerr << "Control request failed" << std::endl;
+                return 1;
+            }
+            ++sent;
+        }
+        ControlResponse response;
+        if (::recv(fd, &response, sizeof(response), 0) != static_cast<ssize_t>(sizeof(response))) {
+            std::cerr << "Control connection lost" << std::endl;
+            return 1;
+        }
+        if (response.status != static_cast<uint8_t>(ControlStatus::Ok)) {
+            ++failed;
+        }
+        ++received;
+    }
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    std::cout << calls << " calls set up and torn down in " << seconds << " s, "
+              << static_cast<uint64_t>(calls / seconds) << " calls/s, " << failed << " failed" << std::endl;
+    return failed == 0 ? 0 : 1;
+}
+
+}
+
+int main(int argc, char* argv[]) {
+    if (argc < 3) {
+        usage();
+        return 1;
+    }
+    std::string command = argv[2];
+    ControlRequest request;
+    std::memset(&request, 0, sizeof(request));
+
+    try {
+        if (command == "allocate") {
+            request.op = static_cast<uint8_t>(ControlOp::AllocatePort);
+            if (argc > 3) {
+                setTenant(request, argv[3]);
+            }
+            if (argc > 4 && !setKey(request, argv[4])) {
+                std::cerr << "The SRTP key must be 60 hex digits" << std::endl;
+                return 1;
+            }
+        } else if (command == "release" && argc == 4) {
+            request.op = static_cast<uint8_t>(ControlOp::ReleasePort);
+            request.port = static_cast<uint16_t>(std::stoi(argv[3]));
+        } else if (command == "create" && (argc == 5 || argc == 6)) {
+            request.op = static_cast<uint8_t>(ControlOp::CreateSession);
+            request.ssrc = static_cast<uint32_t>(std::stoul(argv[3], nullptr, 0));
+            request.port = static_cast<uint16_t>(std::stoi(argv[4]));
+            if (argc == 6 && !setSource(request, argv[5])) {
+                std::cerr << "Bad source address " << argv[5] << std::endl;
+                return 1;
+            }
+        } else if (command == "remove" && argc == 4) {
+            request.op = static_cast<uint8_t>(ControlOp::RemoveSession);
+            request.ssrc = static_cast<uint32_t>(std::stoul(argv[3], nullptr, 0));
+        } else if (command == "tenant" && (argc == 4 || argc == 5)) {
+            request.op = static_cast<uint8_t>(ControlOp::AttachTenant);
+            request.port = static_cast<uint16_t>(std::stoi(argv[3]));
+            if (argc == 5) {
+                setTenant(request, argv[4]);
+            }
+        } else if (command == "stats" && argc == 4) {
+            request.op = static_cast<uint8_t>(ControlOp::SessionStats);
+            request.ssrc = static_cast<uint32_t>(std::stoul(argv[3], nullptr, 0));
+        } else if (command != "bench" || argc < 4) {
+            usage();
+            return 1;
+        }
+    } catch (const std::exception&) {
+        usage();
+        return 1;
+    }
+
+    int fd = connectTo(argv[1]);
+    if (fd < 0) {
+        return 1;
+    }
+    if (command == "bench") {
+        uint32_t window = argc > 4 ? static_cast<uint32_t>(std::atoi(argv[4])) : 256;
+        int result = bench(fd, static_cast<uint32_t>(std::atoi(argv[3])), window > 0 ? window : 1);
+        ::close(fd);
+        return result;
+    }
+
+    ControlResponse response;
+    bool ok = call(fd, request, response);
+    ::close(fd);
+    if (!ok) {
+        return 1;
+    }
+    if (response.status != static_cast<uint8_t>(ControlStatus::Ok)) {
+        std::cerr << (response.status < 7 ? STATUS_NAMES[response.status] : "error") << std::endl;
+        return 1;
+    }
+    if (command == "allocate") {
+        std::cout << response.port << std::endl;
+    } else if (command == "stats") {
+        const ControlSessionStats& stats = response.stats;
+        std::cout << "port " << stats.localPort << (stats.latched ? "" : " (waiting for the first packet)") << "\n"
+                  << "uplink: " << stats.uplinkPackets << " packets, " << stats.uplinkLost << " lost, jitter "
+                  << stats.uplinkJitterUs / 1000.0 << " ms\n"
+                  << "downlink: " << stats.downlinkPackets << " packets, " << stats.downlinkLost << " lost, jitter "
+                  << stats.downlinkJitterUs / 1000.0 << " ms\n"
+                  << "sent: " << stats.sentPackets << " packets, " << stats.sentOctets << " bytes\n"
+                  << "endpoint reports: " << stats.peerCumulativeLost << " lost, fraction "
+                  << static_cast<int>(stats.peerFractionLost) << "/256, rtt ";
+        if (stats.roundTripUs < 0) {
+            std::cout << "unknown\n";
+        } else {
+            std::cout << stats.roundTripUs / 1000.0 << " ms\n";
+        }
+    }
+    return 0;
+}
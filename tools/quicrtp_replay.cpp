@@ -0,0 +1,333 @@
+/*
+ * Copyright 2024 nrjchnd@gmail.com
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     https://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an **"AS IS" BASIS,**
+ * **WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.**
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Replays a capture written with [Capture] enable = true through the same
+// SessionManager / Translator / QuicClient pipeline as the proxy, and
+// reports per-stage timing.
+//
+//   quicrtp_replay <capture> [--speed <factor> | --max] [--quic <host>:<port>] [--loops <n>]
+//                  [--impair-up <spec>] [--impair-down <spec>]
+//
+// --speed 1 (default) keeps the original packet spacing, --speed 4 replays
+// four times faster and --max as fast as possible. Without --quic the
+// uplink stops at the translator, which isolates the proxy's own cost.
+// --impair-up / --impair-down put an ImpairmentRelay between the client
+// and the server, e.g. "delay=40,jitter=5,loss=2%" (see impairment_relay.h),
+// so runs under bad networks are reproducible on one machine.
+
+#include "capture_log.h"
+#include "session_manager.h"
+#include "translator.h"
+#include "quic_client.h"
+#include "impairment_relay.h"
+#include "logger.h"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+using Clock = std::chrono::steady_clock;
+
+namespace {
+
+uint64_t elapsedNs(Clock::time_point from, Clock::time_point to) {
+    return static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(to - from).count());
+}
+
+class StageTimer {
+public:
+    explicit StageTimer(const std::string& name) : name_(name) {}
+
+    void add(uint64_t ns) { samples_.push_back(ns); }
+
+    void report() {
+        if (samples_.empty()) {
+            return;
+        }
+        std::sort(samples_.begin(), samples_.end());
+        uint64_t total = 0;
+        for (uint64_t sample : samples_) {
+            total += sample;
+        }
+        auto percentile = [this](double p) {
+            size_t index = static_cast<size_t>(p * static_cast<double>(samples_.size() - 1));
+            return static_cast<double>(samples_[index]) / 1000.0;
+        };
+        std::cout << std::left << std::setw(16) << name_ << std::right
+                  << std::setw(10) << samples_.size()
+                  << std::fixed << std::setprecision(2)
+                  << std::setw(10) << static_cast<double>(total) / static_cast<double>(samples_.size()) / 1000.0
+                  << std::setw(10) << percentile(0.50)
+                  << std::setw(10) << percentile(0.99)
+                  << std::setw(10) << percentile(0.999)
+                  << std::setw(10) << static_cast<double>(samples_.back()) / 1000.0 << "\n";
+    }
+
+private:
+    std::string name_;
+    std::vector<uint64_t> samples_;
+};
+
+void usage() {
+    std::cerr << "usage: quicrtp_replay <capture> [--speed <factor> | --max] [--quic <host>:<port>] [--loops <n>]"
+                 " [--impair-up <spec>] [--impair-down <spec>]" << std::endl;
+}
+
+boost::asio::ip::udp::endpoint sourceOf(const CaptureRecord& record) {
+    boost::asio::ip::address address;
+    if (record.addressFamily == 4) {
+        boost::asio::ip::address_v4::bytes_type bytes;
+        std::memcpy(bytes.data(), record.sourceAddress, bytes.size());
+        address = boost::asio::ip::address_v4(bytes);
+    } else if (record.addressFamily == 6) {
+        boost::asio::ip::address_v6::bytes_type bytes;
+        std::memcpy(bytes.data(), record.sourceAddress, bytes.size());
+        address = boost::asio::ip::address_v6(bytes);
+    }
+    return boost::asio::ip::udp::endpoint(address, record.sourcePort);
+}
+
+void reportImpairment(const char* direction, const ImpairmentCounters& counters) {
+    std::cout << std::left << std::setw(16) << direction << std::right
+              << std::setw(10) << counters.forwarded << std::setw(10) << counters.lost
+              << std::setw(10) << counters.reordered << std::setw(10) << counters.tooLarge << "\n";
+}
+
+}
+
+int main(int argc, char* argv[]) {
+    if (argc < 2) {
+        usage();
+        return 1;
+    }
+
+    std::string capturePath = argv[1];
+    double speed = 1.0;
+    bool asFastAsPossible = false;
+    std::string quicTarget;
+    int loops = 1;
+    std::string impairUp;
+    std::string impairDown;
+    for (int i = 2; i < argc; ++i) {
+        std::string arg = argv[i];
+        if (arg == "--max") {
+            asFastAsPossible = true;
+        } else if (arg == "--speed" && i + 1 < argc) {
+            speed = std::atof(argv[++i]);
+        } else if (arg == "--quic" && i + 1 < argc) {
+            quicTarget = argv[++i];
+        } else if (arg == "--loops" && i + 1 < argc) {
+            loops = std::max(std::atoi(argv[++i]), 1);
+        } else if (arg == "--impair-up" && i + 1 < argc) {
+            impairUp = argv[++i];
+        } else if (arg == "--impair-down" && i + 1 < argc) {
+            impairDown = argv[++i];
+        } else {
+            usage();
+            return 1;
+        }
+    }
+    if (speed <= 0.0) {
+        usage();
+        return 1;
+    }
+
+    Logger::init();
+
+    CaptureReader reader;
+    if (!reader.open(capturePath)) {
+        return 1;
+    }
+
+    // Load the log up front so file access does not show up in the timings;
+    // concurrent writers can leave records slightly out of order
+    struct Packet {
+        CaptureRecord record;
+        const uint8_t* data;
+    };
+    std::vector<Packet> packets;
+    CaptureRecord record;
+    const uint8_t* data = nullptr;
+    while (reader.next(record, data)) {
+        packets.push_back({record, data});
+    }
+    std::stable_sort(packets.begin(), packets.end(), [](const Packet& a, const Packet& b) {
+        return a.record.timestampNs < b.record.timestampNs;
+    });
+    if (packets.empty()) {
+        std::cerr << "No packets in " << capturePath << std::endl;
+        return 1;
+    }
+
+    SessionManager sessionManager;
+    // Static payload type clock rates, for the session statistics
+    MediaClassifier classifier;
+    Translator translator;
+
+    std::shared_ptr<QuicClient> quicClient;
+    std::unique_ptr<ImpairmentRelay> relay;
+    std::atomic<uint64_t> quicReceived(0);
+    if (!quicTarget.empty()) {
+        size_t colonPos = quicTarget.rfind(':');
+        if (colonPos == std::string::npos) {
+            usage();
+            return 1;
+        }
+        std::string quicHost = quicTarget.substr(0, colonPos);
+        uint16_t quicPort = static_cast<uint16_t>(std::stoi(quicTarget.substr(colonPos + 1)));
+
+        if (!impairUp.empty() || !impairDown.empty()) {
+            ImpairmentProfile up;
+            ImpairmentProfile down;
+            std::string error;
+            if (!ImpairmentProfile::parse(impairUp, up, error) || !ImpairmentProfile::parse(impairDown, down, error)) {
+                std::cerr << error << std::endl;
+                return 1;
+            }
+            relay = std::make_unique<ImpairmentRelay>(up, down);
+            if (!relay->start(quicHost, quicPort)) {
+                return 1;
+            }
+            quicHost = "127.0.0.1";
+            quicPort = relay->localPort();
+        }
+
+        quicClient = std::make_shared<QuicClient>(quicHost, quicPort);
+        // Whatever the server sends back, to see how much survives the network
+        quicClient->setDataHandler([&quicReceived](const uint8_t*, size_t) {
+            ++quicReceived;
+        });
+        if (!quicClient->initialize()) {
+            std::cerr << "Failed to initialize QUIC client" << std::endl;
+            return 1;
+        }
+        quicClient->start();
+        // Let the handshake finish so it is not charged to the first packets
+        std::this_thread::sleep_for(std::chrono::seconds(1));
+    }
+
+    StageTimer sessionStage("session");
+    StageTimer uplinkStage("rtp_to_quic");
+    StageTimer quicSendStage("quic_send");
+    StageTimer downlinkStage("quic_to_rtp");
+    StageTimer pacingLag("pacing_lag");
+
+    uint64_t handlerNs = 0;
+    translator.setRtpToQuicHandler([&](PacketBuffer packet, const SendInfo& info) {
+        Clock::time_point begin = Clock::now();
+        if (quicClient) {
+            quicClient->sendData(std::move(packet), info);
+        }
+        handlerNs = elapsedNs(begin, Clock::now());
+    });
+    // The downlink stops at the translator; there are no RTP peers to send to
+    translator.setQuicToRtpHandler([](const uint8_t*, size_t, const uint8_t*, size_t) {
+    });
+
+    size_t rtpPackets = 0;
+    size_t quicPackets = 0;
+    Clock::time_point runStart = Clock::now();
+
+    for (int loop = 0; loop < loops; ++loop) {
+        Clock::time_point loopStart = Clock::now();
+        uint64_t firstTimestamp = packets.front().record.timestampNs;
+
+        for (const Packet& packet : packets) {
+            if (!asFastAsPossible) {
+                auto offset = std::chrono::nanoseconds(static_cast<uint64_t>(
+                    static_cast<double>(packet.record.timestampNs - firstTimestamp) / speed));
+                Clock::time_point due = loopStart + offset;
+                // Sleep most of the gap, then spin for sub-scheduler precision
+                if (due - Clock::now() > std::chrono::microseconds(100)) {
+                    std::this_thread::sleep_until(due - std::chrono::microseconds(50));
+                }
+                while (Clock::now() < due) {
+                }
+                pacingLag.add(elapsedNs(due, Clock::now()));
+            }
+
+            if (packet.record.kind == static_cast<uint8_t>(CaptureKind::RtpIngress)) {
+                ++rtpPackets;
+                if (packet.record.length < 12) {
+                    continue;
+                }
+                const uint8_t* rtp = packet.data;
+                uint32_t ssrc = (rtp[8] << 24) | (rtp[9] << 16) | (rtp[10] << 8) | rtp[11];
+
+                RtpArrival arrival;
+                arrival.sequenceNumber = static_cast<uint16_t>((rtp[2] << 8) | rtp[3]);
+                arrival.timestamp = (static_cast<uint32_t>(rtp[4]) << 24) | (rtp[5] << 16) | (rtp[6] << 8) | rtp[7];
+                arrival.clockRate = classifier.clockRate(rtp[1]);
+
+                Clock::time_point begin = Clock::now();
+                arrival.time = begin;
+                sessionManager.bindSession(ssrc, sourceOf(packet.record), packet.record.localPort, false, arrival);
+                Clock::time_point bound = Clock::now();
+                handlerNs = 0;
+                translator.translateRtpToQuic(packet.data, packet.record.length);
+                Clock::time_point done = Clock::now();
+
+                sessionStage.add(elapsedNs(begin, bound));
+                uplinkStage.add(elapsedNs(bound, done) - handlerNs);
+                if (quicClient) {
+                    quicSendStage.add(handlerNs);
+                }
+            } else if (packet.record.kind == static_cast<uint8_t>(CaptureKind::QuicIngress)) {
+                ++quicPackets;
+                Clock::time_point begin = Clock::now();
+                translator.translateQuicToRtp(packet.data, packet.record.length);
+                downlinkStage.add(elapsedNs(begin, Clock::now()));
+            }
+        }
+    }
+
+    double seconds = static_cast<double>(elapsedNs(runStart, Clock::now())) / 1e9;
+    size_t total = rtpPackets + quicPackets;
+
+    std::cout << "Replayed " << total << " packets (" << rtpPackets << " RTP, " << quicPackets << " QUIC) in "
+              << std::fixed << std::setprecision(3) << seconds << " s, "
+              << std::setprecision(0) << static_cast<double>(total) / seconds << " packets/s\n\n";
+    std::cout << std::left << std::setw(16) << "stage (us)" << std::right
+              << std::setw(10) << "count" << std::setw(10) << "mean" << std::setw(10) << "p50"
+              << std::setw(10) << "p99" << std::setw(10) << "p99.9" << std::setw(10) << "max" << "\n";
+    sessionStage.report();
+    uplinkStage.report();
+    quicSendStage.report();
+    downlinkStage.report();
+    pacingLag.report();
+
+    if (quicClient) {
+        std::cout << "\nQUIC: " << quicClient->shedPackets() << " packets shed, "
+                  << quicReceived.load() << " messages received from the server\n";
+        quicClient->stop();
+    }
+    if (relay) {
+        relay->stop();
+        std::cout << "\n" << std::left << std::setw(16) << "impairment" << std::right
+                  << std::setw(10) << "sent" << std::setw(10) << "lost" << std::setw(10) << "reorder"
+                  << std::setw(10) << "too_big" << "\n";
+        reportImpairment("up", relay->upCounters());
+        reportImpairment("down", relay->downCounters());
+    }
+    return 0;
+}
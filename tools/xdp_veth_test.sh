@@ -0,0 +1,85 @@
+#!/bin/sh
+#
+# Copyright 2024 nrjchnd@gmail.com
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#     https://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+#
+# Exercises the AF_XDP fast path on a veth pair without touching real NICs.
+#
+#   sudo tools/xdp_veth_test.sh setup     # veth pair + namespace
+#   (start QuicRtp with the [RTP]/[XDP] settings printed by setup)
+#   sudo tools/xdp_veth_test.sh send 5000 # RTP from the namespace to port 5000
+#   sudo tools/xdp_veth_test.sh teardown
+#
+# QuicRtp logs "XDP fast path active" when the program attached and the
+# socket bound; otherwise it falls back to the socket path and the same
+# traffic is received through the kernel.
+
+set -e
+
+NS=quicrtp-xdp
+HOST_IF=veth-rtp
+PEER_IF=veth-rtp-peer
+HOST_IP=10.200.0.1
+PEER_IP=10.200.0.2
+
+case "$1" in
+setup)
+    ip netns add $NS
+    ip link add $HOST_IF type veth peer name $PEER_IF
+    ip link set $PEER_IF netns $NS
+    ip addr add $HOST_IP/24 dev $HOST_IF
+    ip link set $HOST_IF up
+    ip netns exec $NS ip addr add $PEER_IP/24 dev $PEER_IF
+    ip netns exec $NS ip link set $PEER_IF up
+    ip netns exec $NS ip link set lo up
+    # One queue so every packet reaches the single AF_XDP socket
+    ethtool -L $HOST_IF rx 1 tx 1 2>/dev/null || true
+    cat <<EOF
+Namespace $NS ready. Use in /etc/quicrtp/quicrtp.conf:
+
+[RTP]
+mode = single_port
+listen_port = 5000
+io_backend = xdp
+
+[XDP]
+interface = $HOST_IF
+queue = 0
+mode = skb
+EOF
+    ;;
+send)
+    PORT=${2:-5000}
+    COUNT=${3:-50}
+    ip netns exec $NS python3 - "$HOST_IP" "$PORT" "$COUNT" <<'EOF'
+import socket, struct, sys, time
+host, port, count = sys.argv[1], int(sys.argv[2]), int(sys.argv[3])
+sock = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+ssrc = 0x5EED0001
+for seq in range(count):
+    header = struct.pack("!BBHII", 0x80, 0, seq, seq * 160, ssrc)
+    sock.sendto(header + bytes(160), (host, port))
+    time.sleep(0.02)
+print("sent %d RTP packets to %s:%d" % (count, host, port))
+EOF
+    ;;
+teardown)
+    ip link del $HOST_IF 2>/dev/null || true
+    ip netns del $NS 2>/dev/null || true
+    ;;
+*)
+    echo "usage: $0 setup|send [port] [count]|teardown" >&2
+    exit 1
+    ;;
+esac